@@ -1,6 +1,11 @@
 #pragma once
 
 #define ENABLE_MICROPROFILE		0
+// F16C conversions (_mm_cvtph_ps) for the FP16 weights, SSE2 integer code otherwise:
+#define ENABLE_F16C				0
+// Large pages (VirtualAlloc) for the parameter arena when requested, _aligned_malloc otherwise.
+// The privilege to lock pages in memory is left to the application:
+#define ENABLE_LARGE_PAGES		0
 
 #if	ENABLE_MICROPROFILE
 #	include "microprofile.h"
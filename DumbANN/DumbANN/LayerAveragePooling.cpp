@@ -0,0 +1,405 @@
+#include "LayerAveragePooling.h"
+#include <assert.h>
+#include <algorithm>
+#include <xmmintrin.h>
+
+CLayerAveragePooling2D::CLayerAveragePooling2D()
+{
+}
+
+CLayerAveragePooling2D::~CLayerAveragePooling2D()
+{
+}
+
+bool	CLayerAveragePooling2D::Setup(	size_t inputFeatureCount, size_t inputSizeX, size_t inputSizeY,
+										size_t poolSizeX, size_t poolSizeY,
+										size_t padding, size_t stride)
+{
+	if (stride == 0)
+		stride = 1;
+	if (inputSizeX + 2 * padding < poolSizeX ||
+		inputSizeY + 2 * padding < poolSizeY ||
+		(inputSizeX + 2 * padding - poolSizeX) % stride != 0 ||
+		(inputSizeY + 2 * padding - poolSizeY) % stride != 0)
+	{
+		fprintf(stderr, "Pool windows should tile the padded input");
+		assert(false);
+		return false;
+	}
+	if (padding >= poolSizeX || padding >= poolSizeY)
+	{
+		fprintf(stderr, "Padding should be smaller than the pool size");
+		assert(false);
+		return false;
+	}
+
+	m_FeatureCount = inputFeatureCount;
+
+	m_ConvParams.m_KernelSizeX = poolSizeX;
+	m_ConvParams.m_KernelSizeY = poolSizeY;
+	m_ConvParams.m_KernelStride = stride;
+	m_ConvParams.m_InputPadding = padding;
+	m_ConvParams.m_InputSizeX = inputSizeX;
+	m_ConvParams.m_InputSizeY = inputSizeY;
+	m_ConvParams.ComputeConvOutputSize();
+	m_ConvParams.ComputeConvGeometry();
+
+	m_OutputSize = m_FeatureCount * m_ConvParams.m_OutputSizeX * m_ConvParams.m_OutputSizeY;
+	m_InputSize = inputFeatureCount * inputSizeX * inputSizeY;
+	bool	success = true;
+	success &= m_Output.AllocateStorage(m_OutputSize);
+	success &= m_SlopesOut.AllocateStorage(m_OutputSize);
+	if (IsTiled() && !IsGlobal())
+		success &= m_RowSums.AllocateStorage(m_FeatureCount * m_ConvParams.m_OutputSizeX * poolSizeX);
+	return success;
+}
+
+bool	CLayerAveragePooling2D::SetupGlobal(size_t inputFeatureCount, size_t inputSizeX, size_t inputSizeY)
+{
+	return Setup(inputFeatureCount, inputSizeX, inputSizeY, inputSizeX, inputSizeY, 0, std::max(inputSizeX, inputSizeY));
+}
+
+bool	CLayerAveragePooling2D::IsGlobal() const
+{
+	return	m_ConvParams.m_InputPadding == 0 &&
+			m_ConvParams.m_KernelSizeX == m_ConvParams.m_InputSizeX &&
+			m_ConvParams.m_KernelSizeY == m_ConvParams.m_InputSizeY;
+}
+
+bool	CLayerAveragePooling2D::IsTiled() const
+{
+	return	m_ConvParams.m_InputPadding == 0 &&
+			m_ConvParams.m_KernelSizeX == m_ConvParams.m_KernelStride &&
+			m_ConvParams.m_KernelSizeY == m_ConvParams.m_KernelStride;
+}
+
+void	CLayerAveragePooling2D::FeedForward(const float *input, size_t rangeMin, size_t rangeMax)
+{
+	MICROPROFILE_SCOPEI("CLayerAveragePooling2D", "CLayerAveragePooling2D::FeedForward", MP_GREEN1);
+	SComputeOutput_KernelIn	kernelIn;
+
+	if (IsGlobal())
+	{
+		ComputeOutputGlobal(input, rangeMin, rangeMax);
+		return;
+	}
+	if (IsTiled())
+	{
+		ComputeOutputTiled(input, rangeMin, rangeMax);
+		return;
+	}
+
+	kernelIn.m_FeatureCount = m_FeatureCount;
+	kernelIn.m_Output = m_Output.Data();
+	kernelIn.m_Input = input;
+
+	KernelConvolute<SComputeOutput_KernelIn,
+					&CLayerAveragePooling2D::Kernel_ComputeOutput>(kernelIn, rangeMin, rangeMax, m_ConvParams);
+}
+
+float	CLayerAveragePooling2D::BackPropagateError(const float *prevOutput, const SLossTarget &target, size_t rangeMin, size_t rangeMax)
+{
+	MICROPROFILE_SCOPEI("CLayerAveragePooling2D", "CLayerAveragePooling2D::BackPropagateError", MP_RED1);
+	const size_t	featureStide = m_ConvParams.m_OutputSizeX * m_ConvParams.m_OutputSizeY;
+
+	// Outter layer of the neural network:
+	return ComputeLossSlopes(target, featureStide * rangeMin, featureStide * rangeMax);
+}
+
+void	CLayerAveragePooling2D::BackPropagateError(const float *prevOutput, const CLayer* nextLayer, size_t rangeMin, size_t rangeMax)
+{
+}
+
+void	CLayerAveragePooling2D::UpdateWeightsAndBias(size_t trainingSteps, size_t rangeMin, size_t rangeMax)
+{
+}
+
+void	CLayerAveragePooling2D::GatherSlopes(float *dst, const CLayer *prevLayer, size_t rangeMin, size_t rangeMax) const
+{
+	MICROPROFILE_SCOPEI("CLayerAveragePooling2D", "CLayerAveragePooling2D::GatherSlopes", MP_PALEVIOLETRED1);
+	(void)prevLayer;
+	const size_t			featureInputStride = m_ConvParams.m_InputSizeX * m_ConvParams.m_InputSizeY;
+	// Each feature is cleared and written by a single task:
+	const size_t			featureMin = (rangeMin + featureInputStride - 1) / featureInputStride;
+	const size_t			featureMax = (rangeMax + featureInputStride - 1) / featureInputStride;
+	SGatherSlopes_KernelIn	kernelIn;
+
+	if (featureMin >= featureMax)
+		return;
+	// Both write every input slope of the features:
+	if (IsGlobal())
+	{
+		GatherSlopesGlobal(dst, featureMin, featureMax);
+		return;
+	}
+	if (IsTiled())
+	{
+		GatherSlopesTiled(dst, featureMin, featureMax);
+		return;
+	}
+	kernelIn.m_FeatureCount = m_FeatureCount;
+	kernelIn.m_Output = dst;
+	kernelIn.m_Slopes = m_SlopesOut.Data();
+
+	memset(dst + featureMin * featureInputStride, 0, (featureMax - featureMin) * featureInputStride * sizeof(float));
+	KernelConvolute<SGatherSlopes_KernelIn,
+					&CLayerAveragePooling2D::Kernel_GatherSlopes>(kernelIn, featureMin, featureMax, m_ConvParams);
+}
+
+void	CLayerAveragePooling2D::PrintInfo() const
+{
+	printf("\tLayer Average Pooling 2D%s:\n", IsGlobal() ? " (global)" : "");
+	printf("\t\tInput: %zu %zux%zu (padding: %zu)\n",
+			m_FeatureCount, m_ConvParams.m_InputSizeX, m_ConvParams.m_InputSizeY,
+			m_ConvParams.m_InputPadding);
+	printf(	"\t\tPool size: %zux%zu (stride: %zu)\n",
+			m_ConvParams.m_KernelSizeX, m_ConvParams.m_KernelSizeY,
+			m_ConvParams.m_KernelStride);
+	printf("\t\tOutput: %zu %zux%zu\n",
+			m_FeatureCount, m_ConvParams.m_OutputSizeX, m_ConvParams.m_OutputSizeY);
+}
+
+void	CLayerAveragePooling2D::Serialize(std::vector<uint8_t> &data) const
+{
+	SerializeLayerType(data, ELayerType::LayerAveragePooling);
+	SerializeInOutSize(data);
+	m_ConvParams.Serialize(data);
+	size_t		prevSize = data.size();
+	data.resize(prevSize + sizeof(uint32_t));
+	uint32_t	*dataPtr = (uint32_t*)(data.data() + prevSize);
+	dataPtr[0] = m_FeatureCount;
+}
+
+bool	CLayerAveragePooling2D::UnSerialize(const std::vector<uint8_t> &data, size_t &curIdx)
+{
+	if (!UnSerializeInOutSize(data, curIdx))
+		return false;
+	if (!m_ConvParams.UnSerialize(data, curIdx))
+		return false;
+	if (curIdx + sizeof(uint32_t) > data.size())
+		return false;
+	uint32_t	*dataPtr = (uint32_t*)(data.data() + curIdx);
+	m_FeatureCount = dataPtr[0];
+	curIdx += sizeof(uint32_t);
+	if (!Setup(	m_FeatureCount, m_ConvParams.m_InputSizeX, m_ConvParams.m_InputSizeY,
+				m_ConvParams.m_KernelSizeX, m_ConvParams.m_KernelSizeY,
+				m_ConvParams.m_InputPadding, m_ConvParams.m_KernelStride))
+		return false;
+	return true;
+}
+
+size_t	CLayerAveragePooling2D::GetThreadingHint() const
+{
+	// Every input is read once:
+	return m_InputSize;
+}
+
+size_t	CLayerAveragePooling2D::GetDomainSize() const
+{
+	return m_FeatureCount;
+}
+
+void	CLayerAveragePooling2D::ComputeOutputGlobal(const float *input, size_t featureMin, size_t featureMax)
+{
+	const size_t	featureInputStride = m_ConvParams.m_InputSizeX * m_ConvParams.m_InputSizeY;
+	const size_t	simdStop = featureInputStride & ~(size_t)3;
+	const float		scale = 1.0f / static_cast<float>(featureInputStride);
+
+	for (size_t featureIdx = featureMin; featureIdx < featureMax; ++featureIdx)
+	{
+		const float		*inputPtr = input + featureIdx * featureInputStride;
+		__m128			sum0_xyzw = _mm_setzero_ps();
+		__m128			sum1_xyzw = _mm_setzero_ps();
+		size_t			i = 0;
+
+		// Two accumulators to hide the add latency:
+		for (; i + 8 <= simdStop; i += 8)
+		{
+			sum0_xyzw = _mm_add_ps(sum0_xyzw, _mm_loadu_ps(inputPtr + i));
+			sum1_xyzw = _mm_add_ps(sum1_xyzw, _mm_loadu_ps(inputPtr + i + 4));
+		}
+		for (; i < simdStop; i += 4)
+			sum0_xyzw = _mm_add_ps(sum0_xyzw, _mm_loadu_ps(inputPtr + i));
+		float			sum = KernelHorizontalSum(_mm_add_ps(sum0_xyzw, sum1_xyzw));
+		for (; i < featureInputStride; ++i)
+			sum += inputPtr[i];
+		m_Output.Data()[featureIdx] = sum * scale;
+	}
+}
+
+void	CLayerAveragePooling2D::ComputeOutputTiled(const float *input, size_t featureMin, size_t featureMax)
+{
+	const size_t		inputSizeX = m_ConvParams.m_InputSizeX;
+	const size_t		poolSizeX = m_ConvParams.m_KernelSizeX;
+	const size_t		poolSizeY = m_ConvParams.m_KernelSizeY;
+	const size_t		outputSizeX = m_ConvParams.m_OutputSizeX;
+	const size_t		outputSizeY = m_ConvParams.m_OutputSizeY;
+	const size_t		featureInputStride = inputSizeX * m_ConvParams.m_InputSizeY;
+	const size_t		rowSize = outputSizeX * poolSizeX;
+	const size_t		rowSimdStop = rowSize & ~(size_t)3;
+	const float			scale = 1.0f / static_cast<float>(poolSizeX * poolSizeY);
+	const __m128		scale_xxxx = _mm_set1_ps(scale);
+
+	for (size_t featureIdx = featureMin; featureIdx < featureMax; ++featureIdx)
+	{
+		float	*rowSumsPtr = m_RowSums.Data() + featureIdx * rowSize;
+
+		for (size_t outY = 0; outY < outputSizeY; ++outY)
+		{
+			const float		*rowPtr = input + featureIdx * featureInputStride + (outY * poolSizeY) * inputSizeX;
+			float			*outputPtr = m_Output.Data() + (featureIdx * outputSizeY + outY) * outputSizeX;
+
+			// Vertical sum of the window rows:
+			memcpy(rowSumsPtr, rowPtr, rowSize * sizeof(float));
+			for (size_t y = 1; y < poolSizeY; ++y)
+			{
+				const float		*srcPtr = rowPtr + y * inputSizeX;
+				size_t			x = 0;
+
+				for (; x < rowSimdStop; x += 4)
+					_mm_storeu_ps(rowSumsPtr + x, _mm_add_ps(_mm_loadu_ps(rowSumsPtr + x), _mm_loadu_ps(srcPtr + x)));
+				for (; x < rowSize; ++x)
+					rowSumsPtr[x] += srcPtr[x];
+			}
+			// Horizontal sum of the windows:
+			size_t			outX = 0;
+			if (poolSizeX == 2)
+			{
+				for (; outX + 4 <= outputSizeX; outX += 4)
+				{
+					const __m128	sum0_xyzw = _mm_loadu_ps(rowSumsPtr + outX * 2);
+					const __m128	sum1_xyzw = _mm_loadu_ps(rowSumsPtr + outX * 2 + 4);
+					const __m128	even_xyzw = _mm_shuffle_ps(sum0_xyzw, sum1_xyzw, _MM_SHUFFLE(2, 0, 2, 0));
+					const __m128	odd_xyzw = _mm_shuffle_ps(sum0_xyzw, sum1_xyzw, _MM_SHUFFLE(3, 1, 3, 1));
+
+					_mm_storeu_ps(outputPtr + outX, _mm_mul_ps(_mm_add_ps(even_xyzw, odd_xyzw), scale_xxxx));
+				}
+			}
+			for (; outX < outputSizeX; ++outX)
+			{
+				float	sum = 0.0f;
+
+				for (size_t x = 0; x < poolSizeX; ++x)
+					sum += rowSumsPtr[outX * poolSizeX + x];
+				outputPtr[outX] = sum * scale;
+			}
+		}
+	}
+}
+
+void	CLayerAveragePooling2D::GatherSlopesGlobal(float *dst, size_t featureMin, size_t featureMax) const
+{
+	const size_t	featureInputStride = m_ConvParams.m_InputSizeX * m_ConvParams.m_InputSizeY;
+	const size_t	simdStop = featureInputStride & ~(size_t)3;
+	const float		scale = 1.0f / static_cast<float>(featureInputStride);
+
+	for (size_t featureIdx = featureMin; featureIdx < featureMax; ++featureIdx)
+	{
+		const float		slope = m_SlopesOut.Data()[featureIdx] * scale;
+		const __m128	slope_xxxx = _mm_set1_ps(slope);
+		float			*dstPtr = dst + featureIdx * featureInputStride;
+		size_t			i = 0;
+
+		for (; i < simdStop; i += 4)
+			_mm_storeu_ps(dstPtr + i, slope_xxxx);
+		for (; i < featureInputStride; ++i)
+			dstPtr[i] = slope;
+	}
+}
+
+void	CLayerAveragePooling2D::GatherSlopesTiled(float *dst, size_t featureMin, size_t featureMax) const
+{
+	const size_t		inputSizeX = m_ConvParams.m_InputSizeX;
+	const size_t		poolSizeX = m_ConvParams.m_KernelSizeX;
+	const size_t		poolSizeY = m_ConvParams.m_KernelSizeY;
+	const size_t		outputSizeX = m_ConvParams.m_OutputSizeX;
+	const size_t		outputSizeY = m_ConvParams.m_OutputSizeY;
+	const size_t		featureInputStride = inputSizeX * m_ConvParams.m_InputSizeY;
+	const size_t		rowSize = outputSizeX * poolSizeX;
+	const float			scale = 1.0f / static_cast<float>(poolSizeX * poolSizeY);
+	const __m128		scale_xxxx = _mm_set1_ps(scale);
+
+	assert(rowSize == inputSizeX);
+	for (size_t featureIdx = featureMin; featureIdx < featureMax; ++featureIdx)
+	{
+		for (size_t outY = 0; outY < outputSizeY; ++outY)
+		{
+			const float		*slopesPtr = m_SlopesOut.Data() + (featureIdx * outputSizeY + outY) * outputSizeX;
+			float			*dstPtr = dst + featureIdx * featureInputStride + (outY * poolSizeY) * inputSizeX;
+			size_t			outX = 0;
+
+			// Each window slope is spread over the inputs of the first row, copied to the others:
+			if (poolSizeX == 2)
+			{
+				for (; outX + 4 <= outputSizeX; outX += 4)
+				{
+					const __m128	slope_xyzw = _mm_mul_ps(_mm_loadu_ps(slopesPtr + outX), scale_xxxx);
+
+					_mm_storeu_ps(dstPtr + outX * 2, _mm_unpacklo_ps(slope_xyzw, slope_xyzw));
+					_mm_storeu_ps(dstPtr + outX * 2 + 4, _mm_unpackhi_ps(slope_xyzw, slope_xyzw));
+				}
+			}
+			for (; outX < outputSizeX; ++outX)
+			{
+				const float		slope = slopesPtr[outX] * scale;
+
+				for (size_t x = 0; x < poolSizeX; ++x)
+					dstPtr[outX * poolSizeX + x] = slope;
+			}
+			for (size_t y = 1; y < poolSizeY; ++y)
+				memcpy(dstPtr + y * inputSizeX, dstPtr, rowSize * sizeof(float));
+		}
+	}
+}
+
+void	CLayerAveragePooling2D::Kernel_ComputeOutput(	const SComputeOutput_KernelIn &input,
+														const SKernelRange &range,
+														const SConvolutionParams &conv)
+{
+	const size_t	featureInputStride = conv.m_InputSizeX * conv.m_InputSizeY;
+	const size_t	featureOutputStride = conv.m_OutputSizeX * conv.m_OutputSizeY;
+	const size_t	count = (range.m_StopConvY - range.m_StartConvY) * (range.m_StopConvX - range.m_StartConvX);
+	float			sum = 0.0f;
+
+	for (size_t inY = range.m_StartConvY; inY < range.m_StopConvY; ++inY)
+	{
+		for (size_t inX = range.m_StartConvX; inX < range.m_StopConvX; ++inX)
+		{
+			size_t	inputIdx =	range.m_FeatureIdx * featureInputStride +
+								inY * conv.m_InputSizeX +
+								inX;
+			sum += input.m_Input[inputIdx];
+		}
+	}
+	const size_t	outIdx =	range.m_FeatureIdx * featureOutputStride +
+								range.m_ConvIdxY * conv.m_OutputSizeX +
+								range.m_ConvIdxX;
+	input.m_Output[outIdx] = sum / static_cast<float>(count);
+	assert(abs(input.m_Output[outIdx]) < 1000000.0f);
+	assert(!isnan(input.m_Output[outIdx]));
+	assert(!isinf(input.m_Output[outIdx]));
+}
+
+void	CLayerAveragePooling2D::Kernel_GatherSlopes(const SGatherSlopes_KernelIn &input,
+													const SKernelRange &range,
+													const SConvolutionParams &conv)
+{
+	const size_t	featureInputStride = conv.m_InputSizeX * conv.m_InputSizeY;
+	const size_t	featureOutputStride = conv.m_OutputSizeX * conv.m_OutputSizeY;
+	const size_t	count = (range.m_StopConvY - range.m_StartConvY) * (range.m_StopConvX - range.m_StartConvX);
+	const size_t	outIdx =	range.m_FeatureIdx * featureOutputStride +
+								range.m_ConvIdxY * conv.m_OutputSizeX +
+								range.m_ConvIdxX;
+	const float		slope = input.m_Slopes[outIdx] / static_cast<float>(count);
+
+	for (size_t inY = range.m_StartConvY; inY < range.m_StopConvY; ++inY)
+	{
+		for (size_t inX = range.m_StartConvX; inX < range.m_StopConvX; ++inX)
+		{
+			const size_t	dstIdx =	range.m_FeatureIdx * featureInputStride +
+										inY * conv.m_InputSizeX +
+										inX;
+			input.m_Output[dstIdx] += slope;
+		}
+	}
+}
@@ -0,0 +1,76 @@
+#pragma once
+
+#include "LayerBase.h"
+#include "NeuronKernel.h"
+
+// Average of each pool window, the padding is not counted in the average.
+// Global average pooling is a pool window covering the whole feature (one output per feature):
+class	CLayerAveragePooling2D : public CLayer
+{
+public:
+	CLayerAveragePooling2D();
+	~CLayerAveragePooling2D();
+
+	bool	Setup(	size_t inputFeatureCount, size_t inputSizeX, size_t inputSizeY,
+					size_t poolSizeX, size_t poolSizeY,
+					size_t padding, size_t stride);
+	bool	SetupGlobal(size_t inputFeatureCount, size_t inputSizeX, size_t inputSizeY);
+
+	virtual void	FeedForward(const float *input, size_t rangeMin, size_t rangeMax) override;
+	virtual float	BackPropagateError(const float *prevOutput, const SLossTarget &target, size_t rangeMin, size_t rangeMax) override;
+	virtual void	BackPropagateError(const float* prevOutput, const CLayer *nextLayer, size_t rangeMin, size_t rangeMax) override;
+	virtual void	UpdateWeightsAndBias(size_t trainingSteps, size_t rangeMin, size_t rangeMax) override;
+	virtual void	GatherSlopes(float *dst, const CLayer *prevLayer, size_t rangeMin, size_t rangeMax) const override;
+	virtual void	PrintInfo() const override;
+	virtual void	Serialize(std::vector<uint8_t> &data) const override;
+	virtual bool	UnSerialize(const std::vector<uint8_t> &data, size_t &curIdx) override;
+
+	virtual size_t	GetThreadingHint() const override;
+	virtual size_t	GetDomainSize() const override;
+	virtual ELayerType	GetLayerType() const override { return ELayerType::LayerAveragePooling; }
+
+	size_t			GetFeatureCount() const { return m_FeatureCount; }
+	size_t			GetFeatureSizeX() const { return m_ConvParams.m_KernelSizeX; }
+	size_t			GetFeatureSizeY() const { return m_ConvParams.m_KernelSizeY; }
+	size_t			GetOutputSizeX() const { return m_ConvParams.m_OutputSizeX; }
+	size_t			GetOutputSizeY() const { return m_ConvParams.m_OutputSizeY; }
+
+	bool			IsGlobal() const;
+
+private:
+	struct	SComputeOutput_KernelIn
+	{
+		const float				*m_Input;
+		float					*m_Output;
+
+		size_t					m_FeatureCount;
+	};
+
+	struct	SGatherSlopes_KernelIn
+	{
+		float					*m_Output;
+
+		const float				*m_Slopes;
+
+		size_t					m_FeatureCount;
+	};
+
+	__forceinline static void		Kernel_ComputeOutput(	const SComputeOutput_KernelIn &input,
+															const SKernelRange &range,
+															const SConvolutionParams &conv);
+	__forceinline static void		Kernel_GatherSlopes(const SGatherSlopes_KernelIn &input,
+														const SKernelRange &range,
+														const SConvolutionParams &conv);
+
+	// Non overlapping windows without padding, each input row belongs to a single output row:
+	bool							IsTiled() const;
+	void							ComputeOutputGlobal(const float *input, size_t featureMin, size_t featureMax);
+	void							ComputeOutputTiled(const float *input, size_t featureMin, size_t featureMax);
+	void							GatherSlopesGlobal(float *dst, size_t featureMin, size_t featureMax) const;
+	void							GatherSlopesTiled(float *dst, size_t featureMin, size_t featureMax) const;
+
+	SConvolutionParams		m_ConvParams;
+	size_t					m_FeatureCount;
+	// Vertical sums of the window rows of the tiled path, one row per feature so the tasks do not share it:
+	CNeuronVector			m_RowSums;
+};
@@ -2,10 +2,16 @@
 #include "LayerBase.h"
 #include <xmmintrin.h>
 #include <assert.h>
+#include <algorithm>
 
+#include "LayerAveragePooling.h"
+#include "LayerBatchNorm.h"
 #include "LayerConv2D.h"
+#include "LayerConvTranspose2D.h"
 #include "LayerDense.h"
+#include "LayerDepthwiseConv2D.h"
 #include "LayerDropout.h"
+#include "LayerFlatten.h"
 #include "LayerMaxPooling.h"
 #include "LayerSoftmax.h"
 
@@ -48,6 +54,13 @@ const char	*kInitializerNames[]
 	"Rand He"
 };
 
+const char	*kLossNames[]
+{
+	"Mean Squared Error",
+	"Softmax Cross Entropy",
+	"Binary Cross Entropy"
+};
+
 CLayer	*CLayer::CreateLayer(ELayerType type)
 {
 	switch (type)
@@ -67,6 +80,21 @@ CLayer	*CLayer::CreateLayer(ELayerType type)
 	case ELayerType::LayerSofmax:
 		return new CLayerSoftMax();
 		break;
+	case ELayerType::LayerFlatten:
+		return new CLayerFlatten();
+		break;
+	case ELayerType::LayerAveragePooling:
+		return new CLayerAveragePooling2D();
+		break;
+	case ELayerType::LayerConvTranspose2D:
+		return new CLayerConvTranspose2D();
+		break;
+	case ELayerType::LayerDepthwiseConv2D:
+		return new CLayerDepthwiseConv2D();
+		break;
+	case ELayerType::LayerBatchNorm:
+		return new CLayerBatchNorm();
+		break;
 	default:
 		return nullptr;
 		break;
@@ -83,6 +111,8 @@ CLayer::CLayer()
 ,	m_RegularizerRatio(1e-5)
 ,	m_LearningRate(0.001f)
 ,	m_Inertia(0.0f)
+,	m_InputScale(1.0f)
+,	m_InputNonZero(nullptr)
 ,	m_Learn(true)
 {
 }
@@ -134,6 +164,80 @@ void	CLayer::PrintBasicInfo() const
 			kOptimizationNames[(int)m_Optimization],
 			kRegularizationNames[(int)m_Regularizer]);
 	printf("\t\tWeight Initializer: %s\n", kInitializerNames[(int)m_Initializer]);
+	if (IsQuantized())
+		printf("\t\tQuantized: int8 (input scale %f)\n", m_InputScale);
+	else if (UsesHalfWeights())
+		printf("\t\tWeights: %s\n", m_HalfWeights.Format() == EHalfFormat::BFloat16 ? "BF16" : "FP16");
+	else if (UsesBlockSparseWeights())
+	{
+		const size_t	blockColumnCount = (m_SparseWeights.Columns() + CBlockSparseMatrix::kBlockSize - 1) / CBlockSparseMatrix::kBlockSize;
+		const size_t	totalBlockCount = std::max<size_t>(m_SparseWeights.Rows() * blockColumnCount, 1);
+
+		printf(	"\t\tWeights: block sparse 1x%zu (%.2f%% of the blocks kept)\n",
+				CBlockSparseMatrix::kBlockSize,
+				100.0f * m_SparseWeights.BlockCount() / totalBlockCount);
+	}
+}
+
+void	CLayer::BuildNonZeroOutputs(size_t rangeMin, size_t rangeMax)
+{
+	MICROPROFILE_SCOPEI("CLayer", "CLayer::BuildNonZeroOutputs", MP_GREEN2);
+	// Each task owns the blocks starting in its range:
+	const size_t	blockMin = (rangeMin + SNonZeroList::kBlockSize - 1) / SNonZeroList::kBlockSize;
+	const size_t	blockMax = (rangeMax + SNonZeroList::kBlockSize - 1) / SNonZeroList::kBlockSize;
+
+	assert(m_NonZeroOutputs.m_Size == m_Output.Size());
+	m_NonZeroOutputs.Build(m_Output.Data(), blockMin, blockMax);
+}
+
+float	CLayer::ComputeLossSlopes(const SLossTarget &target, size_t rangeMin, size_t rangeMax)
+{
+	const float		*outputPtr = m_Output.Data();
+	const float		*netInputPtr = m_NetInput.Data();
+	float			*slopePtr = m_SlopesOut.Data();
+	const float		epsilon = 1e-7f;
+	float			loss = 0.0f;
+
+	if (target.m_Loss == ELoss::BinaryCrossEntropy && m_Activation == EActivation::Sigmoid && netInputPtr != nullptr)
+	{
+		// Sigmoid and cross entropy fused, computed from the net input to stay stable:
+		for (size_t outIdx = rangeMin; outIdx < rangeMax; ++outIdx)
+		{
+			const float		expected = target.Expected(outIdx);
+			const float		netInput = netInputPtr[outIdx];
+
+			slopePtr[outIdx] = outputPtr[outIdx] - expected;
+			loss += std::max(netInput, 0.0f) - netInput * expected + log1pf(expf(-fabsf(netInput)));
+		}
+		return loss;
+	}
+	if (target.m_Loss == ELoss::BinaryCrossEntropy)
+	{
+		for (size_t outIdx = rangeMin; outIdx < rangeMax; ++outIdx)
+		{
+			const float		expected = target.Expected(outIdx);
+			const float		output = std::min(std::max(outputPtr[outIdx], epsilon), 1.0f - epsilon);
+
+			slopePtr[outIdx] = (output - expected) / (output * (1.0f - output));
+			loss -= expected * logf(output) + (1.0f - expected) * logf(1.0f - output);
+		}
+	}
+	else
+	{
+		// Softmax cross entropy is handled by CLayerSoftMax:
+		assert(target.m_Loss == ELoss::MeanSquaredError);
+		for (size_t outIdx = rangeMin; outIdx < rangeMax; ++outIdx)
+		{
+			const float		error = outputPtr[outIdx] - target.Expected(outIdx);
+
+			slopePtr[outIdx] = error;
+			loss += 0.5f * error * error;
+		}
+	}
+	// Layers without activation have no net input:
+	if (netInputPtr != nullptr)
+		ActivationDerivative(slopePtr + rangeMin, netInputPtr + rangeMin, rangeMax - rangeMin);
+	return loss;
 }
 
 void	CLayer::SerializeLayerType(std::vector<uint8_t> &data, ELayerType type) const
@@ -196,13 +300,78 @@ bool	CLayer::UnSerializeBasicInfo(const std::vector<uint8_t> &data, size_t &curI
 
 void	CLayer::SerializeWeightsAndBias(std::vector<uint8_t> &data) const
 {
-	m_Weights.Serialize(data);
+	if (IsQuantized())
+	{
+		// Quantized section: tag, input scale and int8 weights, in place of the float weights:
+		size_t		prevSize = data.size();
+		data.resize(prevSize + sizeof(uint32_t) + sizeof(float));
+		uint32_t	*dataPtr = (uint32_t*)(data.data() + prevSize);
+		dataPtr[0] = CQuantizedMatrix::kSerializeTag;
+		*(float*)(dataPtr + 1) = m_InputScale;
+		m_QuantizedWeights.Serialize(data);
+	}
+	else if (UsesHalfWeights())
+	{
+		// Half section: tag and 16 bits weights, in place of the float weights:
+		size_t		prevSize = data.size();
+		data.resize(prevSize + sizeof(uint32_t));
+		*(uint32_t*)(data.data() + prevSize) = CHalfMatrix::kSerializeTag;
+		m_HalfWeights.Serialize(data);
+	}
+	else if (UsesBlockSparseWeights())
+	{
+		// Block sparse section: tag and kept blocks, in place of the float weights:
+		size_t		prevSize = data.size();
+		data.resize(prevSize + sizeof(uint32_t));
+		*(uint32_t*)(data.data() + prevSize) = CBlockSparseMatrix::kSerializeTag;
+		m_SparseWeights.Serialize(data);
+	}
+	else
+		m_Weights.Serialize(data);
 	m_Bias.Serialize(data);
 }
 
 bool	CLayer::UnSerializeWeightsAndBias(const std::vector<uint8_t> &data, size_t &curIdx)
 {
-	if (!m_Weights.UnSerialize(data, curIdx))
+	if (curIdx + sizeof(uint32_t) > data.size())
+		return false;
+	const uint32_t	tag = *(const uint32_t*)(data.data() + curIdx);
+
+	if (tag == CQuantizedMatrix::kSerializeTag)
+	{
+		if (curIdx + sizeof(uint32_t) + sizeof(float) > data.size())
+			return false;
+		m_InputScale = *(const float*)(data.data() + curIdx + sizeof(uint32_t));
+		curIdx += sizeof(uint32_t) + sizeof(float);
+		if (!m_QuantizedWeights.UnSerialize(data, curIdx))
+			return false;
+		// The float weights are rebuilt for the passes that still use them:
+		if (!m_Weights.AllocMatrix(m_QuantizedWeights.Rows(), m_QuantizedWeights.Columns()))
+			return false;
+		m_QuantizedWeights.Dequantize(m_Weights.View());
+		m_QuantizedInput.assign(CQuantizedMatrix::AlignedSize(m_InputSize), 0);
+		m_Learn = false;
+	}
+	else if (tag == CHalfMatrix::kSerializeTag)
+	{
+		curIdx += sizeof(uint32_t);
+		if (!m_HalfWeights.UnSerialize(data, curIdx))
+			return false;
+		if (!m_Weights.AllocMatrix(m_HalfWeights.Rows(), m_HalfWeights.Columns()))
+			return false;
+		m_HalfWeights.Expand(m_Weights.View());
+		m_Learn = false;
+	}
+	else if (tag == CBlockSparseMatrix::kSerializeTag)
+	{
+		curIdx += sizeof(uint32_t);
+		if (!m_SparseWeights.UnSerialize(data, curIdx))
+			return false;
+		if (!m_Weights.AllocMatrix(m_SparseWeights.Rows(), m_SparseWeights.Columns()))
+			return false;
+		m_SparseWeights.Expand(m_Weights.View());
+	}
+	else if (!m_Weights.UnSerialize(data, curIdx))
 		return false;
 	m_Weights.DebugCheckForNaNs();
 	if (!m_Bias.UnSerialize(data, curIdx))
@@ -211,6 +380,145 @@ bool	CLayer::UnSerializeWeightsAndBias(const std::vector<uint8_t> &data, size_t
 	return true;
 }
 
+bool	CLayer::Quantize(float inputRange)
+{
+	if (!CanQuantize())
+		return false;
+	m_InputScale = inputRange > 0.0f ? inputRange / 127.0f : 1.0f;
+	if (!m_QuantizedWeights.Quantize(m_Weights.View()))
+		return false;
+	m_QuantizedInput.assign(CQuantizedMatrix::AlignedSize(m_InputSize), 0);
+	m_Learn = false;
+	return true;
+}
+
+bool	CLayer::ConvertWeightsToHalf(EHalfFormat format)
+{
+	if (!CanUseHalfWeights())
+		return false;
+	if (!m_HalfWeights.Convert(m_Weights.View(), format))
+		return false;
+	// The float weights match what the kernels see:
+	m_HalfWeights.Expand(m_Weights.View());
+	m_Learn = false;
+	return true;
+}
+
+bool	CLayer::SetBlockSparsity(float sparsity)
+{
+	if (!CanUseBlockSparseWeights() || sparsity < 0.0f || sparsity >= 1.0f)
+		return false;
+	const SNeuronMatrixView	&weights = m_Weights.View();
+	const SNeuronMatrixView	&velocities = m_DeltaWeightVelocity.View();
+	const size_t			blockSize = CBlockSparseMatrix::kBlockSize;
+	const size_t			blockColumnCount = (weights.m_Columns + blockSize - 1) / blockSize;
+	std::vector<float>		norms(weights.m_Rows * blockColumnCount, 0.0f);
+
+	for (size_t y = 0; y < weights.m_Rows; ++y)
+	{
+		const float		*weightsPtr = weights.GetRow(y);
+
+		for (size_t x = 0; x < weights.m_Columns; ++x)
+			norms[y * blockColumnCount + x / blockSize] += weightsPtr[x] * weightsPtr[x];
+	}
+	const size_t		prunedCount = static_cast<size_t>(sparsity * norms.size());
+
+	if (prunedCount > 0)
+	{
+		std::vector<float>	sortedNorms(norms);
+
+		std::nth_element(sortedNorms.begin(), sortedNorms.begin() + (prunedCount - 1), sortedNorms.end());
+		const float		threshold = sortedNorms[prunedCount - 1];
+		// Blocks at the threshold are pruned until the count is reached:
+		size_t			tiesLeft = prunedCount - std::count_if(norms.begin(), norms.end(), [threshold](float norm) { return norm < threshold; });
+
+		for (size_t y = 0; y < weights.m_Rows; ++y)
+		{
+			for (size_t blockColumn = 0; blockColumn < blockColumnCount; ++blockColumn)
+			{
+				const float		norm = norms[y * blockColumnCount + blockColumn];
+				const size_t	col = blockColumn * blockSize;
+				const size_t	count = std::min(blockSize, weights.m_Columns - col);
+
+				if (norm > threshold || (norm == threshold && tiesLeft == 0))
+					continue;
+				if (norm == threshold)
+					--tiesLeft;
+				// The momentum would move the pruned weights away from zero:
+				memset(weights.GetRow(y) + col, 0, count * sizeof(float));
+				memset(velocities.GetRow(y) + col, 0, count * sizeof(float));
+			}
+		}
+	}
+	return m_SparseWeights.Build(weights);
+}
+
+bool	CLayer::SetMixedPrecision(float *netInputScratch)
+{
+	const size_t	netInputSize = m_NetInput.Size();
+
+	if (!CanUseMixedPrecision())
+		return false;
+	if (netInputScratch == nullptr)
+	{
+		m_NetInputHalf.FreeStorage();
+		return m_NetInput.AllocateStorage(netInputSize);
+	}
+	if (!m_NetInputHalf.AllocateStorage(netInputSize))
+		return false;
+	m_NetInput.AliasStorage(netInputScratch, netInputSize);
+	return true;
+}
+
+void	CLayer::GetParameterStorages(std::vector<CNeuronMatrix*> &matrices, std::vector<CNeuronVector*> &vectors)
+{
+	matrices.push_back(&m_Weights);
+	matrices.push_back(&m_SlopesWeightAccum);
+	matrices.push_back(&m_AdagradWeightAccum);
+	matrices.push_back(&m_DeltaWeightVelocity);
+	vectors.push_back(&m_Bias);
+	vectors.push_back(&m_SlopesOutAccum);
+	vectors.push_back(&m_AdagradBiasAccum);
+	vectors.push_back(&m_DeltaBiasVelocity);
+}
+
+bool	CLayer::AliasActivations(float *output, float *netInput)
+{
+	const size_t	outputSize = m_Output.Size();
+
+	if (output == nullptr)
+	{
+		if (CanAliasNetInput() && !m_NetInput.AllocateStorage(outputSize))
+			return false;
+		return m_Output.AllocateStorage(outputSize);
+	}
+	m_Output.AliasStorage(output, outputSize);
+	if (CanAliasNetInput())
+	{
+		assert(netInput != nullptr);
+		m_NetInput.AliasStorage(netInput, outputSize);
+	}
+	return true;
+}
+
+void	CLayer::PackNetInput(size_t rangeMin, size_t rangeMax)
+{
+	if (UsesMixedPrecision())
+		m_NetInputHalf.Pack(m_NetInput.Data(), rangeMin, rangeMax);
+}
+
+void	CLayer::UnpackNetInput(size_t rangeMin, size_t rangeMax)
+{
+	if (UsesMixedPrecision())
+		m_NetInputHalf.Unpack(m_NetInput.Data(), rangeMin, rangeMax);
+}
+
+void	CLayer::QuantizeInput(const float *input, size_t rangeMin, size_t rangeMax)
+{
+	assert(IsQuantized() && rangeMax <= m_InputSize);
+	CQuantizedMatrix::QuantizeVector(m_QuantizedInput.data() + rangeMin, input + rangeMin, rangeMax - rangeMin, m_InputScale);
+}
+
 void	CLayer::InitializeRandomRange(float min, float max)
 {
 	// Initialize to random floats:
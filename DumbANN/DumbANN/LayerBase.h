@@ -38,10 +38,35 @@ enum class	ERandInitializer
 	RandHe
 };
 
+enum class	ELoss
+{
+	MeanSquaredError,
+	SoftmaxCrossEntropy,
+	BinaryCrossEntropy
+};
+
 const char	*kActivationNames[];
 const char	*kOptimizationNames[];
 const char	*kRegularizationNames[];
 const char	*kInitializerNames[];
+const char	*kLossNames[];
+
+// Expected output of the last layer, either dense or a class index (one-hot):
+struct	SLossTarget
+{
+	ELoss		m_Loss;
+	const float	*m_Expected;
+	size_t		m_ClassIdx;
+
+	SLossTarget()
+	:	m_Loss(ELoss::MeanSquaredError)
+	,	m_Expected(nullptr)
+	,	m_ClassIdx(0)
+	{
+	}
+
+	float	Expected(size_t idx) const { return m_Expected != nullptr ? m_Expected[idx] : (idx == m_ClassIdx ? 1.0f : 0.0f); }
+};
 
 enum class	ELayerType
 {
@@ -49,7 +74,12 @@ enum class	ELayerType
 	LayerConv2D,
 	LayerMaxPooling,
 	LayerDropout,
-	LayerSofmax
+	LayerSofmax,
+	LayerFlatten,
+	LayerAveragePooling,
+	LayerConvTranspose2D,
+	LayerDepthwiseConv2D,
+	LayerBatchNorm
 };
 
 class	CLayer
@@ -58,17 +88,33 @@ public:
 	static CLayer	*CreateLayer(ELayerType type);
 
 	CLayer();
-	~CLayer();
+	virtual ~CLayer();
 
 	size_t	GetInputSize() const { return m_InputSize; }
 	size_t	GetOutputSize() const { return m_Output.Size(); }
 	const CNeuronVector			&GetOutput() const { return m_Output; }
 	const CNeuronVector			&GetNetInput() const { return m_NetInput; }
 	const CNeuronMatrix			&GetWeights() const { return m_Weights; }
+	const CBlockSparseMatrix	&GetBlockSparseWeights() const { return m_SparseWeights; }
 	const CNeuronVector			&GetSlopesOut() const { return m_SlopesOut; }
+	const SNonZeroList			&GetNonZeroOutputs() const { return m_NonZeroOutputs; }
 
 	virtual void	FeedForward(const float *input, size_t rangeMin, size_t rangeMax) = 0;
-	virtual void	BackPropagateError(const float *prevOutput, const std::vector<float> &error, size_t rangeMin, size_t rangeMax) = 0;
+	// Second pass over the same domain for layers that reduce over their whole output:
+	virtual bool	NeedsFeedForwardFinalize() const { return false; }
+	virtual void	FeedForwardFinalize(size_t rangeMin, size_t rangeMax) { (void)rangeMin; (void)rangeMax; }
+	// Sparse inputs: the previous layer publishes its non zero outputs to layers that can skip the others:
+	virtual bool	HasSparseOutput() const { return m_Activation == EActivation::Relu; }
+	virtual bool	SkipsZeroInputs() const { return false; }
+	void			AllocateNonZeroOutputs() { m_NonZeroOutputs.Allocate(m_Output.Size()); }
+	virtual void	BuildNonZeroOutputs(size_t rangeMin, size_t rangeMax);
+	void			SetInputNonZero(const SNonZeroList *inputNonZero) { m_InputNonZero = inputNonZero; }
+	// Called by the network when the layer is added after prevLayer (null for the first layer):
+	virtual void	LinkInput(const CLayer *prevLayer) { (void)prevLayer; }
+	// Called once before the ranged UpdateWeightsAndBias calls of a batch:
+	virtual void	BeginUpdate() { }
+	// Last layer: computes the output slopes from the loss and returns the loss on the range:
+	virtual float	BackPropagateError(const float *prevOutput, const SLossTarget &target, size_t rangeMin, size_t rangeMax) = 0;
 	virtual void	BackPropagateError(const float* prevOutput, const CLayer *nextLayer, size_t rangeMin, size_t rangeMax) = 0;
 	virtual void	UpdateWeightsAndBias(size_t trainingSteps, size_t rangeMin, size_t rangeMax) = 0;
 	virtual void	GatherSlopes(float *dst, const CLayer *prevLayer, size_t rangeMin, size_t rangeMax) const = 0;
@@ -78,8 +124,10 @@ public:
 
 	virtual size_t	GetThreadingHint() const = 0;
 	virtual size_t	GetDomainSize() const = 0;
+	virtual ELayerType	GetLayerType() const = 0;
 
 	void			SetActivation(EActivation activation) { m_Activation = activation; }
+	EActivation		GetActivation() const { return m_Activation; }
 	void			SetInitialization(ERandInitializer initializer) { m_Initializer = initializer; }
 	void			SetOptimizaton(EOptimization optimizer) { m_Optimization = optimizer; }
 	void			SetRegularization(ERegularizer regularizer) { m_Regularizer = regularizer; }
@@ -87,6 +135,45 @@ public:
 	void			SetLearn(bool learn) { m_Learn = learn; }
 	bool			Learn() const { return m_Learn; }
 
+	// Int8 inference: the weights get one scale per row (per output or per feature), the input a single scale
+	// from the largest absolute value seen during calibration. A quantized layer does not learn anymore:
+	virtual bool	CanQuantize() const { return false; }
+	bool			Quantize(float inputRange);
+	bool			IsQuantized() const { return !m_QuantizedWeights.Empty(); }
+	// Pass run by the network before the feed forward of a quantized layer, over the input domain:
+	void			QuantizeInput(const float *input, size_t rangeMin, size_t rangeMax);
+
+	// Half precision weights for inference, converted in registers by the feed forward kernels.
+	// A layer using them does not learn anymore:
+	virtual bool	CanUseHalfWeights() const { return false; }
+	bool			ConvertWeightsToHalf(EHalfFormat format);
+	bool			UsesHalfWeights() const { return !m_HalfWeights.Empty(); }
+
+	// Mixed precision training: the net inputs kept for the back propagation are stored in BF16 and the float
+	// net input becomes a scratch shared by the layers (null to go back to FP32):
+	virtual bool	CanUseMixedPrecision() const { return false; }
+	bool			SetMixedPrecision(float *netInputScratch);
+	bool			UsesMixedPrecision() const { return m_NetInputHalf.Size() != 0; }
+
+	// Block sparse weights: the 1x8 weight blocks of smallest L2 norm are pruned until the sparsity fraction of the
+	// blocks is removed, and stay zero while learning. The float weights remain the reference of the optimizer:
+	virtual bool	CanUseBlockSparseWeights() const { return false; }
+	bool			SetBlockSparsity(float sparsity);
+	bool			UsesBlockSparseWeights() const { return !m_SparseWeights.Empty(); }
+
+	// Inference folding of a following per feature transform, output feature f becomes
+	// activation(netInput * scale[f] + shift[f]). Returns false when the layer cannot absorb it:
+	virtual bool	FoldOutputScale(const float *scale, const float *shift, size_t featureCount) { (void)scale; (void)shift; (void)featureCount; return false; }
+
+	// Activations in buffers owned by the network (inference memory plan, gradient checkpointing). The net input may be
+	// the output itself, computed in place. Null gives the layer its own storages back:
+	bool			AliasActivations(float *output, float *netInput);
+	// The mixed precision net input stays on the shared scratch, its packing reads it after the activation:
+	bool			CanAliasNetInput() const { return m_NetInput.Size() == m_Output.Size() && !UsesMixedPrecision(); }
+
+	// Float storages of the parameters and of their optimizer state, moved by the network to its parameter arena:
+	virtual void	GetParameterStorages(std::vector<CNeuronMatrix*> &matrices, std::vector<CNeuronVector*> &vectors);
+
 	void			Initializer();
 
 protected:
@@ -99,6 +186,10 @@ protected:
 	bool			UnSerializeWeightsAndBias(const std::vector<uint8_t> &data, size_t &curIdx);
 
 	void			PrintBasicInfo() const;
+	float			ComputeLossSlopes(const SLossTarget &target, size_t rangeMin, size_t rangeMax);
+	// Mixed precision: save the net input after the feed forward, restore it before the back propagation:
+	void			PackNetInput(size_t rangeMin, size_t rangeMax);
+	void			UnpackNetInput(size_t rangeMin, size_t rangeMax);
 	void			InitializeRandomRange(float min, float max);
 
 	// Activations:
@@ -153,6 +244,17 @@ protected:
 	CNeuronMatrix		m_DeltaWeightVelocity;
 	CNeuronVector		m_DeltaBiasVelocity;
 
+	CQuantizedMatrix	m_QuantizedWeights;
+	std::vector<int8_t>	m_QuantizedInput;
+	float				m_InputScale;
+	CHalfMatrix			m_HalfWeights;
+	CHalfVector			m_NetInputHalf;
+	CBlockSparseMatrix	m_SparseWeights;
+
+	SNonZeroList		m_NonZeroOutputs;
+	// Non zero outputs of the previous layer for the current feed forward, null when not tracked:
+	const SNonZeroList	*m_InputNonZero;
+
 	bool				m_Learn;
 
 	struct	SSerializedLayerBasicInfo
@@ -0,0 +1,299 @@
+
+#include "LayerBatchNorm.h"
+#include "NeuronKernel.h"
+#include <assert.h>
+#include <math.h>
+#include <algorithm>
+
+CLayerBatchNorm::CLayerBatchNorm()
+:	m_FeatureCount(0)
+,	m_FeatureSize(0)
+,	m_Momentum(0.9f)
+,	m_Epsilon(1.0e-5f)
+,	m_HasStatistics(false)
+,	m_FirstBatch(false)
+{
+	m_Activation = EActivation::Linear;
+}
+
+CLayerBatchNorm::~CLayerBatchNorm()
+{
+}
+
+bool	CLayerBatchNorm::Setup(size_t featureCount, size_t featureSize, float momentum, float epsilon)
+{
+	assert(featureCount != 0 && featureSize != 0 && momentum >= 0.0f && momentum < 1.0f && epsilon > 0.0f);
+	if (featureCount == 0 || featureSize == 0 || momentum < 0.0f || momentum >= 1.0f || epsilon <= 0.0f)
+		return false;
+
+	m_FeatureCount = featureCount;
+	m_FeatureSize = featureSize;
+	m_Momentum = momentum;
+	m_Epsilon = epsilon;
+	m_InputSize = featureCount * featureSize;
+	m_OutputSize = m_InputSize;
+
+	bool	success = true;
+
+	// Gamma and beta, one per feature:
+	success &= m_Weights.AllocMatrix(featureCount, 1);
+	success &= m_SlopesWeightAccum.AllocMatrix(featureCount, 1);
+	success &= m_DeltaWeightVelocity.AllocMatrix(featureCount, 1);
+	success &= m_AdagradWeightAccum.AllocMatrix(featureCount, 1);
+	success &= m_Bias.AllocateStorage(featureCount);
+	success &= m_SlopesOutAccum.AllocateStorage(featureCount);
+	success &= m_DeltaBiasVelocity.AllocateStorage(featureCount);
+	success &= m_AdagradBiasAccum.AllocateStorage(featureCount);
+	success &= m_RunningMean.AllocateStorage(featureCount);
+	success &= m_RunningVariance.AllocateStorage(featureCount);
+
+	success &= m_NetInput.AllocateStorage(m_OutputSize);
+	success &= m_Output.AllocateStorage(m_OutputSize);
+	success &= m_SlopesOut.AllocateStorage(m_OutputSize);
+	if (!success)
+		return false;
+
+	// The optimizers also run on the row padding:
+	memset(m_SlopesWeightAccum.Data(), 0, m_SlopesWeightAccum.StorageByteSize());
+	memset(m_DeltaWeightVelocity.Data(), 0, m_DeltaWeightVelocity.StorageByteSize());
+	std::fill(m_Weights.Data(), m_Weights.Data() + m_Weights.StorageByteSize() / sizeof(float), 1.0f);
+	std::fill(m_AdagradWeightAccum.Data(), m_AdagradWeightAccum.Data() + m_AdagradWeightAccum.StorageByteSize() / sizeof(float), 1.0f);
+	std::fill(m_Bias.Data(), m_Bias.Data() + featureCount, 0.0f);
+	std::fill(m_SlopesOutAccum.Data(), m_SlopesOutAccum.Data() + featureCount, 0.0f);
+	std::fill(m_DeltaBiasVelocity.Data(), m_DeltaBiasVelocity.Data() + featureCount, 0.0f);
+	std::fill(m_AdagradBiasAccum.Data(), m_AdagradBiasAccum.Data() + featureCount, 1.0f);
+	std::fill(m_RunningMean.Data(), m_RunningMean.Data() + featureCount, 0.0f);
+	std::fill(m_RunningVariance.Data(), m_RunningVariance.Data() + featureCount, 1.0f);
+
+	m_BatchSum.assign(featureCount, 0.0);
+	m_BatchSquareSum.assign(featureCount, 0.0);
+	m_HasStatistics = false;
+	m_FirstBatch = false;
+	return true;
+}
+
+float	CLayerBatchNorm::ComputeInvStdDev(size_t featureIdx) const
+{
+	return 1.0f / sqrtf(m_RunningVariance.Data()[featureIdx] + m_Epsilon);
+}
+
+void	CLayerBatchNorm::ComputeFoldedScale(std::vector<float> &scale, std::vector<float> &shift) const
+{
+	scale.resize(m_FeatureCount);
+	shift.resize(m_FeatureCount);
+	for (size_t featureIdx = 0; featureIdx < m_FeatureCount; ++featureIdx)
+	{
+		scale[featureIdx] = m_Weights.View().GetRow(featureIdx)[0] * ComputeInvStdDev(featureIdx);
+		shift[featureIdx] = m_Bias.Data()[featureIdx] - m_RunningMean.Data()[featureIdx] * scale[featureIdx];
+	}
+}
+
+void	CLayerBatchNorm::FeedForward(const float *input, size_t rangeMin, size_t rangeMax)
+{
+	MICROPROFILE_SCOPEI("CLayerBatchNorm", "CLayerBatchNorm::FeedForward", MP_GREEN1);
+	assert(rangeMin < rangeMax && rangeMax <= m_FeatureCount);
+
+	for (size_t featureIdx = rangeMin; featureIdx < rangeMax; ++featureIdx)
+	{
+		const float		scale = m_Weights.View().GetRow(featureIdx)[0] * ComputeInvStdDev(featureIdx);
+		const float		shift = m_Bias.Data()[featureIdx] - m_RunningMean.Data()[featureIdx] * scale;
+		const __m128	scale_xxxx = _mm_set1_ps(scale);
+		const __m128	shift_xxxx = _mm_set1_ps(shift);
+		const float		*inputPtr = input + featureIdx * m_FeatureSize;
+		float			*netInputPtr = m_NetInput.Data() + featureIdx * m_FeatureSize;
+		size_t			i = 0;
+
+		for (; i + 4 <= m_FeatureSize; i += 4)
+			_mm_storeu_ps(netInputPtr + i, _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(inputPtr + i), scale_xxxx), shift_xxxx));
+		for (; i < m_FeatureSize; ++i)
+			netInputPtr[i] = inputPtr[i] * scale + shift;
+	}
+	Activation(	m_Output.Data() + rangeMin * m_FeatureSize,
+				m_NetInput.Data() + rangeMin * m_FeatureSize,
+				(rangeMax - rangeMin) * m_FeatureSize);
+}
+
+float	CLayerBatchNorm::BackPropagateError(const float *prevOutput, const SLossTarget &target, size_t rangeMin, size_t rangeMax)
+{
+	MICROPROFILE_SCOPEI("CLayerBatchNorm", "CLayerBatchNorm::BackPropagateError", MP_RED1);
+	assert(rangeMin < rangeMax && rangeMax <= m_FeatureCount);
+
+	// Outter layer of the neural network:
+	const float		loss = ComputeLossSlopes(target, rangeMin * m_FeatureSize, rangeMax * m_FeatureSize);
+	if (m_Learn)
+		AccumStatisticsAndDerivative(prevOutput, rangeMin, rangeMax);
+	return loss;
+}
+
+void	CLayerBatchNorm::BackPropagateError(const float *prevOutput, const CLayer *nextLayer, size_t rangeMin, size_t rangeMax)
+{
+	MICROPROFILE_SCOPEI("CLayerBatchNorm", "CLayerBatchNorm::BackPropagateError", MP_RED1);
+	assert(rangeMin < rangeMax && rangeMax <= m_FeatureCount);
+
+	// Inner layer of the neural network:
+	ActivationDerivative(	m_SlopesOut.Data() + rangeMin * m_FeatureSize,
+							m_NetInput.Data() + rangeMin * m_FeatureSize,
+							(rangeMax - rangeMin) * m_FeatureSize);
+	if (m_Learn)
+		AccumStatisticsAndDerivative(prevOutput, rangeMin, rangeMax);
+}
+
+void	CLayerBatchNorm::AccumStatisticsAndDerivative(const float *prevOutput, size_t featureMin, size_t featureMax)
+{
+	// The statistics are constants of the feed forward of this batch:
+	// slope(gamma) = sum(slope * (input - mean)) * invStdDev, slope(beta) = sum(slope).
+	for (size_t featureIdx = featureMin; featureIdx < featureMax; ++featureIdx)
+	{
+		const float		*inputPtr = prevOutput + featureIdx * m_FeatureSize;
+		const float		*slopesPtr = m_SlopesOut.Data() + featureIdx * m_FeatureSize;
+		__m128			sum_xyzw = _mm_setzero_ps();
+		__m128			squareSum_xyzw = _mm_setzero_ps();
+		__m128			slopeSum_xyzw = _mm_setzero_ps();
+		__m128			slopeInputSum_xyzw = _mm_setzero_ps();
+		size_t			i = 0;
+
+		for (; i + 4 <= m_FeatureSize; i += 4)
+		{
+			const __m128	input_xyzw = _mm_loadu_ps(inputPtr + i);
+			const __m128	slope_xyzw = _mm_loadu_ps(slopesPtr + i);
+
+			sum_xyzw = _mm_add_ps(sum_xyzw, input_xyzw);
+			squareSum_xyzw = _mm_add_ps(squareSum_xyzw, _mm_mul_ps(input_xyzw, input_xyzw));
+			slopeSum_xyzw = _mm_add_ps(slopeSum_xyzw, slope_xyzw);
+			slopeInputSum_xyzw = _mm_add_ps(slopeInputSum_xyzw, _mm_mul_ps(slope_xyzw, input_xyzw));
+		}
+		float	sum = KernelHorizontalSum(sum_xyzw);
+		float	squareSum = KernelHorizontalSum(squareSum_xyzw);
+		float	slopeSum = KernelHorizontalSum(slopeSum_xyzw);
+		float	slopeInputSum = KernelHorizontalSum(slopeInputSum_xyzw);
+
+		for (; i < m_FeatureSize; ++i)
+		{
+			sum += inputPtr[i];
+			squareSum += inputPtr[i] * inputPtr[i];
+			slopeSum += slopesPtr[i];
+			slopeInputSum += slopesPtr[i] * inputPtr[i];
+		}
+		m_BatchSum[featureIdx] += sum;
+		m_BatchSquareSum[featureIdx] += squareSum;
+		m_SlopesWeightAccum.View().GetRow(featureIdx)[0] += (slopeInputSum - m_RunningMean.Data()[featureIdx] * slopeSum) * ComputeInvStdDev(featureIdx);
+		m_SlopesOutAccum.Data()[featureIdx] += slopeSum;
+	}
+}
+
+void	CLayerBatchNorm::BeginUpdate()
+{
+	m_FirstBatch = !m_HasStatistics;
+	m_HasStatistics = true;
+}
+
+void	CLayerBatchNorm::UpdateWeightsAndBias(size_t trainingSteps, size_t rangeMin, size_t rangeMax)
+{
+	MICROPROFILE_SCOPEI("CLayerBatchNorm", "CLayerBatchNorm::UpdateWeightsAndBias", MP_BLUE1);
+	const size_t	outputRange = rangeMax - rangeMin;
+	const double	valueCount = static_cast<double>(trainingSteps * m_FeatureSize);
+
+	OptimizeWeight(rangeMin, rangeMax, trainingSteps);
+	OptimizeBias(m_Bias.Data(), m_SlopesOutAccum.Data(), rangeMin, rangeMax, trainingSteps);
+	memset(m_SlopesWeightAccum.View().GetRow(rangeMin), 0, outputRange * m_SlopesWeightAccum.View().m_RowByteStride);
+	memset(m_SlopesOutAccum.Data() + rangeMin, 0, outputRange * sizeof(float));
+
+	// Running statistics, the first batch replaces the initial ones:
+	for (size_t featureIdx = rangeMin; featureIdx < rangeMax; ++featureIdx)
+	{
+		const double	mean = m_BatchSum[featureIdx] / valueCount;
+		const double	variance = std::max(m_BatchSquareSum[featureIdx] / valueCount - mean * mean, 0.0);
+		const float		momentum = m_FirstBatch ? 0.0f : m_Momentum;
+		float			&runningMean = m_RunningMean.Data()[featureIdx];
+		float			&runningVariance = m_RunningVariance.Data()[featureIdx];
+
+		runningMean = momentum * runningMean + (1.0f - momentum) * static_cast<float>(mean);
+		runningVariance = momentum * runningVariance + (1.0f - momentum) * static_cast<float>(variance);
+		m_BatchSum[featureIdx] = 0.0;
+		m_BatchSquareSum[featureIdx] = 0.0;
+	}
+}
+
+void	CLayerBatchNorm::GatherSlopes(float *dst, const CLayer *prevLayer, size_t rangeMin, size_t rangeMax) const
+{
+	MICROPROFILE_SCOPEI("CLayerBatchNorm", "CLayerBatchNorm::GatherSlopes", MP_PALEVIOLETRED1);
+	(void)prevLayer;
+	// slope(input) = slope * gamma * invStdDev, over the features cut by the range:
+	size_t	i = rangeMin;
+
+	while (i < rangeMax)
+	{
+		const size_t	featureIdx = i / m_FeatureSize;
+		const size_t	stop = std::min((featureIdx + 1) * m_FeatureSize, rangeMax);
+		const float		scale = m_Weights.View().GetRow(featureIdx)[0] * ComputeInvStdDev(featureIdx);
+		const __m128	scale_xxxx = _mm_set1_ps(scale);
+		const float		*slopesPtr = m_SlopesOut.Data();
+
+		for (; i + 4 <= stop; i += 4)
+			_mm_storeu_ps(dst + i, _mm_mul_ps(_mm_loadu_ps(slopesPtr + i), scale_xxxx));
+		for (; i < stop; ++i)
+			dst[i] = slopesPtr[i] * scale;
+	}
+}
+
+void	CLayerBatchNorm::PrintInfo() const
+{
+	printf("\tLayer Batch Normalization:\n");
+	printf("\t\tInput: %zu features of %zu\n", m_FeatureCount, m_FeatureSize);
+	printf("\t\tMomentum: %f (epsilon: %g)\n", m_Momentum, m_Epsilon);
+	PrintBasicInfo();
+}
+
+void	CLayerBatchNorm::Serialize(std::vector<uint8_t> &data) const
+{
+	SerializeLayerType(data, ELayerType::LayerBatchNorm);
+	SerializeInOutSize(data);
+	SerializeBasicInfo(data);
+	size_t		prevSize = data.size();
+	data.resize(prevSize + 2 * sizeof(uint32_t) + 2 * sizeof(float));
+	uint32_t	*dataPtr = (uint32_t*)(data.data() + prevSize);
+	dataPtr[0] = m_FeatureCount;
+	dataPtr[1] = m_FeatureSize;
+	*(float*)(dataPtr + 2) = m_Momentum;
+	*(float*)(dataPtr + 3) = m_Epsilon;
+	SerializeWeightsAndBias(data);
+	m_RunningMean.Serialize(data);
+	m_RunningVariance.Serialize(data);
+}
+
+bool	CLayerBatchNorm::UnSerialize(const std::vector<uint8_t> &data, size_t &curIdx)
+{
+	if (!UnSerializeInOutSize(data, curIdx))
+		return false;
+	if (!UnSerializeBasicInfo(data, curIdx))
+		return false;
+	if (curIdx + 2 * sizeof(uint32_t) + 2 * sizeof(float) > data.size())
+		return false;
+	const uint32_t	*dataPtr = (const uint32_t*)(data.data() + curIdx);
+	curIdx += 2 * sizeof(uint32_t) + 2 * sizeof(float);
+	if (!Setup(dataPtr[0], dataPtr[1], *(const float*)(dataPtr + 2), *(const float*)(dataPtr + 3)))
+		return false;
+	if (!UnSerializeWeightsAndBias(data, curIdx))
+		return false;
+	if (!m_RunningMean.UnSerialize(data, curIdx) || !m_RunningVariance.UnSerialize(data, curIdx))
+		return false;
+	m_HasStatistics = true;
+	return m_RunningMean.Size() == m_FeatureCount && m_RunningVariance.Size() == m_FeatureCount;
+}
+
+void	CLayerBatchNorm::GetParameterStorages(std::vector<CNeuronMatrix*> &matrices, std::vector<CNeuronVector*> &vectors)
+{
+	CLayer::GetParameterStorages(matrices, vectors);
+	vectors.push_back(&m_RunningMean);
+	vectors.push_back(&m_RunningVariance);
+}
+
+size_t	CLayerBatchNorm::GetThreadingHint() const
+{
+	return m_OutputSize;
+}
+
+size_t	CLayerBatchNorm::GetDomainSize() const
+{
+	return m_FeatureCount;
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include "LayerBase.h"
+
+// Batch normalization of each feature over its featureSize values (1 after a dense layer, the output pixels after a
+// convolution): output = activation(gamma * (input - mean) / sqrt(variance + epsilon) + beta).
+// The samples go through the network one at a time: the back propagation accumulates the mean and variance of the
+// batch, the update folds them in the running statistics used by the feed forward.
+// Gamma is stored in the weights (one column per feature) and beta in the bias:
+class	CLayerBatchNorm : public CLayer
+{
+public:
+	CLayerBatchNorm();
+	~CLayerBatchNorm();
+
+	bool	Setup(size_t featureCount, size_t featureSize, float momentum = 0.9f, float epsilon = 1.0e-5f);
+
+	virtual void	FeedForward(const float *input, size_t rangeMin, size_t rangeMax) override;
+	virtual float	BackPropagateError(const float *prevOutput, const SLossTarget &target, size_t rangeMin, size_t rangeMax) override;
+	virtual void	BackPropagateError(const float *prevOutput, const CLayer *nextLayer, size_t rangeMin, size_t rangeMax) override;
+	virtual void	BeginUpdate() override;
+	virtual void	UpdateWeightsAndBias(size_t trainingSteps, size_t rangeMin, size_t rangeMax) override;
+	virtual void	GatherSlopes(float *dst, const CLayer *prevLayer, size_t rangeMin, size_t rangeMax) const override;
+	virtual void	PrintInfo() const override;
+	virtual void	Serialize(std::vector<uint8_t> &data) const override;
+	virtual bool	UnSerialize(const std::vector<uint8_t> &data, size_t &curIdx) override;
+
+	virtual void	GetParameterStorages(std::vector<CNeuronMatrix*> &matrices, std::vector<CNeuronVector*> &vectors) override;
+
+	virtual size_t	GetThreadingHint() const override;
+	virtual size_t	GetDomainSize() const override;
+	virtual ELayerType	GetLayerType() const override { return ELayerType::LayerBatchNorm; }
+
+	size_t			GetFeatureCount() const { return m_FeatureCount; }
+	size_t			GetFeatureSize() const { return m_FeatureSize; }
+	// Inference transform of each feature, output = activation(input * scale + shift):
+	void			ComputeFoldedScale(std::vector<float> &scale, std::vector<float> &shift) const;
+
+private:
+	float			ComputeInvStdDev(size_t featureIdx) const;
+	void			AccumStatisticsAndDerivative(const float *prevOutput, size_t featureMin, size_t featureMax);
+
+	size_t				m_FeatureCount;
+	size_t				m_FeatureSize;
+	float				m_Momentum;
+	float				m_Epsilon;
+	CNeuronVector		m_RunningMean;
+	CNeuronVector		m_RunningVariance;
+	// Sums of the inputs and of their squares over the current batch:
+	std::vector<double>	m_BatchSum;
+	std::vector<double>	m_BatchSquareSum;
+	// The first batch replaces the initial statistics:
+	bool				m_HasStatistics;
+	bool				m_FirstBatch;
+};
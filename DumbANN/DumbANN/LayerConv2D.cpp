@@ -1,9 +1,125 @@
 
 #include "LayerConv2D.h"
 #include "NeuronKernel.h"
+#include "LayerDropout.h"
+#include "LayerMaxPooling.h"
 #include <assert.h>
+#include <xmmintrin.h>
+
+// Loads p[0], p[_Stride], p[2 * _Stride], p[3 * _Stride] without reading past p[3 * _Stride]:
+template<size_t _Stride>
+static __forceinline __m128	_LoadStrided(const float *p)
+{
+	if (_Stride == 1)
+		return _mm_loadu_ps(p);
+	assert(_Stride == 2);
+	const __m128	a_xyzw = _mm_loadu_ps(p);
+	const __m128	b_xyzw = _mm_loadu_ps(p + 3);
+	return _mm_shuffle_ps(a_xyzw, b_xyzw, _MM_SHUFFLE(3, 1, 2, 0));
+}
+
+// Sum of a[i] * b[i * _Stride]:
+template<size_t _Stride>
+static __forceinline float	_DotStrided(const float *a, const float *b, size_t count)
+{
+	if (_Stride == 1)
+		return KernelDot(a, b, count);
+	__m128			accum_xyzw = _mm_setzero_ps();
+	size_t			i = 0;
+
+	for (; i + 4 <= count; i += 4)
+		accum_xyzw = _mm_add_ps(accum_xyzw, _mm_mul_ps(_mm_loadu_ps(a + i), _LoadStrided<_Stride>(b + i * _Stride)));
+	float			sum = KernelHorizontalSum(accum_xyzw);
+	for (; i < count; ++i)
+		sum += a[i] * b[i * _Stride];
+	return sum;
+}
+
+// dst[i * _Stride] += src[i] * weight, only touches the written pixels:
+template<size_t _Stride>
+static __forceinline void	_AxpyStrided(float *dst, const float *src, float weight, size_t count)
+{
+	if (_Stride == 1)
+	{
+		KernelAxpy(dst, src, weight, count);
+		return;
+	}
+	assert(_Stride == 2);
+	const __m128	weight_xxxx = _mm_set1_ps(weight);
+	const __m128	zero = _mm_setzero_ps();
+	size_t			i = 0;
+
+	for (; i + 4 <= count; i += 4)
+	{
+		const __m128	src_xyzw = _mm_mul_ps(_mm_loadu_ps(src + i), weight_xxxx);
+		float			*dstPtr = dst + i * 2;
+
+		// (x, 0, y, 0) then (0, z, 0, w) one pixel further:
+		_mm_storeu_ps(dstPtr, _mm_add_ps(_mm_loadu_ps(dstPtr), _mm_unpacklo_ps(src_xyzw, zero)));
+		_mm_storeu_ps(dstPtr + 3, _mm_add_ps(_mm_loadu_ps(dstPtr + 3), _mm_unpackhi_ps(zero, src_xyzw)));
+	}
+	for (; i < count; ++i)
+		dst[i * 2] += src[i] * weight;
+}
+
+// Work items (output feature x band of output rows) wanted to keep all the threads busy:
+static const size_t	kMinWorkItemCount = 64;
+
+const CLayerConv2D::SConvolutionKernels	CLayerConv2D::kGenericKernels =
+{
+	0, 0,
+	&KernelConvoluteRows<	SComputeNetInput_KernelIn,
+							&CLayerConv2D::Kernel_ComputeNetInput<false>,
+							&_KernelConvoluteRow<SComputeNetInput_KernelIn, &CLayerConv2D::Kernel_ComputeNetInput<true> > >,
+	&KernelConvoluteRows<	SAccumWeightsAndBiasDerivative_KernelIn,
+							&CLayerConv2D::Kernel_AccumWeightsAndBiasDerivative<false>,
+							&_KernelConvoluteRow<SAccumWeightsAndBiasDerivative_KernelIn, &CLayerConv2D::Kernel_AccumWeightsAndBiasDerivative<true> > >,
+	&KernelConvoluteRows<	SGatherSlopes_KernelIn,
+							&CLayerConv2D::Kernel_GatherSlopes<false>,
+							&_KernelConvoluteRow<SGatherSlopes_KernelIn, &CLayerConv2D::Kernel_GatherSlopes<true> > >
+};
+
+const CLayerConv2D::SConvolutionKernels	CLayerConv2D::kFixedKernels[] =
+{
+	MakeFixedKernels<1, 1>(),
+	MakeFixedKernels<1, 2>(),
+	MakeFixedKernels<3, 1>(),
+	MakeFixedKernels<3, 2>(),
+	MakeFixedKernels<5, 1>(),
+	MakeFixedKernels<5, 2>(),
+	MakeFixedKernels<7, 1>(),
+	MakeFixedKernels<7, 2>(),
+	{ 0, 0, nullptr, nullptr, nullptr }
+};
+
+template<size_t _KernelSize, size_t _Stride>
+CLayerConv2D::SConvolutionKernels	CLayerConv2D::MakeFixedKernels()
+{
+	SConvolutionKernels	kernels;
+
+	kernels.m_KernelSize = _KernelSize;
+	kernels.m_Stride = _Stride;
+	kernels.m_ComputeNetInput =
+		&KernelConvoluteRows<	SComputeNetInput_KernelIn,
+								&CLayerConv2D::Kernel_ComputeNetInput<false>,
+								&CLayerConv2D::Kernel_ComputeNetInputRow<_KernelSize, _Stride> >;
+	kernels.m_AccumWeightsAndBiasDerivative =
+		&KernelConvoluteRows<	SAccumWeightsAndBiasDerivative_KernelIn,
+								&CLayerConv2D::Kernel_AccumWeightsAndBiasDerivative<false>,
+								&CLayerConv2D::Kernel_AccumWeightsAndBiasDerivativeRow<_KernelSize, _Stride> >;
+	kernels.m_GatherSlopes =
+		&KernelConvoluteRows<	SGatherSlopes_KernelIn,
+								&CLayerConv2D::Kernel_GatherSlopes<false>,
+								&CLayerConv2D::Kernel_GatherSlopesRow<_KernelSize, _Stride> >;
+	return kernels;
+}
 
 CLayerConv2D::CLayerConv2D()
+:	m_Kernels(&kGenericKernels)
+,	m_KernelCount(0)
+,	m_InputImageCount(0)
+,	m_TileCount(1)
+,	m_SharedBias(true)
 {
 }
 
@@ -13,7 +129,8 @@ CLayerConv2D::~CLayerConv2D()
 
 bool	CLayerConv2D::Setup(size_t inputFeatureCount, size_t inputSizeX, size_t inputSizeY,
 							size_t featureCount, size_t featureSizeX, size_t featureSizeY,
-							size_t padding, size_t stride)
+							size_t padding, size_t stride,
+							bool sharedBias)
 {
 	if (stride == 0)
 		stride = 1;
@@ -27,6 +144,7 @@ bool	CLayerConv2D::Setup(size_t inputFeatureCount, size_t inputSizeX, size_t inp
 
 	m_KernelCount = featureCount;
 	m_InputImageCount = inputFeatureCount;
+	m_SharedBias = sharedBias;
 
 	m_ConvParams.m_KernelSizeX = featureSizeX;
 	m_ConvParams.m_KernelSizeY = featureSizeY;
@@ -35,6 +153,19 @@ bool	CLayerConv2D::Setup(size_t inputFeatureCount, size_t inputSizeX, size_t inp
 	m_ConvParams.m_InputSizeX = inputSizeX;
 	m_ConvParams.m_InputSizeY = inputSizeY;
 	m_ConvParams.ComputeConvOutputSize();
+	m_ConvParams.ComputeConvGeometry();
+
+	m_Kernels = &kGenericKernels;
+	for (const SConvolutionKernels *kernels = kFixedKernels; kernels->m_KernelSize != 0; ++kernels)
+	{
+		if (kernels->m_KernelSize == featureSizeX &&
+			kernels->m_KernelSize == featureSizeY &&
+			kernels->m_Stride == stride)
+		{
+			m_Kernels = kernels;
+			break;
+		}
+	}
 
 	const size_t	featureOutputSizeX = GetOutputSizeX();
 	const size_t	featureOutputSizeY = GetOutputSizeY();
@@ -48,22 +179,18 @@ bool	CLayerConv2D::Setup(size_t inputFeatureCount, size_t inputSizeX, size_t inp
 
 	m_Weights.AllocMatrix(weightsSizeY, weightsSizeX);
 	m_SlopesWeightAccum.AllocMatrix(weightsSizeY, weightsSizeX);
-	m_SlopesOutAccum.AllocateStorage(outputSize);
-	m_Bias.AllocateStorage(outputSize);
+	m_Bias.AllocateStorage(m_SharedBias ? featureCount : outputSize);
 
 	// When using inertia we need those storages:
 	m_DeltaWeightVelocity.AllocMatrix(weightsSizeY, weightsSizeX);
-	m_DeltaBiasVelocity.AllocateStorage(outputSize);
 
 	m_NetInput.AllocateStorage(outputSize);
 	m_Output.AllocateStorage(outputSize);
 	m_SlopesOut.AllocateStorage(outputSize);
 
 	memset(m_SlopesWeightAccum.Data(), 0, m_SlopesWeightAccum.StorageByteSize());
-	memset(m_SlopesOutAccum.Data(), 0, m_SlopesOutAccum.Size() * sizeof(float));
 
 	m_AdagradWeightAccum.AllocMatrix(weightsSizeY, weightsSizeX);
-	m_AdagradBiasAccum.AllocateStorage(outputSize);
 
 	for (size_t y = 0; y < m_AdagradWeightAccum.View().m_Rows; ++y)
 	{
@@ -73,115 +200,355 @@ bool	CLayerConv2D::Setup(size_t inputFeatureCount, size_t inputSizeX, size_t inp
 			weightAccum[x] = 1.0f;
 		}
 	}
-	for (size_t x = 0; x < m_AdagradBiasAccum.Size(); ++x)
+	if (!AllocateBiasStorages())
+		return false;
+
+	// Split the output rows in tiles until there are enough work items for all the threads:
+	m_TileCount = std::min(featureOutputSizeY, std::max<size_t>(1, (kMinWorkItemCount + featureCount - 1) / featureCount));
+	if (!AllocateTileStorages())
+		return false;
+
+	// Initialize weights to random floats:
+	Initializer();
+	return true;
+}
+
+bool	CLayerConv2D::AllocateBiasStorages()
+{
+	// Allocates everything that has the size of the bias (m_Bias itself is allocated by Setup or UnSerialize):
+	const size_t	biasSize = m_Bias.Size();
+	bool			success = true;
+
+	success &= m_SlopesOutAccum.AllocateStorage(biasSize);
+	success &= m_DeltaBiasVelocity.AllocateStorage(biasSize);
+	success &= m_AdagradBiasAccum.AllocateStorage(biasSize);
+	if (!success)
+		return false;
+	memset(m_SlopesOutAccum.Data(), 0, biasSize * sizeof(float));
+	memset(m_DeltaBiasVelocity.Data(), 0, biasSize * sizeof(float));
+	for (size_t x = 0; x < biasSize; ++x)
 	{
 		m_AdagradBiasAccum.Data()[x] = 1.0f;
 	}
+	return true;
+}
 
-	// Initialize weights to random floats:
-	Initializer();
+bool	CLayerConv2D::AllocateTileStorages()
+{
+	// The first tile accumulates straight in m_SlopesWeightAccum and m_SlopesOutAccum:
+	const size_t	partialCount = (m_TileCount - 1) * m_KernelCount;
+	bool			success = true;
+
+	if (partialCount == 0)
+		return true;
+	success &= m_TileSlopesWeightAccum.AllocMatrix(partialCount, m_Weights.View().m_Columns);
+	success &= m_TileSlopesBiasAccum.AllocateStorage(partialCount);
+	if (!success)
+		return false;
+	memset(m_TileSlopesWeightAccum.Data(), 0, m_TileSlopesWeightAccum.StorageByteSize());
+	memset(m_TileSlopesBiasAccum.Data(), 0, partialCount * sizeof(float));
 	return true;
 }
 
+SKernelRows	CLayerConv2D::GetTileRows(size_t tileIdx) const
+{
+	const size_t	outputSizeY = m_ConvParams.m_OutputSizeY;
+
+	return ComputeKernelRows(outputSizeY * tileIdx / m_TileCount, outputSizeY * (tileIdx + 1) / m_TileCount, m_ConvParams);
+}
+
+template<typename _Function>
+void	CLayerConv2D::ForEachWorkItem(size_t rangeMin, size_t rangeMax, _Function function) const
+{
+	if (UseSparseInput())
+	{
+		// The sparse scatter reaches whole features, each task owns the features starting in its range:
+		const size_t	featureMin = (rangeMin + m_TileCount - 1) / m_TileCount;
+		const size_t	featureMax = (rangeMax + m_TileCount - 1) / m_TileCount;
+
+		for (size_t featureIdx = featureMin; featureIdx < featureMax; ++featureIdx)
+			function(featureIdx, 0, ComputeKernelRows(0, m_ConvParams.m_OutputSizeY, m_ConvParams));
+		return;
+	}
+	for (size_t itemIdx = rangeMin; itemIdx < rangeMax; ++itemIdx)
+		function(itemIdx / m_TileCount, itemIdx % m_TileCount, GetTileRows(itemIdx % m_TileCount));
+}
+
+void	CLayerConv2D::AccumTileDerivative(const float *input, size_t featureIdx, size_t tileIdx, const SKernelRows &rows)
+{
+	const size_t	outputSizeX = m_ConvParams.m_OutputSizeX;
+	const size_t	outIdx = featureIdx * outputSizeX * m_ConvParams.m_OutputSizeY + rows.m_ConvIdxYMin * outputSizeX;
+	const size_t	outCount = (rows.m_ConvIdxYMax - rows.m_ConvIdxYMin) * outputSizeX;
+	SNeuronMatrixView	accumWeights = m_SlopesWeightAccum.View();
+	float			*accumSharedBias = m_SlopesOutAccum.Data() + featureIdx;
+
+	if (tileIdx != 0)
+	{
+		// Partial accumulators of this tile, rows of the other tiles are written by other tasks:
+		accumWeights = m_TileSlopesWeightAccum.View();
+		accumWeights.m_Data = accumWeights.GetRow((tileIdx - 1) * m_KernelCount);
+		accumWeights.m_Rows = m_KernelCount;
+		accumSharedBias = m_TileSlopesBiasAccum.Data() + (tileIdx - 1) * m_KernelCount + featureIdx;
+	}
+	if (UseSparseInput())
+	{
+		assert(tileIdx == 0);
+		AccumWeightsAndBiasDerivativeSparse(input, featureIdx, featureIdx + 1);
+	}
+	else if (IsPointwise())
+	{
+		AccumWeightsAndBiasDerivativePointwise(input, featureIdx, outIdx, outCount, accumWeights.GetRow(featureIdx));
+	}
+	else
+	{
+		SAccumWeightsAndBiasDerivative_KernelIn	kernelIn;
+
+		kernelIn.m_InFeatureCount = m_InputImageCount;
+		kernelIn.m_OutFeatureCount = m_KernelCount;
+		kernelIn.m_Input = input;
+		kernelIn.m_AccumBias = m_SharedBias ? nullptr : m_SlopesOutAccum.Data();
+		kernelIn.m_AccumWeights = accumWeights;
+		kernelIn.m_Slopes = m_SlopesOut.Data();
+
+		m_Kernels->m_AccumWeightsAndBiasDerivative(kernelIn, featureIdx, featureIdx + 1, m_ConvParams, rows);
+	}
+	// The bias derivative of a feature is the sum of all its output slopes:
+	if (m_SharedBias)
+	{
+		*accumSharedBias += KernelSum(m_SlopesOut.Data() + outIdx, outCount);
+		assert(!isnan(*accumSharedBias));
+		assert(!isinf(*accumSharedBias));
+	}
+}
+
+void	CLayerConv2D::ReduceTileAccum(size_t featureMin, size_t featureMax)
+{
+	const size_t	weightsSizeX = m_SlopesWeightAccum.View().m_Columns;
+
+	for (size_t tileIdx = 1; tileIdx < m_TileCount; ++tileIdx)
+	{
+		for (size_t featureIdx = featureMin; featureIdx < featureMax; ++featureIdx)
+		{
+			const size_t	partialIdx = (tileIdx - 1) * m_KernelCount + featureIdx;
+			float			*partialPtr = m_TileSlopesWeightAccum.View().GetRow(partialIdx);
+
+			KernelAxpy(m_SlopesWeightAccum.View().GetRow(featureIdx), partialPtr, 1.0f, weightsSizeX);
+			memset(partialPtr, 0, weightsSizeX * sizeof(float));
+			if (m_SharedBias)
+				m_SlopesOutAccum.Data()[featureIdx] += m_TileSlopesBiasAccum.Data()[partialIdx];
+			m_TileSlopesBiasAccum.Data()[partialIdx] = 0.0f;
+		}
+	}
+}
+
 void	CLayerConv2D::FeedForward(const float *input, size_t rangeMin, size_t rangeMax)
 {
 	MICROPROFILE_SCOPEI("CLayerConv2D", "CLayerConv2D::FeedForward", MP_GREEN1);
+	const size_t				outputSizeX = m_ConvParams.m_OutputSizeX;
+	const size_t				featureStride = outputSizeX * m_ConvParams.m_OutputSizeY;
 	SComputeNetInput_KernelIn	kernelIn;
 
 	kernelIn.m_Bias = m_Bias.Data();
+	kernelIn.m_SharedBias = m_SharedBias;
 	kernelIn.m_InFeatureCount = m_InputImageCount;
 	kernelIn.m_Input = input;
 	kernelIn.m_NetInput = m_NetInput.Data();
 	kernelIn.m_OutFeatureCount = m_KernelCount;
 	kernelIn.m_Weights = m_Weights.View();
 
-	KernelConvolute<SComputeNetInput_KernelIn,
-					&CLayerConv2D::Kernel_ComputeNetInput>(kernelIn, rangeMin, rangeMax, m_ConvParams);
+	ForEachWorkItem(rangeMin, rangeMax, [&](size_t featureIdx, size_t tileIdx, const SKernelRows &rows)
+	{
+		const size_t	outIdx = featureIdx * featureStride + rows.m_ConvIdxYMin * outputSizeX;
+		const size_t	outCount = (rows.m_ConvIdxYMax - rows.m_ConvIdxYMin) * outputSizeX;
 
-	const size_t	featureStride = m_ConvParams.m_OutputSizeX * m_ConvParams.m_OutputSizeY;
-	const size_t	outputRange = (rangeMax - rangeMin) * featureStride;
-	Activation(m_Output.Data() + featureStride * rangeMin, m_NetInput.Data() + featureStride * rangeMin, outputRange);
+		if (IsQuantized())
+			ComputeNetInputQuantized(featureIdx, rows);
+		else if (UseSparseInput())
+			ComputeNetInputSparse(input, featureIdx, featureIdx + 1);
+		else if (IsPointwise())
+			ComputeNetInputPointwise(input, featureIdx, outIdx, outCount);
+		else
+			m_Kernels->m_ComputeNetInput(kernelIn, featureIdx, featureIdx + 1, m_ConvParams, rows);
+		Activation(m_Output.Data() + outIdx, m_NetInput.Data() + outIdx, outCount);
+		PackNetInput(outIdx, outIdx + outCount);
+	});
 }
 
-void	CLayerConv2D::BackPropagateError(const float *prevOutput, const std::vector<float> &error, size_t rangeMin, size_t rangeMax)
+void	CLayerConv2D::FeedForwardFusedMaxPool(	const float *input,
+												const CLayerDropOut *dropOut, CLayerMaxPooling2D *maxPool,
+												bool keepNetInput,
+												size_t rangeMin, size_t rangeMax)
 {
-	MICROPROFILE_SCOPEI("CLayerConv2D", "CLayerConv2D::BackPropagateError", MP_RED1);
-	const size_t	featureStride = m_ConvParams.m_OutputSizeX * m_ConvParams.m_OutputSizeY;
-	const size_t	outputRange = (rangeMax - rangeMin) * featureStride;
-	float			*netInputPtr = m_NetInput.Data();
+	MICROPROFILE_SCOPEI("CLayerConv2D", "CLayerConv2D::FeedForwardFusedMaxPool", MP_GREEN1);
+	assert(maxPool->CanPoolRows());
+	const size_t				outputSizeX = m_ConvParams.m_OutputSizeX;
+	const size_t				featureOutputStride = outputSizeX * m_ConvParams.m_OutputSizeY;
+	const size_t				poolSizeY = maxPool->GetFeatureSizeY();
+	const size_t				poolOutputSizeY = maxPool->GetOutputSizeY();
+	const float					dropOutScale = dropOut != nullptr ? dropOut->GetOutputScale() : 1.0f;
+	// The conv rows of one pool row, small enough to stay in cache:
+	std::vector<float>			netInputRows(keepNetInput ? 0 : poolSizeY * outputSizeX);
+	std::vector<float>			outputRows(poolSizeY * outputSizeX);
+	SComputeNetInput_KernelIn	kernelIn;
+	SKernelRange				kernelRange;
 
-	// Outter layer of the neural network:
-	for (size_t i = featureStride * rangeMin; i < featureStride * rangeMax; ++i)
-		m_SlopesOut.Data()[i] = -error[i];
-	ActivationDerivative(m_SlopesOut.Data() + featureStride * rangeMin, netInputPtr + featureStride * rangeMin, outputRange);
+	kernelIn.m_Bias = m_Bias.Data();
+	kernelIn.m_SharedBias = m_SharedBias;
+	kernelIn.m_InFeatureCount = m_InputImageCount;
+	kernelIn.m_Input = input;
+	kernelIn.m_NetInput = m_NetInput.Data();
+	kernelIn.m_OutFeatureCount = m_KernelCount;
+	kernelIn.m_Weights = m_Weights.View();
 
-	if (m_Learn)
+	// Work items are bands of pool rows of a feature:
+	for (size_t itemIdx = rangeMin; itemIdx < rangeMax; ++itemIdx)
 	{
-		SAccumWeightsAndBiasDerivative_KernelIn	kernelIn;
-	
-		kernelIn.m_InFeatureCount = m_InputImageCount;
-		kernelIn.m_OutFeatureCount = m_KernelCount;
-		kernelIn.m_Input = prevOutput;
-		kernelIn.m_AccumBias = m_SlopesOutAccum.Data();
-		kernelIn.m_AccumWeights = m_SlopesWeightAccum.View();
-		kernelIn.m_Slopes = m_SlopesOut.Data();
-	
-		KernelConvolute<SAccumWeightsAndBiasDerivative_KernelIn,
-						&CLayerConv2D::Kernel_AccumWeightsAndBiasDerivative>(kernelIn, rangeMin, rangeMax, m_ConvParams);
+		const size_t	tileIdx = itemIdx % m_TileCount;
+		const size_t	poolYMin = poolOutputSizeY * tileIdx / m_TileCount;
+		const size_t	poolYMax = poolOutputSizeY * (tileIdx + 1) / m_TileCount;
+
+		kernelRange.m_FeatureIdx = itemIdx / m_TileCount;
+		for (size_t poolY = poolYMin; poolY < poolYMax; ++poolY)
+		{
+			for (size_t rowIdx = 0; rowIdx < poolSizeY; ++rowIdx)
+			{
+				const size_t	convIdxY = poolY * poolSizeY + rowIdx;
+				const size_t	outIdx = kernelRange.m_FeatureIdx * featureOutputStride + convIdxY * outputSizeX;
+				float			*netInputPtr = keepNetInput ? m_NetInput.Data() + outIdx : netInputRows.data() + rowIdx * outputSizeX;
+				float			*outputPtr = outputRows.data() + rowIdx * outputSizeX;
+				const bool		validY = SetKernelRangeY(kernelRange, convIdxY, m_ConvParams);
+
+				for (size_t convIdxX = 0; convIdxX < outputSizeX; ++convIdxX)
+				{
+					const bool		valid = SetKernelRangeX(kernelRange, convIdxX, m_ConvParams) && validY;
+					const bool		interior = m_ConvParams.IsInteriorY(convIdxY) && m_ConvParams.IsInteriorX(convIdxX);
+					float			accum = 0.0f;
+
+					if (interior)
+						accum = Kernel_NetInputSum<true>(kernelIn, kernelRange, m_ConvParams);
+					else if (valid)
+						accum = Kernel_NetInputSum<false>(kernelIn, kernelRange, m_ConvParams);
+
+					netInputPtr[convIdxX] = accum + m_Bias.Data()[m_SharedBias ? kernelRange.m_FeatureIdx : outIdx + convIdxX];
+				}
+				Activation(outputPtr, netInputPtr, outputSizeX);
+				if (keepNetInput)
+					PackNetInput(outIdx, outIdx + outputSizeX);
+				if (dropOut != nullptr)
+				{
+					for (size_t convIdxX = 0; convIdxX < outputSizeX; ++convIdxX)
+						outputPtr[convIdxX] = dropOut->IsKept(outIdx + convIdxX) ? outputPtr[convIdxX] * dropOutScale : 0.0f;
+				}
+			}
+			maxPool->PoolRows(outputRows.data(), kernelRange.m_FeatureIdx, poolY);
+		}
 	}
 }
 
-void	CLayerConv2D::BackPropagateError(const float *prevOutput, const CLayer* nextLayer, size_t rangeMin, size_t rangeMax)
+float	CLayerConv2D::BackPropagateError(const float *prevOutput, const SLossTarget &target, size_t rangeMin, size_t rangeMax)
 {
 	MICROPROFILE_SCOPEI("CLayerConv2D", "CLayerConv2D::BackPropagateError", MP_RED1);
-	const size_t	featureStride = m_ConvParams.m_OutputSizeX * m_ConvParams.m_OutputSizeY;
-	const size_t	outputRange = (rangeMax - rangeMin) * featureStride;
-	float			*netInputPtr = m_NetInput.Data();
+	const size_t	outputSizeX = m_ConvParams.m_OutputSizeX;
+	const size_t	featureStride = outputSizeX * m_ConvParams.m_OutputSizeY;
+	float			loss = 0.0f;
+
+	ForEachWorkItem(rangeMin, rangeMax, [&](size_t featureIdx, size_t tileIdx, const SKernelRows &rows)
+	{
+		const size_t	outIdx = featureIdx * featureStride + rows.m_ConvIdxYMin * outputSizeX;
+		const size_t	outCount = (rows.m_ConvIdxYMax - rows.m_ConvIdxYMin) * outputSizeX;
+
+		// Outter layer of the neural network:
+		UnpackNetInput(outIdx, outIdx + outCount);
+		loss += ComputeLossSlopes(target, outIdx, outIdx + outCount);
+		if (m_Learn)
+			AccumTileDerivative(prevOutput, featureIdx, tileIdx, rows);
+	});
+	return loss;
+}
 
-	// Inner layer of the neural network:
-	ActivationDerivative(m_SlopesOut.Data() + featureStride * rangeMin, netInputPtr + featureStride * rangeMin, outputRange);
+void	CLayerConv2D::BackPropagateError(const float *prevOutput, const CLayer* nextLayer, size_t rangeMin, size_t rangeMax)
+{
+	MICROPROFILE_SCOPEI("CLayerConv2D", "CLayerConv2D::BackPropagateError", MP_RED1);
+	const size_t	outputSizeX = m_ConvParams.m_OutputSizeX;
+	const size_t	featureStride = outputSizeX * m_ConvParams.m_OutputSizeY;
 
-	if (m_Learn)
+	ForEachWorkItem(rangeMin, rangeMax, [&](size_t featureIdx, size_t tileIdx, const SKernelRows &rows)
 	{
-		SAccumWeightsAndBiasDerivative_KernelIn	kernelIn;
-	
-		kernelIn.m_InFeatureCount = m_InputImageCount;
-		kernelIn.m_OutFeatureCount = m_KernelCount;
-		kernelIn.m_Input = prevOutput;
-		kernelIn.m_AccumBias = m_SlopesOutAccum.Data();
-		kernelIn.m_AccumWeights = m_SlopesWeightAccum.View();
-		kernelIn.m_Slopes = m_SlopesOut.Data();
-	
-		KernelConvolute<SAccumWeightsAndBiasDerivative_KernelIn,
-						&CLayerConv2D::Kernel_AccumWeightsAndBiasDerivative>(kernelIn, rangeMin, rangeMax, m_ConvParams);
-	}
+		const size_t	outIdx = featureIdx * featureStride + rows.m_ConvIdxYMin * outputSizeX;
+		const size_t	outCount = (rows.m_ConvIdxYMax - rows.m_ConvIdxYMin) * outputSizeX;
+
+		// Inner layer of the neural network:
+		UnpackNetInput(outIdx, outIdx + outCount);
+		ActivationDerivative(m_SlopesOut.Data() + outIdx, m_NetInput.Data() + outIdx, outCount);
+		if (m_Learn)
+			AccumTileDerivative(prevOutput, featureIdx, tileIdx, rows);
+	});
 }
 
 void	CLayerConv2D::UpdateWeightsAndBias(size_t trainingSteps, size_t rangeMin, size_t rangeMax)
 {
 	MICROPROFILE_SCOPEI("CLayerConv2D", "CLayerConv2D::UpdateWeightsAndBias", MP_BLUE1);
-	const size_t	outputRange = rangeMax - rangeMin;
+	// Each task owns the features starting in its range:
+	const size_t	featureMin = (rangeMin + m_TileCount - 1) / m_TileCount;
+	const size_t	featureMax = (rangeMax + m_TileCount - 1) / m_TileCount;
+	const size_t	outputRange = featureMax - featureMin;
 	float			*slopeAccumPtr = m_SlopesOutAccum.Data();
 	float			*biasesPtr = m_Bias.Data();
 	const size_t	featureOutputSizeX = GetOutputSizeX();
 	const size_t	featureOutputSizeY = GetOutputSizeY();
 	const size_t	featureOutputStride = featureOutputSizeX * featureOutputSizeY;
+	const size_t	biasStride = m_SharedBias ? 1 : featureOutputStride;
+
+	if (featureMin >= featureMax)
+		return;
+	ReduceTileAccum(featureMin, featureMax);
+	OptimizeWeight(featureMin, featureMax, trainingSteps);
+	OptimizeBias(biasesPtr, slopeAccumPtr, featureMin * biasStride, featureMax * biasStride, trainingSteps);
+
+	memset(m_SlopesWeightAccum.View().GetRow(featureMin), 0, outputRange * m_SlopesWeightAccum.View().m_RowByteStride);
+	memset(m_SlopesOutAccum.Data() + featureMin * biasStride, 0, outputRange * biasStride * sizeof(float));
+}
+
+bool	CLayerConv2D::FoldOutputScale(const float *scale, const float *shift, size_t featureCount)
+{
+	if (featureCount != m_KernelCount || IsQuantized())
+		return false;
+	const size_t	featureOutputSize = GetOutputSizeX() * GetOutputSizeY();
+	const size_t	biasPerFeature = m_SharedBias ? 1 : featureOutputSize;
 
-	OptimizeWeight(rangeMin, rangeMax, trainingSteps);
-	OptimizeBias(biasesPtr, slopeAccumPtr, rangeMin * featureOutputStride, rangeMax * featureOutputStride, trainingSteps);
+	for (size_t featureIdx = 0; featureIdx < m_KernelCount; ++featureIdx)
+	{
+		float	*weightsPtr = m_Weights.View().GetRow(featureIdx);
+		float	*biasPtr = m_Bias.Data() + featureIdx * biasPerFeature;
 
-	memset(m_SlopesWeightAccum.View().GetRow(rangeMin), 0, outputRange * m_SlopesWeightAccum.View().m_RowByteStride);
-	memset(m_SlopesOutAccum.Data() + rangeMin * featureOutputStride, 0, outputRange * featureOutputStride * sizeof(float));
+		for (size_t x = 0; x < m_Weights.View().m_Columns; ++x)
+			weightsPtr[x] *= scale[featureIdx];
+		for (size_t x = 0; x < biasPerFeature; ++x)
+			biasPtr[x] = biasPtr[x] * scale[featureIdx] + shift[featureIdx];
+	}
+	return true;
 }
 
 void	CLayerConv2D::GatherSlopes(float *dst, const CLayer *prevLayer, size_t rangeMin, size_t rangeMax) const
 {
 	MICROPROFILE_SCOPEI("CLayerConv2D", "CLayerConv2D::GatherSlopes", MP_PALEVIOLETRED1);
 	(void)prevLayer;
-	const size_t	featureInputStride = m_ConvParams.m_InputSizeX * m_ConvParams.m_InputSizeY;
-	const size_t	dstRange = rangeMax - rangeMin;
+	const size_t	inputSizeX = m_ConvParams.m_InputSizeX;
+	const size_t	inputSizeY = m_ConvParams.m_InputSizeY;
+	const size_t	featureInputStride = inputSizeX * inputSizeY;
+
+	if (UseSparseInput())
+	{
+		// Each task owns the input features starting in its range:
+		const size_t	featureMin = (rangeMin + featureInputStride - 1) / featureInputStride;
+		const size_t	featureMax = (rangeMax + featureInputStride - 1) / featureInputStride;
 
-	memset(dst + rangeMin, 0, (rangeMax - rangeMin) * sizeof(float));
+		if (featureMin >= featureMax)
+			return;
+		memset(dst + featureMin * featureInputStride, 0, (featureMax - featureMin) * featureInputStride * sizeof(float));
+		GatherSlopesSparse(dst, featureMin, featureMax);
+		return;
+	}
 
 	SGatherSlopes_KernelIn	kernelIn;
 
@@ -191,11 +558,30 @@ void	CLayerConv2D::GatherSlopes(float *dst, const CLayer *prevLayer, size_t rang
 	kernelIn.m_Weights = m_Weights.View();
 	kernelIn.m_Output = dst;
 
-	KernelConvolute<SGatherSlopes_KernelIn,
-					&CLayerConv2D::Kernel_GatherSlopes>(kernelIn,
-														rangeMin / featureInputStride,
-														rangeMax / featureInputStride,
-														m_ConvParams);
+	// Each task owns the input rows starting in its range, processed in bands of rows of one input feature:
+	const size_t	rowMax = (rangeMax + inputSizeX - 1) / inputSizeX;
+	size_t			rowIdx = (rangeMin + inputSizeX - 1) / inputSizeX;
+
+	while (rowIdx < rowMax)
+	{
+		const size_t	inFeatureIdx = rowIdx / inputSizeY;
+		const size_t	inputYMin = rowIdx % inputSizeY;
+		const size_t	inputYMax = std::min(inputSizeY, inputYMin + rowMax - rowIdx);
+		const size_t	inIdx = inFeatureIdx * featureInputStride + inputYMin * inputSizeX;
+		const size_t	inCount = (inputYMax - inputYMin) * inputSizeX;
+
+		memset(dst + inIdx, 0, inCount * sizeof(float));
+		if (IsPointwise())
+		{
+			GatherSlopesPointwise(dst, inFeatureIdx, inIdx, inCount);
+		}
+		else
+		{
+			m_Kernels->m_GatherSlopes(	kernelIn, inFeatureIdx, inFeatureIdx + 1, m_ConvParams,
+										ComputeKernelRowsReaching(inputYMin, inputYMax, m_ConvParams));
+		}
+		rowIdx += inputYMax - inputYMin;
+	}
 }
 
 void	CLayerConv2D::PrintInfo() const
@@ -208,6 +594,7 @@ void	CLayerConv2D::PrintInfo() const
 			m_KernelCount, m_ConvParams.m_KernelSizeX, m_ConvParams.m_KernelSizeY,
 			m_ConvParams.m_KernelStride);
 	printf("\t\tOutput: %zu %zux%zu\n", m_KernelCount, m_ConvParams.m_OutputSizeX, m_ConvParams.m_OutputSizeY);
+	printf("\t\tBias: %s\n", m_SharedBias ? "per feature" : "per output");
 	PrintBasicInfo();
 }
 
@@ -222,6 +609,10 @@ void	CLayerConv2D::Serialize(std::vector<uint8_t> &data) const
 	dataPtr[0] = m_KernelCount;
 	dataPtr[1] = m_InputImageCount;
 	SerializeWeightsAndBias(data);
+	prevSize = data.size();
+	data.resize(prevSize + sizeof(uint32_t));
+	*(uint32_t*)(data.data() + prevSize) = kBasicInfoTag;
+	SerializeBasicInfo(data);
 }
 
 bool	CLayerConv2D::UnSerialize(const std::vector<uint8_t> &data, size_t &curIdx)
@@ -242,9 +633,32 @@ bool	CLayerConv2D::UnSerialize(const std::vector<uint8_t> &data, size_t &curIdx)
 		return false;
 	if (!UnSerializeWeightsAndBias(data, curIdx))
 		return false;
+	// The bias size gives the bias mode, older files have one bias per output:
+	if (m_Bias.Size() == m_KernelCount)
+		m_SharedBias = true;
+	else if (m_Bias.Size() == m_OutputSize)
+		m_SharedBias = false;
+	else
+		return false;
+	if (!AllocateBiasStorages())
+		return false;
+	// Older files have no activation nor optimizer, the layer keeps the ones of Setup:
+	if (curIdx + sizeof(uint32_t) <= data.size() && *(const uint32_t*)(data.data() + curIdx) == kBasicInfoTag)
+	{
+		curIdx += sizeof(uint32_t);
+		if (!UnSerializeBasicInfo(data, curIdx))
+			return false;
+	}
 	return true;
 }
 
+void	CLayerConv2D::GetParameterStorages(std::vector<CNeuronMatrix*> &matrices, std::vector<CNeuronVector*> &vectors)
+{
+	CLayer::GetParameterStorages(matrices, vectors);
+	matrices.push_back(&m_TileSlopesWeightAccum);
+	vectors.push_back(&m_TileSlopesBiasAccum);
+}
+
 size_t	CLayerConv2D::GetThreadingHint() const
 {
 	return GetOutputSizeX() * GetOutputSizeY() * m_KernelCount * 4096;
@@ -252,12 +666,265 @@ size_t	CLayerConv2D::GetThreadingHint() const
 
 size_t	CLayerConv2D::GetDomainSize() const
 {
-	return m_KernelCount;
+	// Output features x tiles:
+	return m_KernelCount * m_TileCount;
+}
+
+bool	CLayerConv2D::UseSparseInput() const
+{
+	// The scatter only pays off under half density:
+	return	m_InputNonZero != nullptr && m_InputNonZero->TotalNonZeroCount() * 2 < m_InputSize &&
+			m_ConvParams.m_KernelSizeX * m_ConvParams.m_KernelSizeY <= kMaxInputTapCount;
+}
+
+bool	CLayerConv2D::IsPointwise() const
+{
+	return	m_ConvParams.m_KernelSizeX == 1 && m_ConvParams.m_KernelSizeY == 1 &&
+			m_ConvParams.m_KernelStride == 1 && m_ConvParams.m_InputPadding == 0;
+}
+
+void	CLayerConv2D::ComputeNetInputPointwise(const float *input, size_t featureIdx, size_t outIdx, size_t outCount)
+{
+	// Input and output features have the same size, each output pixel is a weighted sum of the input pixels at the same place:
+	const size_t	featureStride = m_ConvParams.m_OutputSizeX * m_ConvParams.m_OutputSizeY;
+	const size_t	pixelIdx = outIdx - featureIdx * featureStride;
+	const float		*weightsPtr = m_Weights.View().GetRow(featureIdx);
+	float			*netInputPtr = m_NetInput.Data() + outIdx;
+
+	if (m_SharedBias)
+		std::fill(netInputPtr, netInputPtr + outCount, m_Bias.Data()[featureIdx]);
+	else
+		memcpy(netInputPtr, m_Bias.Data() + outIdx, outCount * sizeof(float));
+	for (size_t inFeatureIdx = 0; inFeatureIdx < m_InputImageCount; ++inFeatureIdx)
+		KernelAxpy(netInputPtr, input + inFeatureIdx * featureStride + pixelIdx, weightsPtr[inFeatureIdx], outCount);
+}
+
+void	CLayerConv2D::AccumWeightsAndBiasDerivativePointwise(const float *input, size_t featureIdx, size_t outIdx, size_t outCount, float *accumWeightsPtr)
+{
+	const size_t	featureStride = m_ConvParams.m_OutputSizeX * m_ConvParams.m_OutputSizeY;
+	const size_t	pixelIdx = outIdx - featureIdx * featureStride;
+	const float		*slopesPtr = m_SlopesOut.Data() + outIdx;
+
+	for (size_t inFeatureIdx = 0; inFeatureIdx < m_InputImageCount; ++inFeatureIdx)
+		accumWeightsPtr[inFeatureIdx] += KernelDot(input + inFeatureIdx * featureStride + pixelIdx, slopesPtr, outCount);
+	// The shared bias is reduced separately:
+	if (!m_SharedBias)
+		KernelAxpy(m_SlopesOutAccum.Data() + outIdx, slopesPtr, 1.0f, outCount);
+}
+
+void	CLayerConv2D::GatherSlopesPointwise(float *dst, size_t inFeatureIdx, size_t inIdx, size_t inCount) const
+{
+	const size_t	featureStride = m_ConvParams.m_InputSizeX * m_ConvParams.m_InputSizeY;
+	const size_t	pixelIdx = inIdx - inFeatureIdx * featureStride;
+
+	for (size_t featureIdx = 0; featureIdx < m_KernelCount; ++featureIdx)
+	{
+		const float		weight = m_Weights.View().GetRow(featureIdx)[inFeatureIdx];
+
+		KernelAxpy(dst + inIdx, m_SlopesOut.Data() + featureIdx * featureStride + pixelIdx, weight, inCount);
+	}
+}
+
+void	CLayerConv2D::ComputeNetInputQuantized(size_t featureIdx, const SKernelRows &rows)
+{
+	// Each convolution copies its int8 input window in the layout of the weights (zero on the padding),
+	// then it is a single dot product with the weights of the feature:
+	const size_t	inputSizeX = m_ConvParams.m_InputSizeX;
+	const size_t	featureInputStride = inputSizeX * m_ConvParams.m_InputSizeY;
+	const size_t	kernelSizeX = m_ConvParams.m_KernelSizeX;
+	const size_t	featureWeightStride = kernelSizeX * m_ConvParams.m_KernelSizeY;
+	const size_t	outputSizeX = m_ConvParams.m_OutputSizeX;
+	const size_t	featureOutputStride = outputSizeX * m_ConvParams.m_OutputSizeY;
+	const int8_t	*weightsPtr = m_QuantizedWeights.GetRow(featureIdx);
+	const float		scale = m_InputScale * m_QuantizedWeights.GetScale(featureIdx);
+	std::vector<int8_t>	window(CQuantizedMatrix::AlignedSize(m_QuantizedWeights.Columns()), 0);
+
+	for (size_t convIdxY = rows.m_ConvIdxYMin; convIdxY < rows.m_ConvIdxYMax; ++convIdxY)
+	{
+		const SConvolutionSpan	&spanY = m_ConvParams.m_SpansY[convIdxY];
+
+		for (size_t convIdxX = 0; convIdxX < outputSizeX; ++convIdxX)
+		{
+			const SConvolutionSpan	&spanX = m_ConvParams.m_SpansX[convIdxX];
+			const size_t			outIdx = featureIdx * featureOutputStride + convIdxY * outputSizeX + convIdxX;
+
+			// Interior windows overwrite every tap:
+			if (!m_ConvParams.IsInteriorY(convIdxY) || !m_ConvParams.IsInteriorX(convIdxX))
+				memset(window.data(), 0, window.size());
+			if (spanX.m_Stop > spanX.m_Start)
+			{
+				const size_t	columns = spanX.m_Stop - spanX.m_Start;
+				const size_t	windowX = static_cast<size_t>(static_cast<int>(spanX.m_Start) - spanX.m_Offset);
+
+				for (size_t inFeatureIdx = 0; inFeatureIdx < m_InputImageCount; ++inFeatureIdx)
+				{
+					for (size_t inputY = spanY.m_Start; inputY < spanY.m_Stop; ++inputY)
+					{
+						memcpy(	window.data() + inFeatureIdx * featureWeightStride + static_cast<size_t>(static_cast<int>(inputY) - spanY.m_Offset) * kernelSizeX + windowX,
+								m_QuantizedInput.data() + inFeatureIdx * featureInputStride + inputY * inputSizeX + spanX.m_Start,
+								columns);
+					}
+				}
+			}
+			m_NetInput.Data()[outIdx] =	CQuantizedMatrix::Dot(window.data(), weightsPtr, window.size()) * scale +
+										m_Bias.Data()[m_SharedBias ? featureIdx : outIdx];
+		}
+	}
+}
+
+size_t	CLayerConv2D::ComputeInputTaps(size_t inputIdx, SInputTap *taps) const
+{
+	const size_t	featureInputStride = m_ConvParams.m_InputSizeX * m_ConvParams.m_InputSizeY;
+	const size_t	outFeatureWeightStride = m_ConvParams.m_KernelSizeX * m_ConvParams.m_KernelSizeY;
+	const size_t	inFeatureIdx = inputIdx / featureInputStride;
+	const int		inY = (int)((inputIdx % featureInputStride) / m_ConvParams.m_InputSizeX);
+	const int		inX = (int)(inputIdx % m_ConvParams.m_InputSizeX);
+	const int		padding = static_cast<int>(m_ConvParams.m_InputPadding);
+	const int		stride = static_cast<int>(m_ConvParams.m_KernelStride);
+	size_t			tapCount = 0;
+
+	// The input is read by the weight (kernelX, kernelY) of the convolution (convX, convY)
+	// when convY * stride - padding + kernelY == inY (same for X):
+	for (int kernelY = 0; kernelY < (int)m_ConvParams.m_KernelSizeY; ++kernelY)
+	{
+		const int	strideY = inY + padding - kernelY;
+
+		if (strideY < 0)
+			break;
+		if (strideY % stride != 0 || strideY / stride >= (int)m_ConvParams.m_OutputSizeY)
+			continue;
+		for (int kernelX = 0; kernelX < (int)m_ConvParams.m_KernelSizeX; ++kernelX)
+		{
+			const int	strideX = inX + padding - kernelX;
+
+			if (strideX < 0)
+				break;
+			if (strideX % stride != 0 || strideX / stride >= (int)m_ConvParams.m_OutputSizeX)
+				continue;
+			taps[tapCount].m_WeightIdx = inFeatureIdx * outFeatureWeightStride + kernelY * m_ConvParams.m_KernelSizeX + kernelX;
+			taps[tapCount].m_OutputIdx = (strideY / stride) * m_ConvParams.m_OutputSizeX + strideX / stride;
+			++tapCount;
+		}
+	}
+	return tapCount;
+}
+
+void	CLayerConv2D::ComputeNetInputSparse(const float *input, size_t rangeMin, size_t rangeMax)
+{
+	const size_t			featureOutputStride = m_ConvParams.m_OutputSizeX * m_ConvParams.m_OutputSizeY;
+	const float				*biasPtr = m_Bias.Data();
+	SInputTap				taps[kMaxInputTapCount];
+
+	// The net input starts from the bias:
+	for (size_t featureIdx = rangeMin; featureIdx < rangeMax; ++featureIdx)
+	{
+		float	*netInputPtr = m_NetInput.Data() + featureIdx * featureOutputStride;
+
+		for (size_t outIdx = 0; outIdx < featureOutputStride; ++outIdx)
+			netInputPtr[outIdx] = m_SharedBias ? biasPtr[featureIdx] : biasPtr[featureIdx * featureOutputStride + outIdx];
+	}
+	// Each non zero input adds its contribution to the outputs it reaches:
+	for (size_t blockIdx = 0; blockIdx < m_InputNonZero->BlockCount(); ++blockIdx)
+	{
+		const uint32_t	*indices = m_InputNonZero->BlockIndices(blockIdx);
+		const uint32_t	count = m_InputNonZero->NonZeroCount(blockIdx);
+
+		for (uint32_t i = 0; i < count; ++i)
+		{
+			const float		value = input[indices[i]];
+			const size_t	tapCount = ComputeInputTaps(indices[i], taps);
+
+			for (size_t featureIdx = rangeMin; featureIdx < rangeMax; ++featureIdx)
+			{
+				const float		*weightsPtr = m_Weights.View().GetRow(featureIdx);
+				float			*netInputPtr = m_NetInput.Data() + featureIdx * featureOutputStride;
+
+				for (size_t tapIdx = 0; tapIdx < tapCount; ++tapIdx)
+					netInputPtr[taps[tapIdx].m_OutputIdx] += weightsPtr[taps[tapIdx].m_WeightIdx] * value;
+			}
+		}
+	}
+}
+
+void	CLayerConv2D::AccumWeightsAndBiasDerivativeSparse(const float *input, size_t rangeMin, size_t rangeMax)
+{
+	const size_t			featureOutputStride = m_ConvParams.m_OutputSizeX * m_ConvParams.m_OutputSizeY;
+	SInputTap				taps[kMaxInputTapCount];
+
+	// Shared bias is reduced separately:
+	if (!m_SharedBias)
+	{
+		const float		*slopesPtr = m_SlopesOut.Data();
+		float			*slopeAccumPtr = m_SlopesOutAccum.Data();
+
+		for (size_t outIdx = rangeMin * featureOutputStride; outIdx < rangeMax * featureOutputStride; ++outIdx)
+			slopeAccumPtr[outIdx] += slopesPtr[outIdx];
+	}
+	// Null inputs have a null weight derivative:
+	for (size_t blockIdx = 0; blockIdx < m_InputNonZero->BlockCount(); ++blockIdx)
+	{
+		const uint32_t	*indices = m_InputNonZero->BlockIndices(blockIdx);
+		const uint32_t	count = m_InputNonZero->NonZeroCount(blockIdx);
+
+		for (uint32_t i = 0; i < count; ++i)
+		{
+			const float		value = input[indices[i]];
+			const size_t	tapCount = ComputeInputTaps(indices[i], taps);
+
+			for (size_t featureIdx = rangeMin; featureIdx < rangeMax; ++featureIdx)
+			{
+				const float		*slopesPtr = m_SlopesOut.Data() + featureIdx * featureOutputStride;
+				float			*weightsAccumPtr = m_SlopesWeightAccum.View().GetRow(featureIdx);
+
+				for (size_t tapIdx = 0; tapIdx < tapCount; ++tapIdx)
+					weightsAccumPtr[taps[tapIdx].m_WeightIdx] += slopesPtr[taps[tapIdx].m_OutputIdx] * value;
+			}
+		}
+	}
+}
+
+void	CLayerConv2D::GatherSlopesSparse(float *dst, size_t featureMin, size_t featureMax) const
+{
+	const size_t			featureInputStride = m_ConvParams.m_InputSizeX * m_ConvParams.m_InputSizeY;
+	const size_t			featureOutputStride = m_ConvParams.m_OutputSizeX * m_ConvParams.m_OutputSizeY;
+	const size_t			inputMin = featureMin * featureInputStride;
+	const size_t			inputMax = featureMax * featureInputStride;
+	const size_t			blockMin = inputMin / SNonZeroList::kBlockSize;
+	const size_t			blockMax = (inputMax + SNonZeroList::kBlockSize - 1) / SNonZeroList::kBlockSize;
+	SInputTap				taps[kMaxInputTapCount];
+
+	// Inputs outside the list (dropped or dead units) get no slope, dst is already cleared:
+	for (size_t blockIdx = blockMin; blockIdx < blockMax; ++blockIdx)
+	{
+		const uint32_t	*indices = m_InputNonZero->BlockIndices(blockIdx);
+		const uint32_t	count = m_InputNonZero->NonZeroCount(blockIdx);
+
+		for (uint32_t i = 0; i < count; ++i)
+		{
+			const size_t	inputIdx = indices[i];
+
+			if (inputIdx < inputMin || inputIdx >= inputMax)
+				continue;
+			const size_t	tapCount = ComputeInputTaps(inputIdx, taps);
+			float			slope = 0.0f;
+
+			for (size_t featureIdx = 0; featureIdx < m_KernelCount; ++featureIdx)
+			{
+				const float		*slopesPtr = m_SlopesOut.Data() + featureIdx * featureOutputStride;
+				const float		*weightsPtr = m_Weights.View().GetRow(featureIdx);
+
+				for (size_t tapIdx = 0; tapIdx < tapCount; ++tapIdx)
+					slope += slopesPtr[taps[tapIdx].m_OutputIdx] * weightsPtr[taps[tapIdx].m_WeightIdx];
+			}
+			dst[inputIdx] = slope;
+		}
+	}
 }
 
 // This is going called for each convolution
 // Be careful !
 
+template<bool _Interior>
 void	CLayerConv2D::Kernel_AccumWeightsAndBiasDerivative(	const SAccumWeightsAndBiasDerivative_KernelIn &input,
 															const SKernelRange &range,
 															const SConvolutionParams &conv)
@@ -265,7 +932,8 @@ void	CLayerConv2D::Kernel_AccumWeightsAndBiasDerivative(	const SAccumWeightsAndB
 	const size_t	featureInputStride = conv.m_InputSizeX * conv.m_InputSizeY;
 	const size_t	featureOutputStride = conv.m_OutputSizeX * conv.m_OutputSizeY;
 	const size_t	outFeatureWeightStride = conv.m_KernelSizeX * conv.m_KernelSizeY;
-	float			*weightsAccumPtr = input.m_AccumWeights.GetRow(range.m_FeatureIdx);
+	const SKernelWindow	window = ComputeKernelWindow<_Interior>(range, conv);
+	float			*weightsAccumPtr = input.m_AccumWeights.GetRow(range.m_FeatureIdx) + window.m_WeightOffset;
 	const size_t	outIdx =	range.m_FeatureIdx * featureOutputStride +
 								range.m_ConvIdxY * conv.m_OutputSizeX +
 								range.m_ConvIdxX;
@@ -274,80 +942,93 @@ void	CLayerConv2D::Kernel_AccumWeightsAndBiasDerivative(	const SAccumWeightsAndB
 	assert(abs(slope) < 1000000.0f);
 	assert(!isnan(slope));
 	assert(!isinf(slope));
-	input.m_AccumBias[outIdx] += slope;
-	assert(abs(input.m_AccumBias[outIdx]) < 1000000.0f);
-	assert(!isnan(input.m_AccumBias[outIdx]));
-	assert(!isinf(input.m_AccumBias[outIdx]));
+	if (input.m_AccumBias != nullptr)
+	{
+		input.m_AccumBias[outIdx] += slope;
+		assert(abs(input.m_AccumBias[outIdx]) < 1000000.0f);
+		assert(!isnan(input.m_AccumBias[outIdx]));
+		assert(!isinf(input.m_AccumBias[outIdx]));
+	}
 	// For each input feature:
 	for (size_t inFeatureIdx = 0; inFeatureIdx < input.m_InFeatureCount; ++inFeatureIdx)
 	{
-		for (size_t inY = range.m_StartConvY; inY < range.m_StopConvY; ++inY)
+		const float		*inputRowPtr = input.m_Input + inFeatureIdx * featureInputStride + window.m_InputOffset;
+		float			*weightsAccumRowPtr = weightsAccumPtr + inFeatureIdx * outFeatureWeightStride;
+
+		for (size_t rowIdx = 0; rowIdx < window.m_Rows; ++rowIdx)
 		{
-			for (size_t inX = range.m_StartConvX; inX < range.m_StopConvX; ++inX)
+			for (size_t columnIdx = 0; columnIdx < window.m_Columns; ++columnIdx)
 			{
-				size_t	inputIdx =	inFeatureIdx * featureInputStride +
-									inY * conv.m_InputSizeX +
-									inX;
-				size_t	weightIdx = inFeatureIdx * outFeatureWeightStride + 
-									(inY - range.m_ConvOffsetY) * conv.m_KernelSizeX +
-									(inX - range.m_ConvOffsetX);
-				weightsAccumPtr[weightIdx] += input.m_Input[inputIdx] * slope;
-				assert(abs(weightsAccumPtr[weightIdx]) < 1000000.0f);
-				assert(!isnan(weightsAccumPtr[weightIdx]));
-				assert(!isinf(weightsAccumPtr[weightIdx]));
+				weightsAccumRowPtr[columnIdx] += inputRowPtr[columnIdx] * slope;
+				assert(abs(weightsAccumRowPtr[columnIdx]) < 1000000.0f);
+				assert(!isnan(weightsAccumRowPtr[columnIdx]));
+				assert(!isinf(weightsAccumRowPtr[columnIdx]));
 			}
+			inputRowPtr += conv.m_InputSizeX;
+			weightsAccumRowPtr += conv.m_KernelSizeX;
 		}
 	}
 }
 
-void	CLayerConv2D::Kernel_ComputeNetInput(	const SComputeNetInput_KernelIn &input,
-												const SKernelRange &range,
-												const SConvolutionParams &conv)
+template<bool _Interior>
+float	CLayerConv2D::Kernel_NetInputSum(	const SComputeNetInput_KernelIn &input,
+											const SKernelRange &range,
+											const SConvolutionParams &conv)
 {
 	const size_t	featureInputStride = conv.m_InputSizeX * conv.m_InputSizeY;
-	const size_t	featureOutputStride = conv.m_OutputSizeX * conv.m_OutputSizeY;
 	const size_t	outFeatureWeightStride = conv.m_KernelSizeX * conv.m_KernelSizeY;
-	const float		*weightsPtr = input.m_Weights.GetRow(range.m_FeatureIdx);
+	const SKernelWindow	window = ComputeKernelWindow<_Interior>(range, conv);
+	const float		*weightsPtr = input.m_Weights.GetRow(range.m_FeatureIdx) + window.m_WeightOffset;
 
 	float		accum = 0.0f;
 	// For each input feature:
 	for (size_t inFeatureIdx = 0; inFeatureIdx < input.m_InFeatureCount; ++inFeatureIdx)
 	{
-		for (size_t inY = range.m_StartConvY; inY < range.m_StopConvY; ++inY)
+		const float		*inputRowPtr = input.m_Input + inFeatureIdx * featureInputStride + window.m_InputOffset;
+		const float		*weightsRowPtr = weightsPtr + inFeatureIdx * outFeatureWeightStride;
+
+		for (size_t rowIdx = 0; rowIdx < window.m_Rows; ++rowIdx)
 		{
-			for (size_t inX = range.m_StartConvX; inX < range.m_StopConvX; ++inX)
-			{
-				size_t	inputIdx =	inFeatureIdx * featureInputStride +
-									inY * conv.m_InputSizeX +
-									inX;
-				size_t	weightIdx = inFeatureIdx * outFeatureWeightStride + 
-									(inY - range.m_ConvOffsetY) * conv.m_KernelSizeX +
-									(inX - range.m_ConvOffsetX);
-				accum += input.m_Input[inputIdx] * weightsPtr[weightIdx];
-				assert(abs(accum) < 1000000.0f);
-				assert(!isnan(accum));
-				assert(!isinf(accum));
-			}
+			for (size_t columnIdx = 0; columnIdx < window.m_Columns; ++columnIdx)
+				accum += inputRowPtr[columnIdx] * weightsRowPtr[columnIdx];
+			inputRowPtr += conv.m_InputSizeX;
+			weightsRowPtr += conv.m_KernelSizeX;
 		}
 	}
+	assert(abs(accum) < 1000000.0f);
+	assert(!isnan(accum));
+	assert(!isinf(accum));
+	return accum;
+}
+
+template<bool _Interior>
+void	CLayerConv2D::Kernel_ComputeNetInput(	const SComputeNetInput_KernelIn &input,
+												const SKernelRange &range,
+												const SConvolutionParams &conv)
+{
+	const size_t	featureOutputStride = conv.m_OutputSizeX * conv.m_OutputSizeY;
 	const size_t	outIdx =	range.m_FeatureIdx * featureOutputStride +
 								range.m_ConvIdxY * conv.m_OutputSizeX +
 								range.m_ConvIdxX;
-	accum += input.m_Bias[outIdx];
-	input.m_NetInput[outIdx] = accum;
+	const float		accum = Kernel_NetInputSum<_Interior>(input, range, conv);
+
+	input.m_NetInput[outIdx] = accum + input.m_Bias[input.m_SharedBias ? range.m_FeatureIdx : outIdx];
 	assert(abs(input.m_NetInput[outIdx]) < 1000000.0f);
 	assert(!isnan(input.m_NetInput[outIdx]));
 	assert(!isinf(input.m_NetInput[outIdx]));
 }
 
+template<bool _Interior>
 void	CLayerConv2D::Kernel_GatherSlopes(	const SGatherSlopes_KernelIn &input,
 											const SKernelRange &range,
 											const SConvolutionParams &conv)
 {
-
 	const size_t	featureInputStride = conv.m_InputSizeX * conv.m_InputSizeY;
 	const size_t	featureOutputStride = conv.m_OutputSizeX * conv.m_OutputSizeY;
 	const size_t	outFeatureWeightStride = conv.m_KernelSizeX * conv.m_KernelSizeY;
+	const SKernelWindow	window = ComputeKernelWindow<_Interior>(range, conv);
+	float			*dstPtr = input.m_Output + range.m_FeatureIdx * featureInputStride + window.m_InputOffset;
+	const size_t	weightOffset = range.m_FeatureIdx * outFeatureWeightStride + window.m_WeightOffset;
 
 	// For each output feature:
 	for (size_t outFeatureIdx = 0; outFeatureIdx < input.m_OutFeatureCount; ++outFeatureIdx)
@@ -356,24 +1037,152 @@ void	CLayerConv2D::Kernel_GatherSlopes(	const SGatherSlopes_KernelIn &input,
 									range.m_ConvIdxY * conv.m_OutputSizeX +
 									range.m_ConvIdxX;
 		const float		slope = input.m_Slopes[outIdx];
-		float			*weightsPtr = input.m_Weights.GetRow(outFeatureIdx);
+		const float		*weightsRowPtr = input.m_Weights.GetRow(outFeatureIdx) + weightOffset;
+		float			*dstRowPtr = dstPtr;
+
+		for (size_t rowIdx = 0; rowIdx < window.m_Rows; ++rowIdx)
+		{
+			for (size_t columnIdx = 0; columnIdx < window.m_Columns; ++columnIdx)
+			{
+				dstRowPtr[columnIdx] += slope * weightsRowPtr[columnIdx];
+				assert(abs(dstRowPtr[columnIdx]) < 100000000.0f);
+				assert(!isnan(dstRowPtr[columnIdx]));
+				assert(!isinf(dstRowPtr[columnIdx]));
+			}
+			dstRowPtr += conv.m_InputSizeX;
+			weightsRowPtr += conv.m_KernelSizeX;
+		}
+	}
+}
+
+template<size_t _KernelSize, size_t _Stride>
+void	CLayerConv2D::Kernel_AccumWeightsAndBiasDerivativeRow(	const SAccumWeightsAndBiasDerivative_KernelIn &input,
+																const SKernelRange &range, size_t count,
+																const SConvolutionParams &conv)
+{
+	const size_t	inputSizeX = conv.m_InputSizeX;
+	const size_t	featureInputStride = inputSizeX * conv.m_InputSizeY;
+	const size_t	featureOutputStride = conv.m_OutputSizeX * conv.m_OutputSizeY;
+	const size_t	outFeatureWeightStride = _KernelSize * _KernelSize;
+	const size_t	outIdx =	range.m_FeatureIdx * featureOutputStride +
+								range.m_ConvIdxY * conv.m_OutputSizeX +
+								range.m_ConvIdxX;
+	const float		*slopesPtr = input.m_Slopes + outIdx;
+	const float		*inputPtr = input.m_Input + range.m_ConvOffsetY * inputSizeX + range.m_ConvOffsetX;
+	float			*weightsAccumPtr = input.m_AccumWeights.GetRow(range.m_FeatureIdx);
+
+	assert(conv.m_KernelSizeX == _KernelSize && conv.m_KernelSizeY == _KernelSize && conv.m_KernelStride == _Stride);
+	if (input.m_AccumBias != nullptr)
+		KernelAxpy(input.m_AccumBias + outIdx, slopesPtr, 1.0f, count);
+	// Each weight gets the dot product of the slopes row with the input pixels it read:
+	for (size_t inFeatureIdx = 0; inFeatureIdx < input.m_InFeatureCount; ++inFeatureIdx)
+	{
+		const float		*inputRowPtr = inputPtr + inFeatureIdx * featureInputStride;
+		float			*weightsAccumRowPtr = weightsAccumPtr + inFeatureIdx * outFeatureWeightStride;
+
+		for (size_t kernelY = 0; kernelY < _KernelSize; ++kernelY)
+		{
+			for (size_t kernelX = 0; kernelX < _KernelSize; ++kernelX)
+				weightsAccumRowPtr[kernelX] += _DotStrided<_Stride>(slopesPtr, inputRowPtr + kernelX, count);
+			inputRowPtr += inputSizeX;
+			weightsAccumRowPtr += _KernelSize;
+		}
+	}
+}
+
+template<size_t _KernelSize, size_t _Stride>
+void	CLayerConv2D::Kernel_ComputeNetInputRow(const SComputeNetInput_KernelIn &input,
+												const SKernelRange &range, size_t count,
+												const SConvolutionParams &conv)
+{
+	const size_t	inputSizeX = conv.m_InputSizeX;
+	const size_t	featureInputStride = inputSizeX * conv.m_InputSizeY;
+	const size_t	featureOutputStride = conv.m_OutputSizeX * conv.m_OutputSizeY;
+	const size_t	outFeatureWeightStride = _KernelSize * _KernelSize;
+	const size_t	outIdx =	range.m_FeatureIdx * featureOutputStride +
+								range.m_ConvIdxY * conv.m_OutputSizeX +
+								range.m_ConvIdxX;
+	const float		*weightsPtr = input.m_Weights.GetRow(range.m_FeatureIdx);
+	const float		*inputPtr = input.m_Input + range.m_ConvOffsetY * inputSizeX + range.m_ConvOffsetX;
+	const float		*biasPtr = input.m_SharedBias ? nullptr : input.m_Bias + outIdx;
+	const float		sharedBias = input.m_SharedBias ? input.m_Bias[range.m_FeatureIdx] : 0.0f;
+	float			*netInputPtr = input.m_NetInput + outIdx;
+	size_t			convIdx = 0;
+
+	assert(conv.m_KernelSizeX == _KernelSize && conv.m_KernelSizeY == _KernelSize && conv.m_KernelStride == _Stride);
+	// Four convolutions at once:
+	for (; convIdx + 4 <= count; convIdx += 4)
+	{
+		__m128	accum_xyzw = _mm_setzero_ps();
+
+		for (size_t inFeatureIdx = 0; inFeatureIdx < input.m_InFeatureCount; ++inFeatureIdx)
+		{
+			const float		*inputRowPtr = inputPtr + inFeatureIdx * featureInputStride + convIdx * _Stride;
+			const float		*weightsRowPtr = weightsPtr + inFeatureIdx * outFeatureWeightStride;
+
+			for (size_t kernelY = 0; kernelY < _KernelSize; ++kernelY)
+			{
+				for (size_t kernelX = 0; kernelX < _KernelSize; ++kernelX)
+				{
+					const __m128	weight_xxxx = _mm_set1_ps(weightsRowPtr[kernelX]);
+
+					accum_xyzw = _mm_add_ps(accum_xyzw, _mm_mul_ps(_LoadStrided<_Stride>(inputRowPtr + kernelX), weight_xxxx));
+				}
+				inputRowPtr += inputSizeX;
+				weightsRowPtr += _KernelSize;
+			}
+		}
+		const __m128	bias_xyzw = biasPtr != nullptr ? _mm_loadu_ps(biasPtr + convIdx) : _mm_set1_ps(sharedBias);
+		_mm_storeu_ps(netInputPtr + convIdx, _mm_add_ps(accum_xyzw, bias_xyzw));
+	}
+	for (; convIdx < count; ++convIdx)
+	{
+		float	accum = 0.0f;
 
-		for (size_t inY = range.m_StartConvY; inY < range.m_StopConvY; ++inY)
+		for (size_t inFeatureIdx = 0; inFeatureIdx < input.m_InFeatureCount; ++inFeatureIdx)
 		{
-			for (size_t inX = range.m_StartConvX; inX < range.m_StopConvX; ++inX)
+			const float		*inputRowPtr = inputPtr + inFeatureIdx * featureInputStride + convIdx * _Stride;
+			const float		*weightsRowPtr = weightsPtr + inFeatureIdx * outFeatureWeightStride;
+
+			for (size_t kernelY = 0; kernelY < _KernelSize; ++kernelY)
 			{
-				size_t	dstIdx =	range.m_FeatureIdx * featureInputStride +
-									inY * conv.m_InputSizeX +
-									inX;
-				size_t	weightIdx = range.m_FeatureIdx * outFeatureWeightStride + 
-									(inY - range.m_ConvOffsetY) * conv.m_KernelSizeX +
-									(inX - range.m_ConvOffsetX);
-				input.m_Output[dstIdx] += slope * weightsPtr[weightIdx];
-				assert(abs(input.m_Output[dstIdx]) < 100000000.0f);
-				assert(!isnan(input.m_Output[dstIdx]));
-				assert(!isinf(input.m_Output[dstIdx]));
+				for (size_t kernelX = 0; kernelX < _KernelSize; ++kernelX)
+					accum += inputRowPtr[kernelX] * weightsRowPtr[kernelX];
+				inputRowPtr += inputSizeX;
+				weightsRowPtr += _KernelSize;
 			}
 		}
+		netInputPtr[convIdx] = accum + (biasPtr != nullptr ? biasPtr[convIdx] : sharedBias);
 	}
 }
 
+template<size_t _KernelSize, size_t _Stride>
+void	CLayerConv2D::Kernel_GatherSlopesRow(	const SGatherSlopes_KernelIn &input,
+												const SKernelRange &range, size_t count,
+												const SConvolutionParams &conv)
+{
+	const size_t	inputSizeX = conv.m_InputSizeX;
+	const size_t	featureInputStride = inputSizeX * conv.m_InputSizeY;
+	const size_t	featureOutputStride = conv.m_OutputSizeX * conv.m_OutputSizeY;
+	const size_t	outFeatureWeightStride = _KernelSize * _KernelSize;
+	const size_t	slopesOffset = range.m_ConvIdxY * conv.m_OutputSizeX + range.m_ConvIdxX;
+	float			*dstPtr =	input.m_Output + range.m_FeatureIdx * featureInputStride +
+								range.m_ConvOffsetY * inputSizeX + range.m_ConvOffsetX;
+
+	assert(conv.m_KernelSizeX == _KernelSize && conv.m_KernelSizeY == _KernelSize && conv.m_KernelStride == _Stride);
+	// For each output feature, scatter the slopes row through each weight:
+	for (size_t outFeatureIdx = 0; outFeatureIdx < input.m_OutFeatureCount; ++outFeatureIdx)
+	{
+		const float		*slopesPtr = input.m_Slopes + outFeatureIdx * featureOutputStride + slopesOffset;
+		const float		*weightsRowPtr = input.m_Weights.GetRow(outFeatureIdx) + range.m_FeatureIdx * outFeatureWeightStride;
+		float			*dstRowPtr = dstPtr;
+
+		for (size_t kernelY = 0; kernelY < _KernelSize; ++kernelY)
+		{
+			for (size_t kernelX = 0; kernelX < _KernelSize; ++kernelX)
+				_AxpyStrided<_Stride>(dstRowPtr + kernelX, slopesPtr, weightsRowPtr[kernelX], count);
+			dstRowPtr += inputSizeX;
+			weightsRowPtr += _KernelSize;
+		}
+	}
+}
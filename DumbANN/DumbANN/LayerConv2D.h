@@ -3,6 +3,9 @@
 #include "LayerBase.h"
 #include "NeuronKernel.h"
 
+class	CLayerDropOut;
+class	CLayerMaxPooling2D;
+
 class	CLayerConv2D : public CLayer
 {
 public:
@@ -11,10 +14,11 @@ public:
 
 	bool	Setup(	size_t inputFeatureCount, size_t inputSizeX, size_t inputSizeY,
 					size_t featureCount, size_t featureSizeX, size_t featureSizeY,
-					size_t padding, size_t stride);
+					size_t padding, size_t stride,
+					bool sharedBias = true);
 
 	virtual void	FeedForward(const float *input, size_t rangeMin, size_t rangeMax) override;
-	virtual void	BackPropagateError(const float *prevOutput, const std::vector<float> &error, size_t rangeMin, size_t rangeMax) override;
+	virtual float	BackPropagateError(const float *prevOutput, const SLossTarget &target, size_t rangeMin, size_t rangeMax) override;
 	virtual void	BackPropagateError(const float* prevOutput, const CLayer *nextLayer, size_t rangeMin, size_t rangeMax) override;
 	virtual void	UpdateWeightsAndBias(size_t trainingSteps, size_t rangeMin, size_t rangeMax) override;
 	virtual void	GatherSlopes(float *dst, const CLayer *prevLayer, size_t rangeMin, size_t rangeMax) const override;
@@ -22,16 +26,37 @@ public:
 	virtual void	Serialize(std::vector<uint8_t> &data) const override;
 	virtual bool	UnSerialize(const std::vector<uint8_t> &data, size_t &curIdx) override;
 
+	virtual bool	SkipsZeroInputs() const override { return true; }
+	virtual bool	CanQuantize() const override { return true; }
+	virtual bool	CanUseMixedPrecision() const override { return true; }
+
+	virtual void	GetParameterStorages(std::vector<CNeuronMatrix*> &matrices, std::vector<CNeuronVector*> &vectors) override;
+
 	virtual size_t	GetThreadingHint() const override;
 	virtual size_t	GetDomainSize() const override;
+	virtual ELayerType	GetLayerType() const override { return ELayerType::LayerConv2D; }
 
 	size_t			GetFeatureCount() const { return m_KernelCount; }
 	size_t			GetFeatureSizeX() const { return m_ConvParams.m_KernelSizeX; }
 	size_t			GetFeatureSizeY() const { return m_ConvParams.m_KernelSizeY; }
 	size_t			GetOutputSizeX() const { return m_ConvParams.m_OutputSizeX; }
 	size_t			GetOutputSizeY() const { return m_ConvParams.m_OutputSizeY; }
+	bool			HasSharedBias() const { return m_SharedBias; }
+
+	// Batch normalization folding, one scale per output feature map:
+	virtual bool	FoldOutputScale(const float *scale, const float *shift, size_t featureCount) override;
+
+	// Convolution, activation, optional dropout and max pooling in one pass over output features.
+	// Only the pooled output and its argmax are written, plus the net input when back propagation needs it:
+	void			FeedForwardFusedMaxPool(const float *input,
+											const CLayerDropOut *dropOut, CLayerMaxPooling2D *maxPool,
+											bool keepNetInput,
+											size_t rangeMin, size_t rangeMax);
 
 private:
+	// Written before the basic info, at the end of the layer. Older files go on with the type of the next layer:
+	static const uint32_t	kBasicInfoTag = 0xBA51C1F0;
+
 	struct	SComputeNetInput_KernelIn
 	{
 		// Input data:
@@ -40,6 +65,7 @@ private:
 		SConstNeuronMatrixView	m_Weights;
 		const float				*m_Bias;
 		float					*m_NetInput;
+		bool					m_SharedBias;
 
 		size_t					m_InFeatureCount;
 		size_t					m_OutFeatureCount;
@@ -52,6 +78,7 @@ private:
 		// Neuron data:
 		const float				*m_Slopes;
 		SNeuronMatrixView		m_AccumWeights;
+		// nullptr when the bias is shared (reduced separately):
 		float					*m_AccumBias;
 
 		size_t					m_InFeatureCount;
@@ -70,17 +97,99 @@ private:
 		size_t					m_OutFeatureCount;
 	};
 
+	// Output pixel reached by an input pixel through one weight of the kernel:
+	struct	SInputTap
+	{
+		size_t		m_WeightIdx;
+		size_t		m_OutputIdx;
+	};
+	// The sparse paths keep the taps of an input on the stack, larger kernels stay dense:
+	static const size_t		kMaxInputTapCount = 128;
+
+	bool							AllocateBiasStorages();
+
+	// The domain is output feature x tile, a tile being a band of output rows.
+	// Tiles after the first accumulate the weights and shared bias derivatives in partials, reduced by the update:
+	bool							AllocateTileStorages();
+	SKernelRows						GetTileRows(size_t tileIdx) const;
+	template<typename _Function>
+	void							ForEachWorkItem(size_t rangeMin, size_t rangeMax, _Function function) const;
+	void							AccumTileDerivative(const float *input, size_t featureIdx, size_t tileIdx, const SKernelRows &rows);
+	void							ReduceTileAccum(size_t featureMin, size_t featureMax);
+
+	// 1x1 kernel with stride 1 and no padding: the convolution is a GEMM of the weights with the input features.
+	// Works on the pixels [outIdx, outIdx + outCount) of one feature:
+	bool							IsPointwise() const;
+	void							ComputeNetInputPointwise(const float *input, size_t featureIdx, size_t outIdx, size_t outCount);
+	void							AccumWeightsAndBiasDerivativePointwise(const float *input, size_t featureIdx, size_t outIdx, size_t outCount, float *accumWeightsPtr);
+	void							GatherSlopesPointwise(float *dst, size_t inFeatureIdx, size_t inIdx, size_t inCount) const;
+
+	// Int8 inference, one feature on the output rows:
+	void							ComputeNetInputQuantized(size_t featureIdx, const SKernelRows &rows);
+
+	// Sparse input: loops on the non zero inputs and scatters them to the outputs they reach:
+	bool							UseSparseInput() const;
+	size_t							ComputeInputTaps(size_t inputIdx, SInputTap *taps) const;
+	void							ComputeNetInputSparse(const float *input, size_t rangeMin, size_t rangeMax);
+	void							AccumWeightsAndBiasDerivativeSparse(const float *input, size_t rangeMin, size_t rangeMax);
+	void							GatherSlopesSparse(float *dst, size_t featureMin, size_t featureMax) const;
+
+	// Whole convolution passes over a feature range, picked by Setup for the kernel size and stride:
+	struct	SConvolutionKernels
+	{
+		// 0 for the generic kernels:
+		size_t	m_KernelSize;
+		size_t	m_Stride;
+		void	(*m_ComputeNetInput)(const SComputeNetInput_KernelIn &, size_t, size_t, const SConvolutionParams &, const SKernelRows &);
+		void	(*m_AccumWeightsAndBiasDerivative)(const SAccumWeightsAndBiasDerivative_KernelIn &, size_t, size_t, const SConvolutionParams &, const SKernelRows &);
+		void	(*m_GatherSlopes)(const SGatherSlopes_KernelIn &, size_t, size_t, const SConvolutionParams &, const SKernelRows &);
+	};
+
+	static const SConvolutionKernels	kGenericKernels;
+	static const SConvolutionKernels	kFixedKernels[];
+
+	// Runtime kernel size for the borders, interior rows with the kernel size and stride known at compile time:
+	template<size_t _KernelSize, size_t _Stride>
+	static SConvolutionKernels		MakeFixedKernels();
+
+	// _Interior kernels are called when the whole kernel window is inside the input map:
+	template<bool _Interior>
 	__forceinline static void		Kernel_AccumWeightsAndBiasDerivative(	const SAccumWeightsAndBiasDerivative_KernelIn &input,
 																			const SKernelRange &range,
 																			const SConvolutionParams &conv);
+	template<bool _Interior>
+	__forceinline static float		Kernel_NetInputSum(	const SComputeNetInput_KernelIn &input,
+														const SKernelRange &range,
+														const SConvolutionParams &conv);
+	template<bool _Interior>
 	__forceinline static void		Kernel_ComputeNetInput(	const SComputeNetInput_KernelIn &input,
 															const SKernelRange &range,
 															const SConvolutionParams &conv);
+	template<bool _Interior>
 	__forceinline static void		Kernel_GatherSlopes(const SGatherSlopes_KernelIn &input,
 														const SKernelRange &range,
 														const SConvolutionParams &conv);
+	// Interior rows, four convolutions per SSE vector:
+	template<size_t _KernelSize, size_t _Stride>
+	static void						Kernel_AccumWeightsAndBiasDerivativeRow(const SAccumWeightsAndBiasDerivative_KernelIn &input,
+																			const SKernelRange &range, size_t count,
+																			const SConvolutionParams &conv);
+	template<size_t _KernelSize, size_t _Stride>
+	static void						Kernel_ComputeNetInputRow(	const SComputeNetInput_KernelIn &input,
+																const SKernelRange &range, size_t count,
+																const SConvolutionParams &conv);
+	template<size_t _KernelSize, size_t _Stride>
+	static void						Kernel_GatherSlopesRow(	const SGatherSlopes_KernelIn &input,
+															const SKernelRange &range, size_t count,
+															const SConvolutionParams &conv);
 
 	SConvolutionParams	m_ConvParams;
+	const SConvolutionKernels	*m_Kernels;
 	size_t				m_KernelCount;
 	size_t				m_InputImageCount;
+	size_t				m_TileCount;
+	CNeuronMatrix		m_TileSlopesWeightAccum;
+	CNeuronVector		m_TileSlopesBiasAccum;
+	// One bias per feature map instead of one per output pixel:
+	bool				m_SharedBias;
 };
\ No newline at end of file
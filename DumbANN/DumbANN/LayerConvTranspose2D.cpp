@@ -0,0 +1,371 @@
+
+#include "LayerConvTranspose2D.h"
+#include <assert.h>
+
+CLayerConvTranspose2D::CLayerConvTranspose2D()
+:	m_KernelCount(0)
+,	m_InputImageCount(0)
+{
+}
+
+CLayerConvTranspose2D::~CLayerConvTranspose2D()
+{
+}
+
+bool	CLayerConvTranspose2D::Setup(	size_t inputFeatureCount, size_t inputSizeX, size_t inputSizeY,
+										size_t featureCount, size_t featureSizeX, size_t featureSizeY,
+										size_t padding, size_t stride)
+{
+	if (stride == 0)
+		stride = 1;
+	if (inputSizeX == 0 || inputSizeY == 0 ||
+		padding >= featureSizeX || padding >= featureSizeY ||
+		(inputSizeX - 1) * stride + featureSizeX <= 2 * padding ||
+		(inputSizeY - 1) * stride + featureSizeY <= 2 * padding)
+	{
+		fprintf(stderr, "Padding should be smaller than the feature size");
+		assert(false);
+		return false;
+	}
+
+	m_KernelCount = featureCount;
+	m_InputImageCount = inputFeatureCount;
+
+	m_ConvParams.m_KernelSizeX = featureSizeX;
+	m_ConvParams.m_KernelSizeY = featureSizeY;
+	m_ConvParams.m_KernelStride = stride;
+	m_ConvParams.m_InputPadding = padding;
+	m_ConvParams.m_InputSizeX = (inputSizeX - 1) * stride + featureSizeX - 2 * padding;
+	m_ConvParams.m_InputSizeY = (inputSizeY - 1) * stride + featureSizeY - 2 * padding;
+	m_ConvParams.ComputeConvOutputSize();
+	assert(m_ConvParams.m_OutputSizeX == inputSizeX && m_ConvParams.m_OutputSizeY == inputSizeY);
+
+	m_InputSize = inputFeatureCount * inputSizeX * inputSizeY;
+	m_OutputSize = featureCount * GetOutputSizeX() * GetOutputSizeY();
+	if (!AllocateStorages())
+		return false;
+
+	// Initialize weights to random floats:
+	Initializer();
+	return true;
+}
+
+bool	CLayerConvTranspose2D::AllocateStorages()
+{
+	const size_t	weightsSizeX = m_InputImageCount * m_ConvParams.m_KernelSizeX * m_ConvParams.m_KernelSizeY;
+	const size_t	weightsSizeY = m_KernelCount;
+	bool			success = true;
+
+	success &= m_Weights.AllocMatrix(weightsSizeY, weightsSizeX);
+	success &= m_SlopesWeightAccum.AllocMatrix(weightsSizeY, weightsSizeX);
+	success &= m_DeltaWeightVelocity.AllocMatrix(weightsSizeY, weightsSizeX);
+	success &= m_AdagradWeightAccum.AllocMatrix(weightsSizeY, weightsSizeX);
+	// One bias per feature map:
+	success &= m_Bias.AllocateStorage(m_KernelCount);
+	success &= m_SlopesOutAccum.AllocateStorage(m_KernelCount);
+	success &= m_DeltaBiasVelocity.AllocateStorage(m_KernelCount);
+	success &= m_AdagradBiasAccum.AllocateStorage(m_KernelCount);
+
+	success &= m_NetInput.AllocateStorage(m_OutputSize);
+	success &= m_Output.AllocateStorage(m_OutputSize);
+	success &= m_SlopesOut.AllocateStorage(m_OutputSize);
+	success &= m_Columns.AllocateStorage(m_KernelCount * m_ConvParams.m_OutputSizeX * m_ConvParams.m_OutputSizeY);
+	if (!success)
+		return false;
+
+	memset(m_SlopesWeightAccum.Data(), 0, m_SlopesWeightAccum.StorageByteSize());
+	memset(m_SlopesOutAccum.Data(), 0, m_KernelCount * sizeof(float));
+	for (size_t y = 0; y < m_AdagradWeightAccum.View().m_Rows; ++y)
+	{
+		float	*weightAccum = m_AdagradWeightAccum.View().GetRow(y);
+		for (size_t x = 0; x < m_AdagradWeightAccum.View().m_Columns; ++x)
+		{
+			weightAccum[x] = 1.0f;
+		}
+	}
+	for (size_t x = 0; x < m_KernelCount; ++x)
+	{
+		m_AdagradBiasAccum.Data()[x] = 1.0f;
+	}
+	return true;
+}
+
+void	CLayerConvTranspose2D::FeedForward(const float *input, size_t rangeMin, size_t rangeMax)
+{
+	MICROPROFILE_SCOPEI("CLayerConvTranspose2D", "CLayerConvTranspose2D::FeedForward", MP_GREEN1);
+	const size_t		inputSizeX = m_ConvParams.m_OutputSizeX;
+	const size_t		inputSizeY = m_ConvParams.m_OutputSizeY;
+	const size_t		featureInputStride = inputSizeX * inputSizeY;
+	const size_t		outputSizeX = GetOutputSizeX();
+	const size_t		featureOutputStride = outputSizeX * GetOutputSizeY();
+	const size_t		kernelSizeX = m_ConvParams.m_KernelSizeX;
+	const size_t		kernelStride = kernelSizeX * m_ConvParams.m_KernelSizeY;
+	const size_t		stride = m_ConvParams.m_KernelStride;
+
+	for (size_t featureIdx = rangeMin; featureIdx < rangeMax; ++featureIdx)
+	{
+		const float		*weightsPtr = m_Weights.View().GetRow(featureIdx);
+		float			*netInputPtr = m_NetInput.Data() + featureIdx * featureOutputStride;
+		float			*columnsPtr = m_Columns.Data() + featureIdx * featureInputStride;
+
+		std::fill(netInputPtr, netInputPtr + featureOutputStride, m_Bias.Data()[featureIdx]);
+		for (size_t kernelY = 0; kernelY < m_ConvParams.m_KernelSizeY; ++kernelY)
+		{
+			const SKernelTapRange	rangeY = ComputeKernelTapRange(kernelY, inputSizeY, GetOutputSizeY(), m_ConvParams);
+
+			if (rangeY.m_Min >= rangeY.m_Max)
+				continue;
+			for (size_t kernelX = 0; kernelX < kernelSizeX; ++kernelX)
+			{
+				const SKernelTapRange	rangeX = ComputeKernelTapRange(kernelX, inputSizeX, outputSizeX, m_ConvParams);
+				const size_t		start = rangeY.m_Min * inputSizeX;
+				const size_t		count = (rangeY.m_Max - rangeY.m_Min) * inputSizeX;
+
+				if (rangeX.m_Min >= rangeX.m_Max)
+					continue;
+				// GEMM: weighted sum of the input features for this kernel weight, contiguous over the input pixels:
+				memset(columnsPtr + start, 0, count * sizeof(float));
+				for (size_t inFeatureIdx = 0; inFeatureIdx < m_InputImageCount; ++inFeatureIdx)
+				{
+					const float		weight = weightsPtr[inFeatureIdx * kernelStride + kernelY * kernelSizeX + kernelX];
+
+					KernelAxpy(columnsPtr + start, input + inFeatureIdx * featureInputStride + start, weight, count);
+				}
+				// col2im: scatter to the output pixels reached by this kernel weight:
+				for (size_t inY = rangeY.m_Min; inY < rangeY.m_Max; ++inY)
+				{
+					float			*outputRowPtr = netInputPtr + (inY * stride + rangeY.m_Offset) * outputSizeX + rangeX.m_Offset;
+					const float		*columnsRowPtr = columnsPtr + inY * inputSizeX;
+
+					if (stride == 1)
+					{
+						KernelAxpy(outputRowPtr + rangeX.m_Min, columnsRowPtr + rangeX.m_Min, 1.0f, rangeX.m_Max - rangeX.m_Min);
+						continue;
+					}
+					for (size_t inX = rangeX.m_Min; inX < rangeX.m_Max; ++inX)
+						outputRowPtr[inX * stride] += columnsRowPtr[inX];
+				}
+			}
+		}
+	}
+	Activation(	m_Output.Data() + featureOutputStride * rangeMin,
+				m_NetInput.Data() + featureOutputStride * rangeMin,
+				(rangeMax - rangeMin) * featureOutputStride);
+}
+
+float	CLayerConvTranspose2D::BackPropagateError(const float *prevOutput, const SLossTarget &target, size_t rangeMin, size_t rangeMax)
+{
+	MICROPROFILE_SCOPEI("CLayerConvTranspose2D", "CLayerConvTranspose2D::BackPropagateError", MP_RED1);
+	const size_t	featureStride = GetOutputSizeX() * GetOutputSizeY();
+
+	// Outter layer of the neural network:
+	const float		loss = ComputeLossSlopes(target, featureStride * rangeMin, featureStride * rangeMax);
+
+	if (m_Learn)
+		AccumWeightsAndBiasDerivative(prevOutput, rangeMin, rangeMax);
+	return loss;
+}
+
+void	CLayerConvTranspose2D::BackPropagateError(const float *prevOutput, const CLayer* nextLayer, size_t rangeMin, size_t rangeMax)
+{
+	MICROPROFILE_SCOPEI("CLayerConvTranspose2D", "CLayerConvTranspose2D::BackPropagateError", MP_RED1);
+	const size_t	featureStride = GetOutputSizeX() * GetOutputSizeY();
+
+	// Inner layer of the neural network:
+	ActivationDerivative(	m_SlopesOut.Data() + featureStride * rangeMin,
+							m_NetInput.Data() + featureStride * rangeMin,
+							(rangeMax - rangeMin) * featureStride);
+	if (m_Learn)
+		AccumWeightsAndBiasDerivative(prevOutput, rangeMin, rangeMax);
+}
+
+void	CLayerConvTranspose2D::GatherOutputSlopes(float *dst, size_t featureIdx, size_t kernelX, size_t kernelY) const
+{
+	const size_t		inputSizeX = m_ConvParams.m_OutputSizeX;
+	const size_t		inputSizeY = m_ConvParams.m_OutputSizeY;
+	const size_t		outputSizeX = GetOutputSizeX();
+	const size_t		stride = m_ConvParams.m_KernelStride;
+	const SKernelTapRange	rangeY = ComputeKernelTapRange(kernelY, inputSizeY, GetOutputSizeY(), m_ConvParams);
+	const SKernelTapRange	rangeX = ComputeKernelTapRange(kernelX, inputSizeX, outputSizeX, m_ConvParams);
+	const float			*slopesPtr = m_SlopesOut.Data() + featureIdx * outputSizeX * GetOutputSizeY();
+
+	memset(dst, 0, inputSizeX * inputSizeY * sizeof(float));
+	for (size_t inY = rangeY.m_Min; inY < rangeY.m_Max; ++inY)
+	{
+		const float		*slopesRowPtr = slopesPtr + (inY * stride + rangeY.m_Offset) * outputSizeX + rangeX.m_Offset;
+		float			*dstRowPtr = dst + inY * inputSizeX;
+
+		if (stride == 1)
+		{
+			memcpy(dstRowPtr + rangeX.m_Min, slopesRowPtr + rangeX.m_Min, (rangeX.m_Max - rangeX.m_Min) * sizeof(float));
+			continue;
+		}
+		for (size_t inX = rangeX.m_Min; inX < rangeX.m_Max; ++inX)
+			dstRowPtr[inX] = slopesRowPtr[inX * stride];
+	}
+}
+
+void	CLayerConvTranspose2D::AccumWeightsAndBiasDerivative(const float *input, size_t rangeMin, size_t rangeMax)
+{
+	const size_t		featureInputStride = m_ConvParams.m_OutputSizeX * m_ConvParams.m_OutputSizeY;
+	const size_t		featureOutputStride = GetOutputSizeX() * GetOutputSizeY();
+	const size_t		kernelSizeX = m_ConvParams.m_KernelSizeX;
+	const size_t		kernelStride = kernelSizeX * m_ConvParams.m_KernelSizeY;
+
+	for (size_t featureIdx = rangeMin; featureIdx < rangeMax; ++featureIdx)
+	{
+		float		*accumWeightsPtr = m_SlopesWeightAccum.View().GetRow(featureIdx);
+		float		*columnsPtr = m_Columns.Data() + featureIdx * featureInputStride;
+
+		// The bias derivative of a feature is the sum of all its output slopes:
+		m_SlopesOutAccum.Data()[featureIdx] += KernelSum(m_SlopesOut.Data() + featureIdx * featureOutputStride, featureOutputStride);
+		for (size_t kernelY = 0; kernelY < m_ConvParams.m_KernelSizeY; ++kernelY)
+		{
+			for (size_t kernelX = 0; kernelX < kernelSizeX; ++kernelX)
+			{
+				// Weight derivative: input features dot the output slopes reached by this kernel weight:
+				GatherOutputSlopes(columnsPtr, featureIdx, kernelX, kernelY);
+				for (size_t inFeatureIdx = 0; inFeatureIdx < m_InputImageCount; ++inFeatureIdx)
+				{
+					accumWeightsPtr[inFeatureIdx * kernelStride + kernelY * kernelSizeX + kernelX] +=
+						KernelDot(input + inFeatureIdx * featureInputStride, columnsPtr, featureInputStride);
+				}
+			}
+		}
+	}
+}
+
+void	CLayerConvTranspose2D::UpdateWeightsAndBias(size_t trainingSteps, size_t rangeMin, size_t rangeMax)
+{
+	MICROPROFILE_SCOPEI("CLayerConvTranspose2D", "CLayerConvTranspose2D::UpdateWeightsAndBias", MP_BLUE1);
+	const size_t	outputRange = rangeMax - rangeMin;
+
+	OptimizeWeight(rangeMin, rangeMax, trainingSteps);
+	OptimizeBias(m_Bias.Data(), m_SlopesOutAccum.Data(), rangeMin, rangeMax, trainingSteps);
+
+	memset(m_SlopesWeightAccum.View().GetRow(rangeMin), 0, outputRange * m_SlopesWeightAccum.View().m_RowByteStride);
+	memset(m_SlopesOutAccum.Data() + rangeMin, 0, outputRange * sizeof(float));
+}
+
+void	CLayerConvTranspose2D::GatherSlopes(float *dst, const CLayer *prevLayer, size_t rangeMin, size_t rangeMax) const
+{
+	MICROPROFILE_SCOPEI("CLayerConvTranspose2D", "CLayerConvTranspose2D::GatherSlopes", MP_PALEVIOLETRED1);
+	(void)prevLayer;
+	// Each task owns the input features starting in its range:
+	const size_t		inputSizeX = m_ConvParams.m_OutputSizeX;
+	const size_t		inputSizeY = m_ConvParams.m_OutputSizeY;
+	const size_t		featureInputStride = inputSizeX * inputSizeY;
+	const size_t		featureMin = (rangeMin + featureInputStride - 1) / featureInputStride;
+	const size_t		featureMax = (rangeMax + featureInputStride - 1) / featureInputStride;
+	const size_t		outputSizeX = GetOutputSizeX();
+	const size_t		featureOutputStride = outputSizeX * GetOutputSizeY();
+	const size_t		kernelSizeX = m_ConvParams.m_KernelSizeX;
+	const size_t		kernelStride = kernelSizeX * m_ConvParams.m_KernelSizeY;
+	const size_t		stride = m_ConvParams.m_KernelStride;
+
+	if (featureMin >= featureMax)
+		return;
+	memset(dst + featureMin * featureInputStride, 0, (featureMax - featureMin) * featureInputStride * sizeof(float));
+
+	// This is the forward pass of the transposed convolution. The slopes reached by each kernel weight are read in
+	// place rather than gathered in columns, a task only touches the input features it owns:
+	for (size_t featureIdx = 0; featureIdx < m_KernelCount; ++featureIdx)
+	{
+		const float		*weightsPtr = m_Weights.View().GetRow(featureIdx);
+		const float		*slopesPtr = m_SlopesOut.Data() + featureIdx * featureOutputStride;
+
+		for (size_t kernelY = 0; kernelY < m_ConvParams.m_KernelSizeY; ++kernelY)
+		{
+			const SKernelTapRange	rangeY = ComputeKernelTapRange(kernelY, inputSizeY, GetOutputSizeY(), m_ConvParams);
+
+			if (rangeY.m_Min >= rangeY.m_Max)
+				continue;
+			for (size_t kernelX = 0; kernelX < kernelSizeX; ++kernelX)
+			{
+				const SKernelTapRange	rangeX = ComputeKernelTapRange(kernelX, inputSizeX, outputSizeX, m_ConvParams);
+
+				if (rangeX.m_Min >= rangeX.m_Max)
+					continue;
+				for (size_t inFeatureIdx = featureMin; inFeatureIdx < featureMax; ++inFeatureIdx)
+				{
+					const float		weight = weightsPtr[inFeatureIdx * kernelStride + kernelY * kernelSizeX + kernelX];
+					float			*dstPtr = dst + inFeatureIdx * featureInputStride;
+
+					for (size_t inY = rangeY.m_Min; inY < rangeY.m_Max; ++inY)
+					{
+						const float		*slopesRowPtr = slopesPtr + (inY * stride + rangeY.m_Offset) * outputSizeX + rangeX.m_Offset;
+						float			*dstRowPtr = dstPtr + inY * inputSizeX;
+
+						if (stride == 1)
+						{
+							KernelAxpy(dstRowPtr + rangeX.m_Min, slopesRowPtr + rangeX.m_Min, weight, rangeX.m_Max - rangeX.m_Min);
+							continue;
+						}
+						for (size_t inX = rangeX.m_Min; inX < rangeX.m_Max; ++inX)
+							dstRowPtr[inX] += weight * slopesRowPtr[inX * stride];
+					}
+				}
+			}
+		}
+	}
+}
+
+void	CLayerConvTranspose2D::PrintInfo() const
+{
+	printf("\tLayer Transposed Convolution 2D:\n");
+	printf(	"\t\tInput: %zu %zux%zu\n",
+			m_InputImageCount, m_ConvParams.m_OutputSizeX, m_ConvParams.m_OutputSizeY);
+	printf(	"\t\tFeatures: %zu %zux%zu (stride: %zu, padding: %zu)\n",
+			m_KernelCount, m_ConvParams.m_KernelSizeX, m_ConvParams.m_KernelSizeY,
+			m_ConvParams.m_KernelStride, m_ConvParams.m_InputPadding);
+	printf("\t\tOutput: %zu %zux%zu\n", m_KernelCount, GetOutputSizeX(), GetOutputSizeY());
+	PrintBasicInfo();
+}
+
+void	CLayerConvTranspose2D::Serialize(std::vector<uint8_t> &data) const
+{
+	SerializeLayerType(data, ELayerType::LayerConvTranspose2D);
+	SerializeInOutSize(data);
+	SerializeBasicInfo(data);
+	m_ConvParams.Serialize(data);
+	size_t		prevSize = data.size();
+	data.resize(prevSize + 2 * sizeof(uint32_t));
+	uint32_t	*dataPtr = (uint32_t*)(data.data() + prevSize);
+	dataPtr[0] = m_KernelCount;
+	dataPtr[1] = m_InputImageCount;
+	SerializeWeightsAndBias(data);
+}
+
+bool	CLayerConvTranspose2D::UnSerialize(const std::vector<uint8_t> &data, size_t &curIdx)
+{
+	if (!UnSerializeInOutSize(data, curIdx))
+		return false;
+	if (!UnSerializeBasicInfo(data, curIdx))
+		return false;
+	if (!m_ConvParams.UnSerialize(data, curIdx))
+		return false;
+	if (curIdx + 2 * sizeof(uint32_t) > data.size())
+		return false;
+	uint32_t	*dataPtr = (uint32_t*)(data.data() + curIdx);
+	m_KernelCount = dataPtr[0];
+	m_InputImageCount = dataPtr[1];
+	curIdx += 2 * sizeof(uint32_t);
+	if (!Setup(	m_InputImageCount, m_ConvParams.m_OutputSizeX, m_ConvParams.m_OutputSizeY,
+				m_KernelCount, m_ConvParams.m_KernelSizeX, m_ConvParams.m_KernelSizeY,
+				m_ConvParams.m_InputPadding, m_ConvParams.m_KernelStride))
+		return false;
+	if (!UnSerializeWeightsAndBias(data, curIdx))
+		return false;
+	return m_Bias.Size() == m_KernelCount;
+}
+
+size_t	CLayerConvTranspose2D::GetThreadingHint() const
+{
+	// Multiply-adds of the feed forward:
+	return m_InputSize * m_ConvParams.m_KernelSizeX * m_ConvParams.m_KernelSizeY * m_KernelCount;
+}
+
+size_t	CLayerConvTranspose2D::GetDomainSize() const
+{
+	return m_KernelCount;
+}
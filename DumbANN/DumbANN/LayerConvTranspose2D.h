@@ -0,0 +1,50 @@
+#pragma once
+
+#include "LayerBase.h"
+#include "NeuronKernel.h"
+
+// Transposed convolution (upsampling), each input pixel scatters a weighted kernel to the output.
+// The output size is (inputSize - 1) * stride + featureSize - 2 * padding.
+class	CLayerConvTranspose2D : public CLayer
+{
+public:
+	CLayerConvTranspose2D();
+	~CLayerConvTranspose2D();
+
+	bool	Setup(	size_t inputFeatureCount, size_t inputSizeX, size_t inputSizeY,
+					size_t featureCount, size_t featureSizeX, size_t featureSizeY,
+					size_t padding, size_t stride);
+
+	virtual void	FeedForward(const float *input, size_t rangeMin, size_t rangeMax) override;
+	virtual float	BackPropagateError(const float *prevOutput, const SLossTarget &target, size_t rangeMin, size_t rangeMax) override;
+	virtual void	BackPropagateError(const float* prevOutput, const CLayer *nextLayer, size_t rangeMin, size_t rangeMax) override;
+	virtual void	UpdateWeightsAndBias(size_t trainingSteps, size_t rangeMin, size_t rangeMax) override;
+	virtual void	GatherSlopes(float *dst, const CLayer *prevLayer, size_t rangeMin, size_t rangeMax) const override;
+	virtual void	PrintInfo() const override;
+	virtual void	Serialize(std::vector<uint8_t> &data) const override;
+	virtual bool	UnSerialize(const std::vector<uint8_t> &data, size_t &curIdx) override;
+
+	virtual size_t	GetThreadingHint() const override;
+	virtual size_t	GetDomainSize() const override;
+	virtual ELayerType	GetLayerType() const override { return ELayerType::LayerConvTranspose2D; }
+
+	size_t			GetFeatureCount() const { return m_KernelCount; }
+	size_t			GetFeatureSizeX() const { return m_ConvParams.m_KernelSizeX; }
+	size_t			GetFeatureSizeY() const { return m_ConvParams.m_KernelSizeY; }
+	size_t			GetOutputSizeX() const { return m_ConvParams.m_InputSizeX; }
+	size_t			GetOutputSizeY() const { return m_ConvParams.m_InputSizeY; }
+
+private:
+	bool			AllocateStorages();
+	// im2col row of the output slopes of a feature for the kernel weight (kernelX, kernelY), zero where no output is reached:
+	void			GatherOutputSlopes(float *dst, size_t featureIdx, size_t kernelX, size_t kernelY) const;
+	void			AccumWeightsAndBiasDerivative(const float *input, size_t rangeMin, size_t rangeMax);
+
+	// Parameters of the convolution this layer transposes, its input is the output of this layer:
+	SConvolutionParams	m_ConvParams;
+	size_t				m_KernelCount;
+	size_t				m_InputImageCount;
+	// im2col columns of the forward pass and of the weight derivative, one input feature sized plane per feature
+	// so the tasks do not share it:
+	CNeuronVector		m_Columns;
+};
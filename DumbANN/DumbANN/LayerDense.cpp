@@ -1,8 +1,11 @@
 
 #include "LayerDense.h"
 #include <assert.h>
+#include <math.h>
+#include <algorithm>
 
 CLayerDense::CLayerDense()
+:	m_LearnBias(true)
 {
 }
 
@@ -14,6 +17,7 @@ bool	CLayerDense::Setup(size_t inputSize, size_t outputSize)
 {
 	m_InputSize = inputSize;
 	m_OutputSize = outputSize;
+	m_SparseWeights.Clear();
 	m_Weights.AllocMatrix(outputSize, inputSize);
 	m_SlopesWeightAccum.AllocMatrix(outputSize, inputSize);
 	m_SlopesOutAccum.AllocateStorage(outputSize);
@@ -50,6 +54,242 @@ bool	CLayerDense::Setup(size_t inputSize, size_t outputSize)
 	return true;
 }
 
+static std::vector<size_t>	_KeptIndices(const std::vector<bool> &keep)
+{
+	std::vector<size_t>	indices;
+
+	for (size_t idx = 0; idx < keep.size(); ++idx)
+	{
+		if (keep[idx])
+			indices.push_back(idx);
+	}
+	return indices;
+}
+
+bool	CLayerDense::RemoveOutputs(const std::vector<bool> &keep)
+{
+	assert(keep.size() == m_OutputSize);
+	std::vector<size_t>	inputs(m_InputSize);
+
+	for (size_t inIdx = 0; inIdx < m_InputSize; ++inIdx)
+		inputs[inIdx] = inIdx;
+	return Compact(_KeptIndices(keep), inputs);
+}
+
+bool	CLayerDense::RemoveInputs(const std::vector<bool> &keep, const float *removedInputValues)
+{
+	assert(keep.size() == m_InputSize);
+	std::vector<size_t>	outputs(m_OutputSize);
+
+	for (size_t outIdx = 0; outIdx < m_OutputSize; ++outIdx)
+	{
+		const float		*weightsPtr = m_Weights.View().GetRow(outIdx);
+
+		for (size_t inIdx = 0; inIdx < m_InputSize; ++inIdx)
+		{
+			if (!keep[inIdx])
+				m_Bias.Data()[outIdx] += weightsPtr[inIdx] * removedInputValues[inIdx];
+		}
+		outputs[outIdx] = outIdx;
+	}
+	return Compact(outputs, _KeptIndices(keep));
+}
+
+bool	CLayerDense::Compact(const std::vector<size_t> &outputs, const std::vector<size_t> &inputs)
+{
+	// Setup reallocates every storage, the kept weights are copied aside:
+	std::vector<float>	weights(outputs.size() * inputs.size());
+	std::vector<float>	bias(outputs.size());
+	const bool			blockSparse = UsesBlockSparseWeights();
+
+	for (size_t outIdx = 0; outIdx < outputs.size(); ++outIdx)
+	{
+		const float		*weightsPtr = m_Weights.View().GetRow(outputs[outIdx]);
+
+		for (size_t inIdx = 0; inIdx < inputs.size(); ++inIdx)
+			weights[outIdx * inputs.size() + inIdx] = weightsPtr[inputs[inIdx]];
+		bias[outIdx] = m_Bias.Data()[outputs[outIdx]];
+	}
+	if (!Setup(inputs.size(), outputs.size()))
+		return false;
+	for (size_t outIdx = 0; outIdx < outputs.size(); ++outIdx)
+		memcpy(m_Weights.View().GetRow(outIdx), weights.data() + outIdx * inputs.size(), inputs.size() * sizeof(float));
+	memcpy(m_Bias.Data(), bias.data(), bias.size() * sizeof(float));
+	// The pruned blocks are still zero:
+	if (blockSparse)
+		return m_SparseWeights.Build(m_Weights.View());
+	return true;
+}
+
+bool	CLayerDense::ComputeLowRankFactors(SLowRankFactors &factors) const
+{
+	MICROPROFILE_SCOPEI("CLayerDense", "CLayerDense::ComputeLowRankFactors", MP_GREEN1);
+	// One sided Jacobi: the columns of A are orthogonalized by plane rotations, A * V = B with B = U * diag(singular).
+	// A is the weights or their transpose, the one with the fewest columns:
+	const bool			transpose = m_InputSize > m_OutputSize;
+	const size_t		rows = transpose ? m_InputSize : m_OutputSize;
+	const size_t		columns = transpose ? m_OutputSize : m_InputSize;
+	std::vector<double>	colsB(rows * columns);
+	std::vector<double>	colsV(columns * columns, 0.0);
+
+	for (size_t y = 0; y < m_OutputSize; ++y)
+	{
+		const float		*weightsPtr = m_Weights.View().GetRow(y);
+
+		for (size_t x = 0; x < m_InputSize; ++x)
+		{
+			if (transpose)
+				colsB[y * rows + x] = weightsPtr[x];
+			else
+				colsB[x * rows + y] = weightsPtr[x];
+		}
+	}
+	for (size_t col = 0; col < columns; ++col)
+		colsV[col * columns + col] = 1.0;
+
+	const size_t	kMaxSweepCount = 60;
+	const double	epsilon = 1.0e-12;
+	bool			converged = false;
+
+	for (size_t sweep = 0; sweep < kMaxSweepCount && !converged; ++sweep)
+	{
+		converged = true;
+		for (size_t p = 0; p + 1 < columns; ++p)
+		{
+			for (size_t q = p + 1; q < columns; ++q)
+			{
+				double	*bp = colsB.data() + p * rows;
+				double	*bq = colsB.data() + q * rows;
+				double	alpha = 0.0;
+				double	beta = 0.0;
+				double	gamma = 0.0;
+
+				for (size_t i = 0; i < rows; ++i)
+				{
+					alpha += bp[i] * bp[i];
+					beta += bq[i] * bq[i];
+					gamma += bp[i] * bq[i];
+				}
+				if (fabs(gamma) <= epsilon * sqrt(alpha * beta))
+					continue;
+				converged = false;
+				const double	zeta = (beta - alpha) / (2.0 * gamma);
+				const double	t = (zeta >= 0.0 ? 1.0 : -1.0) / (fabs(zeta) + sqrt(1.0 + zeta * zeta));
+				const double	c = 1.0 / sqrt(1.0 + t * t);
+				const double	s = c * t;
+
+				for (size_t i = 0; i < rows; ++i)
+				{
+					const double	valueP = bp[i];
+					bp[i] = c * valueP - s * bq[i];
+					bq[i] = s * valueP + c * bq[i];
+				}
+				double	*vp = colsV.data() + p * columns;
+				double	*vq = colsV.data() + q * columns;
+
+				for (size_t i = 0; i < columns; ++i)
+				{
+					const double	valueP = vp[i];
+					vp[i] = c * valueP - s * vq[i];
+					vq[i] = s * valueP + c * vq[i];
+				}
+			}
+		}
+	}
+
+	std::vector<double>	singular(columns);
+	std::vector<size_t>	order(columns);
+
+	for (size_t col = 0; col < columns; ++col)
+	{
+		double	norm = 0.0;
+
+		for (size_t i = 0; i < rows; ++i)
+			norm += colsB[col * rows + i] * colsB[col * rows + i];
+		singular[col] = sqrt(norm);
+		order[col] = col;
+	}
+	std::sort(order.begin(), order.end(), [&singular](size_t a, size_t b) { return singular[a] > singular[b]; });
+
+	// Weights = U * diag(singular) * V^T, or V * diag(singular) * U^T for the transpose:
+	factors.m_Singular.resize(columns);
+	factors.m_Left.assign(m_OutputSize * columns, 0.0f);
+	factors.m_Right.assign(columns * m_InputSize, 0.0f);
+	for (size_t k = 0; k < columns; ++k)
+	{
+		const size_t	col = order[k];
+		const double	invSingular = singular[col] > 0.0 ? 1.0 / singular[col] : 0.0;
+		const double	*u = colsB.data() + col * rows;
+		const double	*v = colsV.data() + col * columns;
+
+		factors.m_Singular[k] = static_cast<float>(singular[col]);
+		for (size_t y = 0; y < m_OutputSize; ++y)
+			factors.m_Left[y * columns + k] = static_cast<float>(transpose ? v[y] : u[y] * invSingular);
+		for (size_t x = 0; x < m_InputSize; ++x)
+			factors.m_Right[k * m_InputSize + x] = static_cast<float>(transpose ? u[x] * invSingular : v[x]);
+	}
+	return converged;
+}
+
+bool	CLayerDense::SetupLowRank(const SLowRankFactors &factors, size_t rank, CLayerDense &first, CLayerDense &second) const
+{
+	assert(rank > 0 && rank <= factors.Rank());
+	if (!first.Setup(m_InputSize, rank) || !second.Setup(rank, m_OutputSize))
+		return false;
+
+	// The singular values are split evenly between the two layers:
+	for (size_t k = 0; k < rank; ++k)
+	{
+		const float		scale = sqrtf(factors.m_Singular[k]);
+		float			*weightsPtr = first.m_Weights.View().GetRow(k);
+
+		for (size_t x = 0; x < m_InputSize; ++x)
+			weightsPtr[x] = factors.m_Right[k * m_InputSize + x] * scale;
+		first.m_Bias.Data()[k] = 0.0f;
+	}
+	for (size_t y = 0; y < m_OutputSize; ++y)
+	{
+		float	*weightsPtr = second.m_Weights.View().GetRow(y);
+
+		for (size_t k = 0; k < rank; ++k)
+			weightsPtr[k] = factors.m_Left[y * factors.Rank() + k] * sqrtf(factors.m_Singular[k]);
+	}
+	memcpy(second.m_Bias.Data(), m_Bias.Data(), m_OutputSize * sizeof(float));
+
+	for (CLayerDense *layer : { &first, &second })
+	{
+		layer->m_Optimization = m_Optimization;
+		layer->m_Initializer = m_Initializer;
+		layer->m_Regularizer = m_Regularizer;
+		layer->m_RegularizerRatio = m_RegularizerRatio;
+		layer->m_LearningRate = m_LearningRate;
+		layer->m_Inertia = m_Inertia;
+		layer->m_Learn = m_Learn;
+	}
+	first.m_Activation = EActivation::Linear;
+	first.m_LearnBias = false;
+	second.m_Activation = m_Activation;
+	second.m_LearnBias = m_LearnBias;
+	return true;
+}
+
+bool	CLayerDense::FoldOutputScale(const float *scale, const float *shift, size_t featureCount)
+{
+	if (featureCount != m_OutputSize || IsQuantized() || UsesHalfWeights())
+		return false;
+	for (size_t outIdx = 0; outIdx < m_OutputSize; ++outIdx)
+	{
+		float	*weightsPtr = m_Weights.View().GetRow(outIdx);
+
+		for (size_t inIdx = 0; inIdx < m_InputSize; ++inIdx)
+			weightsPtr[inIdx] *= scale[outIdx];
+		m_Bias.Data()[outIdx] = m_Bias.Data()[outIdx] * scale[outIdx] + shift[outIdx];
+	}
+	if (UsesBlockSparseWeights())
+		m_SparseWeights.UpdateValues(m_Weights.View(), 0, m_OutputSize);
+	return true;
+}
+
 void	CLayerDense::FeedForward(const float *input, size_t rangeMin, size_t rangeMax)
 {
 	MICROPROFILE_SCOPEI("CLayerDense", "CLayerDense::FeedForward", MP_GREEN1);
@@ -63,38 +303,33 @@ void	CLayerDense::FeedForward(const float *input, size_t rangeMin, size_t rangeM
 	SConstNeuronMatrixView	weightMat(weightsPtr, outputRange, m_InputSize, m_Weights.View().m_RowByteStride);
 
 	// MatrixMAdd computes net input:
-	CNeuronMatrix::ComputeNetInput(netInputPtr, input, weightMat, biasesPtr);
+	if (IsQuantized())
+		CQuantizedMatrix::ComputeNetInput(netInputPtr, m_QuantizedInput.data(), m_InputScale, m_QuantizedWeights, rangeMin, rangeMax, biasesPtr);
+	else if (UsesHalfWeights())
+		CHalfMatrix::ComputeNetInput(netInputPtr, input, m_HalfWeights, rangeMin, rangeMax, biasesPtr);
+	else if (UsesBlockSparseWeights())
+		CBlockSparseMatrix::ComputeNetInput(netInputPtr, input, m_SparseWeights, rangeMin, rangeMax, biasesPtr);
+	else if (UseSparseInput())
+		CNeuronMatrix::ComputeNetInputSparse(netInputPtr, input, *m_InputNonZero, weightMat, biasesPtr);
+	else
+		CNeuronMatrix::ComputeNetInput(netInputPtr, input, weightMat, biasesPtr);
 	Activation(outputPtr, netInputPtr, outputRange);
+	PackNetInput(rangeMin, rangeMax);
 }
 
-void	CLayerDense::BackPropagateError(const float *prevOutput, const std::vector<float> &error, size_t rangeMin, size_t rangeMax)
+float	CLayerDense::BackPropagateError(const float *prevOutput, const SLossTarget &target, size_t rangeMin, size_t rangeMax)
 {
 	MICROPROFILE_SCOPEI("CLayerDense", "CLayerDense::BackPropagateError", MP_RED1);
 	assert(rangeMin >= 0 && rangeMin < m_Output.Size() && rangeMin < rangeMax);
 	assert(rangeMax >= 0 && rangeMax <= m_Output.Size());
-	const size_t	outputRange = rangeMax - rangeMin;
-	float			*slopePtr = m_SlopesOut.Data();
-	float			*netInputPtr = m_NetInput.Data();
-	const float		*errorPtr = error.data();
 
 	// Outter layer of the neural network:
-	// Cost derivative:
-	for (size_t outIdx = rangeMin; outIdx < rangeMax; ++outIdx)
-		slopePtr[outIdx] = -errorPtr[outIdx];
-	// Activation derivative:
-	ActivationDerivative(slopePtr + rangeMin, netInputPtr + rangeMin, outputRange);
+	// Cost and activation derivative:
+	UnpackNetInput(rangeMin, rangeMax);
+	const float		loss = ComputeLossSlopes(target, rangeMin, rangeMax);
 	if (m_Learn)
-	{
-		// We compute the delta for the weights and bias (for the bias its just the output slope):
-		float		*slopeAccumPtr = m_SlopesOutAccum.Data();
-		for (size_t outIdx = rangeMin; outIdx < rangeMax; ++outIdx)
-		{
-			float		*slopeWeightAccumPtr = m_SlopesWeightAccum.View().GetRow(outIdx);
-			slopeAccumPtr[outIdx] += slopePtr[outIdx];
-			for (size_t inIdx = 0; inIdx < m_InputSize; ++inIdx)
-				slopeWeightAccumPtr[inIdx] += slopePtr[outIdx] * prevOutput[inIdx];
-		}
-	}
+		AccumWeightsAndBiasDerivative(prevOutput, rangeMin, rangeMax);
+	return loss;
 }
 
 void	CLayerDense::BackPropagateError(const float *prevOutput, const CLayer *nextLayer, size_t rangeMin, size_t rangeMax)
@@ -107,19 +342,10 @@ void	CLayerDense::BackPropagateError(const float *prevOutput, const CLayer *next
 	float					*netInputPtr = m_NetInput.Data();
 
 	// Inner layer of the neural network:
+	UnpackNetInput(rangeMin, rangeMax);
 	ActivationDerivative(slopePtr + rangeMin, netInputPtr + rangeMin, outputRange);
 	if (m_Learn)
-	{
-		// We compute the delta for the weights and bias (for the bias its just the output slope):
-		float	*slopeAccumPtr = m_SlopesOutAccum.Data();
-		for (size_t outIdx = rangeMin; outIdx < rangeMax; ++outIdx)
-		{
-			float* slopeWeightAccumPtr = m_SlopesWeightAccum.View().GetRow(outIdx);
-			slopeAccumPtr[outIdx] += slopePtr[outIdx];
-			for (size_t inIdx = 0; inIdx < m_InputSize; ++inIdx)
-				slopeWeightAccumPtr[inIdx] += slopePtr[outIdx] * prevOutput[inIdx];
-		}
-	}
+		AccumWeightsAndBiasDerivative(prevOutput, rangeMin, rangeMax);
 }
 
 void	CLayerDense::UpdateWeightsAndBias(size_t trainingSteps, size_t rangeMin, size_t rangeMax)
@@ -132,7 +358,10 @@ void	CLayerDense::UpdateWeightsAndBias(size_t trainingSteps, size_t rangeMin, si
 	float				*biasesPtr = m_Bias.Data();
 
 	OptimizeWeight(rangeMin, rangeMax, trainingSteps);
-	OptimizeBias(biasesPtr, slopeAccumPtr, rangeMin, rangeMax, trainingSteps);
+	if (m_LearnBias)
+		OptimizeBias(biasesPtr, slopeAccumPtr, rangeMin, rangeMax, trainingSteps);
+	if (UsesBlockSparseWeights())
+		m_SparseWeights.UpdateValues(m_Weights.View(), rangeMin, rangeMax);
 	memset(m_SlopesWeightAccum.View().GetRow(rangeMin), 0, outputRange * m_SlopesWeightAccum.View().m_RowByteStride);
 	memset(m_SlopesOutAccum.Data() + rangeMin, 0, outputRange * sizeof(float));
 }
@@ -140,11 +369,78 @@ void	CLayerDense::UpdateWeightsAndBias(size_t trainingSteps, size_t rangeMin, si
 void	CLayerDense::GatherSlopes(float *dst, const CLayer *prevLayer, size_t rangeMin, size_t rangeMax) const
 {
 	MICROPROFILE_SCOPEI("CLayerDense", "CLayerDense::GatherSlopes", MP_PALEVIOLETRED1);
-	(void)prevLayer;
-	SConstNeuronMatrixView	weightMat(m_Weights.View());
-	weightMat.m_Data += rangeMin;
-	weightMat.m_Columns = rangeMax - rangeMin;
-	CNeuronMatrix::ComputeError(dst + rangeMin, m_SlopesOut.Data(), weightMat);
+	if (UsesBlockSparseWeights())
+	{
+		CBlockSparseMatrix::ComputeError(dst, m_SlopesOut.Data(), m_SparseWeights, rangeMin, rangeMax);
+		if (m_InputNonZero == nullptr)
+			return;
+		// Inputs outside the list (dropped or dead units) get no slope, listed inputs keep theirs even when null:
+		const size_t	blockMin = rangeMin / SNonZeroList::kBlockSize;
+		const size_t	blockMax = (rangeMax + SNonZeroList::kBlockSize - 1) / SNonZeroList::kBlockSize;
+
+		for (size_t blockIdx = blockMin; blockIdx < blockMax; ++blockIdx)
+		{
+			const size_t	stop = std::min(m_InputNonZero->BlockStop(blockIdx), rangeMax);
+			const uint32_t	*indices = m_InputNonZero->BlockIndices(blockIdx);
+			const uint32_t	*indicesEnd = indices + m_InputNonZero->NonZeroCount(blockIdx);
+			size_t			inIdx = std::max(m_InputNonZero->BlockStart(blockIdx), rangeMin);
+
+			for (const uint32_t *listed = std::lower_bound(indices, indicesEnd, (uint32_t)inIdx); listed != indicesEnd && *listed < stop; ++listed)
+			{
+				for (; inIdx < *listed; ++inIdx)
+					dst[inIdx] = 0.0f;
+				inIdx = *listed + 1;
+			}
+			for (; inIdx < stop; ++inIdx)
+				dst[inIdx] = 0.0f;
+		}
+		return;
+	}
+	if (!UseSparseInput())
+	{
+		SConstNeuronMatrixView	weightMat(m_Weights.View());
+		weightMat.m_Data += rangeMin;
+		weightMat.m_Columns = rangeMax - rangeMin;
+		CNeuronMatrix::ComputeError(dst + rangeMin, m_SlopesOut.Data(), weightMat);
+		return;
+	}
+	// Inputs outside the list (dropped or dead units) get no slope:
+	const size_t	blockMin = rangeMin / SNonZeroList::kBlockSize;
+	const size_t	blockMax = (rangeMax + SNonZeroList::kBlockSize - 1) / SNonZeroList::kBlockSize;
+	const float		*slopePtr = m_SlopesOut.Data();
+
+	for (size_t blockIdx = blockMin; blockIdx < blockMax; ++blockIdx)
+	{
+		const size_t	start = std::max(m_InputNonZero->BlockStart(blockIdx), rangeMin);
+		const size_t	stop = std::min(m_InputNonZero->BlockStop(blockIdx), rangeMax);
+
+		if (!m_InputNonZero->IsBlockSparse(blockIdx))
+		{
+			SConstNeuronMatrixView	weightMat(m_Weights.View());
+			weightMat.m_Data += start;
+			weightMat.m_Columns = stop - start;
+			CNeuronMatrix::ComputeError(dst + start, slopePtr, weightMat);
+			continue;
+		}
+		// The indices are sorted, the ones of the range are contiguous:
+		const uint32_t	*indices = m_InputNonZero->BlockIndices(blockIdx);
+		const uint32_t	*indicesEnd = indices + m_InputNonZero->NonZeroCount(blockIdx);
+		const uint32_t	*first = std::lower_bound(indices, indicesEnd, (uint32_t)start);
+		const uint32_t	*last = std::lower_bound(first, indicesEnd, (uint32_t)stop);
+
+		memset(dst + start, 0, (stop - start) * sizeof(float));
+		// Each row of weights is read once and scattered to the listed inputs:
+		for (size_t outIdx = 0; outIdx < m_OutputSize; ++outIdx)
+		{
+			const float		slope = slopePtr[outIdx];
+			const float		*weightsPtr = m_Weights.View().GetRow(outIdx);
+
+			if (slope == 0.0f)
+				continue;
+			for (const uint32_t *inIdx = first; inIdx != last; ++inIdx)
+				dst[*inIdx] += slope * weightsPtr[*inIdx];
+		}
+	}
 }
 
 void	CLayerDense::PrintInfo() const
@@ -176,8 +472,72 @@ bool	CLayerDense::UnSerialize(const std::vector<uint8_t> &data, size_t &curIdx)
 	return true;
 }
 
+void	CLayerDense::AccumWeightsAndBiasDerivative(const float *prevOutput, size_t rangeMin, size_t rangeMax)
+{
+	// We compute the delta for the weights and bias (for the bias its just the output slope):
+	const float		*slopePtr = m_SlopesOut.Data();
+	float			*slopeAccumPtr = m_SlopesOutAccum.Data();
+
+	if (UsesBlockSparseWeights())
+	{
+		// Masked by the kept blocks, the pruned weights get no slope:
+		if (m_LearnBias)
+		{
+			for (size_t outIdx = rangeMin; outIdx < rangeMax; ++outIdx)
+				slopeAccumPtr[outIdx] += slopePtr[outIdx];
+		}
+		CBlockSparseMatrix::AccumOuterProduct(m_SlopesWeightAccum.View(), slopePtr, prevOutput, m_SparseWeights, rangeMin, rangeMax);
+		return;
+	}
+	const bool		sparseInput = UseSparseInput();
+
+	for (size_t outIdx = rangeMin; outIdx < rangeMax; ++outIdx)
+	{
+		const float		slope = slopePtr[outIdx];
+		float			*slopeWeightAccumPtr = m_SlopesWeightAccum.View().GetRow(outIdx);
+
+		if (m_LearnBias)
+			slopeAccumPtr[outIdx] += slope;
+		// Dead units have a null slope and leave their row untouched:
+		if (slope == 0.0f)
+			continue;
+		if (!sparseInput)
+		{
+			for (size_t inIdx = 0; inIdx < m_InputSize; ++inIdx)
+				slopeWeightAccumPtr[inIdx] += slope * prevOutput[inIdx];
+			continue;
+		}
+		// Only the non zero inputs contribute:
+		for (size_t blockIdx = 0; blockIdx < m_InputNonZero->BlockCount(); ++blockIdx)
+		{
+			if (m_InputNonZero->IsBlockSparse(blockIdx))
+			{
+				const uint32_t	*indices = m_InputNonZero->BlockIndices(blockIdx);
+				const uint32_t	count = m_InputNonZero->NonZeroCount(blockIdx);
+
+				for (uint32_t i = 0; i < count; ++i)
+					slopeWeightAccumPtr[indices[i]] += slope * prevOutput[indices[i]];
+			}
+			else
+			{
+				const size_t	stop = m_InputNonZero->BlockStop(blockIdx);
+
+				for (size_t inIdx = m_InputNonZero->BlockStart(blockIdx); inIdx < stop; ++inIdx)
+					slopeWeightAccumPtr[inIdx] += slope * prevOutput[inIdx];
+			}
+		}
+	}
+}
+
+bool	CLayerDense::UseSparseInput() const
+{
+	return m_InputNonZero != nullptr && m_InputNonZero->TotalNonZeroCount() * 2 < m_InputSize;
+}
+
 size_t	CLayerDense::GetThreadingHint() const
 {
+	if (UsesBlockSparseWeights())
+		return m_SparseWeights.BlockCount() * CBlockSparseMatrix::kBlockSize;
 	return m_Weights.View().m_Columns * m_Weights.View().m_Rows;
 }
 
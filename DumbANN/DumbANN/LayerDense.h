@@ -2,6 +2,19 @@
 
 #include "LayerBase.h"
 
+// Singular value decomposition of dense weights, weights = left * diag(singular) * right.
+// The singular values are sorted in decreasing order:
+struct	SLowRankFactors
+{
+	size_t				Rank() const { return m_Singular.size(); }
+
+	std::vector<float>	m_Singular;
+	// Outputs x rank:
+	std::vector<float>	m_Left;
+	// Rank x inputs:
+	std::vector<float>	m_Right;
+};
+
 class	CLayerDense : public CLayer
 {
 public:
@@ -10,8 +23,27 @@ public:
 
 	bool	Setup(size_t inputSize, size_t outputSize);
 
+	// Structural pruning, keeps the outputs (or inputs) flagged in keep and resets the optimizer state.
+	// The removed inputs are replaced by constant values folded in the bias:
+	bool	RemoveOutputs(const std::vector<bool> &keep);
+	bool	RemoveInputs(const std::vector<bool> &keep, const float *removedInputValues);
+
+	// Low rank factorization: first (input -> rank, linear without bias) followed by second (rank -> output, with the
+	// activation and bias of this layer) compute the truncated decomposition of this layer. The bias of first stays null,
+	// it does not learn it:
+	bool	ComputeLowRankFactors(SLowRankFactors &factors) const;
+	bool	SetupLowRank(const SLowRankFactors &factors, size_t rank, CLayerDense &first, CLayerDense &second) const;
+	// Largest rank for which the two layers have less weights than this one:
+	size_t	MaxUsefulRank() const { return (m_InputSize * m_OutputSize - 1) / (m_InputSize + m_OutputSize); }
+
+	void	SetLearnBias(bool learnBias) { m_LearnBias = learnBias; }
+	bool	LearnBias() const { return m_LearnBias; }
+
+	// Batch normalization folding, one feature per output:
+	virtual bool	FoldOutputScale(const float *scale, const float *shift, size_t featureCount) override;
+
 	virtual void	FeedForward(const float *input, size_t rangeMin, size_t rangeMax) override;
-	virtual void	BackPropagateError(const float *prevOutput, const std::vector<float> &error, size_t rangeMin, size_t rangeMax) override;
+	virtual float	BackPropagateError(const float *prevOutput, const SLossTarget &target, size_t rangeMin, size_t rangeMax) override;
 	virtual void	BackPropagateError(const float *prevOutput, const CLayer *nextLayer, size_t rangeMin, size_t rangeMax) override;
 	virtual void	UpdateWeightsAndBias(size_t trainingSteps, size_t rangeMin, size_t rangeMax) override;
 	virtual void	GatherSlopes(float *dst, const CLayer *prevLayer, size_t rangeMin, size_t rangeMax) const override;
@@ -19,6 +51,22 @@ public:
 	virtual void	Serialize(std::vector<uint8_t> &data) const override;
 	virtual bool	UnSerialize(const std::vector<uint8_t> &data, size_t &curIdx) override;
 
+	virtual bool	SkipsZeroInputs() const override { return true; }
+	virtual bool	CanQuantize() const override { return true; }
+	virtual bool	CanUseBlockSparseWeights() const override { return true; }
+	virtual bool	CanUseHalfWeights() const override { return true; }
+	virtual bool	CanUseMixedPrecision() const override { return true; }
+
 	virtual size_t	GetThreadingHint() const override;
 	virtual size_t	GetDomainSize() const override;
+	virtual ELayerType	GetLayerType() const override { return ELayerType::LayerDense; }
+
+private:
+	// Over half density, the dense kernels are cheaper than the list of non zero inputs:
+	bool	UseSparseInput() const;
+	void	AccumWeightsAndBiasDerivative(const float *prevOutput, size_t rangeMin, size_t rangeMax);
+	bool	Compact(const std::vector<size_t> &outputs, const std::vector<size_t> &inputs);
+
+	// False when the bias is kept as it is, its slopes are not accumulated:
+	bool	m_LearnBias;
 };
@@ -0,0 +1,330 @@
+
+#include "LayerDepthwiseConv2D.h"
+#include <assert.h>
+
+CLayerDepthwiseConv2D::CLayerDepthwiseConv2D()
+:	m_FeatureCount(0)
+{
+}
+
+CLayerDepthwiseConv2D::~CLayerDepthwiseConv2D()
+{
+}
+
+bool	CLayerDepthwiseConv2D::Setup(	size_t featureCount, size_t inputSizeX, size_t inputSizeY,
+										size_t featureSizeX, size_t featureSizeY,
+										size_t padding, size_t stride)
+{
+	if (stride == 0)
+		stride = 1;
+	if (inputSizeX % stride != 0 ||
+		inputSizeY % stride != 0)
+	{
+		fprintf(stderr, "Input size should be a multiple of stride");
+		assert(false);
+		return false;
+	}
+
+	m_FeatureCount = featureCount;
+
+	m_ConvParams.m_KernelSizeX = featureSizeX;
+	m_ConvParams.m_KernelSizeY = featureSizeY;
+	m_ConvParams.m_KernelStride = stride;
+	m_ConvParams.m_InputPadding = padding;
+	m_ConvParams.m_InputSizeX = inputSizeX;
+	m_ConvParams.m_InputSizeY = inputSizeY;
+	m_ConvParams.ComputeConvOutputSize();
+	assert(GetOutputSizeX() != 0 && GetOutputSizeY() != 0);
+
+	m_InputSize = featureCount * inputSizeX * inputSizeY;
+	m_OutputSize = featureCount * GetOutputSizeX() * GetOutputSizeY();
+	if (!AllocateStorages())
+		return false;
+
+	// Initialize weights to random floats:
+	Initializer();
+	return true;
+}
+
+bool	CLayerDepthwiseConv2D::AllocateStorages()
+{
+	// One kernel per feature:
+	const size_t	weightsSizeX = m_ConvParams.m_KernelSizeX * m_ConvParams.m_KernelSizeY;
+	const size_t	weightsSizeY = m_FeatureCount;
+	bool			success = true;
+
+	success &= m_Weights.AllocMatrix(weightsSizeY, weightsSizeX);
+	success &= m_SlopesWeightAccum.AllocMatrix(weightsSizeY, weightsSizeX);
+	success &= m_DeltaWeightVelocity.AllocMatrix(weightsSizeY, weightsSizeX);
+	success &= m_AdagradWeightAccum.AllocMatrix(weightsSizeY, weightsSizeX);
+	// One bias per feature map:
+	success &= m_Bias.AllocateStorage(m_FeatureCount);
+	success &= m_SlopesOutAccum.AllocateStorage(m_FeatureCount);
+	success &= m_DeltaBiasVelocity.AllocateStorage(m_FeatureCount);
+	success &= m_AdagradBiasAccum.AllocateStorage(m_FeatureCount);
+
+	success &= m_NetInput.AllocateStorage(m_OutputSize);
+	success &= m_Output.AllocateStorage(m_OutputSize);
+	success &= m_SlopesOut.AllocateStorage(m_OutputSize);
+	if (!success)
+		return false;
+
+	memset(m_SlopesWeightAccum.Data(), 0, m_SlopesWeightAccum.StorageByteSize());
+	memset(m_SlopesOutAccum.Data(), 0, m_FeatureCount * sizeof(float));
+	for (size_t y = 0; y < m_AdagradWeightAccum.View().m_Rows; ++y)
+	{
+		float	*weightAccum = m_AdagradWeightAccum.View().GetRow(y);
+		for (size_t x = 0; x < m_AdagradWeightAccum.View().m_Columns; ++x)
+		{
+			weightAccum[x] = 1.0f;
+		}
+	}
+	for (size_t x = 0; x < m_FeatureCount; ++x)
+	{
+		m_AdagradBiasAccum.Data()[x] = 1.0f;
+	}
+	return true;
+}
+
+void	CLayerDepthwiseConv2D::FeedForward(const float *input, size_t rangeMin, size_t rangeMax)
+{
+	MICROPROFILE_SCOPEI("CLayerDepthwiseConv2D", "CLayerDepthwiseConv2D::FeedForward", MP_GREEN1);
+	const size_t	inputSizeX = m_ConvParams.m_InputSizeX;
+	const size_t	featureInputStride = inputSizeX * m_ConvParams.m_InputSizeY;
+	const size_t	outputSizeX = GetOutputSizeX();
+	const size_t	featureOutputStride = outputSizeX * GetOutputSizeY();
+	const size_t	kernelSizeX = m_ConvParams.m_KernelSizeX;
+	const size_t	stride = m_ConvParams.m_KernelStride;
+
+	for (size_t featureIdx = rangeMin; featureIdx < rangeMax; ++featureIdx)
+	{
+		const float		*weightsPtr = m_Weights.View().GetRow(featureIdx);
+		const float		*inputPtr = input + featureIdx * featureInputStride;
+		float			*netInputPtr = m_NetInput.Data() + featureIdx * featureOutputStride;
+
+		std::fill(netInputPtr, netInputPtr + featureOutputStride, m_Bias.Data()[featureIdx]);
+		for (size_t kernelY = 0; kernelY < m_ConvParams.m_KernelSizeY; ++kernelY)
+		{
+			const SKernelTapRange	rangeY = ComputeKernelTapRange(kernelY, GetOutputSizeY(), m_ConvParams.m_InputSizeY, m_ConvParams);
+
+			for (size_t kernelX = 0; kernelX < kernelSizeX; ++kernelX)
+			{
+				const SKernelTapRange	rangeX = ComputeKernelTapRange(kernelX, outputSizeX, inputSizeX, m_ConvParams);
+				const float			weight = weightsPtr[kernelY * kernelSizeX + kernelX];
+
+				// Each kernel weight adds a shifted copy of the input rows to the output rows:
+				for (size_t outY = rangeY.m_Min; outY < rangeY.m_Max; ++outY)
+				{
+					float			*outputRowPtr = netInputPtr + outY * outputSizeX;
+					const float		*inputRowPtr = inputPtr + (outY * stride + rangeY.m_Offset) * inputSizeX + rangeX.m_Offset;
+
+					if (stride == 1)
+					{
+						KernelAxpy(outputRowPtr + rangeX.m_Min, inputRowPtr + rangeX.m_Min, weight, rangeX.m_Max - rangeX.m_Min);
+						continue;
+					}
+					for (size_t outX = rangeX.m_Min; outX < rangeX.m_Max; ++outX)
+						outputRowPtr[outX] += inputRowPtr[outX * stride] * weight;
+				}
+			}
+		}
+	}
+	Activation(	m_Output.Data() + featureOutputStride * rangeMin,
+				m_NetInput.Data() + featureOutputStride * rangeMin,
+				(rangeMax - rangeMin) * featureOutputStride);
+}
+
+float	CLayerDepthwiseConv2D::BackPropagateError(const float *prevOutput, const SLossTarget &target, size_t rangeMin, size_t rangeMax)
+{
+	MICROPROFILE_SCOPEI("CLayerDepthwiseConv2D", "CLayerDepthwiseConv2D::BackPropagateError", MP_RED1);
+	const size_t	featureStride = GetOutputSizeX() * GetOutputSizeY();
+
+	// Outter layer of the neural network:
+	const float		loss = ComputeLossSlopes(target, featureStride * rangeMin, featureStride * rangeMax);
+
+	if (m_Learn)
+		AccumWeightsAndBiasDerivative(prevOutput, rangeMin, rangeMax);
+	return loss;
+}
+
+void	CLayerDepthwiseConv2D::BackPropagateError(const float *prevOutput, const CLayer* nextLayer, size_t rangeMin, size_t rangeMax)
+{
+	MICROPROFILE_SCOPEI("CLayerDepthwiseConv2D", "CLayerDepthwiseConv2D::BackPropagateError", MP_RED1);
+	const size_t	featureStride = GetOutputSizeX() * GetOutputSizeY();
+
+	// Inner layer of the neural network:
+	ActivationDerivative(	m_SlopesOut.Data() + featureStride * rangeMin,
+							m_NetInput.Data() + featureStride * rangeMin,
+							(rangeMax - rangeMin) * featureStride);
+	if (m_Learn)
+		AccumWeightsAndBiasDerivative(prevOutput, rangeMin, rangeMax);
+}
+
+void	CLayerDepthwiseConv2D::AccumWeightsAndBiasDerivative(const float *input, size_t rangeMin, size_t rangeMax)
+{
+	const size_t	inputSizeX = m_ConvParams.m_InputSizeX;
+	const size_t	featureInputStride = inputSizeX * m_ConvParams.m_InputSizeY;
+	const size_t	outputSizeX = GetOutputSizeX();
+	const size_t	featureOutputStride = outputSizeX * GetOutputSizeY();
+	const size_t	kernelSizeX = m_ConvParams.m_KernelSizeX;
+	const size_t	stride = m_ConvParams.m_KernelStride;
+
+	for (size_t featureIdx = rangeMin; featureIdx < rangeMax; ++featureIdx)
+	{
+		const float		*inputPtr = input + featureIdx * featureInputStride;
+		const float		*slopesPtr = m_SlopesOut.Data() + featureIdx * featureOutputStride;
+		float			*accumWeightsPtr = m_SlopesWeightAccum.View().GetRow(featureIdx);
+
+		// The bias derivative of a feature is the sum of all its output slopes:
+		m_SlopesOutAccum.Data()[featureIdx] += KernelSum(slopesPtr, featureOutputStride);
+		for (size_t kernelY = 0; kernelY < m_ConvParams.m_KernelSizeY; ++kernelY)
+		{
+			const SKernelTapRange	rangeY = ComputeKernelTapRange(kernelY, GetOutputSizeY(), m_ConvParams.m_InputSizeY, m_ConvParams);
+
+			for (size_t kernelX = 0; kernelX < kernelSizeX; ++kernelX)
+			{
+				const SKernelTapRange	rangeX = ComputeKernelTapRange(kernelX, outputSizeX, inputSizeX, m_ConvParams);
+				float				sum = 0.0f;
+
+				// Weight derivative: output slopes dot the input pixels read by this kernel weight:
+				for (size_t outY = rangeY.m_Min; outY < rangeY.m_Max; ++outY)
+				{
+					const float		*slopesRowPtr = slopesPtr + outY * outputSizeX;
+					const float		*inputRowPtr = inputPtr + (outY * stride + rangeY.m_Offset) * inputSizeX + rangeX.m_Offset;
+
+					if (stride == 1)
+					{
+						sum += KernelDot(slopesRowPtr + rangeX.m_Min, inputRowPtr + rangeX.m_Min, rangeX.m_Max - rangeX.m_Min);
+						continue;
+					}
+					for (size_t outX = rangeX.m_Min; outX < rangeX.m_Max; ++outX)
+						sum += slopesRowPtr[outX] * inputRowPtr[outX * stride];
+				}
+				accumWeightsPtr[kernelY * kernelSizeX + kernelX] += sum;
+			}
+		}
+	}
+}
+
+void	CLayerDepthwiseConv2D::UpdateWeightsAndBias(size_t trainingSteps, size_t rangeMin, size_t rangeMax)
+{
+	MICROPROFILE_SCOPEI("CLayerDepthwiseConv2D", "CLayerDepthwiseConv2D::UpdateWeightsAndBias", MP_BLUE1);
+	const size_t	outputRange = rangeMax - rangeMin;
+
+	OptimizeWeight(rangeMin, rangeMax, trainingSteps);
+	OptimizeBias(m_Bias.Data(), m_SlopesOutAccum.Data(), rangeMin, rangeMax, trainingSteps);
+
+	memset(m_SlopesWeightAccum.View().GetRow(rangeMin), 0, outputRange * m_SlopesWeightAccum.View().m_RowByteStride);
+	memset(m_SlopesOutAccum.Data() + rangeMin, 0, outputRange * sizeof(float));
+}
+
+void	CLayerDepthwiseConv2D::GatherSlopes(float *dst, const CLayer *prevLayer, size_t rangeMin, size_t rangeMax) const
+{
+	MICROPROFILE_SCOPEI("CLayerDepthwiseConv2D", "CLayerDepthwiseConv2D::GatherSlopes", MP_PALEVIOLETRED1);
+	(void)prevLayer;
+	// Each task owns the input features starting in its range:
+	const size_t	inputSizeX = m_ConvParams.m_InputSizeX;
+	const size_t	featureInputStride = inputSizeX * m_ConvParams.m_InputSizeY;
+	const size_t	featureMin = (rangeMin + featureInputStride - 1) / featureInputStride;
+	const size_t	featureMax = (rangeMax + featureInputStride - 1) / featureInputStride;
+	const size_t	outputSizeX = GetOutputSizeX();
+	const size_t	featureOutputStride = outputSizeX * GetOutputSizeY();
+	const size_t	kernelSizeX = m_ConvParams.m_KernelSizeX;
+	const size_t	stride = m_ConvParams.m_KernelStride;
+
+	if (featureMin >= featureMax)
+		return;
+	memset(dst + featureMin * featureInputStride, 0, (featureMax - featureMin) * featureInputStride * sizeof(float));
+
+	// An input feature only receives the slopes of its own output feature:
+	for (size_t featureIdx = featureMin; featureIdx < featureMax; ++featureIdx)
+	{
+		const float		*weightsPtr = m_Weights.View().GetRow(featureIdx);
+		const float		*slopesPtr = m_SlopesOut.Data() + featureIdx * featureOutputStride;
+		float			*dstPtr = dst + featureIdx * featureInputStride;
+
+		for (size_t kernelY = 0; kernelY < m_ConvParams.m_KernelSizeY; ++kernelY)
+		{
+			const SKernelTapRange	rangeY = ComputeKernelTapRange(kernelY, GetOutputSizeY(), m_ConvParams.m_InputSizeY, m_ConvParams);
+
+			for (size_t kernelX = 0; kernelX < kernelSizeX; ++kernelX)
+			{
+				const SKernelTapRange	rangeX = ComputeKernelTapRange(kernelX, outputSizeX, inputSizeX, m_ConvParams);
+				const float			weight = weightsPtr[kernelY * kernelSizeX + kernelX];
+
+				for (size_t outY = rangeY.m_Min; outY < rangeY.m_Max; ++outY)
+				{
+					const float		*slopesRowPtr = slopesPtr + outY * outputSizeX;
+					float			*dstRowPtr = dstPtr + (outY * stride + rangeY.m_Offset) * inputSizeX + rangeX.m_Offset;
+
+					if (stride == 1)
+					{
+						KernelAxpy(dstRowPtr + rangeX.m_Min, slopesRowPtr + rangeX.m_Min, weight, rangeX.m_Max - rangeX.m_Min);
+						continue;
+					}
+					for (size_t outX = rangeX.m_Min; outX < rangeX.m_Max; ++outX)
+						dstRowPtr[outX * stride] += slopesRowPtr[outX] * weight;
+				}
+			}
+		}
+	}
+}
+
+void	CLayerDepthwiseConv2D::PrintInfo() const
+{
+	printf("\tLayer Depthwise Convolution 2D:\n");
+	printf(	"\t\tInput: %zu %zux%zu (padding: %zu)\n",
+			m_FeatureCount, m_ConvParams.m_InputSizeX, m_ConvParams.m_InputSizeY,
+			m_ConvParams.m_InputPadding);
+	printf(	"\t\tFeatures: %zu %zux%zu (stride: %zu)\n",
+			m_FeatureCount, m_ConvParams.m_KernelSizeX, m_ConvParams.m_KernelSizeY,
+			m_ConvParams.m_KernelStride);
+	printf("\t\tOutput: %zu %zux%zu\n", m_FeatureCount, GetOutputSizeX(), GetOutputSizeY());
+	PrintBasicInfo();
+}
+
+void	CLayerDepthwiseConv2D::Serialize(std::vector<uint8_t> &data) const
+{
+	SerializeLayerType(data, ELayerType::LayerDepthwiseConv2D);
+	SerializeInOutSize(data);
+	SerializeBasicInfo(data);
+	m_ConvParams.Serialize(data);
+	size_t		prevSize = data.size();
+	data.resize(prevSize + sizeof(uint32_t));
+	uint32_t	*dataPtr = (uint32_t*)(data.data() + prevSize);
+	dataPtr[0] = m_FeatureCount;
+	SerializeWeightsAndBias(data);
+}
+
+bool	CLayerDepthwiseConv2D::UnSerialize(const std::vector<uint8_t> &data, size_t &curIdx)
+{
+	if (!UnSerializeInOutSize(data, curIdx))
+		return false;
+	if (!UnSerializeBasicInfo(data, curIdx))
+		return false;
+	if (!m_ConvParams.UnSerialize(data, curIdx))
+		return false;
+	if (curIdx + sizeof(uint32_t) > data.size())
+		return false;
+	uint32_t	*dataPtr = (uint32_t*)(data.data() + curIdx);
+	m_FeatureCount = dataPtr[0];
+	curIdx += sizeof(uint32_t);
+	if (!Setup(	m_FeatureCount, m_ConvParams.m_InputSizeX, m_ConvParams.m_InputSizeY,
+				m_ConvParams.m_KernelSizeX, m_ConvParams.m_KernelSizeY,
+				m_ConvParams.m_InputPadding, m_ConvParams.m_KernelStride))
+		return false;
+	if (!UnSerializeWeightsAndBias(data, curIdx))
+		return false;
+	return m_Bias.Size() == m_FeatureCount;
+}
+
+size_t	CLayerDepthwiseConv2D::GetThreadingHint() const
+{
+	// Multiply-adds of the feed forward:
+	return m_OutputSize * m_ConvParams.m_KernelSizeX * m_ConvParams.m_KernelSizeY;
+}
+
+size_t	CLayerDepthwiseConv2D::GetDomainSize() const
+{
+	return m_FeatureCount;
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include "LayerBase.h"
+#include "NeuronKernel.h"
+
+// Depthwise convolution: each feature is convolved with its own kernel, there is no sum across features.
+// The output has as many features as the input (depth multiplier of 1):
+class	CLayerDepthwiseConv2D : public CLayer
+{
+public:
+	CLayerDepthwiseConv2D();
+	~CLayerDepthwiseConv2D();
+
+	bool	Setup(	size_t featureCount, size_t inputSizeX, size_t inputSizeY,
+					size_t featureSizeX, size_t featureSizeY,
+					size_t padding, size_t stride);
+
+	virtual void	FeedForward(const float *input, size_t rangeMin, size_t rangeMax) override;
+	virtual float	BackPropagateError(const float *prevOutput, const SLossTarget &target, size_t rangeMin, size_t rangeMax) override;
+	virtual void	BackPropagateError(const float* prevOutput, const CLayer *nextLayer, size_t rangeMin, size_t rangeMax) override;
+	virtual void	UpdateWeightsAndBias(size_t trainingSteps, size_t rangeMin, size_t rangeMax) override;
+	virtual void	GatherSlopes(float *dst, const CLayer *prevLayer, size_t rangeMin, size_t rangeMax) const override;
+	virtual void	PrintInfo() const override;
+	virtual void	Serialize(std::vector<uint8_t> &data) const override;
+	virtual bool	UnSerialize(const std::vector<uint8_t> &data, size_t &curIdx) override;
+
+	virtual size_t	GetThreadingHint() const override;
+	virtual size_t	GetDomainSize() const override;
+	virtual ELayerType	GetLayerType() const override { return ELayerType::LayerDepthwiseConv2D; }
+
+	size_t			GetFeatureCount() const { return m_FeatureCount; }
+	size_t			GetFeatureSizeX() const { return m_ConvParams.m_KernelSizeX; }
+	size_t			GetFeatureSizeY() const { return m_ConvParams.m_KernelSizeY; }
+	size_t			GetOutputSizeX() const { return m_ConvParams.m_OutputSizeX; }
+	size_t			GetOutputSizeY() const { return m_ConvParams.m_OutputSizeY; }
+
+private:
+	bool			AllocateStorages();
+	void			AccumWeightsAndBiasDerivative(const float *input, size_t rangeMin, size_t rangeMax);
+
+	SConvolutionParams	m_ConvParams;
+	size_t				m_FeatureCount;
+};
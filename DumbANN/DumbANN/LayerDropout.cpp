@@ -1,10 +1,30 @@
-
 #include "LayerDropout.h"
 #include <assert.h>
 #include <stdlib.h>
+#include <emmintrin.h>
+#include <algorithm>
+
+// Philox4x32-10 counter based generator, each (counter, key) gives 4 independent random words:
+static __forceinline void	_Philox4x32(uint32_t counter[4], uint32_t key0, uint32_t key1)
+{
+	for (int round = 0; round < 10; ++round)
+	{
+		const uint64_t	prod0 = (uint64_t)0xD2511F53 * counter[0];
+		const uint64_t	prod1 = (uint64_t)0xCD9E8D57 * counter[2];
+
+		counter[0] = (uint32_t)(prod1 >> 32) ^ counter[1] ^ key0;
+		counter[1] = (uint32_t)prod1;
+		counter[2] = (uint32_t)(prod0 >> 32) ^ counter[3] ^ key1;
+		counter[3] = (uint32_t)prod0;
+		key0 += 0x9E3779B9;
+		key1 += 0xBB67AE85;
+	}
+}
 
 CLayerDropOut::CLayerDropOut()
 :	m_Rate(0.0f)
+,	m_Seed(0)
+,	m_Generation(0)
 {
 }
 
@@ -18,81 +38,69 @@ bool	CLayerDropOut::Setup(size_t inputSize, float rate)
 	if (rate >= 1.0f || rate <= 0.0f)
 		return false;
 
-	size_t	invRate = 1.0f / rate;
-
 	m_Rate = rate;
 	m_InputSize = inputSize;
 	m_OutputSize = inputSize;
 	m_Output.AllocateStorage(m_InputSize);
 	m_SlopesOut.AllocateStorage(m_InputSize);
-	size_t	disabledIdxSize = m_InputSize / invRate;
-	if (m_InputSize % invRate != 0)
-		disabledIdxSize += 1;
-	m_DisabledIdx.resize(disabledIdxSize);
-	UpdateDisabledArray();
+	m_KeepMask.resize((m_InputSize + 31) / 32);
+	m_Seed = ((uint32_t)rand() << 16) ^ (uint32_t)rand();
+	m_Generation = 0;
+	UpdateKeepMask(0, m_KeepMask.size());
 	return true;
 }
 
 void	CLayerDropOut::FeedForward(const float *input, size_t rangeMin, size_t rangeMax)
 {
 	MICROPROFILE_SCOPEI("CLayerDropOut", "CLayerDropOut::FeedForward", MP_GREEN1);
-	size_t			invRate = 1.0f / m_Rate;
-	const float		outScale = 1.0f / (1.0f - m_Rate);
-	for (size_t i = rangeMin; i < rangeMax; ++i)
-	{
-		if (m_DisabledIdx[i / invRate] == i)
-			m_Output.Data()[i] = 0.0f;
-		else
-			m_Output.Data()[i] = input[i] * outScale;
-	}
+	ApplyKeepMask(input, m_Output.Data(), 1.0f / (1.0f - m_Rate), rangeMin, rangeMax);
 }
 
-void	CLayerDropOut::BackPropagateError(const float *prevOutput, const std::vector<float> &error, size_t rangeMin, size_t rangeMax)
+float	CLayerDropOut::BackPropagateError(const float *prevOutput, const SLossTarget &target, size_t rangeMin, size_t rangeMax)
 {
 	MICROPROFILE_SCOPEI("CLayerDropOut", "CLayerDropOut::BackPropagateError", MP_RED1);
-	size_t			invRate = 1.0f / m_Rate;
-	const float		*errorPtr = error.data();
-	float			*slopePtr = m_SlopesOut.Data();
+	const float		loss = ComputeLossSlopes(target, rangeMin, rangeMax);
 
-	for (size_t outIdx = rangeMin; outIdx < rangeMax; ++outIdx)
-	{
-		if (m_DisabledIdx[outIdx / invRate] == outIdx)
-			slopePtr[outIdx] = 0.0f;
-		else
-			slopePtr[outIdx] = -errorPtr[outIdx];
-	}
+	ApplyKeepMask(m_SlopesOut.Data(), m_SlopesOut.Data(), 1.0f / (1.0f - m_Rate), rangeMin, rangeMax);
+	return loss;
 }
 
 void	CLayerDropOut::BackPropagateError(const float *prevOutput, const CLayer* nextLayer, size_t rangeMin, size_t rangeMax)
 {
 	MICROPROFILE_SCOPEI("CLayerDropOut", "CLayerDropOut::BackPropagateError", MP_RED1);
-	size_t			invRate = 1.0f / m_Rate;
-	float			*slopePtr = m_SlopesOut.Data();
+	// The slopes are scaled like the output so the gradient matches the feed forward:
+	ApplyKeepMask(m_SlopesOut.Data(), m_SlopesOut.Data(), 1.0f / (1.0f - m_Rate), rangeMin, rangeMax);
+}
 
-	for (size_t outIdx = rangeMin; outIdx < rangeMax; ++outIdx)
-	{
-		if (m_DisabledIdx[outIdx / invRate] == outIdx)
-			slopePtr[outIdx] = 0.0f;
-	}
+void	CLayerDropOut::BeginUpdate()
+{
+	++m_Generation;
 }
 
 void	CLayerDropOut::UpdateWeightsAndBias(size_t trainingSteps, size_t rangeMin, size_t rangeMax)
 {
-	MICROPROFILE_SCOPEI("CLayerDropOut", "CLayerDropOut::UpdateDisabledArray", MP_BLUE1);
-	UpdateDisabledArray();
+	MICROPROFILE_SCOPEI("CLayerDropOut", "CLayerDropOut::UpdateKeepMask", MP_BLUE1);
+	// Each task owns the mask words starting in its range:
+	UpdateKeepMask((rangeMin + 31) / 32, (rangeMax + 31) / 32);
 }
 
 void	CLayerDropOut::GatherSlopes(float *dst, const CLayer *prevLayer, size_t rangeMin, size_t rangeMax) const
 {
 	MICROPROFILE_SCOPEI("CLayerDropOut", "CLayerDropOut::GatherSlopes", MP_PALEVIOLETRED1);
-	size_t			invRate = 1.0f / m_Rate;
-	for (size_t i = rangeMin; i < rangeMax; ++i)
-	{
-		if (m_DisabledIdx[i / invRate] == i)
-			dst[i] = 0.0f;
-		else
-			dst[i] = m_SlopesOut.Data()[i];
-	}
+	// Dropped units already have a null slope:
+	memcpy(dst + rangeMin, m_SlopesOut.Data() + rangeMin, (rangeMax - rangeMin) * sizeof(float));
+}
+
+void	CLayerDropOut::BuildNonZeroOutputs(size_t rangeMin, size_t rangeMax)
+{
+	MICROPROFILE_SCOPEI("CLayerDropOut", "CLayerDropOut::BuildNonZeroOutputs", MP_GREEN2);
+	// Built from the keep mask and not from the output:
+	// kept units with a null input still get a slope and must stay in the list.
+	const size_t	blockMin = (rangeMin + SNonZeroList::kBlockSize - 1) / SNonZeroList::kBlockSize;
+	const size_t	blockMax = (rangeMax + SNonZeroList::kBlockSize - 1) / SNonZeroList::kBlockSize;
+
+	assert(m_NonZeroOutputs.m_Size == m_Output.Size());
+	m_NonZeroOutputs.BuildFromBits(m_KeepMask.data(), blockMin, blockMax);
 }
 
 void	CLayerDropOut::PrintInfo() const
@@ -128,7 +136,7 @@ bool	CLayerDropOut::UnSerialize(const std::vector<uint8_t> &data, size_t &curIdx
 
 size_t	CLayerDropOut::GetThreadingHint() const
 {
-	return 1;
+	return m_OutputSize;
 }
 
 size_t	CLayerDropOut::GetDomainSize() const
@@ -136,27 +144,53 @@ size_t	CLayerDropOut::GetDomainSize() const
 	return GetOutputSize();
 }
 
-void	CLayerDropOut::UpdateDisabledArray()
+void	CLayerDropOut::UpdateKeepMask(size_t wordMin, size_t wordMax)
 {
-	size_t		invRate = 1.0f / m_Rate;
-	const float	seed = (float)rand() / (float)RAND_MAX;
-	bool		neuronDisabled = false;
+	// A unit is dropped when its 16 bits random value is below the threshold.
+	// SSE2 only has signed compares, both sides are offset by 0x8000:
+	const uint32_t	dropThreshold = std::min((uint32_t)(m_Rate * 65536.0f + 0.5f), 65535u);
+	const __m128i	threshold = _mm_set1_epi16((short)(dropThreshold ^ 0x8000));
+	const __m128i	signFlip = _mm_set1_epi16((short)0x8000);
 
-	for (size_t i = 0; i < m_InputSize; ++i)
+	for (size_t wordIdx = wordMin; wordIdx < wordMax; ++wordIdx)
 	{
-		float	fastRand = sinf((float)i + seed) * 58492.47388f;
-		fastRand = fastRand - floorf(fastRand);
+		uint32_t	keepBits = 0;
 
-		if ((i + 1) % invRate == 0)
+		for (uint32_t part = 0; part < 4; ++part)
 		{
-			if (!neuronDisabled)
-				m_DisabledIdx[i / invRate] = floor(RemapValue(fastRand, 0.0f, 1.0f, (i + 1) - invRate, i + 1));
-			neuronDisabled = false;
-		}
-		else if (fastRand < m_Rate && !neuronDisabled)
-		{
-			m_DisabledIdx[i / invRate] = i;
-			neuronDisabled = true;
+			uint32_t	counter[4] = { (uint32_t)(wordIdx * 4 + part), m_Generation, 0, 0 };
+
+			_Philox4x32(counter, m_Seed, 0x6A09E667);
+			const __m128i	rand16 = _mm_xor_si128(_mm_loadu_si128((const __m128i*)counter), signFlip);
+			const __m128i	drop16 = _mm_cmplt_epi16(rand16, threshold);
+			const uint32_t	dropBits = _mm_movemask_epi8(_mm_packs_epi16(drop16, _mm_setzero_si128()));
+
+			keepBits |= (~dropBits & 0xFF) << (part * 8);
 		}
+		// Bits past the last unit stay cleared:
+		const size_t	unitCount = m_InputSize - wordIdx * 32;
+		if (unitCount < 32)
+			keepBits &= (1u << unitCount) - 1;
+		m_KeepMask[wordIdx] = keepBits;
+	}
+}
+
+void	CLayerDropOut::ApplyKeepMask(const float *src, float *dst, float scale, size_t rangeMin, size_t rangeMax) const
+{
+	const __m128	scale_xxxx = _mm_set1_ps(scale);
+	const __m128i	laneBits = _mm_setr_epi32(1, 2, 4, 8);
+	size_t			i = rangeMin;
+
+	for (; i < rangeMax && (i & 3) != 0; ++i)
+		dst[i] = IsKept(i) ? src[i] * scale : 0.0f;
+	for (; i + 4 <= rangeMax; i += 4)
+	{
+		// Expand the 4 mask bits of these units to lane masks:
+		const __m128i	keep_xyzw = _mm_set1_epi32((m_KeepMask[i >> 5] >> (i & 31)) & 0xF);
+		const __m128	mask_xyzw = _mm_castsi128_ps(_mm_cmpeq_epi32(_mm_and_si128(keep_xyzw, laneBits), laneBits));
+
+		_mm_storeu_ps(dst + i, _mm_and_ps(mask_xyzw, _mm_mul_ps(_mm_loadu_ps(src + i), scale_xxxx)));
 	}
+	for (; i < rangeMax; ++i)
+		dst[i] = IsKept(i) ? src[i] * scale : 0.0f;
 }
@@ -12,20 +12,33 @@ public:
 	bool	Setup(size_t inputSize, float rate);
 
 	virtual void	FeedForward(const float *input, size_t rangeMin, size_t rangeMax) override;
-	virtual void	BackPropagateError(const float *prevOutput, const std::vector<float> &error, size_t rangeMin, size_t rangeMax) override;
+	virtual float	BackPropagateError(const float *prevOutput, const SLossTarget &target, size_t rangeMin, size_t rangeMax) override;
 	virtual void	BackPropagateError(const float* prevOutput, const CLayer *nextLayer, size_t rangeMin, size_t rangeMax) override;
+	virtual void	BeginUpdate() override;
 	virtual void	UpdateWeightsAndBias(size_t trainingSteps, size_t rangeMin, size_t rangeMax) override;
 	virtual void	GatherSlopes(float *dst, const CLayer *prevLayer, size_t rangeMin, size_t rangeMax) const override;
 	virtual void	PrintInfo() const override;
 	virtual void	Serialize(std::vector<uint8_t> &data) const override;
 	virtual bool	UnSerialize(const std::vector<uint8_t> &data, size_t &curIdx) override;
 
+	// Publishes the kept units, the next layer skips the dropped ones:
+	virtual bool	HasSparseOutput() const override { return true; }
+	virtual void	BuildNonZeroOutputs(size_t rangeMin, size_t rangeMax) override;
+
 	virtual size_t	GetThreadingHint() const override;
 	virtual size_t	GetDomainSize() const override;
+	virtual ELayerType	GetLayerType() const override { return ELayerType::LayerDropout; }
+
+	float	GetOutputScale() const { return 1.0f / (1.0f - m_Rate); }
+	bool	IsKept(size_t idx) const { return (m_KeepMask[idx >> 5] >> (idx & 31)) & 1; }
 
 private:
-	void		UpdateDisabledArray();
+	void		UpdateKeepMask(size_t wordMin, size_t wordMax);
+	void		ApplyKeepMask(const float *src, float *dst, float scale, size_t rangeMin, size_t rangeMax) const;
 
-	float				m_Rate;
-	std::vector<size_t>	m_DisabledIdx;
+	float					m_Rate;
+	// One bit per unit, set when the unit is kept:
+	std::vector<uint32_t>	m_KeepMask;
+	uint32_t				m_Seed;
+	uint32_t				m_Generation;
 };
\ No newline at end of file
@@ -0,0 +1,94 @@
+#include "LayerFlatten.h"
+#include <assert.h>
+#include <stdlib.h>
+
+CLayerFlatten::CLayerFlatten()
+{
+}
+
+CLayerFlatten::~CLayerFlatten()
+{
+}
+
+bool	CLayerFlatten::Setup(size_t inputSize)
+{
+	m_InputSize = inputSize;
+	m_OutputSize = inputSize;
+	// Only used until the layer is linked to a previous layer:
+	m_Output.AllocateStorage(m_InputSize);
+	m_SlopesOut.AllocateStorage(m_InputSize);
+	return true;
+}
+
+void	CLayerFlatten::LinkInput(const CLayer *prevLayer)
+{
+	if (prevLayer == nullptr)
+	{
+		// First layer, the network input is copied:
+		Setup(m_InputSize);
+		return;
+	}
+	assert(prevLayer->GetOutputSize() == m_InputSize);
+	m_Output.AliasStorage(prevLayer->GetOutput().Data(), m_InputSize);
+	// The next layer gathers its slopes straight into the previous layer slopes:
+	if (prevLayer->GetSlopesOut().Size() == m_InputSize)
+		m_SlopesOut.AliasStorage(prevLayer->GetSlopesOut().Data(), m_InputSize);
+}
+
+void	CLayerFlatten::FeedForward(const float *input, size_t rangeMin, size_t rangeMax)
+{
+	MICROPROFILE_SCOPEI("CLayerFlatten", "CLayerFlatten::FeedForward", MP_GREEN1);
+	if (m_Output.Data() != input)
+		memcpy(m_Output.Data() + rangeMin, input + rangeMin, (rangeMax - rangeMin) * sizeof(float));
+}
+
+float	CLayerFlatten::BackPropagateError(const float *prevOutput, const SLossTarget &target, size_t rangeMin, size_t rangeMax)
+{
+	MICROPROFILE_SCOPEI("CLayerFlatten", "CLayerFlatten::BackPropagateError", MP_RED1);
+	return ComputeLossSlopes(target, rangeMin, rangeMax);
+}
+
+void	CLayerFlatten::BackPropagateError(const float *prevOutput, const CLayer* nextLayer, size_t rangeMin, size_t rangeMax)
+{
+	// The slopes were gathered by the next layer as is
+}
+
+void	CLayerFlatten::UpdateWeightsAndBias(size_t trainingSteps, size_t rangeMin, size_t rangeMax)
+{
+}
+
+void	CLayerFlatten::GatherSlopes(float *dst, const CLayer *prevLayer, size_t rangeMin, size_t rangeMax) const
+{
+	MICROPROFILE_SCOPEI("CLayerFlatten", "CLayerFlatten::GatherSlopes", MP_PALEVIOLETRED1);
+	if (dst != m_SlopesOut.Data())
+		memcpy(dst + rangeMin, m_SlopesOut.Data() + rangeMin, (rangeMax - rangeMin) * sizeof(float));
+}
+
+void	CLayerFlatten::PrintInfo() const
+{
+	printf("\tLayer Flatten:\n");
+	printf("\t\tInput: %zu\n", m_InputSize);
+}
+
+void	CLayerFlatten::Serialize(std::vector<uint8_t> &data) const
+{
+	SerializeLayerType(data, ELayerType::LayerFlatten);
+	SerializeInOutSize(data);
+}
+
+bool	CLayerFlatten::UnSerialize(const std::vector<uint8_t> &data, size_t &curIdx)
+{
+	if (!UnSerializeInOutSize(data, curIdx))
+		return false;
+	return Setup(m_InputSize);
+}
+
+size_t	CLayerFlatten::GetThreadingHint() const
+{
+	return m_InputSize;
+}
+
+size_t	CLayerFlatten::GetDomainSize() const
+{
+	return m_InputSize;
+}
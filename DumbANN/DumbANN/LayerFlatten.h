@@ -0,0 +1,30 @@
+#pragma once
+
+#include "LayerBase.h"
+#include "NeuronKernel.h"
+
+// Reshapes the features of the previous layer to a flat vector.
+// The output and the slopes alias the previous layer ones once linked, nothing is copied or computed:
+class	CLayerFlatten : public CLayer
+{
+public:
+	CLayerFlatten();
+	~CLayerFlatten();
+
+	bool	Setup(size_t inputSize);
+
+	virtual void	LinkInput(const CLayer *prevLayer) override;
+	virtual void	FeedForward(const float *input, size_t rangeMin, size_t rangeMax) override;
+	virtual bool	HasSparseOutput() const override { return false; }
+	virtual float	BackPropagateError(const float *prevOutput, const SLossTarget &target, size_t rangeMin, size_t rangeMax) override;
+	virtual void	BackPropagateError(const float* prevOutput, const CLayer *nextLayer, size_t rangeMin, size_t rangeMax) override;
+	virtual void	UpdateWeightsAndBias(size_t trainingSteps, size_t rangeMin, size_t rangeMax) override;
+	virtual void	GatherSlopes(float *dst, const CLayer *prevLayer, size_t rangeMin, size_t rangeMax) const override;
+	virtual void	PrintInfo() const override;
+	virtual void	Serialize(std::vector<uint8_t> &data) const override;
+	virtual bool	UnSerialize(const std::vector<uint8_t> &data, size_t &curIdx) override;
+
+	virtual size_t	GetThreadingHint() const override;
+	virtual size_t	GetDomainSize() const override;
+	virtual ELayerType	GetLayerType() const override { return ELayerType::LayerFlatten; }
+};
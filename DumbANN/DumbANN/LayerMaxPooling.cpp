@@ -1,6 +1,8 @@
 
 #include "LayerMaxPooling.h"
 #include <assert.h>
+#include <xmmintrin.h>
+#include <emmintrin.h>
 
 CLayerMaxPooling2D::CLayerMaxPooling2D()
 {
@@ -23,6 +25,12 @@ bool	CLayerMaxPooling2D::Setup(	size_t inputFeatureCount, size_t inputSizeX, siz
 		assert(false);
 		return false;
 	}
+	if (poolSizeX > 16 || poolSizeY > 16)
+	{
+		fprintf(stderr, "Pool size should be 16x16 or less");
+		assert(false);
+		return false;
+	}
 
 	m_FeatureCount = inputFeatureCount;
 
@@ -33,12 +41,14 @@ bool	CLayerMaxPooling2D::Setup(	size_t inputFeatureCount, size_t inputSizeX, siz
 	m_ConvParams.m_InputSizeX = inputSizeX;
 	m_ConvParams.m_InputSizeY = inputSizeY;
 	m_ConvParams.ComputeConvOutputSize();
+	m_ConvParams.ComputeConvGeometry();
 
 	m_OutputSize = m_FeatureCount * m_ConvParams.m_OutputSizeX * m_ConvParams.m_OutputSizeY;
 	m_InputSize = inputFeatureCount * inputSizeX * inputSizeY;
 	bool	success = true;
 	success &= m_Output.AllocateStorage(m_OutputSize);
 	success &= m_SlopesOut.AllocateStorage(m_OutputSize);
+	m_MaxIdx.resize(m_OutputSize);
 	return success;
 }
 
@@ -47,23 +57,29 @@ void	CLayerMaxPooling2D::FeedForward(const float *input, size_t rangeMin, size_t
 	MICROPROFILE_SCOPEI("CLayerMaxPooling2D", "CLayerMaxPooling2D::FeedForward", MP_GREEN1);
 	SComputeOutput_KernelIn	kernelIn;
 
+	if (m_ConvParams.m_KernelSizeX == 2 && m_ConvParams.m_KernelSizeY == 2 &&
+		m_ConvParams.m_KernelStride == 2 && m_ConvParams.m_InputPadding == 0)
+	{
+		ComputeOutput2x2(input, rangeMin, rangeMax);
+		return;
+	}
+
 	kernelIn.m_FeatureCount = m_FeatureCount;
 	kernelIn.m_Output = m_Output.Data();
+	kernelIn.m_MaxIdx = m_MaxIdx.data();
 	kernelIn.m_Input = input;
 
-	const size_t	featureStride = m_ConvParams.m_OutputSizeX * m_ConvParams.m_OutputSizeY;
 	KernelConvolute<SComputeOutput_KernelIn,
 					&CLayerMaxPooling2D::Kernel_ComputeOutput>(kernelIn, rangeMin, rangeMax, m_ConvParams);
 }
 
-void	CLayerMaxPooling2D::BackPropagateError(const float *prevOutput, const std::vector<float> &error, size_t rangeMin, size_t rangeMax)
+float	CLayerMaxPooling2D::BackPropagateError(const float *prevOutput, const SLossTarget &target, size_t rangeMin, size_t rangeMax)
 {
 	MICROPROFILE_SCOPEI("CLayerMaxPooling2D", "CLayerMaxPooling2D::BackPropagateError", MP_RED1);
 	const size_t	featureStide = m_ConvParams.m_OutputSizeX * m_ConvParams.m_OutputSizeY;
 
 	// Outter layer of the neural network:
-	for (size_t i = featureStide * rangeMin; i < featureStide * rangeMax; ++i)
-		m_SlopesOut.Data()[i] = -error[i];
+	return ComputeLossSlopes(target, featureStide * rangeMin, featureStide * rangeMax);
 }
 
 void	CLayerMaxPooling2D::BackPropagateError(const float *prevOutput, const CLayer* nextLayer, size_t rangeMin, size_t rangeMax)
@@ -77,22 +93,23 @@ void	CLayerMaxPooling2D::UpdateWeightsAndBias(size_t trainingSteps, size_t range
 void	CLayerMaxPooling2D::GatherSlopes(float *dst, const CLayer *prevLayer, size_t rangeMin, size_t rangeMax) const
 {
 	MICROPROFILE_SCOPEI("CLayerMaxPooling2D", "CLayerMaxPooling2D::GatherSlopes", MP_PALEVIOLETRED1);
-	if (prevLayer == nullptr)
-	{
-		assert(false); // CLayerMaxPooling2D cannot be first layer
-		return;
-	}
+	(void)prevLayer;
 	const size_t			featureInputStride = m_ConvParams.m_InputSizeX * m_ConvParams.m_InputSizeY;
+	// Each feature is cleared and written by a single task:
+	const size_t			featureMin = (rangeMin + featureInputStride - 1) / featureInputStride;
+	const size_t			featureMax = (rangeMax + featureInputStride - 1) / featureInputStride;
 	SGatherSlopes_KernelIn	kernelIn;
 
+	if (featureMin >= featureMax)
+		return;
 	kernelIn.m_FeatureCount = m_FeatureCount;
 	kernelIn.m_Output = dst;
-	kernelIn.m_Input = prevLayer->GetOutput().Data();
 	kernelIn.m_Slopes = m_SlopesOut.Data();
+	kernelIn.m_MaxIdx = m_MaxIdx.data();
 
-	memset(dst + rangeMin, 0, (rangeMax - rangeMin) * sizeof(float));
+	memset(dst + featureMin * featureInputStride, 0, (featureMax - featureMin) * featureInputStride * sizeof(float));
 	KernelConvolute<SGatherSlopes_KernelIn,
-					&CLayerMaxPooling2D::Kernel_GatherSlopes>(kernelIn, rangeMin / featureInputStride, rangeMax / featureInputStride, m_ConvParams);
+					&CLayerMaxPooling2D::Kernel_GatherSlopes>(kernelIn, featureMin, featureMax, m_ConvParams);
 }
 
 void	CLayerMaxPooling2D::PrintInfo() const
@@ -145,14 +162,142 @@ size_t	CLayerMaxPooling2D::GetDomainSize() const
 	return m_FeatureCount;
 }
 
+void	CLayerMaxPooling2D::ComputeOutput2x2(const float *input, size_t rangeMin, size_t rangeMax)
+{
+	const size_t	inputSizeX = m_ConvParams.m_InputSizeX;
+	const size_t	outputSizeX = m_ConvParams.m_OutputSizeX;
+	const size_t	outputSizeY = m_ConvParams.m_OutputSizeY;
+	const size_t	featureInputStride = inputSizeX * m_ConvParams.m_InputSizeY;
+	const size_t	featureOutputStride = outputSizeX * outputSizeY;
+
+	for (size_t featureIdx = rangeMin; featureIdx < rangeMax; ++featureIdx)
+	{
+		for (size_t outY = 0; outY < outputSizeY; ++outY)
+		{
+			const size_t	outIdx = featureIdx * featureOutputStride + outY * outputSizeX;
+			const float		*topPtr = input + featureIdx * featureInputStride + (outY * 2) * inputSizeX;
+
+			PoolRow2x2(topPtr, topPtr + inputSizeX, m_Output.Data() + outIdx, m_MaxIdx.data() + outIdx);
+		}
+	}
+}
+
+void	CLayerMaxPooling2D::PoolRow2x2(const float *topPtr, const float *bottomPtr, float *outputPtr, uint8_t *maxIdxPtr) const
+{
+	const size_t	outputSizeX = m_ConvParams.m_OutputSizeX;
+	const __m128i	rowBit = _mm_set1_epi32(0x10);
+	const __m128i	colBit = _mm_set1_epi32(0x01);
+	size_t			outX = 0;
+
+	// 4 pool windows per iteration:
+	for (; outX + 4 <= outputSizeX; outX += 4)
+	{
+		const __m128	top0_xyzw = _mm_loadu_ps(topPtr + outX * 2);
+		const __m128	top1_xyzw = _mm_loadu_ps(topPtr + outX * 2 + 4);
+		const __m128	bottom0_xyzw = _mm_loadu_ps(bottomPtr + outX * 2);
+		const __m128	bottom1_xyzw = _mm_loadu_ps(bottomPtr + outX * 2 + 4);
+		// Vertical max:
+		const __m128	isBottom0_xyzw = _mm_cmpgt_ps(bottom0_xyzw, top0_xyzw);
+		const __m128	isBottom1_xyzw = _mm_cmpgt_ps(bottom1_xyzw, top1_xyzw);
+		const __m128	max0_xyzw = _mm_max_ps(top0_xyzw, bottom0_xyzw);
+		const __m128	max1_xyzw = _mm_max_ps(top1_xyzw, bottom1_xyzw);
+		// Horizontal max between even and odd columns:
+		const __m128	even_xyzw = _mm_shuffle_ps(max0_xyzw, max1_xyzw, _MM_SHUFFLE(2, 0, 2, 0));
+		const __m128	odd_xyzw = _mm_shuffle_ps(max0_xyzw, max1_xyzw, _MM_SHUFFLE(3, 1, 3, 1));
+		const __m128	evenIsBottom_xyzw = _mm_shuffle_ps(isBottom0_xyzw, isBottom1_xyzw, _MM_SHUFFLE(2, 0, 2, 0));
+		const __m128	oddIsBottom_xyzw = _mm_shuffle_ps(isBottom0_xyzw, isBottom1_xyzw, _MM_SHUFFLE(3, 1, 3, 1));
+		const __m128	isOdd_xyzw = _mm_cmpgt_ps(odd_xyzw, even_xyzw);
+		const __m128	isBottom_xyzw = _mm_or_ps(	_mm_and_ps(isOdd_xyzw, oddIsBottom_xyzw),
+													_mm_andnot_ps(isOdd_xyzw, evenIsBottom_xyzw));
+		// Pack the 4 argmax to bytes:
+		const __m128i	maxIdx_xyzw = _mm_or_si128(	_mm_and_si128(_mm_castps_si128(isBottom_xyzw), rowBit),
+													_mm_and_si128(_mm_castps_si128(isOdd_xyzw), colBit));
+		const __m128i	maxIdx16 = _mm_packs_epi32(maxIdx_xyzw, maxIdx_xyzw);
+		const int32_t	maxIdx8 = _mm_cvtsi128_si32(_mm_packus_epi16(maxIdx16, maxIdx16));
+
+		_mm_storeu_ps(outputPtr + outX, _mm_max_ps(even_xyzw, odd_xyzw));
+		memcpy(maxIdxPtr + outX, &maxIdx8, sizeof(maxIdx8));
+	}
+	for (; outX < outputSizeX; ++outX)
+	{
+		const float		*windowTopPtr = topPtr + outX * 2;
+		const float		*windowBottomPtr = bottomPtr + outX * 2;
+		float			maxValue = windowTopPtr[0];
+		uint8_t			maxIdx = 0x00;
+
+		if (windowTopPtr[1] > maxValue)
+		{
+			maxValue = windowTopPtr[1];
+			maxIdx = 0x01;
+		}
+		if (windowBottomPtr[0] > maxValue)
+		{
+			maxValue = windowBottomPtr[0];
+			maxIdx = 0x10;
+		}
+		if (windowBottomPtr[1] > maxValue)
+		{
+			maxValue = windowBottomPtr[1];
+			maxIdx = 0x11;
+		}
+		outputPtr[outX] = maxValue;
+		maxIdxPtr[outX] = maxIdx;
+	}
+}
+
+bool	CLayerMaxPooling2D::CanPoolRows() const
+{
+	// Non overlapping windows, each input row belongs to a single output row:
+	return	m_ConvParams.m_InputPadding == 0 &&
+			m_ConvParams.m_KernelSizeX == m_ConvParams.m_KernelStride &&
+			m_ConvParams.m_KernelSizeY == m_ConvParams.m_KernelStride;
+}
+
+void	CLayerMaxPooling2D::PoolRows(const float *inputRows, size_t featureIdx, size_t outY)
+{
+	assert(CanPoolRows());
+	const size_t	inputSizeX = m_ConvParams.m_InputSizeX;
+	const size_t	poolSizeX = m_ConvParams.m_KernelSizeX;
+	const size_t	poolSizeY = m_ConvParams.m_KernelSizeY;
+	const size_t	outIdx = (featureIdx * m_ConvParams.m_OutputSizeY + outY) * m_ConvParams.m_OutputSizeX;
+	float			*outputPtr = m_Output.Data() + outIdx;
+	uint8_t			*maxIdxPtr = m_MaxIdx.data() + outIdx;
+
+	if (poolSizeX == 2 && poolSizeY == 2)
+	{
+		PoolRow2x2(inputRows, inputRows + inputSizeX, outputPtr, maxIdxPtr);
+		return;
+	}
+	for (size_t outX = 0; outX < m_ConvParams.m_OutputSizeX; ++outX)
+	{
+		const float		*windowPtr = inputRows + outX * poolSizeX;
+		float			maxValue = windowPtr[0];
+		uint8_t			maxIdx = 0x00;
+
+		for (size_t y = 0; y < poolSizeY; ++y)
+		{
+			for (size_t x = 0; x < poolSizeX; ++x)
+			{
+				if (windowPtr[y * inputSizeX + x] > maxValue)
+				{
+					maxValue = windowPtr[y * inputSizeX + x];
+					maxIdx = (uint8_t)((y << 4) | x);
+				}
+			}
+		}
+		outputPtr[outX] = maxValue;
+		maxIdxPtr[outX] = maxIdx;
+	}
+}
+
 void	CLayerMaxPooling2D::Kernel_ComputeOutput(	const SComputeOutput_KernelIn &input,
 													const SKernelRange &range,
 													const SConvolutionParams &conv)
 {
 	const size_t	featureInputStride = conv.m_InputSizeX * conv.m_InputSizeY;
 	const size_t	featureOutputStride = conv.m_OutputSizeX * conv.m_OutputSizeY;
-	const size_t	outFeatureWeightStride = conv.m_KernelSizeX * conv.m_KernelSizeY;
 	float			maxValue = -FLT_MAX;
+	uint8_t			maxIdx = 0;
 
 	for (size_t inY = range.m_StartConvY; inY < range.m_StopConvY; ++inY)
 	{
@@ -161,7 +306,11 @@ void	CLayerMaxPooling2D::Kernel_ComputeOutput(	const SComputeOutput_KernelIn &in
 			size_t	inputIdx =	range.m_FeatureIdx * featureInputStride +
 								inY * conv.m_InputSizeX +
 								inX;
-			maxValue = std::max(maxValue, input.m_Input[inputIdx]);
+			if (input.m_Input[inputIdx] > maxValue)
+			{
+				maxValue = input.m_Input[inputIdx];
+				maxIdx = (uint8_t)(((inY - range.m_ConvOffsetY) << 4) | (inX - range.m_ConvOffsetX));
+			}
 			assert(abs(maxValue) < 1000000.0f);
 			assert(!isnan(maxValue));
 			assert(!isinf(maxValue));
@@ -171,6 +320,7 @@ void	CLayerMaxPooling2D::Kernel_ComputeOutput(	const SComputeOutput_KernelIn &in
 								range.m_ConvIdxY * conv.m_OutputSizeX +
 								range.m_ConvIdxX;
 	input.m_Output[outIdx] = maxValue;
+	input.m_MaxIdx[outIdx] = maxIdx;
 	assert(abs(input.m_Output[outIdx]) < 1000000.0f);
 	assert(!isnan(input.m_Output[outIdx]));
 	assert(!isinf(input.m_Output[outIdx]));
@@ -182,30 +332,19 @@ void	CLayerMaxPooling2D::Kernel_GatherSlopes(const SGatherSlopes_KernelIn &input
 {
 	const size_t	featureInputStride = conv.m_InputSizeX * conv.m_InputSizeY;
 	const size_t	featureOutputStride = conv.m_OutputSizeX * conv.m_OutputSizeY;
-	const size_t	outFeatureWeightStride = conv.m_KernelSizeX * conv.m_KernelSizeY;
-	float			maxValue = -FLT_MAX;
-	size_t			maxIdx = 0;
-
-	for (size_t inY = range.m_StartConvY; inY < range.m_StopConvY; ++inY)
-	{
-		for (size_t inX = range.m_StartConvX; inX < range.m_StopConvX; ++inX)
-		{
-			size_t	inputIdx =	range.m_FeatureIdx * featureInputStride +
-								inY * conv.m_InputSizeX +
-								inX;
-			if (input.m_Input[inputIdx] > maxValue)
-			{
-				maxValue = input.m_Input[inputIdx];
-				maxIdx = inputIdx;
-			}
-		}
-	}
 	const size_t	outIdx =	range.m_FeatureIdx * featureOutputStride +
 								range.m_ConvIdxY * conv.m_OutputSizeX +
 								range.m_ConvIdxX;
-	input.m_Output[maxIdx] = input.m_Slopes[outIdx];
-	assert(abs(input.m_Output[maxIdx]) < 1000000.0f);
-	assert(!isnan(input.m_Output[outIdx]));
-	assert(!isinf(input.m_Output[outIdx]));
-}
+	// Argmax was recorded by the forward pass:
+	const uint8_t	maxIdx = input.m_MaxIdx[outIdx];
+	const size_t	inY = (size_t)(range.m_ConvOffsetY + (maxIdx >> 4));
+	const size_t	inX = (size_t)(range.m_ConvOffsetX + (maxIdx & 0xF));
+	const size_t	dstIdx =	range.m_FeatureIdx * featureInputStride +
+								inY * conv.m_InputSizeX +
+								inX;
 
+	input.m_Output[dstIdx] += input.m_Slopes[outIdx];
+	assert(abs(input.m_Output[dstIdx]) < 1000000.0f);
+	assert(!isnan(input.m_Output[dstIdx]));
+	assert(!isinf(input.m_Output[dstIdx]));
+}
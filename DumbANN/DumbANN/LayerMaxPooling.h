@@ -14,7 +14,7 @@ public:
 					size_t padding, size_t stride);
 
 	virtual void	FeedForward(const float *input, size_t rangeMin, size_t rangeMax) override;
-	virtual void	BackPropagateError(const float *prevOutput, const std::vector<float> &error, size_t rangeMin, size_t rangeMax) override;
+	virtual float	BackPropagateError(const float *prevOutput, const SLossTarget &target, size_t rangeMin, size_t rangeMax) override;
 	virtual void	BackPropagateError(const float* prevOutput, const CLayer *nextLayer, size_t rangeMin, size_t rangeMax) override;
 	virtual void	UpdateWeightsAndBias(size_t trainingSteps, size_t rangeMin, size_t rangeMax) override;
 	virtual void	GatherSlopes(float *dst, const CLayer *prevLayer, size_t rangeMin, size_t rangeMax) const override;
@@ -24,6 +24,7 @@ public:
 
 	virtual size_t	GetThreadingHint() const override;
 	virtual size_t	GetDomainSize() const override;
+	virtual ELayerType	GetLayerType() const override { return ELayerType::LayerMaxPooling; }
 
 	size_t			GetFeatureCount() const { return m_FeatureCount; }
 	size_t			GetFeatureSizeX() const { return m_ConvParams.m_KernelSizeX; }
@@ -31,21 +32,26 @@ public:
 	size_t			GetOutputSizeX() const { return m_ConvParams.m_OutputSizeX; }
 	size_t			GetOutputSizeY() const { return m_ConvParams.m_OutputSizeY; }
 
+	// Fusion with the previous layer, which produces the input rows of one output row at a time:
+	bool			CanPoolRows() const;
+	void			PoolRows(const float *inputRows, size_t featureIdx, size_t outY);
+
 private:
 	struct	SComputeOutput_KernelIn
 	{
 		const float				*m_Input;
 		float					*m_Output;
+		uint8_t					*m_MaxIdx;
 
 		size_t					m_FeatureCount;
 	};
 
 	struct	SGatherSlopes_KernelIn
 	{
-		const float				*m_Input;
 		float					*m_Output;
 
 		const float				*m_Slopes;
+		const uint8_t			*m_MaxIdx;
 
 		size_t					m_FeatureCount;
 	};
@@ -57,6 +63,11 @@ private:
 														const SKernelRange &range,
 														const SConvolutionParams &conv);
 
-	SConvolutionParams	m_ConvParams;
-	size_t				m_FeatureCount;
+	void							ComputeOutput2x2(const float *input, size_t rangeMin, size_t rangeMax);
+	void							PoolRow2x2(const float *topPtr, const float *bottomPtr, float *outputPtr, uint8_t *maxIdxPtr) const;
+
+	SConvolutionParams		m_ConvParams;
+	size_t					m_FeatureCount;
+	// Position of the max in its pool window for each output, (y << 4) | x:
+	std::vector<uint8_t>	m_MaxIdx;
 };
\ No newline at end of file
@@ -1,10 +1,49 @@
-
 #include "LayerSoftmax.h"
 #include <assert.h>
 #include <stdlib.h>
+#include <algorithm>
+#include <xmmintrin.h>
+#include <emmintrin.h>
+
+// Cephes style exp, relative error around 1e-7 on [-87, 88]:
+static __forceinline __m128	_SimdExp(__m128 x)
+{
+	const __m128	one = _mm_set1_ps(1.0f);
+
+	x = _mm_min_ps(x, _mm_set1_ps(88.3762626647949f));
+	x = _mm_max_ps(x, _mm_set1_ps(-87.3365478515625f));
+
+	// exp(x) = 2^n * exp(r) with n = floor(x / ln(2) + 0.5):
+	__m128			fx = _mm_add_ps(_mm_mul_ps(x, _mm_set1_ps(1.44269504088896341f)), _mm_set1_ps(0.5f));
+	__m128			n = _mm_cvtepi32_ps(_mm_cvttps_epi32(fx));
+	n = _mm_sub_ps(n, _mm_and_ps(_mm_cmpgt_ps(n, fx), one));
+
+	x = _mm_sub_ps(x, _mm_mul_ps(n, _mm_set1_ps(0.693359375f)));
+	x = _mm_sub_ps(x, _mm_mul_ps(n, _mm_set1_ps(-2.12194440e-4f)));
+
+	const __m128	x2 = _mm_mul_ps(x, x);
+	__m128			y = _mm_set1_ps(1.9875691500e-4f);
+	y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(1.3981999507e-3f));
+	y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(8.3334519073e-3f));
+	y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(4.1665795894e-2f));
+	y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(1.6666665459e-1f));
+	y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(5.0000001201e-1f));
+	y = _mm_add_ps(_mm_add_ps(_mm_mul_ps(y, x2), x), one);
+
+	// Build 2^n:
+	const __m128i	pow2n = _mm_slli_epi32(_mm_add_epi32(_mm_cvttps_epi32(n), _mm_set1_epi32(0x7F)), 23);
+	return _mm_mul_ps(y, _mm_castsi128_ps(pow2n));
+}
+
+static __forceinline float	_HorizontalMax(__m128 v_xyzw)
+{
+	const __m128	v_zwxy = _mm_shuffle_ps(v_xyzw, v_xyzw, _MM_SHUFFLE(1, 0, 3, 2));
+	const __m128	reduc1_xyxy = _mm_max_ps(v_xyzw, v_zwxy);
+	const __m128	reduc1_yxyx = _mm_shuffle_ps(reduc1_xyxy, reduc1_xyxy, _MM_SHUFFLE(0, 1, 0, 1));
+	return _mm_cvtss_f32(_mm_max_ss(reduc1_xyxy, reduc1_yxyx));
+}
 
 CLayerSoftMax::CLayerSoftMax()
-:	m_CurrentSum(0.0f)
 {
 }
 
@@ -14,34 +53,133 @@ CLayerSoftMax::~CLayerSoftMax()
 
 bool	CLayerSoftMax::Setup(size_t inputSize)
 {
+	const size_t	chunkCount = (inputSize + kChunkSize - 1) / kChunkSize;
+
 	m_InputSize = inputSize;
 	m_OutputSize = inputSize;
 	m_Output.AllocateStorage(m_InputSize);
 	m_SlopesOut.AllocateStorage(m_InputSize);
-	m_Jacobian.AllocMatrix(m_InputSize, m_InputSize);
+	m_ChunkMax.resize(chunkCount);
+	m_ChunkSum.resize(chunkCount);
 	return true;
 }
 
 void	CLayerSoftMax::FeedForward(const float *input, size_t rangeMin, size_t rangeMax)
 {
 	MICROPROFILE_SCOPEI("CLayerSoftMax", "CLayerSoftMax::FeedForward", MP_GREEN1);
-	assert(rangeMin == 0);
-	assert(rangeMax == m_InputSize);
-	m_CurrentSum = 0.0f;
-	for (size_t i = 0; i < m_InputSize; i++)
-		m_CurrentSum += expf(input[i]);
-	for (size_t i = 0; i < m_InputSize; i++)
-		m_Output.Data()[i] = expf(input[i]) / m_CurrentSum;
+	for (size_t chunkIdx = rangeMin; chunkIdx < rangeMax; ++chunkIdx)
+	{
+		const size_t	start = ChunkStart(chunkIdx);
+		const size_t	stop = ChunkStop(chunkIdx);
+		const size_t	simdStop = start + ((stop - start) & ~(size_t)3);
+		float			*outputPtr = m_Output.Data();
+
+		// Max of the chunk:
+		__m128			max_xyzw = _mm_set1_ps(-FLT_MAX);
+		for (size_t i = start; i < simdStop; i += 4)
+			max_xyzw = _mm_max_ps(max_xyzw, _mm_loadu_ps(input + i));
+		float			maxValue = _HorizontalMax(max_xyzw);
+		for (size_t i = simdStop; i < stop; ++i)
+			maxValue = std::max(maxValue, input[i]);
+
+		// Single exp pass, the output is normalized by FeedForwardFinalize:
+		const __m128	maxValue_xxxx = _mm_set1_ps(maxValue);
+		__m128			sum_xyzw = _mm_setzero_ps();
+		for (size_t i = start; i < simdStop; i += 4)
+		{
+			const __m128	exp_xyzw = _SimdExp(_mm_sub_ps(_mm_loadu_ps(input + i), maxValue_xxxx));
+			sum_xyzw = _mm_add_ps(sum_xyzw, exp_xyzw);
+			_mm_store_ps(outputPtr + i, exp_xyzw);
+		}
+		float			sum = KernelHorizontalSum(sum_xyzw);
+		for (size_t i = simdStop; i < stop; ++i)
+		{
+			outputPtr[i] = expf(input[i] - maxValue);
+			sum += outputPtr[i];
+		}
+		m_ChunkMax[chunkIdx] = maxValue;
+		m_ChunkSum[chunkIdx] = sum;
+	}
+}
+
+void	CLayerSoftMax::FeedForwardFinalize(size_t rangeMin, size_t rangeMax)
+{
+	MICROPROFILE_SCOPEI("CLayerSoftMax", "CLayerSoftMax::FeedForwardFinalize", MP_GREEN1);
+	float	globalMax;
+	float	globalSum;
+
+	GlobalMaxAndSum(globalMax, globalSum);
+	for (size_t chunkIdx = rangeMin; chunkIdx < rangeMax; ++chunkIdx)
+	{
+		const size_t	start = ChunkStart(chunkIdx);
+		const size_t	stop = ChunkStop(chunkIdx);
+		const size_t	simdStop = start + ((stop - start) & ~(size_t)3);
+		const float		scale = expf(m_ChunkMax[chunkIdx] - globalMax) / globalSum;
+		const __m128	scale_xxxx = _mm_set1_ps(scale);
+		float			*outputPtr = m_Output.Data();
+
+		for (size_t i = start; i < simdStop; i += 4)
+			_mm_store_ps(outputPtr + i, _mm_mul_ps(_mm_load_ps(outputPtr + i), scale_xxxx));
+		for (size_t i = simdStop; i < stop; ++i)
+			outputPtr[i] *= scale;
+	}
+}
+
+void	CLayerSoftMax::GlobalMaxAndSum(float &globalMax, float &globalSum) const
+{
+	globalMax = -FLT_MAX;
+	globalSum = 0.0f;
+	for (size_t chunkIdx = 0; chunkIdx < m_ChunkMax.size(); ++chunkIdx)
+		globalMax = std::max(globalMax, m_ChunkMax[chunkIdx]);
+	for (size_t chunkIdx = 0; chunkIdx < m_ChunkMax.size(); ++chunkIdx)
+		globalSum += m_ChunkSum[chunkIdx] * expf(m_ChunkMax[chunkIdx] - globalMax);
+	assert(globalSum >= 1.0f);
 }
 
-void	CLayerSoftMax::BackPropagateError(const float *prevOutput, const std::vector<float> &error, size_t rangeMin, size_t rangeMax)
+float	CLayerSoftMax::BackPropagateError(const float *prevOutput, const SLossTarget &target, size_t rangeMin, size_t rangeMax)
 {
 	MICROPROFILE_SCOPEI("CLayerSoftMax", "CLayerSoftMax::BackPropagateError", MP_RED1);
+	const size_t	outMin = ChunkStart(rangeMin);
+	const size_t	outMax = ChunkStop(rangeMax - 1);
+
+	// Binary cross entropy expects sigmoid outputs:
+	assert(target.m_Loss != ELoss::BinaryCrossEntropy);
+	if (target.m_Loss != ELoss::SoftmaxCrossEntropy)
+	{
+		// Slopes are passed as is to the previous layer, this is the cross entropy gradient:
+		return ComputeLossSlopes(target, outMin, outMax);
+	}
+
+	// Softmax and cross entropy fused:
+	// slope = softmax - expected, loss = -sum(expected * log(softmax))
+	// with log(softmax) = input - log(sum(exp(input))) computed from the forward pass reductions.
+	const float		*outputPtr = m_Output.Data();
 	float			*slopePtr = m_SlopesOut.Data();
-	const float		*errorPtr = error.data();
+	float			globalMax;
+	float			globalSum;
+	float			loss = 0.0f;
 
-	for (size_t outIdx = rangeMin; outIdx < rangeMax; ++outIdx)
-		slopePtr[outIdx] = -errorPtr[outIdx];
+	GlobalMaxAndSum(globalMax, globalSum);
+	const float		logSumExp = globalMax + logf(globalSum);
+	if (target.m_Expected == nullptr)
+	{
+		memcpy(slopePtr + outMin, outputPtr + outMin, (outMax - outMin) * sizeof(float));
+		if (target.m_ClassIdx >= outMin && target.m_ClassIdx < outMax)
+		{
+			slopePtr[target.m_ClassIdx] -= 1.0f;
+			loss = logSumExp - prevOutput[target.m_ClassIdx];
+		}
+		return loss;
+	}
+	for (size_t outIdx = outMin; outIdx < outMax; ++outIdx)
+	{
+		const float		expected = target.m_Expected[outIdx];
+
+		slopePtr[outIdx] = outputPtr[outIdx] - expected;
+		if (expected != 0.0f)
+			loss += expected * (logSumExp - prevOutput[outIdx]);
+	}
+	return loss;
 }
 
 void	CLayerSoftMax::BackPropagateError(const float *prevOutput, const CLayer* nextLayer, size_t rangeMin, size_t rangeMax)
@@ -86,10 +224,11 @@ bool	CLayerSoftMax::UnSerialize(const std::vector<uint8_t>& data, size_t& curIdx
 
 size_t	CLayerSoftMax::GetThreadingHint() const
 {
-	return 1;
+	// exp is expensive, only large outputs are worth splitting:
+	return m_InputSize * 16;
 }
 
 size_t	CLayerSoftMax::GetDomainSize() const
 {
-	return GetOutputSize();
+	return m_ChunkMax.size();
 }
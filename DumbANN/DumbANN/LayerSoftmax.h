@@ -12,7 +12,9 @@ public:
 	bool	Setup(size_t inputSize);
 
 	virtual void	FeedForward(const float *input, size_t rangeMin, size_t rangeMax) override;
-	virtual void	BackPropagateError(const float *prevOutput, const std::vector<float> &error, size_t rangeMin, size_t rangeMax) override;
+	virtual bool	NeedsFeedForwardFinalize() const override { return true; }
+	virtual void	FeedForwardFinalize(size_t rangeMin, size_t rangeMax) override;
+	virtual float	BackPropagateError(const float *prevOutput, const SLossTarget &target, size_t rangeMin, size_t rangeMax) override;
 	virtual void	BackPropagateError(const float* prevOutput, const CLayer *nextLayer, size_t rangeMin, size_t rangeMax) override;
 	virtual void	UpdateWeightsAndBias(size_t trainingSteps, size_t rangeMin, size_t rangeMax) override;
 	virtual void	GatherSlopes(float *dst, const CLayer *prevLayer, size_t rangeMin, size_t rangeMax) const override;
@@ -21,9 +23,18 @@ public:
 	virtual bool	UnSerialize(const std::vector<uint8_t> &data, size_t &curIdx) override;
 
 	virtual size_t	GetThreadingHint() const override;
+	// The domain is in chunks of kChunkSize outputs:
 	virtual size_t	GetDomainSize() const override;
+	virtual ELayerType	GetLayerType() const override { return ELayerType::LayerSofmax; }
+
+	static const size_t	kChunkSize = 1024;
 
 private:
-	float				m_CurrentSum;
-	CNeuronMatrix		m_Jacobian;
-};
\ No newline at end of file
+	size_t				ChunkStart(size_t chunkIdx) const { return chunkIdx * kChunkSize; }
+	size_t				ChunkStop(size_t chunkIdx) const { return std::min((chunkIdx + 1) * kChunkSize, m_InputSize); }
+	void				GlobalMaxAndSum(float &globalMax, float &globalSum) const;
+
+	// Max and sum of exp(x - max) of each chunk, combined by FeedForwardFinalize:
+	std::vector<float>	m_ChunkMax;
+	std::vector<float>	m_ChunkSum;
+};
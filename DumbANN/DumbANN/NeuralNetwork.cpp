@@ -1,15 +1,24 @@
 
 #include "NeuralNetwork.h"
+#include "LayerBatchNorm.h"
+#include "LayerConv2D.h"
+#include "LayerDense.h"
+#include "LayerDropout.h"
+#include "LayerMaxPooling.h"
 
 #include <xmmintrin.h>
 
 #include <assert.h>
+#include <math.h>
 
 #include <thread>
 #include <algorithm>
 
 CNeuralNetwork::CNeuralNetwork()
 :	m_CurrentTrainingStep(0)
+,	m_Loss(ELoss::MeanSquaredError)
+,	m_LastLoss(0.0f)
+,	m_Verbose(false)
 {
 }
 
@@ -24,43 +33,213 @@ bool	CNeuralNetwork::AddLayer(CLayer *layer)
 		assert(m_Layers.back()->GetOutputSize() == layer->GetInputSize());
 		if (m_Layers.back()->GetOutputSize() != layer->GetInputSize())
 			return false;
+		if (layer->SkipsZeroInputs())
+			m_Layers.back()->AllocateNonZeroOutputs();
 	}
+	layer->LinkInput(m_Layers.empty() ? nullptr : m_Layers.back());
 	m_Layers.push_back(layer);
+	m_FusionEnd.push_back(m_Layers.size() - 1);
+	// With gradient checkpointing, the new last layer keeps its activations:
+	if (!m_KeptActivations.empty())
+		m_KeptActivations.push_back(true);
+	FuseMaxPooling();
 	return true;
 }
 
+bool	CNeuralNetwork::ReplaceLayers(size_t layerIdx, size_t count, const std::vector<CLayer*> &layers)
+{
+	std::vector<CLayer*>	newLayers(m_Layers);
+	// The plan depends on the order of the layers:
+	const bool				plannedMemory = m_ActivationArena.Size() != 0;
+	// The checkpoints after the replaced layers move with them, the ones among them are dropped:
+	std::vector<size_t>		checkpoints;
+
+	assert(layerIdx + count <= m_Layers.size());
+	for (size_t checkpointIdx : m_CheckpointLayers)
+	{
+		if (checkpointIdx < layerIdx)
+			checkpoints.push_back(checkpointIdx);
+		else if (checkpointIdx >= layerIdx + count)
+			checkpoints.push_back(checkpointIdx - count + layers.size());
+	}
+	if (plannedMemory && !PlanInferenceMemory(false))
+		return false;
+	if (!m_CheckpointLayers.empty() && !SetCheckpoints({ }))
+		return false;
+	// The removed layers belong to the caller, they must not point to the parameter arena once it is released:
+	if (!m_ParameterArena.Empty())
+	{
+		std::vector<CNeuronMatrix*>	matrices;
+		std::vector<CNeuronVector*>	vectors;
+
+		for (size_t i = layerIdx; i < layerIdx + count; ++i)
+			m_Layers[i]->GetParameterStorages(matrices, vectors);
+		for (CNeuronMatrix *matrix : matrices)
+		{
+			if (!matrix->OwnStorage())
+				return false;
+		}
+		for (CNeuronVector *vector : vectors)
+		{
+			if (!vector->OwnStorage())
+				return false;
+		}
+	}
+	newLayers.erase(newLayers.begin() + layerIdx, newLayers.begin() + layerIdx + count);
+	newLayers.insert(newLayers.begin() + layerIdx, layers.begin(), layers.end());
+	m_Layers.clear();
+	m_FusionEnd.clear();
+	for (CLayer *layer : newLayers)
+	{
+		if (!AddLayer(layer))
+			return false;
+	}
+	if (plannedMemory)
+		return PlanInferenceMemory(true);
+	return checkpoints.empty() || SetCheckpoints(checkpoints);
+}
+
+void	CNeuralNetwork::FuseMaxPooling()
+{
+	// Conv2D -> (DropOut) -> MaxPooling runs as a single pass, detected when the max pooling is added:
+	const size_t	poolIdx = m_Layers.size() - 1;
+
+	if (poolIdx < 1 || m_Layers[poolIdx]->GetLayerType() != ELayerType::LayerMaxPooling)
+		return;
+	const CLayerMaxPooling2D	*maxPool = static_cast<const CLayerMaxPooling2D*>(m_Layers[poolIdx]);
+	size_t						convIdx = poolIdx - 1;
+
+	if (m_Layers[convIdx]->GetLayerType() == ELayerType::LayerDropout && convIdx >= 1)
+		--convIdx;
+	// The fused pass has no int8 path:
+	if (m_Layers[convIdx]->GetLayerType() != ELayerType::LayerConv2D || !maxPool->CanPoolRows() || m_Layers[convIdx]->IsQuantized())
+		return;
+	const CLayerConv2D			*conv = static_cast<const CLayerConv2D*>(m_Layers[convIdx]);
+
+	if (conv->GetFeatureCount() == maxPool->GetFeatureCount() &&
+		conv->GetOutputSizeX() == maxPool->GetOutputSizeX() * maxPool->GetFeatureSizeX() &&
+		conv->GetOutputSizeY() == maxPool->GetOutputSizeY() * maxPool->GetFeatureSizeY())
+		m_FusionEnd[convIdx] = poolIdx;
+}
+
 bool	CNeuralNetwork::FeedForward(const float *input)
 {
 	MICROPROFILE_SCOPEI("CNeuralNetwork", "FeedForward", MP_GREEN3);
 	if (!m_Layers.empty())
+		FeedForwardLayers(input, 0, m_Layers.size() - 1);
+	return true;
+}
+
+void	CNeuralNetwork::FeedForwardLayers(const float *input, size_t layerMin, size_t layerMax)
+{
+	const SNonZeroList	*inputNonZero = nullptr;
+	// The slopes of a layer are only used when it or a layer before it learns:
+	bool				needsSlopes = false;
+
+	for (size_t i = 0; i < layerMin; ++i)
+		needsSlopes |= m_Layers[i]->Learn();
+	// The non zero outputs of the layer before the range are still valid:
+	if (layerMin != 0 && m_Layers[layerMin - 1]->HasSparseOutput() && m_Layers[layerMin]->SkipsZeroInputs())
+		inputNonZero = &m_Layers[layerMin - 1]->GetNonZeroOutputs();
+	for (size_t i = layerMin; i <= layerMax; ++i)
 	{
-		for (size_t i = 0; i < m_Layers.size(); ++i)
+		const float					*nextInput = (i == 0) ? input : m_Layers[i - 1]->GetOutput().Data();
+		CLayer						*layer = m_Layers[i];
+
+		needsSlopes |= layer->Learn();
+		layer->SetInputNonZero(inputNonZero);
+		if (layer->IsQuantized())
+		{
+			std::function<void(size_t, size_t)>	quantizeInput = [layer, nextInput](size_t minRange, size_t maxRange)
+			{
+				layer->QuantizeInput(nextInput, minRange, maxRange);
+			};
+			m_TaskManager.MultithreadRange(quantizeInput, layer->GetInputSize(), layer->GetInputSize());
+		}
+		if (m_FusionEnd[i] != i)
+		{
+			const size_t				fusionEnd = m_FusionEnd[i];
+			CLayerConv2D				*conv = static_cast<CLayerConv2D*>(layer);
+			const CLayerDropOut			*dropOut = (fusionEnd - i == 2) ? static_cast<const CLayerDropOut*>(m_Layers[i + 1]) : nullptr;
+			CLayerMaxPooling2D			*maxPool = static_cast<CLayerMaxPooling2D*>(m_Layers[fusionEnd]);
+			// The inference memory plan has no room for the conv net input:
+			const bool					keepNetInput = needsSlopes && m_ActivationArena.Size() == 0;
+			std::function<void(size_t, size_t)>	feedForwardFused = [=](size_t minRange, size_t maxRange)
+			{
+				conv->FeedForwardFusedMaxPool(nextInput, dropOut, maxPool, keepNetInput, minRange, maxRange);
+			};
+			// The conv output and the dropout output are never written:
+			m_TaskManager.MultithreadRange(feedForwardFused, conv->GetDomainSize(), conv->GetThreadingHint() / 8);
+			for (size_t j = i + 1; j <= fusionEnd; ++j)
+			{
+				needsSlopes |= m_Layers[j]->Learn();
+				m_Layers[j]->SetInputNonZero(nullptr);
+			}
+			i = fusionEnd;
+			layer = maxPool;
+		}
+		else
 		{
-			const float					*nextInput = (i == 0) ? input : m_Layers[i - 1]->GetOutput().Data();
-			CLayer						*layer = m_Layers[i];
 			std::function<void(size_t, size_t)>	feedForward = [layer, nextInput](size_t minRange, size_t maxRange)
 			{
 				layer->FeedForward(nextInput, minRange, maxRange);
 			};
 			// Feed forward is FAST, we can reduce the threading hint:
 			m_TaskManager.MultithreadRange(feedForward, layer->GetDomainSize(), layer->GetThreadingHint() / 8);
+			if (layer->NeedsFeedForwardFinalize())
+			{
+				std::function<void(size_t, size_t)>	feedForwardFinalize = [layer](size_t minRange, size_t maxRange)
+				{
+					layer->FeedForwardFinalize(minRange, maxRange);
+				};
+				m_TaskManager.MultithreadRange(feedForwardFinalize, layer->GetDomainSize(), layer->GetThreadingHint() / 8);
+			}
+		}
+		inputNonZero = nullptr;
+		if (i + 1 < m_Layers.size() && layer->HasSparseOutput() && m_Layers[i + 1]->SkipsZeroInputs())
+		{
+			// The next layer skips the zero outputs (dead ReLUs, dropped units):
+			std::function<void(size_t, size_t)>	buildNonZero = [layer](size_t minRange, size_t maxRange)
+			{
+				layer->BuildNonZeroOutputs(minRange, maxRange);
+			};
+			m_TaskManager.MultithreadRange(buildNonZero, layer->GetOutputSize(), layer->GetOutputSize());
+			inputNonZero = &layer->GetNonZeroOutputs();
 		}
 	}
-	return true;
 }
 
 bool	CNeuralNetwork::BackPropagateError(const float *input, const float *expected)
+{
+	SLossTarget		target;
+
+	target.m_Loss = m_Loss;
+	target.m_Expected = expected;
+	return BackPropagateError(input, target);
+}
+
+bool	CNeuralNetwork::BackPropagateError(const float *input, size_t expectedClass)
+{
+	SLossTarget		target;
+
+	assert(expectedClass < m_Layers.back()->GetOutputSize());
+	target.m_Loss = m_Loss;
+	target.m_ClassIdx = expectedClass;
+	return BackPropagateError(input, target);
+}
+
+bool	CNeuralNetwork::BackPropagateError(const float *input, const SLossTarget &target)
 {
 	MICROPROFILE_SCOPEI("CNeuralNetwork", "BackPropagateError", MP_RED3);
+	// The inference memory plan overwrites the activations of the layers:
+	assert(m_ActivationArena.Size() == 0);
+	if (m_ActivationArena.Size() != 0)
+		return false;
+	m_LastLoss = 0.0f;
 	if (!m_Layers.empty())
 	{
-		std::vector<float>			error;
-		size_t						outSize = m_Layers.back()->GetOutputSize();
-		const float					*output = m_Layers.back()->GetOutput().Data();
-
-		error.resize(outSize);
-		for (int i = 0; i < error.size(); ++i)
-			error[i] = expected[i] - output[i];
+		// Gradient checkpointing: the last segment is still resident after the feed forward:
+		bool	lastSegment = true;
 
 		for (int i = m_Layers.size() - 1; i >= 0; --i)
 		{
@@ -69,10 +248,27 @@ bool	CNeuralNetwork::BackPropagateError(const float *input, const float *expecte
 			const CLayer	*prevLayer = (i == 0) ? nullptr : m_Layers[i - 1];
 			const float		*prevOutput = (prevLayer == nullptr) ? input : prevLayer->GetOutput().Data();
 
+			if (!m_KeptActivations.empty() && i != 0 && m_KeptActivations[i] && !m_KeptActivations[i - 1])
+			{
+				// The segment before this layer is fed forward again from the previous checkpoint:
+				size_t	segmentMin = i - 1;
+
+				while (segmentMin != 0 && !m_KeptActivations[segmentMin - 1])
+					--segmentMin;
+				if (!lastSegment)
+					FeedForwardLayers(input, segmentMin, i - 1);
+				lastSegment = false;
+			}
+
 			std::function<void(size_t, size_t)>	backProp = [&](size_t minRange, size_t maxRange)
 			{
 				if (nextLayer == nullptr)
-					layer->BackPropagateError(prevOutput, error, minRange, maxRange);
+				{
+					// The loss is computed with the last layer slopes:
+					const float		loss = layer->BackPropagateError(prevOutput, target, minRange, maxRange);
+					std::lock_guard<std::mutex>	lock(m_LossLock);
+					m_LastLoss += loss;
+				}
 				else
 				{
 					layer->BackPropagateError(prevOutput, nextLayer, minRange, maxRange);
@@ -111,6 +307,7 @@ bool	CNeuralNetwork::UpdateWeightAndBiases()
 			{
 				layer->UpdateWeightsAndBias(m_CurrentTrainingStep, minRange, maxRange);
 			};
+			layer->BeginUpdate();
 			m_TaskManager.MultithreadRange(updateWeightAndBias, layer->GetDomainSize(), layer->GetThreadingHint(), false);
 		}
 	}
@@ -122,6 +319,7 @@ void	CNeuralNetwork::PrintDetails() const
 {
 	printf("-------------------------------\n");
 	printf("Neural Network with %zu layers:\n", m_Layers.size());
+	printf("Loss: %s\n", kLossNames[(int)m_Loss]);
 	for (const CLayer *layer : m_Layers)
 	{
 		printf("-------------------------------\n");
@@ -206,6 +404,625 @@ bool	CNeuralNetwork::UnSerialize(const char* path)
 		}
 	}
 	fclose(annFile);
+	return true;
+}
+
+bool	CNeuralNetwork::Quantize(const float *samples, size_t sampleCount)
+{
+	if (m_Layers.empty() || sampleCount == 0)
+		return false;
+	const size_t		inputSize = m_Layers.front()->GetInputSize();
+	const size_t		outputSize = GetOutput().Size();
+	std::vector<float>	inputRanges(m_Layers.size(), 0.0f);
+	std::vector<float>	floatOutputs(m_Verbose ? sampleCount * outputSize : 0);
+	// The calibration reads the input of every layer, the inference memory plan and the checkpointing do not keep them:
+	const bool					plannedMemory = m_ActivationArena.Size() != 0;
+	const std::vector<size_t>	checkpoints = m_CheckpointLayers;
+
+	if (plannedMemory && !PlanInferenceMemory(false))
+		return false;
+	if (!checkpoints.empty() && !SetCheckpoints({ }))
+		return false;
+	// Calibration: largest absolute input of each layer, and the float outputs for the report:
+	for (size_t sampleIdx = 0; sampleIdx < sampleCount; ++sampleIdx)
+	{
+		const float		*sample = samples + sampleIdx * inputSize;
+
+		FeedForward(sample);
+		for (size_t i = 0; i < m_Layers.size(); ++i)
+		{
+			if (!m_Layers[i]->CanQuantize())
+				continue;
+			const float		*input = (i == 0) ? sample : m_Layers[i - 1]->GetOutput().Data();
+
+			for (size_t inIdx = 0; inIdx < m_Layers[i]->GetInputSize(); ++inIdx)
+				inputRanges[i] = std::max(inputRanges[i], fabsf(input[inIdx]));
+		}
+		if (m_Verbose)
+			memcpy(floatOutputs.data() + sampleIdx * outputSize, GetOutput().Data(), outputSize * sizeof(float));
+	}
+	if (plannedMemory && !PlanInferenceMemory(true))
+		return false;
+	if (!checkpoints.empty() && !SetCheckpoints(checkpoints))
+		return false;
+
+	size_t	quantizedCount = 0;
+	size_t	floatWeightsSize = 0;
+	size_t	quantizedWeightsSize = 0;
+
+	for (size_t i = 0; i < m_Layers.size(); ++i)
+	{
+		CLayer	*layer = m_Layers[i];
+
+		if (!layer->CanQuantize())
+			continue;
+		if (!layer->Quantize(inputRanges[i]))
+		{
+			fprintf(stderr, "Could not quantize layer %zu\n", i);
+			return false;
+		}
+		// A quantized conv runs its own pass, without the fused pooling:
+		m_FusionEnd[i] = i;
+		floatWeightsSize += layer->GetWeights().View().m_Rows * layer->GetWeights().View().m_Columns * sizeof(float);
+		quantizedWeightsSize += layer->GetWeights().View().m_Rows * (layer->GetWeights().View().m_Columns + sizeof(float));
+		++quantizedCount;
+	}
+
+	if (!m_Verbose)
+		return true;
+	// Accuracy against the float network:
+	size_t	sameClassCount = 0;
+	float	maxError = 0.0f;
+	double	errorSum = 0.0;
+
+	for (size_t sampleIdx = 0; sampleIdx < sampleCount; ++sampleIdx)
+	{
+		const float		*floatOutput = floatOutputs.data() + sampleIdx * outputSize;
+		const float		*quantizedOutput = GetOutput().Data();
+
+		FeedForward(samples + sampleIdx * inputSize);
+		for (size_t outIdx = 0; outIdx < outputSize; ++outIdx)
+		{
+			const float		error = fabsf(quantizedOutput[outIdx] - floatOutput[outIdx]);
+
+			maxError = std::max(maxError, error);
+			errorSum += error;
+		}
+		if (std::max_element(floatOutput, floatOutput + outputSize) - floatOutput ==
+			std::max_element(quantizedOutput, quantizedOutput + outputSize) - quantizedOutput)
+			++sameClassCount;
+	}
+	printf("Int8 quantization: %zu layers, weights %zu -> %zu bytes\n", quantizedCount, floatWeightsSize, quantizedWeightsSize);
+	printf(	"\tOn %zu samples: top-1 agreement %.2f%%, mean output error %f, max output error %f\n",
+			sampleCount, 100.0f * sameClassCount / sampleCount, errorSum / (sampleCount * outputSize), maxError);
+	return true;
+}
+
+bool	CNeuralNetwork::ConvertWeightsToHalf(EHalfFormat format)
+{
+	for (CLayer *layer : m_Layers)
+	{
+		if (layer->CanUseHalfWeights() && !layer->IsQuantized() && !layer->ConvertWeightsToHalf(format))
+			return false;
+	}
+	return true;
+}
+
+bool	CNeuralNetwork::SetBlockSparsity(float sparsity)
+{
+	size_t	layerCount = 0;
+	size_t	denseByteSize = 0;
+	size_t	sparseByteSize = 0;
+
+	m_TaskManager.WaitForCompletion(true);
+	for (CLayer *layer : m_Layers)
+	{
+		if (!layer->CanUseBlockSparseWeights() || layer->IsQuantized() || layer->UsesHalfWeights())
+			continue;
+		if (!layer->SetBlockSparsity(sparsity))
+			return false;
+		const SNeuronMatrixView	&weights = layer->GetWeights().View();
+
+		denseByteSize += weights.m_Rows * weights.m_Columns * sizeof(float);
+		sparseByteSize += layer->GetBlockSparseWeights().StorageByteSize();
+		++layerCount;
+	}
+	if (m_Verbose)
+		printf("Block sparse weights: %zu layers, weights %zu -> %zu bytes\n", layerCount, denseByteSize, sparseByteSize);
+	return true;
+}
+
+bool	CNeuralNetwork::SetMixedPrecision(bool enable)
+{
+	size_t	scratchSize = 0;
+
+	m_TaskManager.WaitForCompletion(true);
+	for (const CLayer *layer : m_Layers)
+	{
+		if (layer->CanUseMixedPrecision())
+			scratchSize = std::max(scratchSize, layer->GetNetInput().Size());
+	}
+	if (enable && !m_NetInputScratch.AllocateStorage(scratchSize))
+		return false;
+	for (CLayer *layer : m_Layers)
+	{
+		if (layer->CanUseMixedPrecision() && !layer->SetMixedPrecision(enable ? m_NetInputScratch.Data() : nullptr))
+			return false;
+	}
+	if (!enable)
+		m_NetInputScratch.AllocateStorage(0);
+	return true;
+}
+
+bool	CNeuralNetwork::PruneDenseLayers(const float *samples, size_t sampleCount, float threshold)
+{
+	if (m_Layers.empty() || sampleCount == 0)
+		return false;
+	const size_t	inputSize = m_Layers.front()->GetInputSize();
+	// Reduced layers are setup again, their net input leaves the shared scratch.
+	// The output statistics read every layer, the inference memory plan and the checkpointing do not keep them:
+	const bool					mixedPrecision = m_NetInputScratch.Size() != 0;
+	const bool					plannedMemory = m_ActivationArena.Size() != 0;
+	const std::vector<size_t>	checkpoints = m_CheckpointLayers;
+
+	if (plannedMemory && !PlanInferenceMemory(false))
+		return false;
+	if (!checkpoints.empty() && !SetCheckpoints({ }))
+		return false;
+	if (mixedPrecision)
+		SetMixedPrecision(false);
+
+	// Output range and mean of the layers that can be pruned:
+	std::vector<size_t>		prunedLayers;
+	std::vector<std::vector<float>>		minOutputs;
+	std::vector<std::vector<float>>		maxOutputs;
+	std::vector<std::vector<double>>	sumOutputs;
+
+	for (size_t i = 0; i + 1 < m_Layers.size(); ++i)
+	{
+		const CLayer	*layer = m_Layers[i];
+		const CLayer	*nextLayer = m_Layers[i + 1];
+
+		if (layer->GetLayerType() != ELayerType::LayerDense || nextLayer->GetLayerType() != ELayerType::LayerDense)
+			continue;
+		if (layer->IsQuantized() || layer->UsesHalfWeights() || nextLayer->IsQuantized() || nextLayer->UsesHalfWeights())
+			continue;
+		prunedLayers.push_back(i);
+		minOutputs.push_back(std::vector<float>(layer->GetOutputSize(), FLT_MAX));
+		maxOutputs.push_back(std::vector<float>(layer->GetOutputSize(), -FLT_MAX));
+		sumOutputs.push_back(std::vector<double>(layer->GetOutputSize(), 0.0));
+	}
+	for (size_t sampleIdx = 0; sampleIdx < sampleCount; ++sampleIdx)
+	{
+		FeedForward(samples + sampleIdx * inputSize);
+		for (size_t j = 0; j < prunedLayers.size(); ++j)
+		{
+			const CNeuronVector	&output = m_Layers[prunedLayers[j]]->GetOutput();
+
+			for (size_t outIdx = 0; outIdx < output.Size(); ++outIdx)
+			{
+				minOutputs[j][outIdx] = std::min(minOutputs[j][outIdx], output.Data()[outIdx]);
+				maxOutputs[j][outIdx] = std::max(maxOutputs[j][outIdx], output.Data()[outIdx]);
+				sumOutputs[j][outIdx] += output.Data()[outIdx];
+			}
+		}
+	}
+
+	bool	success = true;
+	for (size_t j = 0; j < prunedLayers.size(); ++j)
+	{
+		const size_t		layerIdx = prunedLayers[j];
+		CLayerDense			*layer = static_cast<CLayerDense*>(m_Layers[layerIdx]);
+		CLayerDense			*nextLayer = static_cast<CLayerDense*>(m_Layers[layerIdx + 1]);
+		const size_t		outputSize = layer->GetOutputSize();
+		std::vector<bool>	keep(outputSize);
+		std::vector<float>	meanOutputs(outputSize);
+		size_t				keptCount = 0;
+
+		for (size_t outIdx = 0; outIdx < outputSize; ++outIdx)
+		{
+			const float		*weightsPtr = layer->GetWeights().View().GetRow(outIdx);
+			float			rowNorm = 0.0f;
+			float			columnNorm = 0.0f;
+
+			for (size_t inIdx = 0; inIdx < layer->GetInputSize(); ++inIdx)
+				rowNorm += weightsPtr[inIdx] * weightsPtr[inIdx];
+			for (size_t nextIdx = 0; nextIdx < nextLayer->GetOutputSize(); ++nextIdx)
+				columnNorm += nextLayer->GetWeights().View().GetRow(nextIdx)[outIdx] * nextLayer->GetWeights().View().GetRow(nextIdx)[outIdx];
+			keep[outIdx] =	minOutputs[j][outIdx] != maxOutputs[j][outIdx] &&
+							sqrtf(rowNorm) >= threshold &&
+							sqrtf(columnNorm) >= threshold;
+			meanOutputs[outIdx] = static_cast<float>(sumOutputs[j][outIdx] / sampleCount);
+			keptCount += keep[outIdx] ? 1 : 0;
+		}
+		if (keptCount == outputSize)
+			continue;
+		// Never leave an empty layer:
+		if (keptCount == 0)
+		{
+			keep[0] = true;
+			keptCount = 1;
+		}
+		if (!nextLayer->RemoveInputs(keep, meanOutputs.data()) || !layer->RemoveOutputs(keep))
+		{
+			fprintf(stderr, "Could not prune layer %zu\n", layerIdx);
+			success = false;
+			break;
+		}
+		if (nextLayer->SkipsZeroInputs())
+			layer->AllocateNonZeroOutputs();
+		if (m_Verbose)
+			printf("Pruned layer %zu: %zu -> %zu neurons\n", layerIdx, outputSize, keptCount);
+	}
+	// Restored on failure too, the layers pruned before stay valid:
+	if (mixedPrecision)
+		SetMixedPrecision(true);
+	if (plannedMemory)
+		success = PlanInferenceMemory(true) && success;
+	if (!checkpoints.empty())
+		success = SetCheckpoints(checkpoints) && success;
+	return success && RepackParametersIFN();
+}
+
+bool	CNeuralNetwork::FactorizeDenseLayer(size_t layerIdx, CLayerDense *first, CLayerDense *second, const float *samples, size_t sampleCount, float minAgreement,
+											std::vector<CLayer*> &removedLayers)
+{
+	m_TaskManager.WaitForCompletion(true);
+	if (layerIdx >= m_Layers.size() || m_Layers[layerIdx]->GetLayerType() != ELayerType::LayerDense || sampleCount == 0)
+		return false;
+	CLayerDense		*layer = static_cast<CLayerDense*>(m_Layers[layerIdx]);
+	const size_t	maxRank = layer->MaxUsefulRank();
+	SLowRankFactors	factors;
+
+	// The decomposition works on the float weights:
+	if (layer->IsQuantized() || layer->UsesHalfWeights() || layer->UsesBlockSparseWeights() || maxRank == 0)
+		return false;
+	if (!layer->ComputeLowRankFactors(factors))
+	{
+		fprintf(stderr, "Singular value decomposition of layer %zu did not converge\n", layerIdx);
+		return false;
+	}
+	// The new layers are added in FP32, the shared scratch is sized again afterwards:
+	const bool		mixedPrecision = m_NetInputScratch.Size() != 0;
+	if (mixedPrecision)
+		SetMixedPrecision(false);
+
+	const size_t		inputSize = m_Layers.front()->GetInputSize();
+	const size_t		outputSize = GetOutput().Size();
+	std::vector<float>	refOutputs(sampleCount * outputSize);
+
+	for (size_t sampleIdx = 0; sampleIdx < sampleCount; ++sampleIdx)
+	{
+		FeedForward(samples + sampleIdx * inputSize);
+		memcpy(refOutputs.data() + sampleIdx * outputSize, GetOutput().Data(), outputSize * sizeof(float));
+	}
+
+	size_t	sameClassCount = 0;
+	float	maxError = 0.0f;
+	double	errorSum = 0.0;
+	// Runs the network with the factorized layer of the given rank in place of the original one:
+	auto	evaluateRank = [&](size_t rank)
+	{
+		sameClassCount = 0;
+		maxError = 0.0f;
+		errorSum = 0.0;
+		if (!layer->SetupLowRank(factors, rank, *first, *second) || !ReplaceLayers(layerIdx, 1, { first, second }))
+			return false;
+		for (size_t sampleIdx = 0; sampleIdx < sampleCount; ++sampleIdx)
+		{
+			const float		*refOutput = refOutputs.data() + sampleIdx * outputSize;
+			const float		*output = GetOutput().Data();
+
+			FeedForward(samples + sampleIdx * inputSize);
+			for (size_t outIdx = 0; outIdx < outputSize; ++outIdx)
+			{
+				const float		error = fabsf(output[outIdx] - refOutput[outIdx]);
+
+				maxError = std::max(maxError, error);
+				errorSum += error;
+			}
+			if (std::max_element(refOutput, refOutput + outputSize) - refOutput ==
+				std::max_element(output, output + outputSize) - output)
+				++sameClassCount;
+		}
+		return ReplaceLayers(layerIdx, 2, { layer });
+	};
+
+	// Binary search of the smallest rank reaching the agreement:
+	size_t	rankMin = 1;
+	size_t	rankMax = std::min(maxRank, factors.Rank());
+	bool	evaluated = true;
+
+	while (evaluated && rankMin < rankMax)
+	{
+		const size_t	rank = (rankMin + rankMax) / 2;
+
+		evaluated = evaluateRank(rank);
+		if (sameClassCount >= minAgreement * sampleCount)
+			rankMax = rank;
+		else
+			rankMin = rank + 1;
+	}
+	evaluated = evaluated && evaluateRank(rankMin);
+	bool	success = evaluated && sameClassCount >= minAgreement * sampleCount;
+
+	if (evaluated && m_Verbose)
+	{
+		printf(	"Low rank factorization of layer %zu: rank %zu, weights %zu -> %zu\n",
+				layerIdx, rankMin, layer->GetInputSize() * layer->GetOutputSize(), rankMin * (layer->GetInputSize() + layer->GetOutputSize()));
+		printf(	"\tOn %zu samples: top-1 agreement %.2f%%, mean output error %f, max output error %f\n",
+				sampleCount, 100.0f * sameClassCount / sampleCount, errorSum / (sampleCount * outputSize), maxError);
+	}
+	success = success && ReplaceLayers(layerIdx, 1, { first, second });
+	if (success)
+	{
+		removedLayers.push_back(layer);
+		success = RepackParametersIFN();
+	}
+	// Every exit goes through here, a network training in mixed precision stays in mixed precision:
+	if (mixedPrecision)
+		SetMixedPrecision(true);
+	return success;
+}
+
+bool	CNeuralNetwork::FoldBatchNorm(std::vector<CLayer*> &removedLayers)
+{
+	size_t	foldedCount = 0;
+	size_t	keptCount = 0;
+
+	m_TaskManager.WaitForCompletion(true);
+	for (size_t layerIdx = 1; layerIdx < m_Layers.size(); ++layerIdx)
+	{
+		if (m_Layers[layerIdx]->GetLayerType() != ELayerType::LayerBatchNorm)
+			continue;
+		CLayerBatchNorm			*batchNorm = static_cast<CLayerBatchNorm*>(m_Layers[layerIdx]);
+		CLayer					*prevLayer = m_Layers[layerIdx - 1];
+		std::vector<float>		scale;
+		std::vector<float>		shift;
+
+		batchNorm->ComputeFoldedScale(scale, shift);
+		// The normalization applies to the net input of the previous layer only when it has no activation:
+		if (prevLayer->GetActivation() != EActivation::Linear ||
+			!prevLayer->FoldOutputScale(scale.data(), shift.data(), batchNorm->GetFeatureCount()))
+		{
+			++keptCount;
+			continue;
+		}
+		prevLayer->SetActivation(batchNorm->GetActivation());
+		if (!ReplaceLayers(layerIdx, 1, { }))
+			return false;
+		removedLayers.push_back(batchNorm);
+		--layerIdx;
+		++foldedCount;
+	}
+	if (m_Verbose)
+		printf("Batch normalization folding: %zu layers folded, %zu kept\n", foldedCount, keptCount);
+	return true;
+}
+
+bool	CNeuralNetwork::PlanInferenceMemory(bool enable)
+{
+	m_TaskManager.WaitForCompletion(true);
+	if (!enable)
+	{
+		if (m_ActivationArena.Size() == 0)
+			return true;
+		for (size_t layerIdx = 0; layerIdx < m_Layers.size(); ++layerIdx)
+		{
+			if (!m_Layers[layerIdx]->AliasActivations(nullptr, nullptr))
+				return false;
+			// Layers aliasing their input point again to the previous output:
+			if (layerIdx != 0)
+				m_Layers[layerIdx]->LinkInput(m_Layers[layerIdx - 1]);
+		}
+		m_ActivationArena.AllocateStorage(0);
+		return true;
+	}
+	if (m_Layers.empty() || m_ActivationArena.Size() != 0)
+		return true;
+	if (!m_KeptActivations.empty())
+	{
+		fprintf(stderr, "The inference memory plan is not available with gradient checkpointing\n");
+		return false;
+	}
+
+	// An output is live from the feed forward of its layer to the one of the next layer (or of the end of its fusion,
+	// whose layers are not written). Consecutive outputs go to different buffers, a layer aliasing its input (flatten)
+	// shares the buffer of the previous layer:
+	std::vector<size_t>	bufferIdx(m_Layers.size());
+	std::vector<bool>	aliasesInput(m_Layers.size());
+	size_t				bufferSize[2] = { 0, 0 };
+	size_t				layersByteSize = 0;
+
+	for (size_t layerIdx = 0; layerIdx < m_Layers.size(); ++layerIdx)
+	{
+		const CLayer	*layer = m_Layers[layerIdx];
+
+		aliasesInput[layerIdx] = layerIdx != 0 && layer->GetOutput().Data() == m_Layers[layerIdx - 1]->GetOutput().Data();
+		if (aliasesInput[layerIdx])
+		{
+			bufferIdx[layerIdx] = bufferIdx[layerIdx - 1];
+			continue;
+		}
+		bufferIdx[layerIdx] = layerIdx != 0 ? 1 - bufferIdx[layerIdx - 1] : 0;
+		bufferSize[bufferIdx[layerIdx]] = std::max(bufferSize[bufferIdx[layerIdx]], layer->GetOutputSize());
+		layersByteSize += layer->GetOutputSize() * sizeof(float);
+		if (layer->CanAliasNetInput())
+			layersByteSize += layer->GetNetInput().Size() * sizeof(float);
+	}
+	// The second buffer stays 16 bytes aligned:
+	const size_t	bufferOffset[2] = { 0, (bufferSize[0] + 3) & ~(size_t)3 };
+
+	if (!m_ActivationArena.AllocateStorage(bufferOffset[1] + bufferSize[1]))
+		return false;
+	for (size_t layerIdx = 0; layerIdx < m_Layers.size(); ++layerIdx)
+	{
+		if (aliasesInput[layerIdx])
+			m_Layers[layerIdx]->LinkInput(m_Layers[layerIdx - 1]);
+		else
+		{
+			// The activations are elementwise, the net input is computed in place:
+			float	*output = m_ActivationArena.Data() + bufferOffset[bufferIdx[layerIdx]];
+
+			if (!m_Layers[layerIdx]->AliasActivations(output, output))
+				return false;
+		}
+	}
+	if (m_Verbose)
+		printf("Inference memory plan: activations %zu -> %zu bytes\n", layersByteSize, m_ActivationArena.Size() * sizeof(float));
+	return true;
+}
+
+bool	CNeuralNetwork::SetCheckpoints(const std::vector<size_t> &layerIndices)
+{
+	m_TaskManager.WaitForCompletion(true);
+	if (m_ActivationArena.Size() != 0)
+	{
+		fprintf(stderr, "Gradient checkpointing is not available with the inference memory plan\n");
+		return false;
+	}
+	// The layers of the previous segments get their own storages back:
+	if (!m_KeptActivations.empty())
+	{
+		for (size_t layerIdx = 0; layerIdx < m_Layers.size(); ++layerIdx)
+		{
+			if (!m_KeptActivations[layerIdx] && !m_Layers[layerIdx]->AliasActivations(nullptr, nullptr))
+				return false;
+			if (layerIdx != 0)
+				m_Layers[layerIdx]->LinkInput(m_Layers[layerIdx - 1]);
+		}
+		m_KeptActivations.clear();
+		m_CheckpointArena.AllocateStorage(0);
+	}
+	m_CheckpointLayers = layerIndices;
+	if (layerIndices.empty() || m_Layers.empty())
+		return true;
+
+	std::vector<bool>	kept(m_Layers.size(), false);
+	std::vector<bool>	aliasesInput(m_Layers.size(), false);
+
+	for (size_t layerIdx : layerIndices)
+	{
+		assert(layerIdx < m_Layers.size());
+		if (layerIdx >= m_Layers.size())
+			return false;
+		kept[layerIdx] = true;
+	}
+	// The loss needs the last output:
+	kept.back() = true;
+	// A fused pass only writes the end of its fusion, it is fed forward as a whole:
+	for (size_t layerIdx = 0; layerIdx < m_Layers.size(); ++layerIdx)
+	{
+		for (size_t j = layerIdx; j < m_FusionEnd[layerIdx]; ++j)
+		{
+			if (kept[j])
+			{
+				kept[j] = false;
+				kept[m_FusionEnd[layerIdx]] = true;
+			}
+		}
+	}
+	// A layer aliasing its input (flatten) keeps it:
+	for (size_t layerIdx = m_Layers.size() - 1; layerIdx != 0; --layerIdx)
+	{
+		aliasesInput[layerIdx] = m_Layers[layerIdx]->GetOutput().Data() == m_Layers[layerIdx - 1]->GetOutput().Data();
+		if (kept[layerIdx] && aliasesInput[layerIdx])
+			kept[layerIdx - 1] = true;
+	}
+
+	// The activations of a segment are all needed by its back propagation, the segments start again at the arena start:
+	std::vector<size_t>	outputOffset(m_Layers.size(), 0);
+	std::vector<size_t>	netInputOffset(m_Layers.size(), 0);
+	size_t				offset = 0;
+	size_t				arenaSize = 0;
+	size_t				segmentsByteSize = 0;
+
+	for (size_t layerIdx = 0; layerIdx < m_Layers.size(); ++layerIdx)
+	{
+		const CLayer	*layer = m_Layers[layerIdx];
+
+		if (kept[layerIdx])
+		{
+			offset = 0;
+			continue;
+		}
+		if (aliasesInput[layerIdx])
+			continue;
+		// Offsets stay 16 bytes aligned:
+		outputOffset[layerIdx] = offset;
+		offset += (layer->GetOutputSize() + 3) & ~(size_t)3;
+		segmentsByteSize += layer->GetOutputSize() * sizeof(float);
+		if (layer->CanAliasNetInput())
+		{
+			netInputOffset[layerIdx] = offset;
+			offset += (layer->GetNetInput().Size() + 3) & ~(size_t)3;
+			segmentsByteSize += layer->GetNetInput().Size() * sizeof(float);
+		}
+		arenaSize = std::max(arenaSize, offset);
+	}
+	if (!m_CheckpointArena.AllocateStorage(arenaSize))
+		return false;
+	for (size_t layerIdx = 0; layerIdx < m_Layers.size(); ++layerIdx)
+	{
+		if (kept[layerIdx])
+			continue;
+		if (aliasesInput[layerIdx])
+			m_Layers[layerIdx]->LinkInput(m_Layers[layerIdx - 1]);
+		else if (!m_Layers[layerIdx]->AliasActivations(	m_CheckpointArena.Data() + outputOffset[layerIdx],
+														m_CheckpointArena.Data() + netInputOffset[layerIdx]))
+			return false;
+	}
+	m_KeptActivations = kept;
+	if (m_Verbose)
+		printf(	"Gradient checkpointing: %zu kept layers, segment activations %zu -> %zu bytes\n",
+				std::count(kept.begin(), kept.end(), true), segmentsByteSize, arenaSize * sizeof(float));
+	return true;
+}
+
+bool	CNeuralNetwork::PackParameters(bool largePages)
+{
+	std::vector<CNeuronMatrix*>	matrices;
+	std::vector<CNeuronVector*>	vectors;
+	size_t						byteSize = 0;
+	size_t						storageCount = 0;
+
+	m_TaskManager.WaitForCompletion(true);
+	for (CLayer *layer : m_Layers)
+		layer->GetParameterStorages(matrices, vectors);
+	for (const CNeuronMatrix *matrix : matrices)
+		byteSize += CNeuronArena::AlignSize(matrix->StorageByteSize());
+	for (const CNeuronVector *vector : vectors)
+		byteSize += CNeuronArena::AlignSize(vector->Size() * sizeof(float));
+
+	// Packing again moves the storages out of the current arena before releasing it:
+	CNeuronArena	arena;
+	uint8_t			*dst;
+
+	if (!arena.Allocate(byteSize, largePages))
+		return false;
+	dst = arena.Data();
+	for (CNeuronMatrix *matrix : matrices)
+	{
+		if (matrix->StorageByteSize() == 0)
+			continue;
+		matrix->MoveStorage((float*)dst);
+		dst += CNeuronArena::AlignSize(matrix->StorageByteSize());
+		++storageCount;
+	}
+	for (CNeuronVector *vector : vectors)
+	{
+		if (vector->Size() == 0)
+			continue;
+		vector->MoveStorage((float*)dst);
+		dst += CNeuronArena::AlignSize(vector->Size() * sizeof(float));
+		++storageCount;
+	}
+	assert(dst == arena.Data() + byteSize);
+	m_ParameterArena.Swap(arena);
+	if (m_Verbose)
+		printf(	"Parameter arena: %zu storages, %zu bytes%s\n",
+				storageCount, byteSize, m_ParameterArena.UsesLargePages() ? " in large pages" : "");
+	return true;
 }
 
 void	CNeuralNetwork::SetAllLearningRate(float learningRate)
@@ -1,8 +1,11 @@
 #pragma once
 
 #include "LayerBase.h"
+#include "NeuronArena.h"
 #include "TaskManager.h"
 
+class	CLayerDense;
+
 #include <vector>
 #include <queue>
 #include <functional>
@@ -18,6 +21,7 @@ public:
 	bool	AddLayer(CLayer *layer);
 	bool	FeedForward(const float *input);
 	bool	BackPropagateError(const float *input, const float *expected);
+	bool	BackPropagateError(const float *input, size_t expectedClass);
 	bool	UpdateWeightAndBiases();
 
 	const CNeuronVector		&GetOutput() const { return m_Layers.back()->GetOutput(); }
@@ -26,20 +30,95 @@ public:
 	const std::vector<CLayer*>	&Layers() const { return m_Layers; }
 
 	void	PrintDetails() const;
+	// Summaries of the conversions and memory transforms on stdout, off by default:
+	void	SetVerbose(bool verbose) { m_Verbose = verbose; }
 
 	bool	Serialize(const char *path);
 	bool	UnSerialize(const char *path);
 
+	// Post-training int8 quantization of the layers that support it, calibrated on sampleCount inputs.
+	// When verbose, prints the accuracy of the quantized network against the float one on the same samples:
+	bool	Quantize(const float *samples, size_t sampleCount);
+	// Half precision storage of the weights of the layers that support it, halves their memory traffic and file size:
+	bool	ConvertWeightsToHalf(EHalfFormat format);
+	// Prunes the sparsity fraction of the 1x8 weight blocks of the layers supporting block sparse weights:
+	bool	SetBlockSparsity(float sparsity);
+	// Mixed precision training: BF16 storage of the net inputs kept for the back propagation, the weights,
+	// the optimizer state and the slopes stay in FP32:
+	bool	SetMixedPrecision(bool enable);
+	// Removes the neurons of the dense layers followed by a dense layer that are constant on the samples (dead ReLUs),
+	// or with incoming or outgoing weights of L2 norm under threshold. Their mean output is folded in the next bias.
+	// The layers are reduced in place, none is removed from the network:
+	bool	PruneDenseLayers(const float *samples, size_t sampleCount, float threshold);
+	// Replaces the dense layer at layerIdx with first and second, its truncated singular value decomposition of the
+	// smallest rank keeping a top-1 agreement of minAgreement with the current network on the samples.
+	// Fails and keeps the layer when no rank that saves weights reaches it.
+	// The network does not own its layers: the replaced layer is appended to removedLayers, the caller destroys it:
+	bool	FactorizeDenseLayer(size_t layerIdx, CLayerDense *first, CLayerDense *second, const float *samples, size_t sampleCount, float minAgreement,
+								std::vector<CLayer*> &removedLayers);
+	// Inference export: folds each batch normalization layer in the weights and bias of the linear dense or
+	// convolution layer before it, which takes its activation. The folded layers are removed from the network and
+	// appended to removedLayers, the caller destroys them:
+	bool	FoldBatchNorm(std::vector<CLayer*> &removedLayers);
+	// Inference memory plan: the outputs of the layers are placed in a single arena, alternating between two buffers as
+	// each one is only read by the next layer, and the net inputs are computed in place. The back propagation is not
+	// available until the plan is disabled:
+	bool	PlanInferenceMemory(bool enable);
+	// Gradient checkpointing: only the activations of the checkpoint layers (and of the last layer) stay resident. The
+	// layers between two checkpoints share one buffer with the other segments and are fed forward again by the back
+	// propagation. An empty list keeps every activation:
+	bool	SetCheckpoints(const std::vector<size_t> &layerIndices);
+	// Moves the weights, biases and optimizer state of the layers to a single allocation, each storage aligned on a
+	// cache line. Large pages are used when requested, built with ENABLE_LARGE_PAGES and the application holds the
+	// privilege to lock pages in memory, GetParameterArena().UsesLargePages() tells if they were obtained.
+	// PruneDenseLayers and FactorizeDenseLayer pack again the layers they setup, layers setup by other means allocate
+	// their own storages until the next call. The block sparse, int8 and half weights are not part of the arena, and the
+	// layers removed from the network get their own storages back:
+	bool				PackParameters(bool largePages);
+	const CNeuronArena	&GetParameterArena() const { return m_ParameterArena; }
+
 	void	SetAllLearningRate(float learningRate);
+	void	SetLoss(ELoss loss) { m_Loss = loss; }
+	ELoss	GetLoss() const { return m_Loss; }
+	// Loss of the last call to BackPropagateError:
+	float	GetLastLoss() const { return m_LastLoss; }
 
 private:
 	void	ResetTrainingSteps() { m_CurrentTrainingStep = 0; }
+	bool	BackPropagateError(const float *input, const SLossTarget &target);
+	// Feed forward of the layers [layerMin, layerMax], the output of the layer before layerMin is its input:
+	void	FeedForwardLayers(const float *input, size_t layerMin, size_t layerMax);
+	void	FuseMaxPooling();
+	// Replaces count layers from layerIdx, the layers are added again to update their links.
+	// The replaced layers are not destroyed, they still belong to the caller:
+	bool	ReplaceLayers(size_t layerIdx, size_t count, const std::vector<CLayer*> &layers);
+	// Packs the parameters again after a transform that setup layers, when they were packed:
+	bool	RepackParametersIFN() { return m_ParameterArena.Empty() || PackParameters(m_ParameterArena.UsesLargePages()); }
 
 	std::vector<CLayer*>		m_Layers;
+	// Last layer executed with each layer (itself when not fused):
+	std::vector<size_t>			m_FusionEnd;
 	uint32_t					m_CurrentTrainingStep;
 
+	ELoss						m_Loss;
+	float						m_LastLoss;
+	std::mutex					m_LossLock;
+	bool						m_Verbose;
+
 	CTaskManager				m_TaskManager;
 
+	// Float net input shared by the mixed precision layers, each one works on it between its unpack and pack:
+	CNeuronVector				m_NetInputScratch;
+	// Outputs of the layers while the inference memory plan is enabled:
+	CNeuronVector				m_ActivationArena;
+	// Parameters of the layers once packed:
+	CNeuronArena				m_ParameterArena;
+	// Gradient checkpointing: checkpoints asked for, activations kept per layer (empty when disabled) and buffer shared
+	// by the segments between the checkpoints:
+	std::vector<size_t>			m_CheckpointLayers;
+	std::vector<bool>			m_KeptActivations;
+	CNeuronVector				m_CheckpointArena;
+
 	// Serializer:
 	struct	SNetworkHeader
 	{
@@ -0,0 +1,81 @@
+#include "NeuronArena.h"
+
+#include <malloc.h>
+
+#if	ENABLE_LARGE_PAGES
+#	define WIN32_LEAN_AND_MEAN
+#	define NOMINMAX
+#	include <windows.h>
+#endif
+
+CNeuronArena::CNeuronArena()
+:	m_Data(nullptr)
+,	m_ByteSize(0)
+,	m_LargePages(false)
+{
+}
+
+CNeuronArena::~CNeuronArena()
+{
+	Free();
+}
+
+bool	CNeuronArena::Allocate(size_t byteSize, bool largePages)
+{
+	Free();
+	if (byteSize == 0)
+		return true;
+#if	ENABLE_LARGE_PAGES
+	if (largePages)
+	{
+		const size_t	pageSize = GetLargePageMinimum();
+
+		// Fails without the privilege, the arena then uses regular pages:
+		if (pageSize != 0)
+		{
+			const size_t	largePageByteSize = (byteSize + pageSize - 1) / pageSize * pageSize;
+
+			m_Data = (uint8_t*)VirtualAlloc(nullptr, largePageByteSize, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+		}
+		if (m_Data != nullptr)
+		{
+			m_ByteSize = byteSize;
+			m_LargePages = true;
+			return true;
+		}
+	}
+#endif
+	m_Data = (uint8_t*)_aligned_malloc(byteSize, kAlignment);
+	m_ByteSize = byteSize;
+	return m_Data != nullptr;
+}
+
+void	CNeuronArena::Free()
+{
+	if (m_Data != nullptr)
+	{
+#if	ENABLE_LARGE_PAGES
+		if (m_LargePages)
+			VirtualFree(m_Data, 0, MEM_RELEASE);
+		else
+#endif
+			_aligned_free(m_Data);
+	}
+	m_Data = nullptr;
+	m_ByteSize = 0;
+	m_LargePages = false;
+}
+
+void	CNeuronArena::Swap(CNeuronArena &other)
+{
+	uint8_t		*data = m_Data;
+	size_t		byteSize = m_ByteSize;
+	bool		largePages = m_LargePages;
+
+	m_Data = other.m_Data;
+	m_ByteSize = other.m_ByteSize;
+	m_LargePages = other.m_LargePages;
+	other.m_Data = data;
+	other.m_ByteSize = byteSize;
+	other.m_LargePages = largePages;
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include "DumbANNConfig.h"
+#include <stdlib.h>
+#include <stdint.h>
+
+// Single allocation holding many storages, each one starting on a cache line.
+// Large pages (2 MB) need ENABLE_LARGE_PAGES and the "Lock pages in memory" privilege enabled by the application,
+// the arena falls back to regular pages without them and UsesLargePages tells which ones it got:
+class	CNeuronArena
+{
+public:
+	static const size_t		kAlignment = 64;
+
+	CNeuronArena();
+	~CNeuronArena();
+
+	bool		Allocate(size_t byteSize, bool largePages);
+	void		Free();
+	void		Swap(CNeuronArena &other);
+
+	uint8_t		*Data() const { return m_Data; }
+	size_t		ByteSize() const { return m_ByteSize; }
+	bool		UsesLargePages() const { return m_LargePages; }
+	bool		Empty() const { return m_Data == nullptr; }
+
+	static size_t	AlignSize(size_t byteSize) { return (byteSize + kAlignment - 1) & ~(kAlignment - 1); }
+
+private:
+	uint8_t		*m_Data;
+	size_t		m_ByteSize;
+	bool		m_LargePages;
+};
@@ -4,6 +4,17 @@
 #include <cstring>
 #include <assert.h>
 #include <vector>
+#include <algorithm>
+#include <xmmintrin.h>
+
+// Window of one convolution row (or column) in the input map:
+struct	SConvolutionSpan
+{
+	// Theoretical kernel offset (same as m_Start with no padding):
+	int		m_Offset;
+	size_t	m_Start;
+	size_t	m_Stop;
+};
 
 struct	SConvolutionParams
 {
@@ -17,6 +28,16 @@ public:
 	size_t	m_OutputSizeX;
 	size_t	m_OutputSizeY;
 
+	// Geometry plan, computed once by ComputeConvGeometry():
+	// One span per output column / row:
+	std::vector<SConvolutionSpan>	m_SpansX;
+	std::vector<SConvolutionSpan>	m_SpansY;
+	// Interior convolutions, the whole kernel is inside the input map (no padding read):
+	size_t	m_InteriorMinX;
+	size_t	m_InteriorMaxX;
+	size_t	m_InteriorMinY;
+	size_t	m_InteriorMaxY;
+
 	SConvolutionParams()
 	:	m_KernelSizeX(0)
 	,	m_KernelSizeY(0)
@@ -26,14 +47,54 @@ public:
 	,	m_InputSizeY(0)
 	,	m_OutputSizeX(0)
 	,	m_OutputSizeY(0)
+	,	m_InteriorMinX(0)
+	,	m_InteriorMaxX(0)
+	,	m_InteriorMinY(0)
+	,	m_InteriorMaxY(0)
 	{
 	}
 
 	void	ComputeConvOutputSize();
 	void	Serialize(std::vector<uint8_t> &data) const;
 	bool	UnSerialize(const std::vector<uint8_t> &data, size_t &curIdx);
+
+	// Needs the output size:
+	inline void		ComputeConvGeometry();
+
+	bool			IsInteriorX(size_t convIdxX) const { return convIdxX >= m_InteriorMinX && convIdxX < m_InteriorMaxX; }
+	bool			IsInteriorY(size_t convIdxY) const { return convIdxY >= m_InteriorMinY && convIdxY < m_InteriorMaxY; }
 };
 
+// Spans of the convolutions along one axis, and the range of the ones fully inside the input:
+inline void	_ComputeConvSpans(	std::vector<SConvolutionSpan> &spans, size_t &interiorMin, size_t &interiorMax,
+								size_t outputSize, size_t inputSize, size_t kernelSize, size_t stride, size_t padding)
+{
+	spans.resize(outputSize);
+	interiorMin = outputSize;
+	interiorMax = outputSize;
+	for (size_t convIdx = 0; convIdx < outputSize; ++convIdx)
+	{
+		SConvolutionSpan	&span = spans[convIdx];
+
+		span.m_Offset = (int)(convIdx * stride) - static_cast<int>(padding);
+		span.m_Start = std::max(0, span.m_Offset);
+		span.m_Stop = std::min(span.m_Offset + kernelSize, inputSize);
+		if (span.m_Offset >= 0 && span.m_Offset + kernelSize <= inputSize)
+		{
+			// The interior convolutions are contiguous:
+			if (interiorMin == outputSize)
+				interiorMin = convIdx;
+			interiorMax = convIdx + 1;
+		}
+	}
+}
+
+inline void	SConvolutionParams::ComputeConvGeometry()
+{
+	_ComputeConvSpans(m_SpansX, m_InteriorMinX, m_InteriorMaxX, m_OutputSizeX, m_InputSizeX, m_KernelSizeX, m_KernelStride, m_InputPadding);
+	_ComputeConvSpans(m_SpansY, m_InteriorMinY, m_InteriorMaxY, m_OutputSizeY, m_InputSizeY, m_KernelSizeY, m_KernelStride, m_InputPadding);
+}
+
 struct	SKernelRange
 {
 	// Convolution idx:
@@ -69,113 +130,277 @@ struct	SKernelRange
 	}
 };
 
-template<class _KernelIn, void (*_Kernel)(	const _KernelIn &,
-											const SKernelRange &,
-											const SConvolutionParams &)>
-void		KernelConvolute(	const _KernelIn &kernelInput,
+// Window of the convolution row convIdxY in the input map, false when it only covers padding:
+inline bool	SetKernelRangeY(SKernelRange &kernelRange, size_t convIdxY, const SConvolutionParams &convolution)
+{
+	assert(convIdxY < convolution.m_SpansY.size());
+	const SConvolutionSpan	&span = convolution.m_SpansY[convIdxY];
+
+	kernelRange.m_ConvIdxY = convIdxY;
+	kernelRange.m_ConvOffsetY = span.m_Offset;
+	kernelRange.m_StartConvY = span.m_Start;
+	kernelRange.m_StopConvY = span.m_Stop;
+	return span.m_Start < span.m_Stop;
+}
+
+// Same for the convolution column convIdxX:
+inline bool	SetKernelRangeX(SKernelRange &kernelRange, size_t convIdxX, const SConvolutionParams &convolution)
+{
+	assert(convIdxX < convolution.m_SpansX.size());
+	const SConvolutionSpan	&span = convolution.m_SpansX[convIdxX];
+
+	kernelRange.m_ConvIdxX = convIdxX;
+	kernelRange.m_ConvOffsetX = span.m_Offset;
+	kernelRange.m_StartConvX = span.m_Start;
+	kernelRange.m_StopConvX = span.m_Stop;
+	return span.m_Start < span.m_Stop;
+}
+
+// Part of the kernel window inside the input map, m_Rows rows of m_Columns contiguous pixels:
+struct	SKernelWindow
+{
+	// First pixel in the input feature and first weight in the feature kernel:
+	size_t	m_InputOffset;
+	size_t	m_WeightOffset;
+	size_t	m_Rows;
+	size_t	m_Columns;
+};
+
+// The interior window is the whole kernel, without any clamping:
+template<bool _Interior>
+inline SKernelWindow	ComputeKernelWindow(const SKernelRange &range, const SConvolutionParams &convolution)
+{
+	SKernelWindow	window;
+
+	if (_Interior)
+	{
+		window.m_InputOffset = range.m_ConvOffsetY * convolution.m_InputSizeX + range.m_ConvOffsetX;
+		window.m_WeightOffset = 0;
+		window.m_Rows = convolution.m_KernelSizeY;
+		window.m_Columns = convolution.m_KernelSizeX;
+	}
+	else
+	{
+		window.m_InputOffset = range.m_StartConvY * convolution.m_InputSizeX + range.m_StartConvX;
+		window.m_WeightOffset =	(range.m_StartConvY - range.m_ConvOffsetY) * convolution.m_KernelSizeX +
+								(range.m_StartConvX - range.m_ConvOffsetX);
+		window.m_Rows = range.m_StopConvY - range.m_StartConvY;
+		window.m_Columns = range.m_StopConvX - range.m_StartConvX;
+	}
+	return window;
+}
+
+// Positions i in [m_Min, m_Max) for which i * stride + m_Offset is in [0, size), with m_Offset = kernelIdx - padding.
+// For a convolution i is an output and i * stride + m_Offset the input read through kernelIdx, the opposite for a transposed convolution:
+struct	SKernelTapRange
+{
+	size_t	m_Min;
+	size_t	m_Max;
+	int		m_Offset;
+};
+
+inline SKernelTapRange	ComputeKernelTapRange(size_t kernelIdx, size_t count, size_t size, const SConvolutionParams &convolution)
+{
+	const int		stride = static_cast<int>(convolution.m_KernelStride);
+	const int		last = static_cast<int>(size) - 1;
+	SKernelTapRange	range;
+
+	range.m_Offset = static_cast<int>(kernelIdx) - static_cast<int>(convolution.m_InputPadding);
+	range.m_Min = range.m_Offset >= 0 ? 0 : (size_t)((-range.m_Offset + stride - 1) / stride);
+	range.m_Max = last < range.m_Offset ? 0 : std::min(count, (size_t)((last - range.m_Offset) / stride + 1));
+	range.m_Max = std::max(range.m_Max, range.m_Min);
+	return range;
+}
+
+// SSE helpers on contiguous rows, unaligned:
+// dst += src * weight
+inline void		KernelAxpy(float *dst, const float *src, float weight, size_t count)
+{
+	const __m128	weight_xxxx = _mm_set1_ps(weight);
+	size_t			i = 0;
+
+	for (; i + 4 <= count; i += 4)
+		_mm_storeu_ps(dst + i, _mm_add_ps(_mm_loadu_ps(dst + i), _mm_mul_ps(_mm_loadu_ps(src + i), weight_xxxx)));
+	for (; i < count; ++i)
+		dst[i] += src[i] * weight;
+}
+
+inline float	KernelHorizontalSum(__m128 v_xyzw)
+{
+	const __m128	v_zwxy = _mm_shuffle_ps(v_xyzw, v_xyzw, _MM_SHUFFLE(1, 0, 3, 2));
+	const __m128	reduc1_xyxy = _mm_add_ps(v_xyzw, v_zwxy);
+	const __m128	reduc1_yxyx = _mm_shuffle_ps(reduc1_xyxy, reduc1_xyxy, _MM_SHUFFLE(0, 1, 0, 1));
+	return _mm_cvtss_f32(_mm_add_ss(reduc1_xyxy, reduc1_yxyx));
+}
+
+inline float	KernelSum(const float *src, size_t count)
+{
+	__m128			accum_xyzw = _mm_setzero_ps();
+	size_t			i = 0;
+
+	for (; i + 4 <= count; i += 4)
+		accum_xyzw = _mm_add_ps(accum_xyzw, _mm_loadu_ps(src + i));
+	float			sum = KernelHorizontalSum(accum_xyzw);
+	for (; i < count; ++i)
+		sum += src[i];
+	return sum;
+}
+
+inline float	KernelDot(const float *a, const float *b, size_t count)
+{
+	__m128			accum_xyzw = _mm_setzero_ps();
+	size_t			i = 0;
+
+	for (; i + 4 <= count; i += 4)
+		accum_xyzw = _mm_add_ps(accum_xyzw, _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+	float			sum = KernelHorizontalSum(accum_xyzw);
+	for (; i < count; ++i)
+		sum += a[i] * b[i];
+	return sum;
+}
+
+// Output rows [m_ConvIdxYMin, m_ConvIdxYMax) of a convolution pass,
+// the kernel windows are clipped to the input rows [m_InputYMin, m_InputYMax):
+struct	SKernelRows
+{
+	size_t	m_ConvIdxYMin;
+	size_t	m_ConvIdxYMax;
+	size_t	m_InputYMin;
+	size_t	m_InputYMax;
+};
+
+inline SKernelRows	ComputeKernelRows(size_t convIdxYMin, size_t convIdxYMax, const SConvolutionParams &convolution)
+{
+	SKernelRows	rows;
+
+	rows.m_ConvIdxYMin = convIdxYMin;
+	rows.m_ConvIdxYMax = convIdxYMax;
+	rows.m_InputYMin = 0;
+	rows.m_InputYMax = convolution.m_InputSizeY;
+	return rows;
+}
+
+// Output rows whose kernel window reaches the input rows [inputYMin, inputYMax), clipped to them:
+inline SKernelRows	ComputeKernelRowsReaching(size_t inputYMin, size_t inputYMax, const SConvolutionParams &convolution)
+{
+	SKernelRows	rows;
+
+	rows.m_InputYMin = inputYMin;
+	rows.m_InputYMax = inputYMax;
+	rows.m_ConvIdxYMin = 0;
+	while (rows.m_ConvIdxYMin < convolution.m_OutputSizeY && convolution.m_SpansY[rows.m_ConvIdxYMin].m_Stop <= inputYMin)
+		++rows.m_ConvIdxYMin;
+	rows.m_ConvIdxYMax = rows.m_ConvIdxYMin;
+	while (rows.m_ConvIdxYMax < convolution.m_OutputSizeY && convolution.m_SpansY[rows.m_ConvIdxYMax].m_Start < inputYMax)
+		++rows.m_ConvIdxYMax;
+	return rows;
+}
+
+// Calls _BorderKernel on the convolutions reading padding and _InteriorRowKernel once per row on the others,
+// with the range of the first interior convolution of the row and the count of interior convolutions.
+// Only the given rows are processed, the windows clipped to their input rows go to the border kernel:
+template<class _KernelIn,
+		void (*_BorderKernel)(		const _KernelIn &,
+									const SKernelRange &,
+									const SConvolutionParams &),
+		void (*_InteriorRowKernel)(	const _KernelIn &,
+									const SKernelRange &,
+									size_t,
+									const SConvolutionParams &)>
+void		KernelConvoluteRows(const _KernelIn &kernelInput,
 								size_t rangeMin, size_t rangeMax,
-								const SConvolutionParams &convolution)
+								const SConvolutionParams &convolution,
+								const SKernelRows &rows)
 {
-	const int		padding = static_cast<int>(convolution.m_InputPadding);
 	SKernelRange	kernelRange;
 
+	assert(convolution.m_SpansX.size() == convolution.m_OutputSizeX);
+	assert(convolution.m_SpansY.size() == convolution.m_OutputSizeY);
+	assert(rows.m_ConvIdxYMax <= convolution.m_OutputSizeY);
 	// For each feature:
 	for (	kernelRange.m_FeatureIdx = rangeMin;
 			kernelRange.m_FeatureIdx < rangeMax;
 			++kernelRange.m_FeatureIdx)
 	{
 		// For each convolution:
-		for (	kernelRange.m_ConvIdxY = 0;
-				kernelRange.m_ConvIdxY < convolution.m_OutputSizeY;
-				++kernelRange.m_ConvIdxY)
+		for (size_t convIdxY = rows.m_ConvIdxYMin; convIdxY < rows.m_ConvIdxYMax; ++convIdxY)
 		{
-			kernelRange.m_ConvOffsetY = (int)(kernelRange.m_ConvIdxY * convolution.m_KernelStride) - padding;
-			kernelRange.m_StartConvY = std::max(0, kernelRange.m_ConvOffsetY);
-			kernelRange.m_StopConvY = std::min(	kernelRange.m_ConvOffsetY + convolution.m_KernelSizeY,
-												convolution.m_InputSizeY);
-			
-			assert(kernelRange.m_StartConvY < kernelRange.m_StopConvY);
-			if (kernelRange.m_StartConvY < kernelRange.m_StopConvY)
+			const bool	validY = SetKernelRangeY(kernelRange, convIdxY, convolution);
+
+			assert(validY);
+			if (!validY)
+				continue;
+			const bool	clippedY = kernelRange.m_StartConvY < rows.m_InputYMin || kernelRange.m_StopConvY > rows.m_InputYMax;
+
+			if (clippedY)
+			{
+				// Partial window, only the border kernel handles those:
+				kernelRange.m_StartConvY = std::max(kernelRange.m_StartConvY, rows.m_InputYMin);
+				kernelRange.m_StopConvY = std::min(kernelRange.m_StopConvY, rows.m_InputYMax);
+				if (kernelRange.m_StartConvY >= kernelRange.m_StopConvY)
+					continue;
+			}
+			if (clippedY || !convolution.IsInteriorY(convIdxY))
 			{
-				for (	kernelRange.m_ConvIdxX = 0;
-						kernelRange.m_ConvIdxX < convolution.m_OutputSizeX;
-						++kernelRange.m_ConvIdxX)
+				for (size_t convIdxX = 0; convIdxX < convolution.m_OutputSizeX; ++convIdxX)
 				{
-					kernelRange.m_ConvOffsetX = (int)(kernelRange.m_ConvIdxX * convolution.m_KernelStride) - padding;
-					kernelRange.m_StartConvX = std::max(0, kernelRange.m_ConvOffsetX);
-					kernelRange.m_StopConvX = std::min(kernelRange.m_ConvOffsetX + convolution.m_KernelSizeX, convolution.m_InputSizeX);
-	
-					assert(kernelRange.m_StartConvX < kernelRange.m_StopConvX);
-					if (kernelRange.m_StartConvX < kernelRange.m_StopConvX)
-					{
-						_Kernel(kernelInput, kernelRange, convolution);
-					}
+					if (SetKernelRangeX(kernelRange, convIdxX, convolution))
+						_BorderKernel(kernelInput, kernelRange, convolution);
 				}
+				continue;
+			}
+			// Left border, interior, right border:
+			for (size_t convIdxX = 0; convIdxX < convolution.m_InteriorMinX; ++convIdxX)
+			{
+				if (SetKernelRangeX(kernelRange, convIdxX, convolution))
+					_BorderKernel(kernelInput, kernelRange, convolution);
+			}
+			if (convolution.m_InteriorMinX < convolution.m_InteriorMaxX)
+			{
+				SetKernelRangeX(kernelRange, convolution.m_InteriorMinX, convolution);
+				_InteriorRowKernel(kernelInput, kernelRange, convolution.m_InteriorMaxX - convolution.m_InteriorMinX, convolution);
+			}
+			for (size_t convIdxX = convolution.m_InteriorMaxX; convIdxX < convolution.m_OutputSizeX; ++convIdxX)
+			{
+				if (SetKernelRangeX(kernelRange, convIdxX, convolution))
+					_BorderKernel(kernelInput, kernelRange, convolution);
 			}
 		}
 	}
 }
 
-#if		0
-template<typename T,
-		void (T::*_Func)(	float *,
-							float *,
-							const SConvolutionParams &,
-							size_t, size_t,
-							int, int,
-							int, int,
-							int, int,
-							int, int) const>
-void	ConvoluteTranspose(	const T *cbClass,
-							float *output,
-							float *input,
-							size_t rangeMin, size_t rangeMax,
-							const SConvolutionParams &convolution)
-{
-	// Quite confusing: feature input is the "output" ptr
-	// feature output writes into feature input... the naming is done for the regular convolution...
-	const size_t	featureOutputSizeX = convolution.GetConvOutputSizeX();
-	const size_t	featureOutputSizeY = convolution.GetConvOutputSizeY();
-	const size_t	featureInputStride = convolution.m_InputSizeX * convolution.m_InputSizeY;
-	const int		padding = static_cast<int>(convolution.m_InputPadding);
-
-	memset(output + rangeMin * featureInputStride, 0, (rangeMax - rangeMin) * featureInputStride * sizeof(float));
-	// For each input feature:
-	for (size_t inFeatureIdx = rangeMin; inFeatureIdx < rangeMax; ++inFeatureIdx)
-	{
-		// For each output feature:
-		for (size_t outFeatureIdx = 0; outFeatureIdx < convolution.m_KernelCount; ++outFeatureIdx)
-		{
-			// Convolution:
-			for (size_t convY = 0; convY < featureOutputSizeY; ++convY)
-			{
-				for (size_t convX = 0; convX < featureOutputSizeX; ++convX)
-				{
-					int				paddedConvX = (int)(convX * convolution.m_KernelStride) - padding;
-					int				paddedConvY = (int)(convY * convolution.m_KernelStride) - padding;
-					int				startInX = (size_t)(paddedConvX >= 0 ? 0 : -paddedConvX);
-					int				startInY = (size_t)(paddedConvY >= 0 ? 0 : -paddedConvY);
-					int				stopInX = convolution.m_KernelSizeX;
-					int				stopInY = convolution.m_KernelSizeY;
-					
-					if (paddedConvX + convolution.m_KernelSizeX > convolution.m_InputSizeX)
-						stopInX -= paddedConvX + convolution.m_KernelSizeX - convolution.m_InputSizeX;
-					if (paddedConvY + convolution.m_KernelSizeY > convolution.m_InputSizeY)
-						stopInY -= paddedConvY + convolution.m_KernelSizeY - convolution.m_InputSizeY;
-	
-					if (stopInX <= 0 || stopInY <= 0)
-						continue;
-					(cbClass->*_Func)(	output,
-										convolution,
-										inFeatureIdx, outFeatureIdx,
-										startInX, stopInX,
-										startInY, stopInY,
-										convX, convY,
-										paddedConvX, paddedConvY);
+// Interior row of a per convolution kernel:
+template<class _KernelIn, void (*_Kernel)(	const _KernelIn &,
+											const SKernelRange &,
+											const SConvolutionParams &)>
+void		_KernelConvoluteRow(const _KernelIn &kernelInput,
+								const SKernelRange &range, size_t count,
+								const SConvolutionParams &convolution)
+{
+	SKernelRange	kernelRange = range;
 
-				}
-			}
-		}
+	for (size_t convIdxX = range.m_ConvIdxX; convIdxX < range.m_ConvIdxX + count; ++convIdxX)
+	{
+		SetKernelRangeX(kernelRange, convIdxX, convolution);
+		_Kernel(kernelInput, kernelRange, convolution);
 	}
 }
-#endif
\ No newline at end of file
+
+// Calls _BorderKernel on the convolutions reading padding and _InteriorKernel on the others, over all the output rows.
+// The interior kernel can assume the whole kernel window is inside the input map:
+template<class _KernelIn,
+		void (*_BorderKernel)(	const _KernelIn &,
+								const SKernelRange &,
+								const SConvolutionParams &),
+		void (*_InteriorKernel)(const _KernelIn &,
+								const SKernelRange &,
+								const SConvolutionParams &) = _BorderKernel>
+void		KernelConvolute(	const _KernelIn &kernelInput,
+								size_t rangeMin, size_t rangeMax,
+								const SConvolutionParams &convolution)
+{
+	KernelConvoluteRows<_KernelIn,
+						_BorderKernel,
+						&_KernelConvoluteRow<_KernelIn, _InteriorKernel> >(	kernelInput, rangeMin, rangeMax, convolution,
+																			ComputeKernelRows(0, convolution.m_OutputSizeY, convolution));
+}
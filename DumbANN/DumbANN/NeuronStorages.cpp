@@ -1,9 +1,15 @@
 #include "NeuronStorages.h"
+#include "NeuronKernel.h"
+#include "DumbANNConfig.h"
 
 #include <algorithm>
 #include <assert.h>
+#include <math.h>
 #include <xmmintrin.h>
 #include <emmintrin.h>
+#if		ENABLE_F16C
+#	include <immintrin.h>
+#endif
 
 SNeuronMatrixView::SNeuronMatrixView(float *data, size_t rows, size_t col, size_t rowStride)
 :	m_Data(data)
@@ -52,25 +58,58 @@ const float	*SConstNeuronMatrixView::GetRow(size_t idx) const
 CNeuronVector::CNeuronVector()
 :	m_Data(nullptr)
 ,	m_Size(0)
+,	m_OwnsData(false)
 {
 
 }
 
 CNeuronVector::~CNeuronVector()
 {
-	if (m_Data != nullptr)
-		_aligned_free(m_Data);
+	FreeStorage();
 }
 
 bool	CNeuronVector::AllocateStorage(size_t elements)
 {
-	if (m_Data != nullptr)
-		_aligned_free(m_Data);
+	FreeStorage();
 	m_Size = elements;
 	m_Data = (float*)_aligned_malloc(elements * sizeof(float), 0x10);
+	m_OwnsData = true;
 	return m_Data != nullptr;
 }
 
+void	CNeuronVector::AliasStorage(float *data, size_t elements)
+{
+	FreeStorage();
+	m_Size = elements;
+	m_Data = data;
+	m_OwnsData = false;
+}
+
+void	CNeuronVector::FreeStorage()
+{
+	if (m_Data != nullptr && m_OwnsData)
+		_aligned_free(m_Data);
+	m_Data = nullptr;
+}
+
+void	CNeuronVector::MoveStorage(float *dst)
+{
+	memcpy(dst, m_Data, m_Size * sizeof(float));
+	AliasStorage(dst, m_Size);
+}
+
+bool	CNeuronVector::OwnStorage()
+{
+	const float		*data = m_Data;
+
+	if (m_OwnsData || data == nullptr)
+		return true;
+	if (!AllocateStorage(m_Size))
+		return false;
+	memcpy(m_Data, data, m_Size * sizeof(float));
+	return true;
+}
+
 void	CNeuronVector::Serialize(std::vector<uint8_t> &data) const
 {
 	size_t		prevSize = data.size();
@@ -91,7 +130,7 @@ bool	CNeuronVector::UnSerialize(const std::vector<uint8_t> &data, size_t &curIdx
 	curIdx += sizeof(uint32_t);
 	if (curIdx + m_Size * sizeof(float) > data.size())
 		return false;
-	memcpy(m_Data, dataPtr, m_Size * sizeof(float));
+	memcpy(m_Data, dataPtr + 1, m_Size * sizeof(float));
 	curIdx += m_Size * sizeof(float);
 	DebugCheckForNaNs();
 	return true;
@@ -106,15 +145,122 @@ void	CNeuronVector::DebugCheckForNaNs() const
 	}
 }
 
+void	SNonZeroList::Allocate(size_t size)
+{
+	m_Size = size;
+	m_Indices.resize(size);
+	m_Counts.resize((size + kBlockSize - 1) / kBlockSize);
+}
+
+void	SNonZeroList::Build(const float *values, size_t blockMin, size_t blockMax)
+{
+	assert(blockMax <= BlockCount());
+	const __m128	zero_xyzw = _mm_setzero_ps();
+
+	for (size_t blockIdx = blockMin; blockIdx < blockMax; ++blockIdx)
+	{
+		const size_t	start = BlockStart(blockIdx);
+		const size_t	stop = BlockStop(blockIdx);
+		uint32_t		*dstPtr = m_Indices.data() + start;
+		uint32_t		count = 0;
+		size_t			i = start;
+
+		// Branchless compaction, the 4 indices are always written but only the non zero ones are kept:
+		for (; i + 4 <= stop; i += 4)
+		{
+			const int	nonZeroMask = _mm_movemask_ps(_mm_cmpneq_ps(_mm_loadu_ps(values + i), zero_xyzw));
+
+			dstPtr[count] = (uint32_t)i;
+			count += nonZeroMask & 1;
+			dstPtr[count] = (uint32_t)(i + 1);
+			count += (nonZeroMask >> 1) & 1;
+			dstPtr[count] = (uint32_t)(i + 2);
+			count += (nonZeroMask >> 2) & 1;
+			dstPtr[count] = (uint32_t)(i + 3);
+			count += (nonZeroMask >> 3) & 1;
+		}
+		for (; i < stop; ++i)
+		{
+			dstPtr[count] = (uint32_t)i;
+			count += values[i] != 0.0f ? 1 : 0;
+		}
+		m_Counts[blockIdx] = count;
+	}
+}
+
+void	SNonZeroList::BuildFromBits(const uint32_t *bits, size_t blockMin, size_t blockMax)
+{
+	static_assert(kBlockSize % 32 == 0, "Blocks must hold whole bit words");
+	assert(blockMax <= BlockCount());
+	for (size_t blockIdx = blockMin; blockIdx < blockMax; ++blockIdx)
+	{
+		const size_t	start = BlockStart(blockIdx);
+		const size_t	stop = BlockStop(blockIdx);
+		uint32_t		*dstPtr = m_Indices.data() + start;
+		uint32_t		count = 0;
+
+		for (size_t wordStart = start; wordStart < stop; wordStart += 32)
+		{
+			const uint32_t	word = bits[wordStart / 32];
+			const size_t	bitCount = std::min(stop - wordStart, (size_t)32);
+
+			// Same branchless compaction as Build:
+			for (size_t bitIdx = 0; bitIdx < bitCount; ++bitIdx)
+			{
+				dstPtr[count] = (uint32_t)(wordStart + bitIdx);
+				count += (word >> bitIdx) & 1;
+			}
+		}
+		m_Counts[blockIdx] = count;
+	}
+}
+
+size_t	SNonZeroList::TotalNonZeroCount() const
+{
+	size_t	total = 0;
+
+	for (size_t blockIdx = 0; blockIdx < BlockCount(); ++blockIdx)
+		total += m_Counts[blockIdx];
+	return total;
+}
+
 CNeuronMatrix::CNeuronMatrix()
 :	m_Mat(nullptr, 0, 0, 0)
+,	m_OwnsData(false)
 {
 }
 
 CNeuronMatrix::~CNeuronMatrix()
 {
-	if (m_Mat.m_Data != nullptr)
+	FreeStorage();
+}
+
+void	CNeuronMatrix::FreeStorage()
+{
+	if (m_Mat.m_Data != nullptr && m_OwnsData)
 		_aligned_free(m_Mat.m_Data);
+	m_Mat.m_Data = nullptr;
+}
+
+void	CNeuronMatrix::MoveStorage(float *dst)
+{
+	memcpy(dst, m_Mat.m_Data, StorageByteSize());
+	FreeStorage();
+	m_Mat.m_Data = dst;
+	m_OwnsData = false;
+}
+
+bool	CNeuronMatrix::OwnStorage()
+{
+	const float		*data = m_Mat.m_Data;
+
+	if (m_OwnsData || data == nullptr)
+		return true;
+	// Same row stride, the rows are copied with their padding:
+	if (!AllocMatrix(m_Mat.m_Rows, m_Mat.m_Columns))
+		return false;
+	memcpy(m_Mat.m_Data, data, StorageByteSize());
+	return true;
 }
 
 bool	CNeuronMatrix::AllocMatrix(size_t rows, size_t col)
@@ -124,9 +270,9 @@ bool	CNeuronMatrix::AllocMatrix(size_t rows, size_t col)
 	size_t			offsetToAlign = alignment - (colByteSize % alignment);
 	size_t			alignedColSize = offsetToAlign == alignment ? colByteSize : colByteSize + offsetToAlign;
 
-	if (m_Mat.m_Data != nullptr)
-		_aligned_free(m_Mat.m_Data);
+	FreeStorage();
 	m_Mat.m_Data = (float*)_aligned_malloc(alignedColSize * rows, alignment);
+	m_OwnsData = true;
 	m_Mat.m_Rows = rows;
 	m_Mat.m_Columns = col;
 	m_Mat.m_RowByteStride = alignedColSize;
@@ -331,6 +477,35 @@ void	CNeuronMatrix::ComputeNetInput(float *dst, const float *src, const SConstNe
 		assert(false);
 }
 
+void	CNeuronMatrix::ComputeNetInputSparse(float *dst, const float *src, const SNonZeroList &nonZeroSrc, const SConstNeuronMatrixView &mul, const float *add)
+{
+	assert(nonZeroSrc.m_Size == mul.m_Columns);
+	for (size_t y = 0; y < mul.m_Rows; ++y)
+	{
+		const float		*mulPtr = mul.GetRow(y);
+		float			sum = 0;
+
+		for (size_t blockIdx = 0; blockIdx < nonZeroSrc.BlockCount(); ++blockIdx)
+		{
+			if (nonZeroSrc.IsBlockSparse(blockIdx))
+			{
+				const uint32_t	*indices = nonZeroSrc.BlockIndices(blockIdx);
+				const uint32_t	count = nonZeroSrc.NonZeroCount(blockIdx);
+
+				for (uint32_t i = 0; i < count; ++i)
+					sum += src[indices[i]] * mulPtr[indices[i]];
+			}
+			else
+			{
+				const size_t	start = nonZeroSrc.BlockStart(blockIdx);
+
+				sum += KernelDot(src + start, mulPtr + start, nonZeroSrc.BlockStop(blockIdx) - start);
+			}
+		}
+		dst[y] = sum + add[y];
+	}
+}
+
 void	CNeuronMatrix::ComputeError(float *dstProd, const float *src, const SConstNeuronMatrixView &mul)
 {
 #if		0
@@ -444,3 +619,728 @@ void	CNeuronMatrix::ComputeError(float *dstProd, const float *src, const SConstN
 	}
 #endif
 }
+
+CQuantizedMatrix::CQuantizedMatrix()
+:	m_Data(nullptr)
+,	m_RowStride(0)
+,	m_Rows(0)
+,	m_Columns(0)
+{
+}
+
+CQuantizedMatrix::~CQuantizedMatrix()
+{
+	if (m_Data != nullptr)
+		_aligned_free(m_Data);
+}
+
+bool	CQuantizedMatrix::AllocMatrix(size_t rows, size_t col)
+{
+	if (m_Data != nullptr)
+		_aligned_free(m_Data);
+	m_RowStride = AlignedSize(col);
+	m_Rows = rows;
+	m_Columns = col;
+	m_Data = (int8_t*)_aligned_malloc(std::max<size_t>(m_RowStride * rows, kRowAlignment), kRowAlignment);
+	m_Scales.resize(rows);
+	if (m_Data == nullptr)
+		return false;
+	// The padding must stay null for the dot product:
+	memset(m_Data, 0, m_RowStride * rows);
+	return true;
+}
+
+bool	CQuantizedMatrix::Quantize(const SConstNeuronMatrixView &src)
+{
+	if (!AllocMatrix(src.m_Rows, src.m_Columns))
+		return false;
+	for (size_t y = 0; y < m_Rows; ++y)
+	{
+		const float		*srcRow = src.GetRow(y);
+		float			maxAbs = 0.0f;
+
+		for (size_t x = 0; x < m_Columns; ++x)
+			maxAbs = std::max(maxAbs, fabsf(srcRow[x]));
+		// A null row keeps a valid scale:
+		m_Scales[y] = maxAbs > 0.0f ? maxAbs / 127.0f : 1.0f;
+		QuantizeVector(m_Data + y * m_RowStride, srcRow, m_Columns, m_Scales[y]);
+	}
+	return true;
+}
+
+void	CQuantizedMatrix::Dequantize(const SNeuronMatrixView &dst) const
+{
+	assert(dst.m_Rows == m_Rows && dst.m_Columns == m_Columns);
+	for (size_t y = 0; y < m_Rows; ++y)
+	{
+		const int8_t	*srcRow = GetRow(y);
+		float			*dstRow = dst.GetRow(y);
+
+		for (size_t x = 0; x < m_Columns; ++x)
+			dstRow[x] = srcRow[x] * m_Scales[y];
+	}
+}
+
+void	CQuantizedMatrix::Serialize(std::vector<uint8_t> &data) const
+{
+	size_t		prevSize = data.size();
+	data.resize(prevSize + 2 * sizeof(uint32_t) + m_Rows * sizeof(float) + StorageByteSize());
+	uint32_t	*dataPtr = (uint32_t*)(data.data() + prevSize);
+	dataPtr[0] = m_Rows;
+	dataPtr[1] = m_Columns;
+	dataPtr += 2;
+	memcpy(dataPtr, m_Scales.data(), m_Rows * sizeof(float));
+	memcpy(dataPtr + m_Rows, m_Data, StorageByteSize());
+}
+
+bool	CQuantizedMatrix::UnSerialize(const std::vector<uint8_t> &data, size_t &curIdx)
+{
+	if (curIdx + 2 * sizeof(uint32_t) > data.size())
+		return false;
+	const uint32_t	*dataPtr = (const uint32_t*)(data.data() + curIdx);
+	if (!AllocMatrix(dataPtr[0], dataPtr[1]))
+		return false;
+	dataPtr += 2;
+	curIdx += 2 * sizeof(uint32_t);
+	if (curIdx + m_Rows * sizeof(float) + StorageByteSize() > data.size())
+		return false;
+	memcpy(m_Scales.data(), dataPtr, m_Rows * sizeof(float));
+	memcpy(m_Data, dataPtr + m_Rows, StorageByteSize());
+	curIdx += m_Rows * sizeof(float) + StorageByteSize();
+	return true;
+}
+
+void	CQuantizedMatrix::QuantizeVector(int8_t *dst, const float *src, size_t count, float scale)
+{
+	const float		invScale = 1.0f / scale;
+
+	for (size_t i = 0; i < count; ++i)
+	{
+		const float		value = std::min(127.0f, std::max(-127.0f, src[i] * invScale));
+
+		dst[i] = static_cast<int8_t>(value < 0.0f ? value - 0.5f : value + 0.5f);
+	}
+}
+
+int32_t	CQuantizedMatrix::Dot(const int8_t *a, const int8_t *b, size_t count)
+{
+	assert((count % kRowAlignment) == 0);
+	// SSE2 has no int8 multiply: both sides are sign extended to int16 and multiplied with _mm_madd_epi16,
+	// which sums adjacent products into int32 lanes:
+	__m128i		accum_xyzw = _mm_setzero_si128();
+
+	for (size_t i = 0; i < count; i += kRowAlignment)
+	{
+		const __m128i	a8 = _mm_loadu_si128((const __m128i*)(a + i));
+		const __m128i	b8 = _mm_loadu_si128((const __m128i*)(b + i));
+		const __m128i	aLo16 = _mm_srai_epi16(_mm_unpacklo_epi8(a8, a8), 8);
+		const __m128i	aHi16 = _mm_srai_epi16(_mm_unpackhi_epi8(a8, a8), 8);
+		const __m128i	bLo16 = _mm_srai_epi16(_mm_unpacklo_epi8(b8, b8), 8);
+		const __m128i	bHi16 = _mm_srai_epi16(_mm_unpackhi_epi8(b8, b8), 8);
+
+		accum_xyzw = _mm_add_epi32(accum_xyzw, _mm_madd_epi16(aLo16, bLo16));
+		accum_xyzw = _mm_add_epi32(accum_xyzw, _mm_madd_epi16(aHi16, bHi16));
+	}
+	// Horizontal sum of accum:
+	const __m128i	accum_zwxy = _mm_shuffle_epi32(accum_xyzw, _MM_SHUFFLE(1, 0, 3, 2));
+	const __m128i	reduc1_xyxy = _mm_add_epi32(accum_xyzw, accum_zwxy);
+	const __m128i	reduc1_yxyx = _mm_shuffle_epi32(reduc1_xyxy, _MM_SHUFFLE(0, 1, 0, 1));
+
+	return _mm_cvtsi128_si32(_mm_add_epi32(reduc1_xyxy, reduc1_yxyx));
+}
+
+void	CQuantizedMatrix::ComputeNetInput(float *dst, const int8_t *src, float srcScale, const CQuantizedMatrix &mul, size_t rowMin, size_t rowMax, const float *add)
+{
+	const size_t	count = AlignedSize(mul.m_Columns);
+
+	for (size_t y = rowMin; y < rowMax; ++y)
+		dst[y - rowMin] = Dot(src, mul.GetRow(y), count) * (srcScale * mul.m_Scales[y]) + add[y - rowMin];
+}
+
+CHalfMatrix::CHalfMatrix()
+:	m_Data(nullptr)
+,	m_Format(EHalfFormat::Float16)
+,	m_RowStride(0)
+,	m_Rows(0)
+,	m_Columns(0)
+{
+}
+
+CHalfMatrix::~CHalfMatrix()
+{
+	if (m_Data != nullptr)
+		_aligned_free(m_Data);
+}
+
+bool	CHalfMatrix::AllocMatrix(size_t rows, size_t col, EHalfFormat format)
+{
+	if (m_Data != nullptr)
+		_aligned_free(m_Data);
+	m_Format = format;
+	m_RowStride = (col + kRowAlignment - 1) & ~(kRowAlignment - 1);
+	m_Rows = rows;
+	m_Columns = col;
+	m_Data = (uint16_t*)_aligned_malloc(std::max<size_t>(StorageByteSize(), 0x10), 0x10);
+	if (m_Data == nullptr)
+		return false;
+	memset(m_Data, 0, StorageByteSize());
+	return true;
+}
+
+bool	CHalfMatrix::Convert(const SConstNeuronMatrixView &src, EHalfFormat format)
+{
+	if (!AllocMatrix(src.m_Rows, src.m_Columns, format))
+		return false;
+	for (size_t y = 0; y < m_Rows; ++y)
+	{
+		const float		*srcRow = src.GetRow(y);
+		uint16_t		*dstRow = m_Data + y * m_RowStride;
+
+		for (size_t x = 0; x < m_Columns; ++x)
+			dstRow[x] = FloatToHalf(srcRow[x], format);
+	}
+	return true;
+}
+
+void	CHalfMatrix::Expand(const SNeuronMatrixView &dst) const
+{
+	assert(dst.m_Rows == m_Rows && dst.m_Columns == m_Columns);
+	for (size_t y = 0; y < m_Rows; ++y)
+	{
+		const uint16_t	*srcRow = GetRow(y);
+		float			*dstRow = dst.GetRow(y);
+
+		for (size_t x = 0; x < m_Columns; ++x)
+			dstRow[x] = HalfToFloat(srcRow[x], m_Format);
+	}
+}
+
+void	CHalfMatrix::Serialize(std::vector<uint8_t> &data) const
+{
+	size_t		prevSize = data.size();
+	data.resize(prevSize + 3 * sizeof(uint32_t) + StorageByteSize());
+	uint32_t	*dataPtr = (uint32_t*)(data.data() + prevSize);
+	dataPtr[0] = (uint32_t)m_Format;
+	dataPtr[1] = m_Rows;
+	dataPtr[2] = m_Columns;
+	memcpy(dataPtr + 3, m_Data, StorageByteSize());
+}
+
+bool	CHalfMatrix::UnSerialize(const std::vector<uint8_t> &data, size_t &curIdx)
+{
+	if (curIdx + 3 * sizeof(uint32_t) > data.size())
+		return false;
+	const uint32_t	*dataPtr = (const uint32_t*)(data.data() + curIdx);
+	if (dataPtr[0] > (uint32_t)EHalfFormat::BFloat16)
+		return false;
+	if (!AllocMatrix(dataPtr[1], dataPtr[2], (EHalfFormat)dataPtr[0]))
+		return false;
+	curIdx += 3 * sizeof(uint32_t);
+	if (curIdx + StorageByteSize() > data.size())
+		return false;
+	memcpy(m_Data, dataPtr + 3, StorageByteSize());
+	curIdx += StorageByteSize();
+	return true;
+}
+
+uint16_t	CHalfMatrix::FloatToHalf(float value, EHalfFormat format)
+{
+	uint32_t	bits;
+	memcpy(&bits, &value, sizeof(float));
+	if (format == EHalfFormat::BFloat16)
+	{
+		// Upper half of the float, NaNs stay quiet NaNs:
+		if ((bits & 0x7FFFFFFF) > 0x7F800000)
+			return static_cast<uint16_t>((bits >> 16) | 0x40);
+		return static_cast<uint16_t>((bits + 0x7FFF + ((bits >> 16) & 1)) >> 16);
+	}
+
+	const uint32_t	sign = (bits >> 16) & 0x8000;
+	const uint32_t	absBits = bits & 0x7FFFFFFF;
+	uint32_t		half = 0;
+	uint32_t		rem = 0;
+	uint32_t		tie = 0;
+
+	if (absBits >= 0x7F800000)
+		return static_cast<uint16_t>(sign | (absBits > 0x7F800000 ? 0x7E00 : 0x7C00));
+	// 65520 and above round to infinite:
+	if (absBits >= 0x477FF000)
+		return static_cast<uint16_t>(sign | 0x7C00);
+	if (absBits < 0x38800000)
+	{
+		// Denormal half, under 2^-25 it rounds to zero:
+		if (absBits < 0x33000000)
+			return static_cast<uint16_t>(sign);
+		const uint32_t	shift = 126 - (absBits >> 23);
+		const uint32_t	mantissa = (absBits & 0x7FFFFF) | 0x800000;
+
+		half = mantissa >> shift;
+		rem = mantissa & ((1u << shift) - 1);
+		tie = 1u << (shift - 1);
+	}
+	else
+	{
+		// Rebias the exponent (127 -> 15) and drop 13 bits of mantissa, a carry goes in the exponent:
+		half = (absBits - 0x38000000) >> 13;
+		rem = absBits & 0x1FFF;
+		tie = 0x1000;
+	}
+	if (rem > tie || (rem == tie && (half & 1) != 0))
+		++half;
+	return static_cast<uint16_t>(sign | half);
+}
+
+static __forceinline __m128	_Float16ToFloat(__m128i half_xyzw)
+{
+	// half_xyzw has one half per 32 bits lane (high bits null).
+	// Exponent and mantissa are moved in place and rebiased by a multiplication by 2^112, which also normalizes the denormals:
+	const __m128i	sign_xyzw = _mm_slli_epi32(_mm_and_si128(half_xyzw, _mm_set1_epi32(0x8000)), 16);
+	const __m128i	expMantissa_xyzw = _mm_slli_epi32(_mm_and_si128(half_xyzw, _mm_set1_epi32(0x7FFF)), 13);
+	const __m128	value_xyzw = _mm_mul_ps(_mm_castsi128_ps(expMantissa_xyzw), _mm_castsi128_ps(_mm_set1_epi32(0x77800000)));
+	// Infinites and NaNs keep a full exponent:
+	const __m128i	infNan_xyzw = _mm_cmpgt_epi32(expMantissa_xyzw, _mm_set1_epi32(0x0F7FFFFF));
+	const __m128	infNanExp_xyzw = _mm_castsi128_ps(_mm_and_si128(infNan_xyzw, _mm_set1_epi32(0x7F800000)));
+
+	return _mm_or_ps(_mm_or_ps(value_xyzw, infNanExp_xyzw), _mm_castsi128_ps(sign_xyzw));
+}
+
+float	CHalfMatrix::HalfToFloat(uint16_t value, EHalfFormat format)
+{
+	if (format == EHalfFormat::BFloat16)
+	{
+		const uint32_t	bits = static_cast<uint32_t>(value) << 16;
+		float			result;
+
+		memcpy(&result, &bits, sizeof(float));
+		return result;
+	}
+	return _mm_cvtss_f32(_Float16ToFloat(_mm_cvtsi32_si128(value)));
+}
+
+// Converts 8 packed halves to two float vectors:
+template<EHalfFormat _Format>
+static __forceinline void	_HalfToFloat8(__m128i half8, __m128 &lo_xyzw, __m128 &hi_xyzw)
+{
+	const __m128i	zero = _mm_setzero_si128();
+
+	if (_Format == EHalfFormat::BFloat16)
+	{
+		lo_xyzw = _mm_castsi128_ps(_mm_unpacklo_epi16(zero, half8));
+		hi_xyzw = _mm_castsi128_ps(_mm_unpackhi_epi16(zero, half8));
+	}
+	else
+	{
+#if		ENABLE_F16C
+		lo_xyzw = _mm_cvtph_ps(half8);
+		hi_xyzw = _mm_cvtph_ps(_mm_srli_si128(half8, 8));
+#else
+		lo_xyzw = _Float16ToFloat(_mm_unpacklo_epi16(half8, zero));
+		hi_xyzw = _Float16ToFloat(_mm_unpackhi_epi16(half8, zero));
+#endif
+	}
+}
+
+template<EHalfFormat _Format>
+static void	_ComputeNetInputHalf(float *dst, const float *src, const CHalfMatrix &mul, size_t rowMin, size_t rowMax, const float *add)
+{
+	const size_t	columns = mul.Columns();
+	const size_t	blockColumns = columns & ~(CHalfMatrix::kRowAlignment - 1);
+	float			srcTail[CHalfMatrix::kRowAlignment] = { 0.0f };
+
+	// The row padding is null, the last block reads the input from a padded copy:
+	memcpy(srcTail, src + blockColumns, (columns - blockColumns) * sizeof(float));
+	for (size_t y = rowMin; y < rowMax; ++y)
+	{
+		const uint16_t	*mulPtr = mul.GetRow(y);
+		__m128			accumLo_xyzw = _mm_setzero_ps();
+		__m128			accumHi_xyzw = _mm_setzero_ps();
+		__m128			weightLo_xyzw;
+		__m128			weightHi_xyzw;
+
+		for (size_t x = 0; x < blockColumns; x += CHalfMatrix::kRowAlignment)
+		{
+			_HalfToFloat8<_Format>(_mm_load_si128((const __m128i*)(mulPtr + x)), weightLo_xyzw, weightHi_xyzw);
+			accumLo_xyzw = _mm_add_ps(accumLo_xyzw, _mm_mul_ps(weightLo_xyzw, _mm_loadu_ps(src + x)));
+			accumHi_xyzw = _mm_add_ps(accumHi_xyzw, _mm_mul_ps(weightHi_xyzw, _mm_loadu_ps(src + x + 4)));
+		}
+		if (blockColumns < columns)
+		{
+			_HalfToFloat8<_Format>(_mm_load_si128((const __m128i*)(mulPtr + blockColumns)), weightLo_xyzw, weightHi_xyzw);
+			accumLo_xyzw = _mm_add_ps(accumLo_xyzw, _mm_mul_ps(weightLo_xyzw, _mm_loadu_ps(srcTail)));
+			accumHi_xyzw = _mm_add_ps(accumHi_xyzw, _mm_mul_ps(weightHi_xyzw, _mm_loadu_ps(srcTail + 4)));
+		}
+		// Horizontal sum of accum:
+		const __m128	accum_xyzw = _mm_add_ps(accumLo_xyzw, accumHi_xyzw);
+		const __m128	accum_zwxy = _mm_shuffle_ps(accum_xyzw, accum_xyzw, _MM_SHUFFLE(1, 0, 3, 2));
+		const __m128	reduc1_xyxy = _mm_add_ps(accum_xyzw, accum_zwxy);
+		const __m128	reduc1_yxyx = _mm_shuffle_ps(reduc1_xyxy, reduc1_xyxy, _MM_SHUFFLE(0, 1, 0, 1));
+
+		dst[y - rowMin] = _mm_cvtss_f32(_mm_add_ss(reduc1_yxyx, reduc1_xyxy)) + add[y - rowMin];
+	}
+}
+
+void	CHalfMatrix::ComputeNetInput(float *dst, const float *src, const CHalfMatrix &mul, size_t rowMin, size_t rowMax, const float *add)
+{
+	if (mul.m_Format == EHalfFormat::BFloat16)
+		_ComputeNetInputHalf<EHalfFormat::BFloat16>(dst, src, mul, rowMin, rowMax, add);
+	else
+		_ComputeNetInputHalf<EHalfFormat::Float16>(dst, src, mul, rowMin, rowMax, add);
+}
+
+CHalfVector::CHalfVector()
+:	m_Data(nullptr)
+,	m_Size(0)
+{
+}
+
+CHalfVector::~CHalfVector()
+{
+	FreeStorage();
+}
+
+bool	CHalfVector::AllocateStorage(size_t elements)
+{
+	FreeStorage();
+	m_Size = elements;
+	m_Data = (uint16_t*)_aligned_malloc(std::max<size_t>(elements * sizeof(uint16_t), 0x10), 0x10);
+	return m_Data != nullptr;
+}
+
+void	CHalfVector::FreeStorage()
+{
+	if (m_Data != nullptr)
+		_aligned_free(m_Data);
+	m_Data = nullptr;
+	m_Size = 0;
+}
+
+void	CHalfVector::Pack(const float *src, size_t rangeMin, size_t rangeMax)
+{
+	assert(rangeMax <= m_Size);
+	const __m128i	roundBias = _mm_set1_epi32(0x7FFF);
+	const __m128i	one = _mm_set1_epi32(1);
+	size_t			idx = rangeMin;
+
+	// Round to nearest even, the values are finite:
+	for (; idx + 8 <= rangeMax; idx += 8)
+	{
+		const __m128i	lo_xyzw = _mm_castps_si128(_mm_loadu_ps(src + idx));
+		const __m128i	hi_xyzw = _mm_castps_si128(_mm_loadu_ps(src + idx + 4));
+		const __m128i	loOdd_xyzw = _mm_and_si128(_mm_srli_epi32(lo_xyzw, 16), one);
+		const __m128i	hiOdd_xyzw = _mm_and_si128(_mm_srli_epi32(hi_xyzw, 16), one);
+		// Arithmetic shift: the upper halves fit in an int16 and are not saturated by the pack:
+		const __m128i	loHalf_xyzw = _mm_srai_epi32(_mm_add_epi32(lo_xyzw, _mm_add_epi32(roundBias, loOdd_xyzw)), 16);
+		const __m128i	hiHalf_xyzw = _mm_srai_epi32(_mm_add_epi32(hi_xyzw, _mm_add_epi32(roundBias, hiOdd_xyzw)), 16);
+
+		_mm_storeu_si128((__m128i*)(m_Data + idx), _mm_packs_epi32(loHalf_xyzw, hiHalf_xyzw));
+	}
+	for (; idx < rangeMax; ++idx)
+		m_Data[idx] = CHalfMatrix::FloatToHalf(src[idx], EHalfFormat::BFloat16);
+}
+
+void	CHalfVector::Unpack(float *dst, size_t rangeMin, size_t rangeMax) const
+{
+	assert(rangeMax <= m_Size);
+	const __m128i	zero = _mm_setzero_si128();
+	size_t			idx = rangeMin;
+
+	for (; idx + 8 <= rangeMax; idx += 8)
+	{
+		const __m128i	half8 = _mm_loadu_si128((const __m128i*)(m_Data + idx));
+
+		_mm_storeu_ps(dst + idx, _mm_castsi128_ps(_mm_unpacklo_epi16(zero, half8)));
+		_mm_storeu_ps(dst + idx + 4, _mm_castsi128_ps(_mm_unpackhi_epi16(zero, half8)));
+	}
+	for (; idx < rangeMax; ++idx)
+		dst[idx] = CHalfMatrix::HalfToFloat(m_Data[idx], EHalfFormat::BFloat16);
+}
+
+CBlockSparseMatrix::CBlockSparseMatrix()
+:	m_Values(nullptr)
+,	m_Rows(0)
+,	m_Columns(0)
+{
+}
+
+CBlockSparseMatrix::~CBlockSparseMatrix()
+{
+	Clear();
+}
+
+bool	CBlockSparseMatrix::AllocValues(size_t blockCount)
+{
+	if (m_Values != nullptr)
+		_aligned_free(m_Values);
+	m_Values = (float*)_aligned_malloc(std::max<size_t>(blockCount * kBlockSize * sizeof(float), 0x10), 0x10);
+	if (m_Values == nullptr)
+		return false;
+	// The columns of the last block past the end of the row stay zero:
+	memset(m_Values, 0, blockCount * kBlockSize * sizeof(float));
+	return true;
+}
+
+void	CBlockSparseMatrix::Clear()
+{
+	if (m_Values != nullptr)
+		_aligned_free(m_Values);
+	m_Values = nullptr;
+	m_RowStarts.clear();
+	m_BlockColumns.clear();
+	m_ColumnStarts.clear();
+	m_ColumnBlocks.clear();
+	m_BlockRows.clear();
+	m_Rows = 0;
+	m_Columns = 0;
+}
+
+bool	CBlockSparseMatrix::Build(const SConstNeuronMatrixView &src)
+{
+	m_Rows = src.m_Rows;
+	m_Columns = src.m_Columns;
+	m_RowStarts.assign(1, 0);
+	m_BlockColumns.clear();
+	for (size_t y = 0; y < m_Rows; ++y)
+	{
+		const float		*srcRow = src.GetRow(y);
+
+		for (size_t col = 0; col < m_Columns; col += kBlockSize)
+		{
+			const size_t	stop = std::min(col + kBlockSize, m_Columns);
+
+			for (size_t x = col; x < stop; ++x)
+			{
+				if (srcRow[x] != 0.0f)
+				{
+					m_BlockColumns.push_back(static_cast<uint32_t>(col));
+					break;
+				}
+			}
+		}
+		m_RowStarts.push_back(static_cast<uint32_t>(m_BlockColumns.size()));
+	}
+	if (!AllocValues(BlockCount()))
+		return false;
+	UpdateValues(src, 0, m_Rows);
+	return BuildColumnIndex();
+}
+
+bool	CBlockSparseMatrix::BuildColumnIndex()
+{
+	const size_t	blockColumnCount = (m_Columns + kBlockSize - 1) / kBlockSize;
+
+	m_ColumnStarts.assign(blockColumnCount + 1, 0);
+	m_ColumnBlocks.resize(BlockCount());
+	m_BlockRows.resize(BlockCount());
+	for (size_t blockIdx = 0; blockIdx < BlockCount(); ++blockIdx)
+		++m_ColumnStarts[m_BlockColumns[blockIdx] / kBlockSize + 1];
+	for (size_t x = 0; x < blockColumnCount; ++x)
+		m_ColumnStarts[x + 1] += m_ColumnStarts[x];
+
+	// The rows are walked in order, the blocks of a column are sorted by row:
+	std::vector<uint32_t>	cursors(m_ColumnStarts.begin(), m_ColumnStarts.end() - 1);
+
+	for (size_t y = 0; y < m_Rows; ++y)
+	{
+		for (uint32_t blockIdx = m_RowStarts[y]; blockIdx < m_RowStarts[y + 1]; ++blockIdx)
+		{
+			m_ColumnBlocks[cursors[m_BlockColumns[blockIdx] / kBlockSize]++] = blockIdx;
+			m_BlockRows[blockIdx] = static_cast<uint32_t>(y);
+		}
+	}
+	return true;
+}
+
+void	CBlockSparseMatrix::UpdateValues(const SConstNeuronMatrixView &src, size_t rowMin, size_t rowMax)
+{
+	assert(src.m_Rows == m_Rows && src.m_Columns == m_Columns && rowMax <= m_Rows);
+	for (size_t y = rowMin; y < rowMax; ++y)
+	{
+		const float		*srcRow = src.GetRow(y);
+
+		for (uint32_t blockIdx = m_RowStarts[y]; blockIdx < m_RowStarts[y + 1]; ++blockIdx)
+		{
+			const size_t	col = m_BlockColumns[blockIdx];
+			const size_t	count = std::min(kBlockSize, m_Columns - col);
+
+			memcpy(m_Values + blockIdx * kBlockSize, srcRow + col, count * sizeof(float));
+		}
+	}
+}
+
+void	CBlockSparseMatrix::Expand(const SNeuronMatrixView &dst) const
+{
+	assert(dst.m_Rows == m_Rows && dst.m_Columns == m_Columns);
+	for (size_t y = 0; y < m_Rows; ++y)
+	{
+		float	*dstRow = dst.GetRow(y);
+
+		memset(dstRow, 0, m_Columns * sizeof(float));
+		for (uint32_t blockIdx = m_RowStarts[y]; blockIdx < m_RowStarts[y + 1]; ++blockIdx)
+		{
+			const size_t	col = m_BlockColumns[blockIdx];
+			const size_t	count = std::min(kBlockSize, m_Columns - col);
+
+			memcpy(dstRow + col, m_Values + blockIdx * kBlockSize, count * sizeof(float));
+		}
+	}
+}
+
+void	CBlockSparseMatrix::Serialize(std::vector<uint8_t> &data) const
+{
+	const size_t	blockCount = BlockCount();
+	const size_t	valuesByteSize = blockCount * kBlockSize * sizeof(float);
+	size_t			prevSize = data.size();
+
+	data.resize(prevSize + 3 * sizeof(uint32_t) + (m_RowStarts.size() + blockCount) * sizeof(uint32_t) + valuesByteSize);
+	uint32_t	*dataPtr = (uint32_t*)(data.data() + prevSize);
+	dataPtr[0] = static_cast<uint32_t>(m_Rows);
+	dataPtr[1] = static_cast<uint32_t>(m_Columns);
+	dataPtr[2] = static_cast<uint32_t>(blockCount);
+	dataPtr += 3;
+	memcpy(dataPtr, m_RowStarts.data(), m_RowStarts.size() * sizeof(uint32_t));
+	dataPtr += m_RowStarts.size();
+	memcpy(dataPtr, m_BlockColumns.data(), blockCount * sizeof(uint32_t));
+	dataPtr += blockCount;
+	memcpy(dataPtr, m_Values, valuesByteSize);
+}
+
+bool	CBlockSparseMatrix::UnSerialize(const std::vector<uint8_t> &data, size_t &curIdx)
+{
+	if (curIdx + 3 * sizeof(uint32_t) > data.size())
+		return false;
+	const uint32_t	*dataPtr = (const uint32_t*)(data.data() + curIdx);
+	const size_t	rows = dataPtr[0];
+	const size_t	columns = dataPtr[1];
+	const size_t	blockCount = dataPtr[2];
+	const size_t	valuesByteSize = blockCount * kBlockSize * sizeof(float);
+
+	curIdx += 3 * sizeof(uint32_t);
+	if (curIdx + (rows + 1 + blockCount) * sizeof(uint32_t) + valuesByteSize > data.size())
+		return false;
+	dataPtr += 3;
+	m_Rows = rows;
+	m_Columns = columns;
+	m_RowStarts.assign(dataPtr, dataPtr + rows + 1);
+	dataPtr += rows + 1;
+	m_BlockColumns.assign(dataPtr, dataPtr + blockCount);
+	dataPtr += blockCount;
+	if (m_RowStarts.front() != 0 || m_RowStarts.back() != blockCount)
+		return false;
+	for (size_t y = 0; y < rows; ++y)
+	{
+		if (m_RowStarts[y] > m_RowStarts[y + 1])
+			return false;
+	}
+	for (uint32_t col : m_BlockColumns)
+	{
+		if (col >= columns || col % kBlockSize != 0)
+			return false;
+	}
+	if (!AllocValues(blockCount))
+		return false;
+	memcpy(m_Values, dataPtr, valuesByteSize);
+	curIdx += (rows + 1 + blockCount) * sizeof(uint32_t) + valuesByteSize;
+	return BuildColumnIndex();
+}
+
+void	CBlockSparseMatrix::ComputeNetInput(float *dst, const float *src, const CBlockSparseMatrix &mul, size_t rowMin, size_t rowMax, const float *add)
+{
+	assert(rowMax <= mul.m_Rows);
+	const size_t	fullColumns = mul.m_Columns & ~(kBlockSize - 1);
+	float			srcTail[kBlockSize] = { 0.0f };
+
+	// The values of the last block are padded with zeros, it reads the input from a padded copy:
+	memcpy(srcTail, src + fullColumns, (mul.m_Columns - fullColumns) * sizeof(float));
+	for (size_t y = rowMin; y < rowMax; ++y)
+	{
+		__m128			accumLo_xyzw = _mm_setzero_ps();
+		__m128			accumHi_xyzw = _mm_setzero_ps();
+
+		for (uint32_t blockIdx = mul.m_RowStarts[y]; blockIdx < mul.m_RowStarts[y + 1]; ++blockIdx)
+		{
+			const size_t	col = mul.m_BlockColumns[blockIdx];
+			const float		*srcPtr = col < fullColumns ? src + col : srcTail;
+			const float		*valuesPtr = mul.m_Values + blockIdx * kBlockSize;
+
+			accumLo_xyzw = _mm_add_ps(accumLo_xyzw, _mm_mul_ps(_mm_load_ps(valuesPtr), _mm_loadu_ps(srcPtr)));
+			accumHi_xyzw = _mm_add_ps(accumHi_xyzw, _mm_mul_ps(_mm_load_ps(valuesPtr + 4), _mm_loadu_ps(srcPtr + 4)));
+		}
+		// Horizontal sum of accum:
+		const __m128	accum_xyzw = _mm_add_ps(accumLo_xyzw, accumHi_xyzw);
+		const __m128	accum_zwxy = _mm_shuffle_ps(accum_xyzw, accum_xyzw, _MM_SHUFFLE(1, 0, 3, 2));
+		const __m128	reduc1_xyxy = _mm_add_ps(accum_xyzw, accum_zwxy);
+		const __m128	reduc1_yxyx = _mm_shuffle_ps(reduc1_xyxy, reduc1_xyxy, _MM_SHUFFLE(0, 1, 0, 1));
+
+		dst[y - rowMin] = _mm_cvtss_f32(_mm_add_ss(reduc1_yxyx, reduc1_xyxy)) + add[y - rowMin];
+	}
+}
+
+void	CBlockSparseMatrix::ComputeError(float *dst, const float *src, const CBlockSparseMatrix &mul, size_t colMin, size_t colMax)
+{
+	assert(colMin < colMax && colMax <= mul.m_Columns);
+	const size_t	blockMin = colMin / kBlockSize;
+	const size_t	blockMax = (colMax + kBlockSize - 1) / kBlockSize;
+
+	for (size_t blockColumn = blockMin; blockColumn < blockMax; ++blockColumn)
+	{
+		const size_t	col = blockColumn * kBlockSize;
+		const size_t	start = std::max(col, colMin);
+		const size_t	stop = std::min(col + kBlockSize, colMax);
+		__m128			accumLo_xyzw = _mm_setzero_ps();
+		__m128			accumHi_xyzw = _mm_setzero_ps();
+
+		for (uint32_t i = mul.m_ColumnStarts[blockColumn]; i < mul.m_ColumnStarts[blockColumn + 1]; ++i)
+		{
+			const uint32_t	blockIdx = mul.m_ColumnBlocks[i];
+			const __m128	src_xxxx = _mm_set1_ps(src[mul.m_BlockRows[blockIdx]]);
+			const float		*valuesPtr = mul.m_Values + blockIdx * kBlockSize;
+
+			accumLo_xyzw = _mm_add_ps(accumLo_xyzw, _mm_mul_ps(src_xxxx, _mm_load_ps(valuesPtr)));
+			accumHi_xyzw = _mm_add_ps(accumHi_xyzw, _mm_mul_ps(src_xxxx, _mm_load_ps(valuesPtr + 4)));
+		}
+		if (start == col && stop == col + kBlockSize)
+		{
+			_mm_storeu_ps(dst + col, accumLo_xyzw);
+			_mm_storeu_ps(dst + col + 4, accumHi_xyzw);
+			continue;
+		}
+		// Block cut by the range or by the end of the row:
+		float	accum[kBlockSize];
+
+		_mm_storeu_ps(accum, accumLo_xyzw);
+		_mm_storeu_ps(accum + 4, accumHi_xyzw);
+		memcpy(dst + start, accum + start - col, (stop - start) * sizeof(float));
+	}
+}
+
+void	CBlockSparseMatrix::AccumOuterProduct(const SNeuronMatrixView &dst, const float *src, const float *vec, const CBlockSparseMatrix &mask, size_t rowMin, size_t rowMax)
+{
+	assert(dst.m_Rows == mask.m_Rows && dst.m_Columns == mask.m_Columns && rowMax <= mask.m_Rows);
+	const size_t	fullColumns = mask.m_Columns & ~(kBlockSize - 1);
+
+	for (size_t y = rowMin; y < rowMax; ++y)
+	{
+		const float		slope = src[y];
+		float			*dstRow = dst.GetRow(y);
+
+		// Dead units have a null slope and leave their row untouched:
+		if (slope == 0.0f)
+			continue;
+		const __m128	slope_xxxx = _mm_set1_ps(slope);
+
+		for (uint32_t blockIdx = mask.m_RowStarts[y]; blockIdx < mask.m_RowStarts[y + 1]; ++blockIdx)
+		{
+			const size_t	col = mask.m_BlockColumns[blockIdx];
+
+			if (col >= fullColumns)
+			{
+				for (size_t x = col; x < mask.m_Columns; ++x)
+					dstRow[x] += slope * vec[x];
+				continue;
+			}
+			// Rows are 16 bytes aligned and blocks start on a multiple of 8 columns:
+			_mm_store_ps(dstRow + col, _mm_add_ps(_mm_load_ps(dstRow + col), _mm_mul_ps(slope_xxxx, _mm_loadu_ps(vec + col))));
+			_mm_store_ps(dstRow + col + 4, _mm_add_ps(_mm_load_ps(dstRow + col + 4), _mm_mul_ps(slope_xxxx, _mm_loadu_ps(vec + col + 4))));
+		}
+	}
+}
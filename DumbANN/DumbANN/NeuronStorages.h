@@ -1,6 +1,7 @@
 #pragma once
 
 #include <stdlib.h>
+#include <stdint.h>
 #include <cstring>
 #include <vector>
 
@@ -49,6 +50,37 @@ struct	SConstNeuronMatrixView
 	size_t		m_Columns;
 };
 
+// Indices of the non zero values of a vector.
+// Values outside the list are zero and their slopes are ignored by the layer that built it.
+// Built per block so each task fills the blocks starting in its range:
+struct	SNonZeroList
+{
+	static const size_t		kBlockSize = 1024;
+
+	SNonZeroList()
+	:	m_Size(0)
+	{
+	}
+
+	void			Allocate(size_t size);
+	void			Build(const float *values, size_t blockMin, size_t blockMax);
+	// Lists the set bits, one bit per value:
+	void			BuildFromBits(const uint32_t *bits, size_t blockMin, size_t blockMax);
+
+	size_t			BlockCount() const { return m_Counts.size(); }
+	size_t			BlockStart(size_t blockIdx) const { return blockIdx * kBlockSize; }
+	size_t			BlockStop(size_t blockIdx) const { return (blockIdx + 1) * kBlockSize < m_Size ? (blockIdx + 1) * kBlockSize : m_Size; }
+	const uint32_t	*BlockIndices(size_t blockIdx) const { return m_Indices.data() + blockIdx * kBlockSize; }
+	uint32_t		NonZeroCount(size_t blockIdx) const { return m_Counts[blockIdx]; }
+	size_t			TotalNonZeroCount() const;
+	// Under half density, looping on the indices is cheaper than the dense loop:
+	bool			IsBlockSparse(size_t blockIdx) const { return m_Counts[blockIdx] * 2 < BlockStop(blockIdx) - BlockStart(blockIdx); }
+
+	std::vector<uint32_t>	m_Indices;
+	std::vector<uint32_t>	m_Counts;
+	size_t					m_Size;
+};
+
 class	CNeuronVector
 {
 public:
@@ -56,6 +88,12 @@ public:
 	~CNeuronVector();
 
 	bool	AllocateStorage(size_t elements);
+	// Points to a storage owned by someone else, it is not freed by this vector:
+	void	AliasStorage(float *data, size_t elements);
+	// Copies the values to dst, owned by someone else, and keeps it as storage:
+	void	MoveStorage(float *dst);
+	// Copies a storage owned by someone else to an allocation of its own:
+	bool	OwnStorage();
 	float	*Data() const { return m_Data; }
 	size_t	Size() const { return m_Size; }
 
@@ -64,8 +102,11 @@ public:
 	void	DebugCheckForNaNs() const;
 
 private:
+	void	FreeStorage();
+
 	float	*m_Data;
 	size_t	m_Size;
+	bool	m_OwnsData;
 };
 
 class	CNeuronMatrix
@@ -75,6 +116,10 @@ public:
 	~CNeuronMatrix();
 
 	bool	AllocMatrix(size_t rows, size_t col);
+	// Copies the rows to dst, owned by someone else, and keeps it as storage with the same row stride:
+	void	MoveStorage(float *dst);
+	// Copies a storage owned by someone else to an allocation of its own:
+	bool	OwnStorage();
 
 	float						*Data() const { return m_Mat.m_Data; }
 	size_t						StorageByteSize() const { return m_Mat.m_RowByteStride * m_Mat.m_Rows; }
@@ -85,8 +130,177 @@ public:
 	void	DebugCheckForNaNs() const;
 
 	static void		ComputeNetInput(float *dst, const float *src, const SConstNeuronMatrixView &mul, const float *add);
+	static void		ComputeNetInputSparse(float *dst, const float *src, const SNonZeroList &nonZeroSrc, const SConstNeuronMatrixView &mul, const float *add);
 	static void		ComputeError(float *dstProd, const float *src, const SConstNeuronMatrixView &mul);
 
 private:
+	void	FreeStorage();
+
 	SNeuronMatrixView	m_Mat;
+	bool				m_OwnsData;
+};
+
+// Int8 copy of a matrix for inference, with one scale per row (row = dequantized row / scale).
+// Rows are padded with zeros to 16 values for the SIMD dot product:
+class	CQuantizedMatrix
+{
+public:
+	static const size_t		kRowAlignment = 16;
+	// Written in place of the row stride of a float matrix, which is always a multiple of 16:
+	static const uint32_t	kSerializeTag = 1;
+
+	CQuantizedMatrix();
+	~CQuantizedMatrix();
+
+	bool	Quantize(const SConstNeuronMatrixView &src);
+	void	Dequantize(const SNeuronMatrixView &dst) const;
+	bool	Empty() const { return m_Data == nullptr; }
+
+	const int8_t	*GetRow(size_t idx) const { return m_Data + idx * m_RowStride; }
+	float			GetScale(size_t idx) const { return m_Scales[idx]; }
+	size_t			Rows() const { return m_Rows; }
+	size_t			Columns() const { return m_Columns; }
+	size_t			StorageByteSize() const { return m_RowStride * m_Rows; }
+
+	void	Serialize(std::vector<uint8_t> &data) const;
+	bool	UnSerialize(const std::vector<uint8_t> &data, size_t &curIdx);
+
+	// Padded size of a quantized vector of count values:
+	static size_t	AlignedSize(size_t count) { return (count + kRowAlignment - 1) & ~(kRowAlignment - 1); }
+	// Symmetric quantization, dst = clamp(round(src / scale), -127, 127):
+	static void		QuantizeVector(int8_t *dst, const float *src, size_t count, float scale);
+	// Dot product with int32 accumulation, count must be a multiple of kRowAlignment:
+	static int32_t	Dot(const int8_t *a, const int8_t *b, size_t count);
+	// dst[y] = dot(src, row y) * srcScale * rowScale + add[y], for the rows [rowMin, rowMax):
+	static void		ComputeNetInput(float *dst, const int8_t *src, float srcScale, const CQuantizedMatrix &mul, size_t rowMin, size_t rowMax, const float *add);
+
+private:
+	bool	AllocMatrix(size_t rows, size_t col);
+
+	int8_t				*m_Data;
+	std::vector<float>	m_Scales;
+	size_t				m_RowStride;
+	size_t				m_Rows;
+	size_t				m_Columns;
+};
+
+enum class	EHalfFormat
+{
+	Float16,
+	BFloat16
+};
+
+// 16 bits copy of a matrix for inference, converted back to float in registers by the kernels.
+// Rows are padded with zeros to 8 values:
+class	CHalfMatrix
+{
+public:
+	static const size_t		kRowAlignment = 8;
+	// Written in place of the row stride of a float matrix, which is always a multiple of 16:
+	static const uint32_t	kSerializeTag = 2;
+
+	CHalfMatrix();
+	~CHalfMatrix();
+
+	bool	Convert(const SConstNeuronMatrixView &src, EHalfFormat format);
+	void	Expand(const SNeuronMatrixView &dst) const;
+	bool	Empty() const { return m_Data == nullptr; }
+
+	const uint16_t	*GetRow(size_t idx) const { return m_Data + idx * m_RowStride; }
+	EHalfFormat		Format() const { return m_Format; }
+	size_t			Rows() const { return m_Rows; }
+	size_t			Columns() const { return m_Columns; }
+	size_t			StorageByteSize() const { return m_RowStride * m_Rows * sizeof(uint16_t); }
+
+	void	Serialize(std::vector<uint8_t> &data) const;
+	bool	UnSerialize(const std::vector<uint8_t> &data, size_t &curIdx);
+
+	// Round to nearest even, out of range values become infinites:
+	static uint16_t	FloatToHalf(float value, EHalfFormat format);
+	static float	HalfToFloat(uint16_t value, EHalfFormat format);
+	// dst[y] = dot(src, row y) + add[y], for the rows [rowMin, rowMax):
+	static void		ComputeNetInput(float *dst, const float *src, const CHalfMatrix &mul, size_t rowMin, size_t rowMax, const float *add);
+
+private:
+	bool	AllocMatrix(size_t rows, size_t col, EHalfFormat format);
+
+	uint16_t	*m_Data;
+	EHalfFormat	m_Format;
+	size_t		m_RowStride;
+	size_t		m_Rows;
+	size_t		m_Columns;
+};
+
+// BF16 vector, for values kept between two passes with a float scratch to work on:
+class	CHalfVector
+{
+public:
+	CHalfVector();
+	~CHalfVector();
+
+	bool		AllocateStorage(size_t elements);
+	void		FreeStorage();
+	uint16_t	*Data() const { return m_Data; }
+	size_t		Size() const { return m_Size; }
+
+	void		Pack(const float *src, size_t rangeMin, size_t rangeMax);
+	void		Unpack(float *dst, size_t rangeMin, size_t rangeMax) const;
+
+private:
+	uint16_t	*m_Data;
+	size_t		m_Size;
+};
+
+// Block compressed sparse rows: each row keeps its non zero blocks of kBlockSize consecutive columns (1x8 blocks
+// starting on a multiple of kBlockSize), the values of the dropped blocks are zero.
+// A column index lists the blocks of each block column for the input slopes:
+class	CBlockSparseMatrix
+{
+public:
+	static const size_t		kBlockSize = 8;
+	// Written in place of the row stride of a float matrix, which is always a multiple of 16:
+	static const uint32_t	kSerializeTag = 3;
+
+	CBlockSparseMatrix();
+	~CBlockSparseMatrix();
+
+	// Keeps the blocks with a non zero value:
+	bool	Build(const SConstNeuronMatrixView &src);
+	void	Clear();
+	// Copies the values of the kept blocks of the rows [rowMin, rowMax), after a weight update:
+	void	UpdateValues(const SConstNeuronMatrixView &src, size_t rowMin, size_t rowMax);
+	// The dropped blocks are written as zeros:
+	void	Expand(const SNeuronMatrixView &dst) const;
+	bool	Empty() const { return m_Values == nullptr; }
+
+	size_t			Rows() const { return m_Rows; }
+	size_t			Columns() const { return m_Columns; }
+	size_t			BlockCount() const { return m_BlockColumns.size(); }
+	size_t			RowBlockCount(size_t row) const { return m_RowStarts[row + 1] - m_RowStarts[row]; }
+	size_t			StorageByteSize() const { return BlockCount() * (kBlockSize * sizeof(float) + sizeof(uint32_t)) + m_RowStarts.size() * sizeof(uint32_t); }
+
+	void	Serialize(std::vector<uint8_t> &data) const;
+	bool	UnSerialize(const std::vector<uint8_t> &data, size_t &curIdx);
+
+	// dst[y] = dot(src, row y) + add[y], for the rows [rowMin, rowMax):
+	static void		ComputeNetInput(float *dst, const float *src, const CBlockSparseMatrix &mul, size_t rowMin, size_t rowMax, const float *add);
+	// dst[x] = sum(src[y] * mul[y][x]), for the columns [colMin, colMax):
+	static void		ComputeError(float *dst, const float *src, const CBlockSparseMatrix &mul, size_t colMin, size_t colMax);
+	// dst[y][x] += src[y] * vec[x] on the kept blocks of mask only, for the rows [rowMin, rowMax):
+	static void		AccumOuterProduct(const SNeuronMatrixView &dst, const float *src, const float *vec, const CBlockSparseMatrix &mask, size_t rowMin, size_t rowMax);
+
+private:
+	bool	AllocValues(size_t blockCount);
+	bool	BuildColumnIndex();
+
+	float					*m_Values;
+	// Blocks of row y are [m_RowStarts[y], m_RowStarts[y + 1]), with their first column in m_BlockColumns:
+	std::vector<uint32_t>	m_RowStarts;
+	std::vector<uint32_t>	m_BlockColumns;
+	// Blocks of block column x are m_ColumnBlocks[m_ColumnStarts[x], m_ColumnStarts[x + 1]), with their row:
+	std::vector<uint32_t>	m_ColumnStarts;
+	std::vector<uint32_t>	m_ColumnBlocks;
+	std::vector<uint32_t>	m_BlockRows;
+	size_t					m_Rows;
+	size_t					m_Columns;
 };
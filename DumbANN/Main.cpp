@@ -20,6 +20,15 @@ int		main(int ac, char** av)
 //	float	poolTest = TestConvolution(true);
 //	if (poolTest < 0.0f)
 //		return EXIT_FAILURE;
+	float	layersTest = TestLayers();
+	if (layersTest < 0.0f)
+		return EXIT_FAILURE;
+	float	equivalenceTest = TestTrainingEquivalence();
+	if (equivalenceTest < 0.0f)
+		return EXIT_FAILURE;
+	float	conversionsTest = TestInferenceConversions();
+	if (conversionsTest < 0.0f)
+		return EXIT_FAILURE;
 	float	mnistTest = TestMNIST();
 	if (mnistTest < 0.0f)
 		return EXIT_FAILURE;
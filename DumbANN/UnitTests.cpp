@@ -6,13 +6,24 @@
 #include "DumbANN/LayerConv2D.h"
 #include "DumbANN/LayerMaxPooling.h"
 #include "DumbANN/LayerDropout.h"
+#include "DumbANN/LayerFlatten.h"
 #include "DumbANN/LayerSoftmax.h"
+#include "DumbANN/LayerAveragePooling.h"
+#include "DumbANN/LayerConvTranspose2D.h"
+#include "DumbANN/LayerDepthwiseConv2D.h"
+#include "DumbANN/LayerBatchNorm.h"
 
 #include <stdlib.h>
 #include <time.h>
+#include <float.h>
+#include <algorithm>
 
 #define		MNIST_MODEL_PATH	"ModelMNIST.dann"
 #define		MNIST_MODEL_PATH2	"ModelMNIST2.dann"
+#define		MNIST_MODEL_INT8_PATH	"ModelMNISTInt8.dann"
+#define		MNIST_MODEL_PRUNED_PATH	"ModelMNISTPruned.dann"
+#define		MNIST_MODEL_LOWRANK_PATH	"ModelMNISTLowRank.dann"
+#define		TEST_MODEL_PATH		"ModelTest.dann"
 
 void	PrintData2D(const float *data, size_t sizeX, size_t sizeY, bool image)
 {
@@ -146,7 +157,6 @@ void	TrainNetwork(CNeuralNetwork &ann, const std::vector<float> &images, const s
 	const size_t		epochCount = 1;
 	const size_t		miniBatchCount = 2;
 	const size_t		batchCount = labels.size() / miniBatchCount;
-	std::vector<float>	expectedOutput(10);
 	const size_t		printFrequency = 10;
 	float				inVariance = 0.0f;
 	float				outVariance = 0.0f;
@@ -165,20 +175,10 @@ void	TrainNetwork(CNeuralNetwork &ann, const std::vector<float> &images, const s
 			{
 				int					randImgIdx = rand() % labels.size();
 				uint8_t				curLabel = labels[randImgIdx];
-				// Label to output:
-				for (size_t j = 0; j < 10; ++j)
-					expectedOutput[j] = 0.0f;
-				expectedOutput[curLabel] = 1.0f;
 				// Input image data:
 				const float* inputPtr = images.data() + (ptrdiff_t)randImgIdx * inputSize;
 				// Feedforward:
 				ann.FeedForward(inputPtr);
-				// Compute error:
-				float	currentError = 0.0f;
-				for (size_t j = 0; j < 10; ++j)
-					currentError += abs(expectedOutput[j] - ann.GetOutput().Data()[j]);
-				errorEpoch += currentError;
-				errorBatch += currentError;
 
 				// Compute variance:
 				if (prevLabel != -1)
@@ -191,8 +191,10 @@ void	TrainNetwork(CNeuralNetwork &ann, const std::vector<float> &images, const s
 				}
 				prevLabel = curLabel;
 
-				// Backpropagation:
-				ann.BackPropagateError(inputPtr, expectedOutput.data());
+				// Backpropagation, the label is the expected class:
+				ann.BackPropagateError(inputPtr, curLabel);
+				errorEpoch += ann.GetLastLoss();
+				errorBatch += ann.GetLastLoss();
 			}
 			ann.UpdateWeightAndBiases();
 			if ((batchIdx + 1) % printFrequency == 0)
@@ -365,8 +367,9 @@ float	TestMNIST()
 
 	CLayerDense			layers[6];
 	CLayerMaxPooling2D	poolLayers[2];
-	CLayerConv2D		convLayers[3];
+	CLayerConv2D		convLayers[2];
 	CLayerDropOut		dropout;
+	CLayerFlatten		flatten;
 	CLayerSoftMax		softmax;
 
 	// Convolution
@@ -392,15 +395,9 @@ float	TestMNIST()
 						2, 2,
 						0, 2);
 	// Flatten:
-	convLayers[2].Setup(poolLayers[0].GetFeatureCount(),
-						poolLayers[0].GetOutputSizeX(),
-						poolLayers[0].GetOutputSizeY(),
-						1, 1, 1,
-						0, 1);
-	convLayers[2].SetActivation(EActivation::Linear);
-	convLayers[2].SetInitialization(ERandInitializer::RandHe);
+	flatten.Setup(poolLayers[0].GetOutputSize());
 	// Dense, encode to 84 floats:
-	layers[2].Setup(convLayers[2].GetOutputSize(), convLayers[2].GetOutputSize() / 4);
+	layers[2].Setup(flatten.GetOutputSize(), 84);
 	layers[2].SetActivation(EActivation::LeakyRelu);
 	layers[2].SetInitialization(ERandInitializer::RandHe);
 
@@ -424,7 +421,7 @@ float	TestMNIST()
 //	ann.AddLayer(&convLayers[1]);
 //	ann.AddLayer(&dropout);
 //	ann.AddLayer(&poolLayers[0]);
-//	ann.AddLayer(&convLayers[2]);
+//	ann.AddLayer(&flatten);
 //	ann.AddLayer(&layers[2]);
 
 	// Auto-encoder:
@@ -442,14 +439,16 @@ float	TestMNIST()
 		autoEncoder.AddLayer(&convLayers[1]);
 		autoEncoder.AddLayer(&dropout);
 		autoEncoder.AddLayer(&poolLayers[0]);
-		autoEncoder.AddLayer(&convLayers[2]);
+		autoEncoder.AddLayer(&flatten);
 		autoEncoder.AddLayer(&layers[2]);
 		autoEncoder.AddLayer(&layers[3]);
 		autoEncoder.AddLayer(&layers[4]);
 	}
 	autoEncoder.SetAllLearningRate(0.001f);
 
-	if (!ann.UnSerialize(MNIST_MODEL_PATH2))
+	const bool	annLoaded = ann.UnSerialize(MNIST_MODEL_PATH2);
+
+	if (!annLoaded)
 	{
 		ann.AddLayer(autoEncoder.Layers()[0]);
 		ann.AddLayer(autoEncoder.Layers()[1]);
@@ -462,6 +461,7 @@ float	TestMNIST()
 		ann.AddLayer(&layers[1]);
 		ann.AddLayer(&softmax);
 	}
+	ann.SetLoss(ELoss::SoftmaxCrossEntropy);
 	ann.SetAllLearningRate(0.0001f);
 
 //	autoEncoder.PrintDetails();
@@ -473,7 +473,7 @@ float	TestMNIST()
 	//convLayers[1].SetLearn(false);
 	//dropout.SetLearn(false);
 	//poolLayers[0].SetLearn(false);
-	//convLayers[2].SetLearn(false);
+	//flatten.SetLearn(false);
 	//layers[2].SetLearn(false);
 
 	ann.PrintDetails();
@@ -485,6 +485,31 @@ float	TestMNIST()
 	LoadDataSet(images, labels, "t10k-images.idx3-ubyte", "t10k-labels.idx1-ubyte");
 
 	float	error = 0.0f; // TestNetwork(ann, images, labels);
+
+	// The conversions below report their accuracy against the trained network:
+	ann.SetVerbose(true);
+	// Low rank factorization of the first dense layer, keeping 99% of the top-1 answers:
+	// The layers are new objects when the model was loaded, the first dense layer is found by type:
+	CLayerDense				lowRankLayers[2];
+	std::vector<CLayer*>	removedLayers;
+	const size_t			firstDenseIdx = std::find_if(ann.Layers().begin(), ann.Layers().end(),
+														[](const CLayer *layer) { return layer->GetLayerType() == ELayerType::LayerDense; }) - ann.Layers().begin();
+	if (ann.FactorizeDenseLayer(firstDenseIdx, &lowRankLayers[0], &lowRankLayers[1], images.data(), std::min<size_t>(labels.size(), 1000), 0.99f, removedLayers))
+		ann.Serialize(MNIST_MODEL_LOWRANK_PATH);
+	else
+		printf("Low rank factorization of layer %zu failed, %s not written\n", firstDenseIdx, MNIST_MODEL_LOWRANK_PATH);
+	// A loaded layer was created by the load, the others are the layers of this function:
+	if (annLoaded)
+	{
+		for (CLayer *layer : removedLayers)
+			delete layer;
+	}
+	// Dead and low magnitude dense neurons removed, calibrated on the first test images:
+	if (ann.PruneDenseLayers(images.data(), std::min<size_t>(labels.size(), 1000), 1e-3f))
+		ann.Serialize(MNIST_MODEL_PRUNED_PATH);
+	// Int8 model for inference, calibrated on the first test images:
+	if (ann.Quantize(images.data(), std::min<size_t>(labels.size(), 1000)))
+		ann.Serialize(MNIST_MODEL_INT8_PATH);
 	printf("--------------------------------\n");
 	ann.DestroyThreadsIFN();
 	autoEncoder.DestroyThreadsIFN();
@@ -728,3 +753,1536 @@ float	TestConvolution(bool addPool)
 	printf("\n");
 	return 0.0f;
 }
+
+// Uniform random values in [-1, 1]:
+void	FillRandom(std::vector<float> &values)
+{
+	for (size_t i = 0; i < values.size(); ++i)
+		values[i] = (float)rand() / (float)RAND_MAX * 2.0f - 1.0f;
+}
+
+// Loads a copy of a model, the layers drawing their random seeds at setup (dropout) get the same ones for a same seed:
+bool	LoadCopy(CNeuralNetwork &ann, const char *path, unsigned seed)
+{
+	srand(seed);
+	return ann.UnSerialize(path);
+}
+
+void	ComputeOutputs(CNeuralNetwork &ann, const std::vector<float> &samples, std::vector<float> &outputs)
+{
+	const size_t	inputSize = ann.Layers().front()->GetInputSize();
+	const size_t	outputSize = ann.GetOutput().Size();
+	const size_t	sampleCount = samples.size() / inputSize;
+
+	outputs.resize(sampleCount * outputSize);
+	for (size_t sampleIdx = 0; sampleIdx < sampleCount; ++sampleIdx)
+	{
+		ann.FeedForward(samples.data() + sampleIdx * inputSize);
+		memcpy(outputs.data() + sampleIdx * outputSize, ann.GetOutput().Data(), outputSize * sizeof(float));
+	}
+}
+
+float	MaxDifference(const std::vector<float> &values0, const std::vector<float> &values1)
+{
+	float	difference = 0.0f;
+
+	if (values0.size() != values1.size())
+		return FLT_MAX;
+	for (size_t i = 0; i < values0.size(); ++i)
+		difference = std::max(difference, fabsf(values0[i] - values1[i]));
+	return difference;
+}
+
+// One batch of all the samples:
+void	TrainBatch(CNeuralNetwork &ann, const std::vector<float> &samples, const std::vector<float> &expected)
+{
+	const size_t	inputSize = ann.Layers().front()->GetInputSize();
+	const size_t	outputSize = ann.GetOutput().Size();
+	const size_t	sampleCount = samples.size() / inputSize;
+
+	for (size_t sampleIdx = 0; sampleIdx < sampleCount; ++sampleIdx)
+	{
+		ann.FeedForward(samples.data() + sampleIdx * inputSize);
+		ann.BackPropagateError(samples.data() + sampleIdx * inputSize, expected.data() + sampleIdx * outputSize);
+	}
+	ann.UpdateWeightAndBiases();
+}
+
+// Loss of one sample, summed in double so that the difference of two close losses stays exact:
+double	ComputeLoss(CNeuralNetwork &ann, const float *input, const float *expected)
+{
+	double	loss = 0.0;
+
+	ann.FeedForward(input);
+	for (size_t i = 0; i < ann.GetOutput().Size(); ++i)
+	{
+		const double	output = ann.GetOutput().Data()[i];
+		const double	target = expected[i];
+
+		if (ann.GetLoss() == ELoss::SoftmaxCrossEntropy)
+			loss -= target * log(output);
+		else if (ann.GetLoss() == ELoss::BinaryCrossEntropy)
+			loss -= target * log(output) + (1.0 - target) * log(1.0 - output);
+		else
+			loss += 0.5 * (output - target) * (output - target);
+	}
+	return loss;
+}
+
+// Largest relative error between the weight slopes of a layer and the central differences of the loss of one sample.
+// The back propagated slopes are read from a SGD step of learning rate 1 on this layer only: the network is left one
+// step further, with the learning rates of the other layers set to zero:
+float	MaxGradientError(CNeuralNetwork &ann, CLayer *layer, const float *input, const float *expected)
+{
+	const SNeuronMatrixView	&weights = layer->GetWeights().View();
+	const float				epsilon = 1.0e-3f;
+	std::vector<float>		values(weights.m_Rows * weights.m_Columns);
+	std::vector<double>		numericSlopes(weights.m_Rows * weights.m_Columns);
+	std::vector<bool>		kinks(weights.m_Rows * weights.m_Columns);
+	const double			loss = ComputeLoss(ann, input, expected);
+	float					error = 0.0f;
+
+	for (size_t y = 0; y < weights.m_Rows; ++y)
+	{
+		for (size_t x = 0; x < weights.m_Columns; ++x)
+		{
+			float			&weight = weights.GetRow(y)[x];
+			const float		value = weight;
+
+			weight = value + epsilon;
+			const double	lossPlus = ComputeLoss(ann, input, expected);
+			weight = value - epsilon;
+			const double	lossMinus = ComputeLoss(ann, input, expected);
+			weight = value;
+			// A weight moving a max or a ReLU kink has one sided slopes that disagree:
+			const double	slopePlus = (lossPlus - loss) / epsilon;
+			const double	slopeMinus = (loss - lossMinus) / epsilon;
+
+			values[y * weights.m_Columns + x] = value;
+			numericSlopes[y * weights.m_Columns + x] = (lossPlus - lossMinus) / (2.0 * epsilon);
+			kinks[y * weights.m_Columns + x] = fabs(slopePlus - slopeMinus) > 2.0e-2 * std::max(1.0, fabs(slopePlus) + fabs(slopeMinus));
+		}
+	}
+	ann.SetAllLearningRate(0.0f);
+	layer->SetOptimizaton(EOptimization::SGD);
+	layer->SetLearningRate(1.0f);
+	ann.FeedForward(input);
+	ann.BackPropagateError(input, expected);
+	ann.UpdateWeightAndBiases();
+	// Waits for the update:
+	ann.FeedForward(input);
+	for (size_t y = 0; y < weights.m_Rows; ++y)
+	{
+		for (size_t x = 0; x < weights.m_Columns; ++x)
+		{
+			const float		slope = values[y * weights.m_Columns + x] - weights.GetRow(y)[x];
+			const float		numericSlope = (float)numericSlopes[y * weights.m_Columns + x];
+
+			if (kinks[y * weights.m_Columns + x])
+				continue;
+			error = std::max(error, fabsf(numericSlope - slope) / std::max(1.0e-2f, fabsf(numericSlope) + fabsf(slope)));
+		}
+	}
+	return error;
+}
+
+// Largest difference between a pooling output and the max or the average of its windows, the padding is not counted:
+float	PoolingReferenceError(	const float *input, const float *output, size_t featureCount, size_t inputSize, size_t outputSize,
+								size_t poolSize, size_t padding, size_t stride, bool average)
+{
+	float	error = 0.0f;
+
+	for (size_t featureIdx = 0; featureIdx < featureCount; ++featureIdx)
+	{
+		for (size_t outY = 0; outY < outputSize; ++outY)
+		{
+			for (size_t outX = 0; outX < outputSize; ++outX)
+			{
+				float	maxValue = -FLT_MAX;
+				float	sum = 0.0f;
+				size_t	count = 0;
+
+				for (size_t poolY = 0; poolY < poolSize; ++poolY)
+				{
+					for (size_t poolX = 0; poolX < poolSize; ++poolX)
+					{
+						const ptrdiff_t	inY = (ptrdiff_t)(outY * stride + poolY) - (ptrdiff_t)padding;
+						const ptrdiff_t	inX = (ptrdiff_t)(outX * stride + poolX) - (ptrdiff_t)padding;
+
+						if (inY < 0 || inY >= (ptrdiff_t)inputSize || inX < 0 || inX >= (ptrdiff_t)inputSize)
+							continue;
+						const float	value = input[(featureIdx * inputSize + inY) * inputSize + inX];
+
+						maxValue = std::max(maxValue, value);
+						sum += value;
+						++count;
+					}
+				}
+				const float	reference = average ? sum / (float)count : maxValue;
+
+				error = std::max(error, fabsf(reference - output[(featureIdx * outputSize + outY) * outputSize + outX]));
+			}
+		}
+	}
+	return error;
+}
+
+// Largest difference between the outputs of a linear dense layer and weights * input + bias:
+float	DenseReferenceError(const CLayerDense &dense, const float *input, const float *bias)
+{
+	const SNeuronMatrixView	&weights = dense.GetWeights().View();
+	float					error = 0.0f;
+
+	for (size_t y = 0; y < weights.m_Rows; ++y)
+	{
+		float	output = bias != nullptr ? bias[y] : 0.0f;
+
+		for (size_t x = 0; x < weights.m_Columns; ++x)
+			output += weights.GetRow(y)[x] * input[x];
+		error = std::max(error, fabsf(output - dense.GetOutput().Data()[y]));
+	}
+	return error;
+}
+
+// Largest difference between the outputs of a linear convolution with zero bias and a direct computation:
+float	ConvReferenceError(const CLayerConv2D &conv, const float *input, size_t inputSize, size_t padding, size_t stride)
+{
+	const SNeuronMatrixView	&weights = conv.GetWeights().View();
+	const size_t			kernelSize = conv.GetFeatureSizeX();
+	const size_t			inputFeatureCount = conv.GetInputSize() / (inputSize * inputSize);
+	const size_t			outputSize = conv.GetOutputSizeX();
+	float					error = 0.0f;
+
+	for (size_t featureIdx = 0; featureIdx < conv.GetFeatureCount(); ++featureIdx)
+	{
+		for (size_t outY = 0; outY < outputSize; ++outY)
+		{
+			for (size_t outX = 0; outX < outputSize; ++outX)
+			{
+				float	output = 0.0f;
+
+				for (size_t inFeatureIdx = 0; inFeatureIdx < inputFeatureCount; ++inFeatureIdx)
+				{
+					for (size_t kernelY = 0; kernelY < kernelSize; ++kernelY)
+					{
+						for (size_t kernelX = 0; kernelX < kernelSize; ++kernelX)
+						{
+							const ptrdiff_t	inY = (ptrdiff_t)(outY * stride + kernelY) - (ptrdiff_t)padding;
+							const ptrdiff_t	inX = (ptrdiff_t)(outX * stride + kernelX) - (ptrdiff_t)padding;
+
+							if (inY < 0 || inY >= (ptrdiff_t)inputSize || inX < 0 || inX >= (ptrdiff_t)inputSize)
+								continue;
+							output +=	weights.GetRow(featureIdx)[(inFeatureIdx * kernelSize + kernelY) * kernelSize + kernelX] *
+										input[(inFeatureIdx * inputSize + inY) * inputSize + inX];
+						}
+					}
+				}
+				error = std::max(error, fabsf(output - conv.GetOutput().Data()[(featureIdx * outputSize + outY) * outputSize + outX]));
+			}
+		}
+	}
+	return error;
+}
+
+size_t	ArgMax(const float *values, size_t count)
+{
+	return std::max_element(values, values + count) - values;
+}
+
+// Copies of the parameters and optimizer state of the layers, without the padding of the matrix rows:
+void	SaveParameters(CNeuralNetwork &ann, std::vector<std::vector<float>> &values)
+{
+	std::vector<CNeuronMatrix*>	matrices;
+	std::vector<CNeuronVector*>	vectors;
+
+	for (CLayer *layer : ann.Layers())
+		layer->GetParameterStorages(matrices, vectors);
+	values.clear();
+	for (const CNeuronMatrix *matrix : matrices)
+	{
+		const SNeuronMatrixView	&view = matrix->View();
+
+		values.emplace_back();
+		for (size_t y = 0; y < view.m_Rows; ++y)
+			values.back().insert(values.back().end(), view.GetRow(y), view.GetRow(y) + view.m_Columns);
+	}
+	for (const CNeuronVector *storage : vectors)
+		values.emplace_back(storage->Data(), storage->Data() + storage->Size());
+}
+
+// Prints the error of a test case and keeps the largest one, returns false above the tolerance:
+bool	CheckError(const char *name, float error, float tolerance, float &maxError)
+{
+	printf("%s error is %f\n", name, error);
+	maxError = std::max(maxError, error);
+	return error <= tolerance;
+}
+
+// Forward references and gradient checks of the layers:
+float	TestLayers()
+{
+	srand(26);
+
+	printf("--------------------------------\n");
+	printf("Layers Test\n");
+
+	float	maxError = 0.0f;
+	bool	success = true;
+
+	// One bias per feature or per output, the outputs of a zero input are the activated biases:
+	for (bool sharedBias : { true, false })
+	{
+		CLayerConv2D	convLayers[2];
+
+		convLayers[0].Setup(1, 6, 6,
+							3, 3, 3,
+							1, 1,
+							sharedBias);
+		convLayers[0].SetActivation(EActivation::Tanh);
+		convLayers[1].Setup(convLayers[0].GetFeatureCount(), convLayers[0].GetOutputSizeX(), convLayers[0].GetOutputSizeY(),
+							2, 3, 3,
+							1, 1,
+							sharedBias);
+		convLayers[1].SetActivation(EActivation::Tanh);
+
+		CNeuralNetwork	ann;
+
+		ann.AddLayer(&convLayers[0]);
+		ann.AddLayer(&convLayers[1]);
+
+		std::vector<float>	samples(8 * convLayers[0].GetInputSize());
+		std::vector<float>	expected(8 * convLayers[1].GetOutputSize());
+		std::vector<float>	zeros(convLayers[0].GetInputSize(), 0.0f);
+
+		FillRandom(samples);
+		FillRandom(expected);
+		for (size_t batchIdx = 0; batchIdx < 4; ++batchIdx)
+			TrainBatch(ann, samples, expected);
+		// The bias mode and the activation are serialized:
+		CNeuralNetwork	loaded;
+
+		if (!ann.Serialize(TEST_MODEL_PATH) || !loaded.UnSerialize(TEST_MODEL_PATH))
+			return -1.0f;
+		loaded.FeedForward(samples.data());
+		ann.FeedForward(samples.data());
+		if (memcmp(loaded.GetOutput().Data(), ann.GetOutput().Data(), ann.GetOutput().Size() * sizeof(float)) != 0)
+		{
+			printf("Conv round trip changes the outputs\n");
+			success = false;
+		}
+
+		const size_t	featureSize = convLayers[0].GetOutputSizeX() * convLayers[0].GetOutputSizeY();
+		float			biasSpread = 0.0f;
+
+		ann.FeedForward(zeros.data());
+		for (size_t featureIdx = 0; featureIdx < convLayers[0].GetFeatureCount(); ++featureIdx)
+		{
+			const float	*feature = convLayers[0].GetOutput().Data() + featureIdx * featureSize;
+
+			biasSpread = std::max(biasSpread, *std::max_element(feature, feature + featureSize) - *std::min_element(feature, feature + featureSize));
+		}
+		const float		error = std::max(	MaxGradientError(ann, &convLayers[1], samples.data(), expected.data()),
+											MaxGradientError(ann, &convLayers[0], samples.data(), expected.data()));
+
+		success = CheckError(sharedBias ? "Shared bias conv gradient" : "Conv gradient", error, 1.0e-2f, maxError) && success;
+		// The biases of the outputs of a feature learn apart unless they are shared:
+		printf("Bias spread inside the features is %f\n", biasSpread);
+		if ((biasSpread == 0.0f) != sharedBias)
+			success = false;
+	}
+
+	// Max pooling in tiles and in overlapping windows with padding, the slopes go to the recorded max:
+	const size_t	maxPoolConfigs[][3] = { { 2, 0, 2 }, { 3, 1, 2 } };
+
+	for (const size_t *config : maxPoolConfigs)
+	{
+		CLayerConv2D		conv;
+		CLayerMaxPooling2D	pool;
+		CLayerDense			dense;
+
+		conv.Setup(	2, 8, 8,
+					3, 3, 3,
+					1, 1);
+		conv.SetActivation(EActivation::Tanh);
+		pool.Setup(	conv.GetFeatureCount(), conv.GetOutputSizeX(), conv.GetOutputSizeY(),
+					config[0], config[0],
+					config[1], config[2]);
+		dense.Setup(pool.GetOutputSize(), 4);
+		dense.SetActivation(EActivation::Tanh);
+
+		CNeuralNetwork	ann;
+
+		ann.AddLayer(&conv);
+		ann.AddLayer(&pool);
+		ann.AddLayer(&dense);
+
+		std::vector<float>	input(conv.GetInputSize());
+		std::vector<float>	expected(dense.GetOutputSize());
+
+		FillRandom(input);
+		FillRandom(expected);
+		// The fused pass does not write the conv output, a network of the conv alone does:
+		CNeuralNetwork	convOnly;
+
+		convOnly.AddLayer(&conv);
+		convOnly.FeedForward(input.data());
+		ann.FeedForward(input.data());
+		const float		forwardError = PoolingReferenceError(	conv.GetOutput().Data(), pool.GetOutput().Data(), pool.GetFeatureCount(),
+																conv.GetOutputSizeX(), pool.GetOutputSizeX(),
+																config[0], config[1], config[2], false);
+		const float		gradientError = std::max(	MaxGradientError(ann, &dense, input.data(), expected.data()),
+													MaxGradientError(ann, &conv, input.data(), expected.data()));
+
+		success = CheckError("Max pooling", forwardError, 0.0f, maxError) && success;
+		success = CheckError("Max pooling gradient", gradientError, 1.0e-2f, maxError) && success;
+	}
+
+	// Logits overflowing a direct exp, over several chunks of the softmax:
+	{
+		CLayerDense		dense;
+		CLayerSoftMax	softmax;
+
+		dense.Setup(4, 2500);
+		dense.SetActivation(EActivation::Linear);
+		softmax.Setup(dense.GetOutputSize());
+
+		CNeuralNetwork	ann;
+
+		ann.AddLayer(&dense);
+		ann.AddLayer(&softmax);
+
+		// Logits around 400, a few units apart:
+		const SNeuronMatrixView	&weights = dense.GetWeights().View();
+		std::vector<float>		input(dense.GetInputSize(), 100.0f);
+
+		for (size_t y = 0; y < weights.m_Rows; ++y)
+		{
+			for (size_t x = 0; x < weights.m_Columns; ++x)
+				weights.GetRow(y)[x] = 1.0f + weights.GetRow(y)[x] * 0.01f;
+		}
+		ann.FeedForward(input.data());
+
+		const float		*logits = dense.GetOutput().Data();
+		const double	maxLogit = *std::max_element(logits, logits + dense.GetOutputSize());
+		double			sum = 0.0;
+		float			error = 0.0f;
+
+		for (size_t i = 0; i < dense.GetOutputSize(); ++i)
+			sum += exp(logits[i] - maxLogit);
+		for (size_t i = 0; i < dense.GetOutputSize(); ++i)
+		{
+			const double	reference = exp(logits[i] - maxLogit) / sum;
+
+			error = std::max(error, (float)(fabs(softmax.GetOutput().Data()[i] - reference) / reference));
+		}
+		success = CheckError("Softmax relative", error, 1.0e-4f, maxError) && success;
+	}
+
+	// Softmax cross entropy fused in the softmax layer, binary cross entropy fused with a sigmoid:
+	for (ELoss loss : { ELoss::SoftmaxCrossEntropy, ELoss::BinaryCrossEntropy })
+	{
+		CLayerDense		layers[2];
+		CLayerSoftMax	softmax;
+
+		layers[0].Setup(8, 6);
+		layers[0].SetActivation(EActivation::Tanh);
+		layers[1].Setup(layers[0].GetOutputSize(), 5);
+		layers[1].SetActivation(loss == ELoss::BinaryCrossEntropy ? EActivation::Sigmoid : EActivation::Linear);
+		softmax.Setup(layers[1].GetOutputSize());
+
+		CNeuralNetwork	ann;
+
+		ann.AddLayer(&layers[0]);
+		ann.AddLayer(&layers[1]);
+		if (loss == ELoss::SoftmaxCrossEntropy)
+			ann.AddLayer(&softmax);
+		ann.SetLoss(loss);
+
+		std::vector<float>	input(layers[0].GetInputSize());
+		std::vector<float>	expected(layers[1].GetOutputSize(), 0.0f);
+
+		FillRandom(input);
+		if (loss == ELoss::SoftmaxCrossEntropy)
+			expected[2] = 1.0f;
+		else
+		{
+			FillRandom(expected);
+			for (float &value : expected)
+				value = value * 0.5f + 0.5f;
+		}
+		const float		error = std::max(	MaxGradientError(ann, &layers[1], input.data(), expected.data()),
+											MaxGradientError(ann, &layers[0], input.data(), expected.data()));
+
+		success = CheckError(loss == ELoss::SoftmaxCrossEntropy ? "Softmax cross entropy gradient" : "Binary cross entropy gradient", error, 1.0e-2f, maxError) && success;
+	}
+
+	// Dropout masks: the kept fraction, the same mask until the next update and the same masks for the same seeds:
+	{
+		CLayerDropOut	dropout;
+
+		dropout.Setup(4096, 0.25f);
+
+		CNeuralNetwork	model;
+
+		model.AddLayer(&dropout);
+		if (!model.Serialize(TEST_MODEL_PATH))
+			return -1.0f;
+
+		CNeuralNetwork	ann;
+		CNeuralNetwork	copy;
+
+		if (!LoadCopy(ann, TEST_MODEL_PATH, 42) || !LoadCopy(copy, TEST_MODEL_PATH, 42))
+			return -1.0f;
+
+		std::vector<float>	ones(dropout.GetInputSize(), 1.0f);
+		std::vector<float>	mask(ones.size());
+		size_t				keptCount = 0;
+		size_t				scaleErrorCount = 0;
+
+		ann.FeedForward(ones.data());
+		memcpy(mask.data(), ann.GetOutput().Data(), mask.size() * sizeof(float));
+		for (float value : mask)
+		{
+			keptCount += value != 0.0f ? 1 : 0;
+			scaleErrorCount += value != 0.0f && value != 1.0f / 0.75f ? 1 : 0;
+		}
+		ann.FeedForward(ones.data());
+		copy.FeedForward(ones.data());
+		const bool	sameMask = memcmp(mask.data(), ann.GetOutput().Data(), mask.size() * sizeof(float)) == 0;
+		const bool	sameSeed = memcmp(mask.data(), copy.GetOutput().Data(), mask.size() * sizeof(float)) == 0;
+
+		TrainBatch(ann, ones, ones);
+		ann.FeedForward(ones.data());
+		const bool	nextMask = memcmp(mask.data(), ann.GetOutput().Data(), mask.size() * sizeof(float)) != 0;
+		const float	keptFraction = (float)keptCount / (float)mask.size();
+
+		printf("Dropout kept fraction is %f\n", keptFraction);
+		if (fabsf(keptFraction - 0.75f) > 0.03f || scaleErrorCount != 0 || !sameMask || !sameSeed || !nextMask)
+		{
+			printf("Wrong dropout mask\n");
+			success = false;
+		}
+	}
+
+	// The slopes through a dropout are scaled like its output:
+	{
+		CLayerDense		layers[2];
+		CLayerDropOut	dropout;
+
+		layers[0].Setup(12, 24);
+		layers[0].SetActivation(EActivation::Tanh);
+		dropout.Setup(layers[0].GetOutputSize(), 0.5f);
+		layers[1].Setup(dropout.GetOutputSize(), 4);
+		layers[1].SetActivation(EActivation::Linear);
+
+		CNeuralNetwork	ann;
+
+		ann.AddLayer(&layers[0]);
+		ann.AddLayer(&dropout);
+		ann.AddLayer(&layers[1]);
+
+		std::vector<float>	input(layers[0].GetInputSize());
+		std::vector<float>	expected(layers[1].GetOutputSize());
+
+		FillRandom(input);
+		FillRandom(expected);
+		// The dense layer only reads the kept units:
+		ann.FeedForward(input.data());
+		success = CheckError("Dense after dropout", DenseReferenceError(layers[1], dropout.GetOutput().Data(), nullptr), 1.0e-5f, maxError) && success;
+		const float		error = std::max(	MaxGradientError(ann, &layers[1], input.data(), expected.data()),
+											MaxGradientError(ann, &layers[0], input.data(), expected.data()));
+
+		success = CheckError("Dropout gradient", error, 1.0e-2f, maxError) && success;
+	}
+
+	// Dense layer after a ReLU, the second block of inputs is all positive. When the first block is mostly zero, it goes
+	// through the list of non-zero inputs, otherwise the input is over half density and takes the dense path:
+	for (bool mostlyZero : { true, false })
+	{
+		CLayerDense		layers[2];
+
+		layers[0].Setup(8, 1280);
+		layers[0].SetActivation(EActivation::Relu);
+		layers[1].Setup(layers[0].GetOutputSize(), 4);
+		layers[1].SetActivation(EActivation::Linear);
+
+		CNeuralNetwork	ann;
+
+		ann.AddLayer(&layers[0]);
+		ann.AddLayer(&layers[1]);
+
+		const SNeuronMatrixView	&hiddenWeights = layers[0].GetWeights().View();
+		std::vector<float>		input(layers[0].GetInputSize());
+		std::vector<float>		expected(layers[1].GetOutputSize());
+
+		// Positive inputs, the negative rows never fire:
+		for (size_t y = 0; y < hiddenWeights.m_Rows; ++y)
+		{
+			for (size_t x = 0; x < hiddenWeights.m_Columns; ++x)
+			{
+				float	&weight = hiddenWeights.GetRow(y)[x];
+
+				if (y >= 1024)
+					weight = fabsf(weight);
+				else if ((y % 10 != 0) == mostlyZero)
+					weight = -fabsf(weight);
+				else
+					weight = fabsf(weight);
+			}
+		}
+		FillRandom(input);
+		FillRandom(expected);
+		for (float &value : input)
+			value = fabsf(value);
+		ann.FeedForward(input.data());
+		const float		forwardError = DenseReferenceError(layers[1], layers[0].GetOutput().Data(), nullptr);
+		const float		gradientError = std::max(	MaxGradientError(ann, &layers[1], input.data(), expected.data()),
+													MaxGradientError(ann, &layers[0], input.data(), expected.data()));
+
+		success = CheckError("Dense after ReLU", forwardError, 1.0e-5f, maxError) && success;
+		success = CheckError("Dense after ReLU gradient", gradientError, 1.0e-2f, maxError) && success;
+	}
+
+	// Convolution after a dropout keeping a quarter of its inputs, through the input stationary path:
+	{
+		CLayerConv2D	convLayers[2];
+		CLayerDropOut	dropout;
+
+		convLayers[0].Setup(1, 8, 8,
+							3, 3, 3,
+							1, 1);
+		convLayers[0].SetActivation(EActivation::Tanh);
+		dropout.Setup(convLayers[0].GetOutputSize(), 0.75f);
+		convLayers[1].Setup(convLayers[0].GetFeatureCount(), convLayers[0].GetOutputSizeX(), convLayers[0].GetOutputSizeY(),
+							2, 3, 3,
+							1, 1);
+		convLayers[1].SetActivation(EActivation::Tanh);
+
+		CNeuralNetwork	ann;
+
+		ann.AddLayer(&convLayers[0]);
+		ann.AddLayer(&dropout);
+		ann.AddLayer(&convLayers[1]);
+
+		std::vector<float>	input(convLayers[0].GetInputSize());
+		std::vector<float>	expected(convLayers[1].GetOutputSize());
+
+		FillRandom(input);
+		FillRandom(expected);
+		const float		error = std::max(	MaxGradientError(ann, &convLayers[1], input.data(), expected.data()),
+											MaxGradientError(ann, &convLayers[0], input.data(), expected.data()));
+
+		success = CheckError("Conv after dropout gradient", error, 1.0e-2f, maxError) && success;
+	}
+
+	// Conv, dropout and max pooling fused in one pass, against the layers run one by one:
+	{
+		CLayerConv2D		conv;
+		CLayerDropOut		dropout;
+		CLayerMaxPooling2D	pools[2];
+
+		conv.Setup(	2, 12, 12,
+					4, 3, 3,
+					1, 1);
+		conv.SetActivation(EActivation::Tanh);
+		dropout.Setup(conv.GetOutputSize(), 0.25f);
+		for (CLayerMaxPooling2D &pool : pools)
+		{
+			pool.Setup(	conv.GetFeatureCount(), conv.GetOutputSizeX(), conv.GetOutputSizeY(),
+						2, 2,
+						0, 2);
+		}
+
+		CNeuralNetwork	fused;
+		CNeuralNetwork	convDropout;
+		CNeuralNetwork	pooling;
+
+		fused.AddLayer(&conv);
+		fused.AddLayer(&dropout);
+		fused.AddLayer(&pools[0]);
+		convDropout.AddLayer(&conv);
+		convDropout.AddLayer(&dropout);
+		pooling.AddLayer(&pools[1]);
+
+		std::vector<float>	input(conv.GetInputSize());
+		std::vector<float>	expected(pools[0].GetOutputSize());
+		float				forwardError = 0.0f;
+
+		FillRandom(input);
+		FillRandom(expected);
+		const float		gradientError = MaxGradientError(fused, &conv, input.data(), expected.data());
+
+		fused.FeedForward(input.data());
+		convDropout.FeedForward(input.data());
+		pooling.FeedForward(dropout.GetOutput().Data());
+		for (size_t i = 0; i < pools[0].GetOutputSize(); ++i)
+			forwardError = std::max(forwardError, fabsf(pools[0].GetOutput().Data()[i] - pools[1].GetOutput().Data()[i]));
+		success = CheckError("Fused conv max pooling", forwardError, 1.0e-5f, maxError) && success;
+		success = CheckError("Fused conv max pooling gradient", gradientError, 1.0e-2f, maxError) && success;
+	}
+
+	// The dense layer reads the convolution output directly without the flatten layer:
+	{
+		CLayerConv2D	conv;
+		CLayerFlatten	flatten;
+		CLayerDense		dense;
+
+		conv.Setup(	1, 8, 8,
+					4, 3, 3,
+					1, 1);
+		conv.SetActivation(EActivation::Tanh);
+		flatten.Setup(conv.GetOutputSize());
+		dense.Setup(flatten.GetOutputSize(), 5);
+		dense.SetActivation(EActivation::Linear);
+
+		CNeuralNetwork	withFlatten;
+		CNeuralNetwork	withoutFlatten;
+
+		withFlatten.AddLayer(&conv);
+		withFlatten.AddLayer(&flatten);
+		withFlatten.AddLayer(&dense);
+		withoutFlatten.AddLayer(&conv);
+		withoutFlatten.AddLayer(&dense);
+
+		std::vector<float>	input(conv.GetInputSize());
+		std::vector<float>	expected(dense.GetOutputSize());
+		std::vector<float>	outputs(dense.GetOutputSize());
+		float				forwardError = 0.0f;
+
+		FillRandom(input);
+		FillRandom(expected);
+		const float		gradientError = std::max(	MaxGradientError(withFlatten, &dense, input.data(), expected.data()),
+													MaxGradientError(withFlatten, &conv, input.data(), expected.data()));
+
+		withFlatten.FeedForward(input.data());
+		memcpy(outputs.data(), dense.GetOutput().Data(), outputs.size() * sizeof(float));
+		withoutFlatten.FeedForward(input.data());
+		for (size_t i = 0; i < outputs.size(); ++i)
+			forwardError = std::max(forwardError, fabsf(outputs[i] - dense.GetOutput().Data()[i]));
+		success = CheckError("Flatten", forwardError, 0.0f, maxError) && success;
+		success = CheckError("Flatten gradient", gradientError, 1.0e-2f, maxError) && success;
+	}
+
+	// Average pooling in tiles, in overlapping windows with padding and global:
+	const size_t	averagePoolConfigs[][3] = { { 2, 0, 2 }, { 3, 1, 1 }, { 8, 0, 8 } };
+
+	for (const size_t *config : averagePoolConfigs)
+	{
+		CLayerConv2D			conv;
+		CLayerAveragePooling2D	pool;
+		CLayerDense				dense;
+
+		conv.Setup(	2, 8, 8,
+					3, 3, 3,
+					1, 1);
+		conv.SetActivation(EActivation::Tanh);
+		if (config[0] == conv.GetOutputSizeX())
+			pool.SetupGlobal(conv.GetFeatureCount(), conv.GetOutputSizeX(), conv.GetOutputSizeY());
+		else
+		{
+			pool.Setup(	conv.GetFeatureCount(), conv.GetOutputSizeX(), conv.GetOutputSizeY(),
+						config[0], config[0],
+						config[1], config[2]);
+		}
+		dense.Setup(pool.GetOutputSize(), 4);
+		dense.SetActivation(EActivation::Tanh);
+
+		CNeuralNetwork	ann;
+
+		ann.AddLayer(&conv);
+		ann.AddLayer(&pool);
+		ann.AddLayer(&dense);
+
+		std::vector<float>	input(conv.GetInputSize());
+		std::vector<float>	expected(dense.GetOutputSize());
+
+		FillRandom(input);
+		FillRandom(expected);
+		ann.FeedForward(input.data());
+		const float		forwardError = PoolingReferenceError(	conv.GetOutput().Data(), pool.GetOutput().Data(), pool.GetFeatureCount(),
+																conv.GetOutputSizeX(), pool.GetOutputSizeX(),
+																config[0], config[1], config[2], true);
+		const float		gradientError = MaxGradientError(ann, &conv, input.data(), expected.data());
+
+		success = CheckError("Average pooling", forwardError, 1.0e-5f, maxError) && success;
+		success = CheckError("Average pooling gradient", gradientError, 1.0e-2f, maxError) && success;
+	}
+
+	// Upsampling of 6x6 features to 11x11, the slopes of the convolution go through the transposed convolution:
+	{
+		CLayerConv2D			conv;
+		CLayerConvTranspose2D	convTranspose;
+
+		conv.Setup(	1, 6, 6,
+					4, 3, 3,
+					1, 1);
+		conv.SetActivation(EActivation::Tanh);
+		convTranspose.Setup(conv.GetFeatureCount(), conv.GetOutputSizeX(), conv.GetOutputSizeY(),
+							3, 3, 3,
+							1, 2);
+		convTranspose.SetActivation(EActivation::Tanh);
+
+		CNeuralNetwork	ann;
+
+		ann.AddLayer(&conv);
+		ann.AddLayer(&convTranspose);
+
+		std::vector<float>	input(conv.GetInputSize());
+		std::vector<float>	expected(convTranspose.GetOutputSize());
+
+		FillRandom(input);
+		FillRandom(expected);
+		const float		error = std::max(	MaxGradientError(ann, &convTranspose, input.data(), expected.data()),
+											MaxGradientError(ann, &conv, input.data(), expected.data()));
+
+		success = CheckError("Transposed convolution gradient", error, 1.0e-2f, maxError) && success;
+	}
+
+	// Depthwise separable convolution, the 1x1 convolution mixes the features:
+	{
+		CLayerConv2D			conv;
+		CLayerDepthwiseConv2D	depthwise;
+		CLayerConv2D			pointwise;
+
+		conv.Setup(	2, 8, 8,
+					3, 3, 3,
+					1, 1);
+		conv.SetActivation(EActivation::Tanh);
+		depthwise.Setup(conv.GetFeatureCount(), conv.GetOutputSizeX(), conv.GetOutputSizeY(),
+						3, 3,
+						1, 2);
+		depthwise.SetActivation(EActivation::Tanh);
+		pointwise.Setup(depthwise.GetFeatureCount(), depthwise.GetOutputSizeX(), depthwise.GetOutputSizeY(),
+						4, 1, 1,
+						0, 1);
+		pointwise.SetActivation(EActivation::Tanh);
+
+		CNeuralNetwork	ann;
+
+		ann.AddLayer(&conv);
+		ann.AddLayer(&depthwise);
+		ann.AddLayer(&pointwise);
+
+		std::vector<float>	input(conv.GetInputSize());
+		std::vector<float>	expected(pointwise.GetOutputSize());
+
+		FillRandom(input);
+		FillRandom(expected);
+		const float		error = std::max(	std::max(	MaxGradientError(ann, &pointwise, input.data(), expected.data()),
+														MaxGradientError(ann, &depthwise, input.data(), expected.data())),
+											MaxGradientError(ann, &conv, input.data(), expected.data()));
+
+		success = CheckError("Depthwise convolution gradient", error, 1.0e-2f, maxError) && success;
+	}
+
+	// Convolutions against a direct computation, with border and interior convolutions:
+	struct	SConvConfig
+	{
+		size_t	m_InputSize;
+		size_t	m_KernelSize;
+		size_t	m_Padding;
+		size_t	m_Stride;
+	};
+	const SConvConfig	convConfigs[] =
+	{
+		{ 8, 3, 1, 1 },
+		{ 10, 5, 2, 1 },
+		{ 9, 4, 0, 1 },
+		// The kernel sizes and strides with specialized passes:
+		{ 8, 1, 0, 1 },
+		{ 8, 1, 0, 2 },
+		{ 8, 3, 1, 2 },
+		{ 12, 5, 2, 2 },
+		{ 14, 7, 3, 1 },
+		{ 14, 7, 3, 2 },
+		// Enough output rows to be split in tiles:
+		{ 48, 3, 1, 1 },
+	};
+
+	for (const SConvConfig &config : convConfigs)
+	{
+		CLayerConv2D	conv;
+
+		conv.Setup(	2, config.m_InputSize, config.m_InputSize,
+					3, config.m_KernelSize, config.m_KernelSize,
+					config.m_Padding, config.m_Stride);
+		conv.SetActivation(EActivation::Linear);
+
+		CNeuralNetwork	ann;
+
+		ann.AddLayer(&conv);
+
+		std::vector<float>	input(conv.GetInputSize());
+		std::vector<float>	expected(conv.GetOutputSize());
+
+		FillRandom(input);
+		FillRandom(expected);
+		ann.FeedForward(input.data());
+		const float		forwardError = ConvReferenceError(conv, input.data(), config.m_InputSize, config.m_Padding, config.m_Stride);
+		const float		gradientError = MaxGradientError(ann, &conv, input.data(), expected.data());
+
+		printf("Conv %zux%zu stride %zu on %zux%zu:\n", config.m_KernelSize, config.m_KernelSize, config.m_Stride, config.m_InputSize, config.m_InputSize);
+		success = CheckError("\tForward", forwardError, 1.0e-5f, maxError) && success;
+		success = CheckError("\tGradient", gradientError, 1.0e-2f, maxError) && success;
+	}
+
+	// The statistics are constants of the feed forward, the slopes of the convolution weights go through them:
+	{
+		CLayerConv2D	conv;
+		CLayerBatchNorm	convNorm;
+		CLayerFlatten	flatten;
+		CLayerDense		layers[2];
+		CLayerBatchNorm	denseNorm;
+
+		conv.Setup(	2, 6, 6,
+					3, 3, 3,
+					1, 1);
+		conv.SetActivation(EActivation::Linear);
+		convNorm.Setup(conv.GetFeatureCount(), conv.GetOutputSizeX() * conv.GetOutputSizeY());
+		convNorm.SetActivation(EActivation::Tanh);
+		flatten.Setup(convNorm.GetOutputSize());
+		layers[0].Setup(flatten.GetOutputSize(), 8);
+		layers[0].SetActivation(EActivation::Linear);
+		denseNorm.Setup(layers[0].GetOutputSize(), 1);
+		denseNorm.SetActivation(EActivation::Tanh);
+		layers[1].Setup(denseNorm.GetOutputSize(), 3);
+		layers[1].SetActivation(EActivation::Linear);
+
+		CNeuralNetwork	ann;
+
+		ann.AddLayer(&conv);
+		ann.AddLayer(&convNorm);
+		ann.AddLayer(&flatten);
+		ann.AddLayer(&layers[0]);
+		ann.AddLayer(&denseNorm);
+		ann.AddLayer(&layers[1]);
+		ann.SetAllLearningRate(0.01f);
+
+		std::vector<float>	samples(16 * conv.GetInputSize());
+		std::vector<float>	expected(16 * layers[1].GetOutputSize());
+
+		FillRandom(samples);
+		FillRandom(expected);
+		for (size_t batchIdx = 0; batchIdx < 4; ++batchIdx)
+			TrainBatch(ann, samples, expected);
+		const float		error = std::max(	std::max(	MaxGradientError(ann, &denseNorm, samples.data(), expected.data()),
+														MaxGradientError(ann, &convNorm, samples.data(), expected.data())),
+											MaxGradientError(ann, &conv, samples.data(), expected.data()));
+
+		success = CheckError("Batch normalization gradient", error, 1.0e-2f, maxError) && success;
+	}
+
+	printf("--------------------------------\n");
+	return success ? maxError : -1.0f;
+}
+
+// Networks that must give the same outputs while training:
+float	TestTrainingEquivalence()
+{
+	srand(43);
+
+	printf("--------------------------------\n");
+	printf("Training Equivalence Test\n");
+
+	float	maxError = 0.0f;
+	bool	success = true;
+
+	// Only the derivatives of the activations read the BF16 net inputs, going back to FP32 keeps the weights:
+	{
+		CLayerConv2D	conv;
+		CLayerFlatten	flatten;
+		CLayerDense		layers[2];
+
+		conv.Setup(	1, 8, 8,
+					4, 3, 3,
+					1, 1);
+		conv.SetActivation(EActivation::Tanh);
+		flatten.Setup(conv.GetOutputSize());
+		layers[0].Setup(flatten.GetOutputSize(), 16);
+		layers[0].SetActivation(EActivation::Tanh);
+		layers[1].Setup(layers[0].GetOutputSize(), 4);
+		layers[1].SetActivation(EActivation::Linear);
+
+		CNeuralNetwork	model;
+
+		model.AddLayer(&conv);
+		model.AddLayer(&flatten);
+		model.AddLayer(&layers[0]);
+		model.AddLayer(&layers[1]);
+		model.SetAllLearningRate(0.01f);
+		if (!model.Serialize(TEST_MODEL_PATH))
+			return -1.0f;
+
+		CNeuralNetwork	fp32;
+		CNeuralNetwork	mixed;
+
+		if (!LoadCopy(fp32, TEST_MODEL_PATH, 42) || !LoadCopy(mixed, TEST_MODEL_PATH, 42) || !mixed.SetMixedPrecision(true))
+			return -1.0f;
+
+		std::vector<float>	samples(16 * conv.GetInputSize());
+		std::vector<float>	expected(16 * layers[1].GetOutputSize());
+		std::vector<float>	fp32Outputs;
+		std::vector<float>	mixedOutputs;
+		std::vector<float>	disabledOutputs;
+
+		FillRandom(samples);
+		FillRandom(expected);
+		for (size_t batchIdx = 0; batchIdx < 8; ++batchIdx)
+		{
+			TrainBatch(fp32, samples, expected);
+			TrainBatch(mixed, samples, expected);
+		}
+		ComputeOutputs(fp32, samples, fp32Outputs);
+		ComputeOutputs(mixed, samples, mixedOutputs);
+		if (!mixed.SetMixedPrecision(false))
+			return -1.0f;
+		ComputeOutputs(mixed, samples, disabledOutputs);
+		success = CheckError("Mixed precision", MaxDifference(fp32Outputs, mixedOutputs), 1.0e-3f, maxError) && success;
+		success = CheckError("Mixed precision disable", MaxDifference(mixedOutputs, disabledOutputs), 0.0f, maxError) && success;
+	}
+
+	// Networks with the inference memory plan and with gradient checkpointing against a reference. The first dropout is
+	// fused with the convolution and the max pooling, the flatten layer aliases the batch normalization output:
+	{
+		CLayerConv2D		convLayers[2];
+		CLayerDropOut		dropoutLayers[2];
+		CLayerMaxPooling2D	pool;
+		CLayerBatchNorm		batchNorm;
+		CLayerFlatten		flatten;
+		CLayerDense			layers[2];
+
+		convLayers[0].Setup(2, 12, 12,
+							4, 3, 3,
+							1, 1);
+		convLayers[0].SetActivation(EActivation::Relu);
+		dropoutLayers[0].Setup(convLayers[0].GetOutputSize(), 0.2f);
+		pool.Setup(	convLayers[0].GetFeatureCount(), convLayers[0].GetOutputSizeX(), convLayers[0].GetOutputSizeY(),
+					2, 2,
+					0, 2);
+		convLayers[1].Setup(pool.GetFeatureCount(), pool.GetOutputSizeX(), pool.GetOutputSizeY(),
+							6, 3, 3,
+							1, 1);
+		convLayers[1].SetActivation(EActivation::Linear);
+		batchNorm.Setup(convLayers[1].GetFeatureCount(), convLayers[1].GetOutputSizeX() * convLayers[1].GetOutputSizeY());
+		batchNorm.SetActivation(EActivation::Relu);
+		flatten.Setup(batchNorm.GetOutputSize());
+		layers[0].Setup(flatten.GetOutputSize(), 20);
+		layers[0].SetActivation(EActivation::Relu);
+		dropoutLayers[1].Setup(layers[0].GetOutputSize(), 0.3f);
+		layers[1].Setup(dropoutLayers[1].GetOutputSize(), 4);
+		layers[1].SetActivation(EActivation::Linear);
+
+		CNeuralNetwork	model;
+
+		model.AddLayer(&convLayers[0]);
+		model.AddLayer(&dropoutLayers[0]);
+		model.AddLayer(&pool);
+		model.AddLayer(&convLayers[1]);
+		model.AddLayer(&batchNorm);
+		model.AddLayer(&flatten);
+		model.AddLayer(&layers[0]);
+		model.AddLayer(&dropoutLayers[1]);
+		model.AddLayer(&layers[1]);
+		if (!model.Serialize(TEST_MODEL_PATH))
+			return -1.0f;
+
+		std::vector<float>	samples(8 * convLayers[0].GetInputSize());
+		std::vector<float>	expected(8 * layers[1].GetOutputSize());
+
+		FillRandom(samples);
+		FillRandom(expected);
+
+		// The layers get their own activations back and learn again after the plan:
+		CNeuralNetwork		reference;
+		CNeuralNetwork		planned;
+		std::vector<float>	referenceOutputs;
+		std::vector<float>	outputs;
+		float				error = 0.0f;
+
+		if (!LoadCopy(reference, TEST_MODEL_PATH, 42) || !LoadCopy(planned, TEST_MODEL_PATH, 42))
+			return -1.0f;
+		TrainBatch(reference, samples, expected);
+		TrainBatch(planned, samples, expected);
+		ComputeOutputs(reference, samples, referenceOutputs);
+		if (!planned.PlanInferenceMemory(true))
+			return -1.0f;
+		ComputeOutputs(planned, samples, outputs);
+		error = std::max(error, MaxDifference(referenceOutputs, outputs));
+		if (!planned.PlanInferenceMemory(false))
+			return -1.0f;
+		TrainBatch(reference, samples, expected);
+		TrainBatch(planned, samples, expected);
+		ComputeOutputs(reference, samples, referenceOutputs);
+		ComputeOutputs(planned, samples, outputs);
+		error = std::max(error, MaxDifference(referenceOutputs, outputs));
+		success = CheckError("Inference memory plan", error, 0.0f, maxError) && success;
+
+		// The parameters, the optimizer state and the outputs must be bit identical with checkpoints. The plan is not
+		// available with them:
+		const std::vector<size_t>	checkpointSets[] = { { 1 }, { 2 }, { 5 }, { 1, 6 }, { 3, 7 } };
+		size_t						mismatchCount = 0;
+
+		for (const std::vector<size_t> &checkpoints : checkpointSets)
+		{
+			CNeuralNetwork					unchanged;
+			CNeuralNetwork					checkpointed;
+			std::vector<std::vector<float>>	referenceParameters;
+			std::vector<std::vector<float>>	parameters;
+
+			if (!LoadCopy(unchanged, TEST_MODEL_PATH, 42) || !LoadCopy(checkpointed, TEST_MODEL_PATH, 42) || !checkpointed.SetCheckpoints(checkpoints))
+				return -1.0f;
+			for (size_t batchIdx = 0; batchIdx < 3; ++batchIdx)
+			{
+				TrainBatch(unchanged, samples, expected);
+				TrainBatch(checkpointed, samples, expected);
+			}
+			ComputeOutputs(unchanged, samples, referenceOutputs);
+			ComputeOutputs(checkpointed, samples, outputs);
+			SaveParameters(unchanged, referenceParameters);
+			SaveParameters(checkpointed, parameters);
+			if (parameters != referenceParameters || outputs != referenceOutputs || checkpointed.PlanInferenceMemory(true))
+				++mismatchCount;
+		}
+		printf("Gradient checkpointing mismatches: %zu\n", mismatchCount);
+		success = success && mismatchCount == 0;
+	}
+
+	// The parameters and the optimizer state move to a new arena when packing again:
+	{
+		CLayerConv2D	conv;
+		CLayerFlatten	flatten;
+		CLayerDense		layers[3];
+
+		conv.Setup(	1, 8, 8,
+					4, 3, 3,
+					1, 1);
+		conv.SetActivation(EActivation::Relu);
+		flatten.Setup(conv.GetOutputSize());
+		layers[0].Setup(flatten.GetOutputSize(), 32);
+		layers[0].SetActivation(EActivation::Relu);
+		layers[1].Setup(layers[0].GetOutputSize(), 16);
+		layers[1].SetActivation(EActivation::Relu);
+		layers[2].Setup(layers[1].GetOutputSize(), 4);
+		layers[2].SetActivation(EActivation::Linear);
+
+		CNeuralNetwork	model;
+
+		model.AddLayer(&conv);
+		model.AddLayer(&flatten);
+		model.AddLayer(&layers[0]);
+		model.AddLayer(&layers[1]);
+		model.AddLayer(&layers[2]);
+		if (!model.Serialize(TEST_MODEL_PATH))
+			return -1.0f;
+
+		CNeuralNetwork	packed;
+		CNeuralNetwork	reference;
+
+		if (!LoadCopy(packed, TEST_MODEL_PATH, 42) || !LoadCopy(reference, TEST_MODEL_PATH, 42) || !packed.PackParameters(false))
+			return -1.0f;
+
+		std::vector<float>	samples(16 * conv.GetInputSize());
+		std::vector<float>	expected(16 * layers[2].GetOutputSize());
+		std::vector<float>	referenceOutputs;
+		std::vector<float>	outputs;
+		float				error = 0.0f;
+
+		FillRandom(samples);
+		FillRandom(expected);
+		for (size_t passIdx = 0; passIdx < 2; ++passIdx)
+		{
+			TrainBatch(packed, samples, expected);
+			TrainBatch(reference, samples, expected);
+			ComputeOutputs(packed, samples, outputs);
+			ComputeOutputs(reference, samples, referenceOutputs);
+			error = std::max(error, MaxDifference(referenceOutputs, outputs));
+			if (!packed.PackParameters(false))
+				return -1.0f;
+		}
+		// The pruned and factorized layers are setup again and packed with the others:
+		CLayerDense		lowRankLayers[2][2];
+		std::vector<CLayer*>	removedLayers;
+
+		if (!packed.PruneDenseLayers(samples.data(), 16, 0.3f) || !reference.PruneDenseLayers(samples.data(), 16, 0.3f))
+			return -1.0f;
+		if (!packed.FactorizeDenseLayer(2, &lowRankLayers[0][0], &lowRankLayers[0][1], samples.data(), 16, 0.9f, removedLayers) ||
+			!reference.FactorizeDenseLayer(2, &lowRankLayers[1][0], &lowRankLayers[1][1], samples.data(), 16, 0.9f, removedLayers))
+			return -1.0f;
+		TrainBatch(packed, samples, expected);
+		TrainBatch(reference, samples, expected);
+		ComputeOutputs(packed, samples, outputs);
+		ComputeOutputs(reference, samples, referenceOutputs);
+		error = std::max(error, MaxDifference(referenceOutputs, outputs));
+		success = CheckError("Packed parameters", error, 0.0f, maxError) && success && !packed.GetParameterArena().Empty();
+	}
+
+	printf("--------------------------------\n");
+	return success ? maxError : -1.0f;
+}
+
+// Inference conversions of trained networks:
+float	TestInferenceConversions()
+{
+	srand(41);
+
+	printf("--------------------------------\n");
+	printf("Inference Conversions Test\n");
+
+	float	maxError = 0.0f;
+	bool	success = true;
+
+	// Int8 weights, the top-1 agreement with the float outputs. The int8 weights and the input scales are serialized:
+	{
+		CLayerConv2D		conv;
+		CLayerMaxPooling2D	pool;
+		CLayerFlatten		flatten;
+		CLayerDense			layers[2];
+
+		conv.Setup(	1, 8, 8,
+					4, 3, 3,
+					1, 1);
+		conv.SetActivation(EActivation::Relu);
+		pool.Setup(	conv.GetFeatureCount(), conv.GetOutputSizeX(), conv.GetOutputSizeY(),
+					2, 2,
+					0, 2);
+		flatten.Setup(pool.GetOutputSize());
+		layers[0].Setup(flatten.GetOutputSize(), 16);
+		layers[0].SetActivation(EActivation::Relu);
+		layers[1].Setup(layers[0].GetOutputSize(), 4);
+		layers[1].SetActivation(EActivation::Linear);
+
+		CNeuralNetwork	ann;
+
+		ann.AddLayer(&conv);
+		ann.AddLayer(&pool);
+		ann.AddLayer(&flatten);
+		ann.AddLayer(&layers[0]);
+		ann.AddLayer(&layers[1]);
+
+		const size_t		sampleCount = 64;
+		const size_t		outputSize = layers[1].GetOutputSize();
+		std::vector<float>	samples(sampleCount * conv.GetInputSize());
+		std::vector<float>	expected(sampleCount * outputSize);
+		std::vector<float>	floatOutputs;
+		std::vector<float>	quantizedOutputs;
+		std::vector<float>	loadedOutputs;
+
+		FillRandom(samples);
+		FillRandom(expected);
+		for (size_t batchIdx = 0; batchIdx < 4; ++batchIdx)
+			TrainBatch(ann, samples, expected);
+		ComputeOutputs(ann, samples, floatOutputs);
+		if (!ann.Quantize(samples.data(), sampleCount))
+			return -1.0f;
+		ComputeOutputs(ann, samples, quantizedOutputs);
+
+		size_t	agreementCount = 0;
+
+		for (size_t sampleIdx = 0; sampleIdx < sampleCount; ++sampleIdx)
+		{
+			if (ArgMax(floatOutputs.data() + sampleIdx * outputSize, outputSize) == ArgMax(quantizedOutputs.data() + sampleIdx * outputSize, outputSize))
+				++agreementCount;
+		}
+
+		CNeuralNetwork	loaded;
+
+		if (!ann.Serialize(TEST_MODEL_PATH) || !loaded.UnSerialize(TEST_MODEL_PATH))
+			return -1.0f;
+		ComputeOutputs(loaded, samples, loadedOutputs);
+		success = CheckError("Int8 top-1 disagreement", 1.0f - (float)agreementCount / (float)sampleCount, 0.1f, maxError) && success;
+		success = CheckError("Int8 round trip", MaxDifference(quantizedOutputs, loadedOutputs), 0.0f, maxError) && success;
+	}
+
+	// 11 and 8 bits of mantissa, the 16 bits weights are serialized as they are:
+	{
+		CLayerDense		layers[2];
+
+		layers[0].Setup(32, 16);
+		layers[0].SetActivation(EActivation::Tanh);
+		layers[1].Setup(layers[0].GetOutputSize(), 4);
+		layers[1].SetActivation(EActivation::Linear);
+
+		CNeuralNetwork	ann;
+
+		ann.AddLayer(&layers[0]);
+		ann.AddLayer(&layers[1]);
+		if (!ann.Serialize(TEST_MODEL_PATH))
+			return -1.0f;
+
+		CNeuralNetwork		float16;
+		CNeuralNetwork		bfloat16;
+		CNeuralNetwork		loaded;
+		std::vector<float>	samples(16 * layers[0].GetInputSize());
+		std::vector<float>	floatOutputs;
+		std::vector<float>	float16Outputs;
+		std::vector<float>	bfloat16Outputs;
+		std::vector<float>	loadedOutputs;
+
+		FillRandom(samples);
+		ComputeOutputs(ann, samples, floatOutputs);
+		if (!LoadCopy(float16, TEST_MODEL_PATH, 42) || !float16.ConvertWeightsToHalf(EHalfFormat::Float16))
+			return -1.0f;
+		if (!LoadCopy(bfloat16, TEST_MODEL_PATH, 42) || !bfloat16.ConvertWeightsToHalf(EHalfFormat::BFloat16))
+			return -1.0f;
+		ComputeOutputs(float16, samples, float16Outputs);
+		ComputeOutputs(bfloat16, samples, bfloat16Outputs);
+		if (!bfloat16.Serialize(TEST_MODEL_PATH) || !loaded.UnSerialize(TEST_MODEL_PATH))
+			return -1.0f;
+		ComputeOutputs(loaded, samples, loadedOutputs);
+		success = CheckError("FP16 weights", MaxDifference(floatOutputs, float16Outputs), 1.0e-3f, maxError) && success;
+		success = CheckError("BF16 weights", MaxDifference(floatOutputs, bfloat16Outputs), 1.0e-2f, maxError) && success;
+		success = CheckError("BF16 round trip", MaxDifference(bfloat16Outputs, loadedOutputs), 0.0f, maxError) && success;
+	}
+
+	// Pruning of the constant neurons only is exact, their mean output goes to the bias of the next layer:
+	{
+		CLayerDense		layers[3];
+
+		layers[0].Setup(16, 32);
+		layers[0].SetActivation(EActivation::Relu);
+		layers[1].Setup(layers[0].GetOutputSize(), 16);
+		layers[1].SetActivation(EActivation::Relu);
+		layers[2].Setup(layers[1].GetOutputSize(), 4);
+		layers[2].SetActivation(EActivation::Linear);
+
+		CNeuralNetwork	ann;
+
+		ann.AddLayer(&layers[0]);
+		ann.AddLayer(&layers[1]);
+		ann.AddLayer(&layers[2]);
+
+		std::vector<float>	samples(16 * layers[0].GetInputSize());
+		std::vector<float>	expected(16 * layers[2].GetOutputSize());
+		std::vector<float>	outputs;
+		std::vector<float>	prunedOutputs;
+
+		FillRandom(samples);
+		FillRandom(expected);
+		for (size_t batchIdx = 0; batchIdx < 4; ++batchIdx)
+			TrainBatch(ann, samples, expected);
+		// Neurons without incoming weights only output their bias:
+		for (size_t y = 0; y < 8; ++y)
+			memset(layers[0].GetWeights().View().GetRow(y), 0, layers[0].GetInputSize() * sizeof(float));
+		ComputeOutputs(ann, samples, outputs);
+		if (!ann.PruneDenseLayers(samples.data(), 16, 0.0f))
+			return -1.0f;
+		ComputeOutputs(ann, samples, prunedOutputs);
+		success = CheckError("Pruning", MaxDifference(outputs, prunedOutputs), 1.0e-5f, maxError) && success;
+		printf("Pruned neurons: %zu\n", 32 - layers[0].GetOutputSize());
+		success = success && layers[0].GetOutputSize() <= 24 && layers[1].GetInputSize() == layers[0].GetOutputSize();
+	}
+
+	// Pruned blocks stay zero while learning, the kept ones follow the float weights. The last block of each row is
+	// partial:
+	{
+		const size_t	blockSize = CBlockSparseMatrix::kBlockSize;
+		CLayerDense		dense;
+
+		dense.Setup(44, 16);
+		dense.SetActivation(EActivation::Linear);
+
+		CNeuralNetwork	ann;
+
+		ann.AddLayer(&dense);
+		if (!ann.SetBlockSparsity(0.5f))
+			return -1.0f;
+
+		const SNeuronMatrixView	&weights = dense.GetWeights().View();
+		const size_t			blockColumns = (weights.m_Columns + blockSize - 1) / blockSize;
+		std::vector<bool>		prunedBlocks(weights.m_Rows * blockColumns);
+		size_t					prunedCount = 0;
+
+		for (size_t y = 0; y < weights.m_Rows; ++y)
+		{
+			for (size_t blockX = 0; blockX < blockColumns; ++blockX)
+			{
+				const float		*block = weights.GetRow(y) + blockX * blockSize;
+				const size_t	blockWidth = std::min(blockSize, weights.m_Columns - blockX * blockSize);
+
+				prunedBlocks[y * blockColumns + blockX] = std::all_of(block, block + blockWidth, [](float weight) { return weight == 0.0f; });
+				prunedCount += prunedBlocks[y * blockColumns + blockX] ? 1 : 0;
+			}
+		}
+
+		std::vector<float>	samples(16 * dense.GetInputSize());
+		std::vector<float>	expected(16 * dense.GetOutputSize());
+		std::vector<float>	zeros(dense.GetInputSize(), 0.0f);
+		std::vector<float>	bias(dense.GetOutputSize());
+		float				error = 0.0f;
+
+		FillRandom(samples);
+		FillRandom(expected);
+		for (size_t batchIdx = 0; batchIdx < 4; ++batchIdx)
+			TrainBatch(ann, samples, expected);
+		ann.FeedForward(zeros.data());
+		memcpy(bias.data(), dense.GetOutput().Data(), bias.size() * sizeof(float));
+		for (size_t sampleIdx = 0; sampleIdx < 16; ++sampleIdx)
+		{
+			ann.FeedForward(samples.data() + sampleIdx * dense.GetInputSize());
+			error = std::max(error, DenseReferenceError(dense, samples.data() + sampleIdx * dense.GetInputSize(), bias.data()));
+		}
+
+		size_t	regrownCount = 0;
+
+		for (size_t y = 0; y < weights.m_Rows; ++y)
+		{
+			for (size_t x = 0; x < weights.m_Columns; ++x)
+				regrownCount += prunedBlocks[y * blockColumns + x / blockSize] && weights.GetRow(y)[x] != 0.0f ? 1 : 0;
+		}
+		printf("Pruned blocks %zu/%zu, regrown weights %zu\n", prunedCount, prunedBlocks.size(), regrownCount);
+		success = CheckError("Block sparse weights", error, 1.0e-5f, maxError) && success && prunedCount * 2 >= prunedBlocks.size() && regrownCount == 0;
+	}
+
+	// Kept units of a dropout with a null output still get their slope through the block sparse weights:
+	{
+		CLayerDense		layers[2];
+		CLayerDropOut	dropout;
+
+		layers[0].Setup(16, 64);
+		layers[0].SetActivation(EActivation::Linear);
+		dropout.Setup(layers[0].GetOutputSize(), 0.25f);
+		layers[1].Setup(layers[0].GetOutputSize(), 4);
+		layers[1].SetActivation(EActivation::Linear);
+		if (!layers[1].SetBlockSparsity(0.5f))
+			return -1.0f;
+
+		CNeuralNetwork	ann;
+
+		ann.AddLayer(&layers[0]);
+		ann.AddLayer(&dropout);
+		ann.AddLayer(&layers[1]);
+
+		const SNeuronMatrixView	&weights = layers[0].GetWeights().View();
+		std::vector<float>		input(layers[0].GetInputSize());
+		std::vector<float>		expected(layers[1].GetOutputSize());
+
+		// The first outputs are null, the bias starts at zero:
+		for (size_t y = 0; y < 16; ++y)
+			memset(weights.GetRow(y), 0, weights.m_Columns * sizeof(float));
+		FillRandom(input);
+		FillRandom(expected);
+		success = CheckError("Block sparse null input gradient", MaxGradientError(ann, &layers[0], input.data(), expected.data()), 1.0e-2f, maxError) && success;
+	}
+
+	// A rank one layer is factorized exactly:
+	{
+		CLayerDense		layers[2];
+		CLayerDense		lowRankLayers[2];
+
+		layers[0].Setup(24, 16);
+		layers[0].SetActivation(EActivation::Tanh);
+		layers[1].Setup(layers[0].GetOutputSize(), 4);
+		layers[1].SetActivation(EActivation::Linear);
+
+		CNeuralNetwork	ann;
+
+		ann.AddLayer(&layers[0]);
+		ann.AddLayer(&layers[1]);
+
+		const SNeuronMatrixView	&weights = layers[0].GetWeights().View();
+		std::vector<float>		columns(weights.m_Rows);
+		std::vector<float>		rows(weights.m_Columns);
+		std::vector<float>		samples(16 * layers[0].GetInputSize());
+		std::vector<float>		outputs;
+		std::vector<float>		lowRankOutputs;
+
+		FillRandom(columns);
+		FillRandom(rows);
+		for (size_t y = 0; y < weights.m_Rows; ++y)
+		{
+			for (size_t x = 0; x < weights.m_Columns; ++x)
+				weights.GetRow(y)[x] = columns[y] * rows[x] * 0.5f;
+		}
+		FillRandom(samples);
+		ComputeOutputs(ann, samples, outputs);
+		// The replaced layer is handed back to its owner:
+		std::vector<CLayer*>	removedLayers;
+
+		if (!ann.FactorizeDenseLayer(0, &lowRankLayers[0], &lowRankLayers[1], samples.data(), 16, 1.0f, removedLayers) ||
+			removedLayers.size() != 1 || removedLayers[0] != &layers[0])
+			return -1.0f;
+		ComputeOutputs(ann, samples, lowRankOutputs);
+		success = CheckError("Low rank factorization", MaxDifference(outputs, lowRankOutputs), 1.0e-4f, maxError) && success;
+		printf("Factorized rank: %zu\n", lowRankLayers[0].GetOutputSize());
+		success = success && lowRankLayers[0].GetOutputSize() == 1;
+
+		// The first factor learns no bias, a null input still gives a null rank vector after training:
+		std::vector<float>	expected(16 * layers[1].GetOutputSize());
+		std::vector<float>	zeros(layers[0].GetInputSize(), 0.0f);
+		float				firstOutput = 0.0f;
+
+		FillRandom(expected);
+		TrainBatch(ann, samples, expected);
+		ann.FeedForward(zeros.data());
+		for (size_t k = 0; k < lowRankLayers[0].GetOutputSize(); ++k)
+			firstOutput = std::max(firstOutput, fabsf(lowRankLayers[0].GetOutput().Data()[k]));
+		success = CheckError("Low rank first factor bias", firstOutput, 0.0f, maxError) && success;
+	}
+
+	// Batch normalizations folded in the linear convolution and dense layers before them. The running statistics are
+	// serialized with gamma and beta:
+	{
+		CLayerConv2D	conv;
+		CLayerBatchNorm	convNorm;
+		CLayerFlatten	flatten;
+		CLayerDense		layers[2];
+		CLayerBatchNorm	denseNorm;
+
+		conv.Setup(	2, 8, 8,
+					4, 3, 3,
+					1, 1);
+		conv.SetActivation(EActivation::Linear);
+		convNorm.Setup(conv.GetFeatureCount(), conv.GetOutputSizeX() * conv.GetOutputSizeY());
+		convNorm.SetActivation(EActivation::Tanh);
+		flatten.Setup(convNorm.GetOutputSize());
+		layers[0].Setup(flatten.GetOutputSize(), 12);
+		layers[0].SetActivation(EActivation::Linear);
+		denseNorm.Setup(layers[0].GetOutputSize(), 1);
+		denseNorm.SetActivation(EActivation::Tanh);
+		layers[1].Setup(denseNorm.GetOutputSize(), 3);
+		layers[1].SetActivation(EActivation::Linear);
+
+		CNeuralNetwork	ann;
+
+		ann.AddLayer(&conv);
+		ann.AddLayer(&convNorm);
+		ann.AddLayer(&flatten);
+		ann.AddLayer(&layers[0]);
+		ann.AddLayer(&denseNorm);
+		ann.AddLayer(&layers[1]);
+		ann.SetAllLearningRate(0.01f);
+
+		std::vector<float>	samples(16 * conv.GetInputSize());
+		std::vector<float>	expected(16 * layers[1].GetOutputSize());
+		std::vector<float>	outputs;
+		std::vector<float>	loadedOutputs;
+		std::vector<float>	foldedOutputs;
+
+		FillRandom(samples);
+		FillRandom(expected);
+		for (size_t batchIdx = 0; batchIdx < 6; ++batchIdx)
+			TrainBatch(ann, samples, expected);
+		ComputeOutputs(ann, samples, outputs);
+
+		CNeuralNetwork	loaded;
+		CNeuralNetwork	folded;
+
+		if (!ann.Serialize(TEST_MODEL_PATH) || !loaded.UnSerialize(TEST_MODEL_PATH))
+			return -1.0f;
+		ComputeOutputs(loaded, samples, loadedOutputs);
+		// The folded layers were created by the load and are destroyed here:
+		std::vector<CLayer*>	removedLayers;
+
+		if (!folded.UnSerialize(TEST_MODEL_PATH) || !folded.FoldBatchNorm(removedLayers) || removedLayers.size() != 2 ||
+			folded.Layers().size() != ann.Layers().size() - 2)
+			return -1.0f;
+		for (CLayer *layer : removedLayers)
+			delete layer;
+		ComputeOutputs(folded, samples, foldedOutputs);
+		success = CheckError("Batch normalization round trip", MaxDifference(outputs, loadedOutputs), 0.0f, maxError) && success;
+		success = CheckError("Batch normalization fold", MaxDifference(outputs, foldedOutputs), 1.0e-5f, maxError) && success;
+	}
+
+	printf("--------------------------------\n");
+	return success ? maxError : -1.0f;
+}
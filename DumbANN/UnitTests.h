@@ -4,3 +4,6 @@ float	TestMNIST();
 float	TestXOR();
 float	TestCosine();
 float	TestConvolution(bool addPool);
+float	TestLayers();
+float	TestTrainingEquivalence();
+float	TestInferenceConversions();